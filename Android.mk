@@ -21,6 +21,11 @@ LOCAL_SRC_FILES := \
     fixPermissions.cpp \
     twrpTar.cpp \
     twrpDigest.cpp \
+    twrpDU.cpp \
+    twrpBlockIO.cpp \
+    twrpRemove.cpp \
+    twrpExec.cpp \
+    twrpBenchmark.cpp \
 
 LOCAL_SRC_FILES += \
     data.cpp \
@@ -33,7 +38,9 @@ LOCAL_SRC_FILES += \
 
 LOCAL_SRC_FILES += \
     multirom.cpp \
-    mrominstaller.cpp
+    mrominstaller.cpp \
+    twrpRamdisk.cpp \
+    twrpCodec.cpp
 
 ifneq ($(TARGET_RECOVERY_REBOOT_SRC),)
   LOCAL_SRC_FILES += $(TARGET_RECOVERY_REBOOT_SRC)
@@ -179,6 +186,9 @@ endif
 ifeq ($(TW_NO_BATT_PERCENT), true)
     LOCAL_CFLAGS += -DTW_NO_BATT_PERCENT
 endif
+ifeq ($(TW_NO_SPARSE_BACKUP), true)
+    LOCAL_CFLAGS += -DTW_NO_SPARSE_BACKUP
+endif
 ifneq ($(TW_CUSTOM_POWER_BUTTON),)
 	LOCAL_CFLAGS += -DTW_CUSTOM_POWER_BUTTON=$(TW_CUSTOM_POWER_BUTTON)
 endif
@@ -29,6 +29,7 @@
 #include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <errno.h>
 
 #include <string>
 #include <utility>
@@ -59,12 +60,35 @@ extern "C"
 
 #define FILE_VERSION 0x00010001
 
+// Persisted changes are written out this long after the first change, so
+// a burst of SetValue() calls results in a single settings file write
+#define SAVE_DELAY_SECS 2
+
+// Value store limits. Slots are allocated a page at a time and never move,
+// so a handle stays valid and can be read without holding mLock.
+#define VAR_PAGE_SHIFT  6
+#define VAR_PAGE_SIZE   (1 << VAR_PAGE_SHIFT)
+#define VAR_MAX_PAGES   64
+#define VAR_MAX_SLOTS   (VAR_PAGE_SIZE * VAR_MAX_PAGES)
+#define VAR_HASH_SIZE   (VAR_MAX_SLOTS * 2)
+
 using namespace std;
 
-map<string, DataManager::TStrIntPair>   DataManager::mValues;
-map<string, string>                     DataManager::mConstValues;
+DataManager::VarSlot*                   DataManager::mSlotPages[VAR_MAX_PAGES];
+volatile int                            DataManager::mSlotCount = 0;
+int                                     DataManager::mHashTable[VAR_HASH_SIZE];
+pthread_mutex_t                         DataManager::mLock = PTHREAD_MUTEX_INITIALIZER;
 string                                  DataManager::mBackingFile;
 int                                     DataManager::mInitialized = 0;
+int                                     DataManager::mTimeHandle = -1;
+int                                     DataManager::mBatteryHandle = -1;
+// Recursive: mounting the settings storage from FlushPending() can unmount
+// and remount it (exFAT without fuse), which comes back in through LockStorage()
+pthread_mutex_t                         DataManager::mSaveLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+pthread_cond_t                          DataManager::mSaveCond = PTHREAD_COND_INITIALIZER;
+int                                     DataManager::mSaveDirty = 0;
+int                                     DataManager::mSaveQueued = 0;
+int                                     DataManager::mSaveThreadStarted = 0;
 #ifndef TW_NO_SCREEN_TIMEOUT
 extern blanktimer blankTimer;
 #endif
@@ -118,7 +142,7 @@ void DataManager::get_device_id(void) {
 			strcat(device_id, hardware_id);
 		}
 		sanitize_device_id((char *)device_id);
-		mConstValues.insert(make_pair("device_id", device_id));
+		InsertConst("device_id", device_id);
 		LOGINFO("=> using device id: '%s'\n", device_id);
 		return;
 	}
@@ -145,7 +169,7 @@ void DataManager::get_device_id(void) {
 				// We found the serial number!
 				strcpy(device_id, token + CMDLINE_SERIALNO_LEN);
 				sanitize_device_id((char *)device_id);
-				mConstValues.insert(make_pair("device_id", device_id));
+				InsertConst("device_id", device_id);
 				return;
 			}
 			token = strtok(NULL, " ");
@@ -173,7 +197,7 @@ void DataManager::get_device_id(void) {
 					LOGINFO("=> serial from cpuinfo: '%s'\n", device_id);
 					fclose(fp);
 					sanitize_device_id((char *)device_id);
-					mConstValues.insert(make_pair("device_id", device_id));
+					InsertConst("device_id", device_id);
 					return;
 				}
 			} else if (memcmp(line, CPUINFO_HARDWARE, CPUINFO_HARDWARE_LEN) == 0) {// We're also going to look for the hardware line in cpuinfo and save it for later in case we don't find the device ID
@@ -199,20 +223,195 @@ void DataManager::get_device_id(void) {
 		LOGINFO("\nusing hardware id for device id: '%s'\n", hardware_id);
 		strcpy(device_id, hardware_id);
 		sanitize_device_id((char *)device_id);
-		mConstValues.insert(make_pair("device_id", device_id));
+		InsertConst("device_id", device_id);
 		return;
 	}
 
 	strcpy(device_id, "serialno");
 	LOGERR("=> device id not found, using '%s'.", device_id);
-	mConstValues.insert(make_pair("device_id", device_id));
+	InsertConst("device_id", device_id);
 	return;
 }
 
+// FNV-1a, the variable names are short so this is cheap and spreads well
+static unsigned hash_var_name(const char* varName, size_t length)
+{
+	unsigned hash = 2166136261U;
+
+	for (size_t i = 0; i < length; i++) {
+		hash ^= (unsigned char) varName[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+DataManager::VarSlot* DataManager::GetSlot(int handle)
+{
+	return &mSlotPages[handle >> VAR_PAGE_SHIFT][handle & (VAR_PAGE_SIZE - 1)];
+}
+
+// Lock free lookup. The hash table is only ever appended to, and a slot is
+// fully built before its index is published, so readers never see a
+// partially created entry.
+int DataManager::FindSlot(const char* varName, size_t length)
+{
+	unsigned hash = hash_var_name(varName, length);
+	unsigned bucket = hash & (VAR_HASH_SIZE - 1);
+	int count = mSlotCount;
+
+	if (count == 0)
+		return -1;
+
+	while (1) {
+		int handle = mHashTable[bucket];
+		if (handle < 0)
+			return -1;
+
+		VarSlot* slot = GetSlot(handle);
+		if (slot->hash == hash && slot->name.length() == length && memcmp(slot->name.data(), varName, length) == 0)
+			return handle;
+
+		bucket = (bucket + 1) & (VAR_HASH_SIZE - 1);
+	}
+}
+
+// Must be called with mLock held
+int DataManager::CreateSlot(const string& varName)
+{
+	int handle = FindSlot(varName.data(), varName.length());
+	if (handle >= 0)
+		return handle;
+
+	if (mSlotCount == 0)
+		memset(mHashTable, 0xff, sizeof(mHashTable));
+
+	handle = mSlotCount;
+	if (handle >= VAR_MAX_SLOTS) {
+		LOGERR("DataManager: too many variables, unable to add '%s'\n", varName.c_str());
+		return -1;
+	}
+	if ((handle & (VAR_PAGE_SIZE - 1)) == 0)
+		mSlotPages[handle >> VAR_PAGE_SHIFT] = new VarSlot[VAR_PAGE_SIZE];
+
+	VarSlot* slot = GetSlot(handle);
+	slot->name = varName;
+	slot->hash = hash_var_name(varName.data(), varName.length());
+	slot->flags = 0;
+	slot->persist = 0;
+	slot->seq = 0;
+	slot->intValue = 0;
+	slot->floatValue = 0;
+	slot->ullValue = 0;
+
+	unsigned bucket = slot->hash & (VAR_HASH_SIZE - 1);
+	while (mHashTable[bucket] >= 0)
+		bucket = (bucket + 1) & (VAR_HASH_SIZE - 1);
+
+	__sync_synchronize();
+	mHashTable[bucket] = handle;
+	mSlotCount = handle + 1;
+	return handle;
+}
+
+// Must be called with mLock held
+void DataManager::StoreValue(VarSlot* slot, const string& value)
+{
+	slot->seq++;
+	__sync_synchronize();
+	slot->value = value;
+	slot->intValue = atoi(value.c_str());
+	slot->floatValue = atof(value.c_str());
+	slot->ullValue = strtoull(value.c_str(), NULL, 10);
+	slot->flags |= VAR_SET;
+	__sync_synchronize();
+	slot->seq++;
+}
+
+// Reads the numeric forms of a value without taking mLock, retrying if a
+// writer updated the slot while we were reading it
+bool DataManager::ReadNumeric(int handle, int* intValue, float* floatValue, unsigned long long* ullValue)
+{
+	VarSlot* slot = GetSlot(handle);
+	unsigned seq;
+	int flags;
+
+	do {
+		seq = slot->seq;
+		__sync_synchronize();
+		flags = slot->flags;
+		if (intValue)
+			*intValue = slot->intValue;
+		if (floatValue)
+			*floatValue = slot->floatValue;
+		if (ullValue)
+			*ullValue = slot->ullValue;
+		__sync_synchronize();
+	} while ((seq & 1) || seq != slot->seq);
+
+	return (flags & VAR_SET) != 0;
+}
+
+// Adds a default value, existing values are left alone
+void DataManager::InsertValue(const string varName, const string value, int persist)
+{
+	pthread_mutex_lock(&mLock);
+	int handle = CreateSlot(varName);
+	if (handle >= 0) {
+		VarSlot* slot = GetSlot(handle);
+		if (!(slot->flags & VAR_SET)) {
+			slot->persist = persist;
+			StoreValue(slot, value);
+		}
+	}
+	pthread_mutex_unlock(&mLock);
+}
+
+// Adds a read-only value, which takes precedence over a regular value of the same name
+void DataManager::InsertConst(const string varName, const string value)
+{
+	pthread_mutex_lock(&mLock);
+	int handle = CreateSlot(varName);
+	if (handle >= 0) {
+		VarSlot* slot = GetSlot(handle);
+		if (!(slot->flags & VAR_CONST)) {
+			slot->flags |= VAR_CONST;
+			slot->persist = 0;
+			StoreValue(slot, value);
+		}
+	}
+	pthread_mutex_unlock(&mLock);
+}
+
+int DataManager::GetHandle(const string varName)
+{
+	int handle = FindSlot(varName.data(), varName.length());
+	if (handle >= 0)
+		return handle;
+
+	pthread_mutex_lock(&mLock);
+	handle = CreateSlot(varName);
+	pthread_mutex_unlock(&mLock);
+	return handle;
+}
+
 int DataManager::ResetDefaults()
 {
-	mValues.clear();
-	mConstValues.clear();
+	// Keep the slots so existing handles stay valid, just forget the values
+	pthread_mutex_lock(&mLock);
+	for (int handle = 0; handle < mSlotCount; handle++) {
+		VarSlot* slot = GetSlot(handle);
+		slot->seq++;
+		__sync_synchronize();
+		slot->flags &= VAR_MAGIC;
+		slot->persist = 0;
+		slot->value.clear();
+		slot->intValue = 0;
+		slot->floatValue = 0;
+		slot->ullValue = 0;
+		__sync_synchronize();
+		slot->seq++;
+	}
+	pthread_mutex_unlock(&mLock);
 	SetDefaultValues();
 	return 0;
 }
@@ -232,6 +431,9 @@ int DataManager::LoadValues(const string filename)
 	FILE* in = fopen(filename.c_str(), "rb");
 	if (!in) {
 		LOGINFO("Settings file '%s' not found.\n", filename.c_str());
+		pthread_mutex_lock(&mLock);
+		mSaveDirty = 0;
+		pthread_mutex_unlock(&mLock);
 		return 0;
 	} else {
 		LOGINFO("Loading settings from '%s'.\n", filename.c_str());
@@ -258,16 +460,16 @@ int DataManager::LoadValues(const string filename)
 		if (fread(array, 1, length, in) != length)										goto error;
 		Value = array;
 
-		map<string, TStrIntPair>::iterator pos;
-
-		pos = mValues.find(Name);
-		if (pos != mValues.end())
+		pthread_mutex_lock(&mLock);
+		int handle = CreateSlot(Name);
+		// Constants keep the value the build gave them, like in SetValue
+		if (handle >= 0 && !(GetSlot(handle)->flags & VAR_CONST))
 		{
-			pos->second.first = Value;
-			pos->second.second = 1;
+			VarSlot* slot = GetSlot(handle);
+			slot->persist = 1;
+			StoreValue(slot, Value);
 		}
-		else
-			mValues.insert(TNameValuePair(Name, TStrIntPair(Value, 1)));
+		pthread_mutex_unlock(&mLock);
 #ifndef TW_NO_SCREEN_TIMEOUT
 		if (Name == "tw_screen_timeout_secs")
 			blankTimer.setTime(atoi(Value.c_str()));
@@ -275,6 +477,10 @@ int DataManager::LoadValues(const string filename)
 	}
 error:
 	fclose(in);
+	// What we just read matches the file, nothing needs to be written back
+	pthread_mutex_lock(&mLock);
+	mSaveDirty = 0;
+	pthread_mutex_unlock(&mLock);
 	string current = GetCurrentStoragePath();
 	string settings = GetSettingsStoragePath();
 	if (current != settings && !PartitionManager.Mount_By_Path(current, false)) {
@@ -290,104 +496,278 @@ int DataManager::Flush()
 	return SaveValues();
 }
 
+// Taking mSaveLock first waits out a write the settings writer thread
+// may be in the middle of, so the file is complete once this returns
+int DataManager::FlushPending()
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&mSaveLock);
+	pthread_mutex_lock(&mLock);
+	int dirty = mSaveDirty;
+	pthread_mutex_unlock(&mLock);
+
+	if (dirty && !mBackingFile.empty()) {
+		PartitionManager.Mount_By_Path(GetSettingsStoragePath(), 1);
+		ret = WriteValues();
+	}
+	pthread_mutex_unlock(&mSaveLock);
+	return ret;
+}
+
+// The caller is about to unmount the settings storage, which is mounted
+void DataManager::LockStorage()
+{
+	pthread_mutex_lock(&mSaveLock);
+	pthread_mutex_lock(&mLock);
+	int dirty = mSaveDirty;
+	pthread_mutex_unlock(&mLock);
+
+	if (dirty && !mBackingFile.empty())
+		WriteValues();
+}
+
+void DataManager::UnlockStorage()
+{
+	pthread_mutex_unlock(&mSaveLock);
+}
+
 int DataManager::SaveValues()
 {
 	if (mBackingFile.empty())
 		return -1;
 
-	string mount_path = GetSettingsStoragePath();
-	PartitionManager.Mount_By_Path(mount_path.c_str(), 1);
-
-	FILE* out = fopen(mBackingFile.c_str(), "wb");
-	if (!out)
-		return -1;
+	pthread_mutex_lock(&mSaveLock);
+	PartitionManager.Mount_By_Path(GetSettingsStoragePath(), 1);
+	int ret = WriteValues();
+	pthread_mutex_unlock(&mSaveLock);
+	return ret;
+}
 
+// Serializes the persisted values into one buffer and replaces the settings
+// file with it through a temp file and rename, so an interrupted write
+// can't leave a truncated settings file behind
+int DataManager::WriteValues()
+{
+	string data, temp_file;
 	int file_version = FILE_VERSION;
-	fwrite(&file_version, 1, sizeof(int), out);
+	int ret = -1;
+
+	data.append((const char*) &file_version, sizeof(int));
 
-	map<string, TStrIntPair>::iterator iter;
-	for (iter = mValues.begin(); iter != mValues.end(); ++iter)
+	pthread_mutex_lock(&mLock);
+	for (int handle = 0; handle < mSlotCount; handle++)
 	{
+		VarSlot* slot = GetSlot(handle);
+
 		// Save only the persisted data
-		if (iter->second.second != 0)
+		if ((slot->flags & VAR_SET) && slot->persist != 0)
 		{
-			unsigned short length = (unsigned short) iter->first.length() + 1;
-			fwrite(&length, 1, sizeof(unsigned short), out);
-			fwrite(iter->first.c_str(), 1, length, out);
-			length = (unsigned short) iter->second.first.length() + 1;
-			fwrite(&length, 1, sizeof(unsigned short), out);
-			fwrite(iter->second.first.c_str(), 1, length, out);
+			unsigned short length = (unsigned short) slot->name.length() + 1;
+			data.append((const char*) &length, sizeof(unsigned short));
+			data.append(slot->name.c_str(), length);
+			length = (unsigned short) slot->value.length() + 1;
+			data.append((const char*) &length, sizeof(unsigned short));
+			data.append(slot->value.c_str(), length);
 		}
 	}
-	fclose(out);
-	return 0;
+	mSaveDirty = 0;
+	pthread_mutex_unlock(&mLock);
+
+	temp_file = mBackingFile + ".tmp";
+	FILE* out = fopen(temp_file.c_str(), "wb");
+	if (out) {
+		if (fwrite(data.data(), 1, data.size(), out) == data.size() && fflush(out) == 0 && fsync(fileno(out)) == 0)
+			ret = 0;
+		fclose(out);
+		if (ret == 0 && rename(temp_file.c_str(), mBackingFile.c_str()) != 0)
+			ret = -1;
+		if (ret != 0)
+			unlink(temp_file.c_str());
+	}
+
+	if (ret != 0) {
+		LOGINFO("Unable to write settings file '%s'\n", mBackingFile.c_str());
+		pthread_mutex_lock(&mLock);
+		mSaveDirty = 1;
+		pthread_mutex_unlock(&mLock);
+	}
+	return ret;
 }
 
-int DataManager::GetValue(const string varName, string& value)
+// Must be called with mLock held
+void DataManager::QueueSave()
+{
+	mSaveDirty = 1;
+	if (!mSaveThreadStarted) {
+		pthread_t thread;
+		pthread_attr_t attr;
+
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if (pthread_create(&thread, &attr, save_thread, NULL) == 0)
+			mSaveThreadStarted = 1;
+		else
+			LOGINFO("Unable to start settings writer thread\n");
+		pthread_attr_destroy(&attr);
+	}
+	mSaveQueued = 1;
+	pthread_cond_signal(&mSaveCond);
+}
+
+void* DataManager::save_thread(void* cookie)
+{
+	pthread_mutex_lock(&mLock);
+	while (1) {
+		while (!mSaveQueued)
+			pthread_cond_wait(&mSaveCond, &mLock);
+
+		// Let further changes pile up until the deadline
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += SAVE_DELAY_SECS;
+		while (pthread_cond_timedwait(&mSaveCond, &mLock, &deadline) != ETIMEDOUT)
+			;
+		mSaveQueued = 0;
+		pthread_mutex_unlock(&mLock);
+
+		// Only write if the settings storage is already mounted, mounting
+		// from here could race with a wipe or backup on the action thread.
+		// The check and the write both happen under mSaveLock, which
+		// UnMount holds while it takes the settings storage away. Anything
+		// left over is written by FlushPending() before reboot.
+		pthread_mutex_lock(&mSaveLock);
+		pthread_mutex_lock(&mLock);
+		int dirty = mSaveDirty;
+		pthread_mutex_unlock(&mLock);
+		if (dirty && !mBackingFile.empty() && PartitionManager.Is_Mounted_By_Path(GetSettingsStoragePath()))
+			WriteValues();
+		pthread_mutex_unlock(&mSaveLock);
+
+		pthread_mutex_lock(&mLock);
+	}
+	return NULL;
+}
+
+int DataManager::FindVar(const string& varName)
 {
-	string localStr = varName;
+	const char* name = varName.data();
+	size_t length = varName.length();
 
 	if (!mInitialized)
 		SetDefaultValues();
 
 	// Strip off leading and trailing '%' if provided
-	if (localStr.length() > 2 && localStr[0] == '%' && localStr[localStr.length()-1] == '%')
+	if (length > 2 && name[0] == '%' && name[length - 1] == '%')
 	{
-		localStr.erase(0, 1);
-		localStr.erase(localStr.length() - 1, 1);
+		name++;
+		length -= 2;
 	}
+	return FindSlot(name, length);
+}
 
-	// Handle magic values
-	if (GetMagicValue(localStr, value) == 0)
-		return 0;
+int DataManager::GetValue(const string varName, string& value)
+{
+	return GetValue(FindVar(varName), value);
+}
 
-	map<string, string>::iterator constPos;
-	constPos = mConstValues.find(localStr);
-	if (constPos != mConstValues.end())
-	{
-		value = constPos->second;
-		return 0;
-	}
+int DataManager::GetValue(const string varName, int& value)
+{
+	return GetValue(FindVar(varName), value);
+}
 
-	map<string, TStrIntPair>::iterator pos;
-	pos = mValues.find(localStr);
-	if (pos == mValues.end())
-		return -1;
+int DataManager::GetValue(const string varName, float& value)
+{
+	return GetValue(FindVar(varName), value);
+}
 
-	value = pos->second.first;
-	return 0;
+unsigned long long DataManager::GetValue(const string varName, unsigned long long& value)
+{
+	return GetValue(FindVar(varName), value);
 }
 
-int DataManager::GetValue(const string varName, int& value)
+int DataManager::GetValue(int handle, string& value)
 {
-	string data;
+	if (handle < 0 || handle >= mSlotCount)
+		return -1;
 
-	if (GetValue(varName,data) != 0)
+	VarSlot* slot = GetSlot(handle);
+
+	// Handle magic values
+	if (slot->flags & VAR_MAGIC)
+		return GetMagicValue(handle, value);
+
+	pthread_mutex_lock(&mLock);
+	int ret = -1;
+	if (slot->flags & VAR_SET)
+	{
+		value = slot->value;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&mLock);
+	return ret;
+}
+
+int DataManager::GetValue(int handle, int& value)
+{
+	if (handle < 0 || handle >= mSlotCount)
 		return -1;
 
-	value = atoi(data.c_str());
+	if (GetSlot(handle)->flags & VAR_MAGIC)
+	{
+		string data;
+		if (GetMagicValue(handle, data) != 0)
+			return -1;
+		value = atoi(data.c_str());
+		return 0;
+	}
+
+	int data;
+	if (!ReadNumeric(handle, &data, NULL, NULL))
+		return -1;
+	value = data;
 	return 0;
 }
 
-int DataManager::GetValue(const string varName, float& value)
+int DataManager::GetValue(int handle, float& value)
 {
-	string data;
-
-	if (GetValue(varName,data) != 0)
+	if (handle < 0 || handle >= mSlotCount)
 		return -1;
 
-	value = atof(data.c_str());
+	if (GetSlot(handle)->flags & VAR_MAGIC)
+	{
+		string data;
+		if (GetMagicValue(handle, data) != 0)
+			return -1;
+		value = atof(data.c_str());
+		return 0;
+	}
+
+	float data;
+	if (!ReadNumeric(handle, NULL, &data, NULL))
+		return -1;
+	value = data;
 	return 0;
 }
 
-unsigned long long DataManager::GetValue(const string varName, unsigned long long& value)
+unsigned long long DataManager::GetValue(int handle, unsigned long long& value)
 {
-	string data;
-
-	if (GetValue(varName,data) != 0)
+	if (handle < 0 || handle >= mSlotCount)
 		return -1;
 
-	value = strtoull(data.c_str(), NULL, 10);
+	if (GetSlot(handle)->flags & VAR_MAGIC)
+	{
+		string data;
+		if (GetMagicValue(handle, data) != 0)
+			return -1;
+		value = strtoull(data.c_str(), NULL, 10);
+		return 0;
+	}
+
+	unsigned long long data;
+	if (!ReadNumeric(handle, NULL, NULL, &data))
+		return -1;
+	value = data;
 	return 0;
 }
 
@@ -397,17 +777,21 @@ string& DataManager::GetValueRef(const string varName)
 	if (!mInitialized)
 		SetDefaultValues();
 
-	map<string, string>::iterator constPos;
-	constPos = mConstValues.find(varName);
-	if (constPos != mConstValues.end())
-		return constPos->second;
+	static string empty;
 
-	map<string, TStrIntPair>::iterator pos;
-	pos = mValues.find(varName);
-	if (pos == mValues.end())
-		pos = (mValues.insert(TNameValuePair(varName, TStrIntPair("", 0)))).first;
+	pthread_mutex_lock(&mLock);
+	int handle = CreateSlot(varName);
+	if (handle < 0)
+	{
+		pthread_mutex_unlock(&mLock);
+		return empty;
+	}
+	VarSlot* slot = GetSlot(handle);
+	if (!(slot->flags & VAR_SET))
+		StoreValue(slot, "");
+	pthread_mutex_unlock(&mLock);
 
-	return pos->second.first;
+	return slot->value;
 }
 
 // This function will return an empty string if the value doesn't exist
@@ -422,10 +806,10 @@ string DataManager::GetStrValue(const string varName)
 // This function will return 0 if the value doesn't exist
 int DataManager::GetIntValue(const string varName)
 {
-	string retVal;
+	int retVal = 0;
 
 	GetValue(varName, retVal);
-	return atoi(retVal.c_str());
+	return retVal;
 }
 
 int DataManager::SetValue(const string varName, string value, int persist /* = 0 */)
@@ -437,20 +821,26 @@ int DataManager::SetValue(const string varName, string value, int persist /* = 0
 	if (varName.empty() || (varName[0] >= '0' && varName[0] <= '9'))
 		return -1;
 
-	map<string, string>::iterator constChk;
-	constChk = mConstValues.find(varName);
-	if (constChk != mConstValues.end())
+	pthread_mutex_lock(&mLock);
+	int handle = CreateSlot(varName);
+	if (handle < 0)
+	{
+		pthread_mutex_unlock(&mLock);
 		return -1;
+	}
 
-	map<string, TStrIntPair>::iterator pos;
-	pos = mValues.find(varName);
-	if (pos == mValues.end())
-		pos = (mValues.insert(TNameValuePair(varName, TStrIntPair(value, persist)))).first;
-	else
-		pos->second.first = value;
-
-	if (pos->second.second != 0)
-		SaveValues();
+	VarSlot* slot = GetSlot(handle);
+	if (slot->flags & VAR_CONST)
+	{
+		pthread_mutex_unlock(&mLock);
+		return -1;
+	}
+	if (!(slot->flags & VAR_SET))
+		slot->persist = persist;
+	if (slot->persist != 0 && (!(slot->flags & VAR_SET) || slot->value != value))
+		QueueSave();
+	StoreValue(slot, value);
+	pthread_mutex_unlock(&mLock);
 
 #ifndef TW_NO_SCREEN_TIMEOUT
 	if (varName == "tw_screen_timeout_secs") {
@@ -518,10 +908,15 @@ int DataManager::ShowProgress(float Portion, float Seconds)
 
 void DataManager::DumpValues()
 {
-	map<string, TStrIntPair>::iterator iter;
 	gui_print("Data Manager dump - Values with leading X are persisted.\n");
-	for (iter = mValues.begin(); iter != mValues.end(); ++iter)
-		gui_print("%c %s=%s\n", iter->second.second ? 'X' : ' ', iter->first.c_str(), iter->second.first.c_str());
+	pthread_mutex_lock(&mLock);
+	for (int handle = 0; handle < mSlotCount; handle++)
+	{
+		VarSlot* slot = GetSlot(handle);
+		if ((slot->flags & (VAR_SET | VAR_CONST)) == VAR_SET)
+			gui_print("%c %s=%s\n", slot->persist ? 'X' : ' ', slot->name.c_str(), slot->value.c_str());
+	}
+	pthread_mutex_unlock(&mLock);
 }
 
 void DataManager::update_tz_environment_variables(void)
@@ -576,11 +971,17 @@ void DataManager::SetDefaultValues()
 
 	mInitialized = 1;
 
-	mConstValues.insert(make_pair("true", "1"));
-	mConstValues.insert(make_pair("false", "0"));
+	// Dynamic values are computed on every read
+	mTimeHandle = GetHandle("tw_time");
+	mBatteryHandle = GetHandle("tw_battery");
+	GetSlot(mTimeHandle)->flags |= VAR_MAGIC;
+	GetSlot(mBatteryHandle)->flags |= VAR_MAGIC;
+
+	InsertConst("true", "1");
+	InsertConst("false", "0");
 
-	mConstValues.insert(make_pair(TW_VERSION_VAR, TW_VERSION_STR));
-	mValues.insert(make_pair("tw_storage_path", make_pair("/", 1)));
+	InsertConst(TW_VERSION_VAR, TW_VERSION_STR);
+	InsertValue("tw_storage_path", "/", 1);
 
 #ifdef TW_FORCE_CPUINFO_FOR_DEVICE_ID
 	printf("TW_FORCE_CPUINFO_FOR_DEVICE_ID := true\n");
@@ -588,118 +989,118 @@ void DataManager::SetDefaultValues()
 
 #ifdef BOARD_HAS_NO_REAL_SDCARD
 	printf("BOARD_HAS_NO_REAL_SDCARD := true\n");
-	mConstValues.insert(make_pair(TW_ALLOW_PARTITION_SDCARD, "0"));
+	InsertConst(TW_ALLOW_PARTITION_SDCARD, "0");
 #else
-	mConstValues.insert(make_pair(TW_ALLOW_PARTITION_SDCARD, "1"));
+	InsertConst(TW_ALLOW_PARTITION_SDCARD, "1");
 #endif
 
 #ifdef TW_INCLUDE_DUMLOCK
 	printf("TW_INCLUDE_DUMLOCK := true\n");
-	mConstValues.insert(make_pair(TW_SHOW_DUMLOCK, "1"));
+	InsertConst(TW_SHOW_DUMLOCK, "1");
 #else
-	mConstValues.insert(make_pair(TW_SHOW_DUMLOCK, "0"));
+	InsertConst(TW_SHOW_DUMLOCK, "0");
 #endif
 
 #ifdef TW_INTERNAL_STORAGE_PATH
 	LOGINFO("Internal path defined: '%s'\n", EXPAND(TW_INTERNAL_STORAGE_PATH));
-	mValues.insert(make_pair(TW_USE_EXTERNAL_STORAGE, make_pair("0", 1)));
-	mConstValues.insert(make_pair(TW_HAS_INTERNAL, "1"));
-	mValues.insert(make_pair(TW_INTERNAL_PATH, make_pair(EXPAND(TW_INTERNAL_STORAGE_PATH), 0)));
-	mConstValues.insert(make_pair(TW_INTERNAL_LABEL, EXPAND(TW_INTERNAL_STORAGE_MOUNT_POINT)));
+	InsertValue(TW_USE_EXTERNAL_STORAGE, "0", 1);
+	InsertConst(TW_HAS_INTERNAL, "1");
+	InsertValue(TW_INTERNAL_PATH, EXPAND(TW_INTERNAL_STORAGE_PATH), 0);
+	InsertConst(TW_INTERNAL_LABEL, EXPAND(TW_INTERNAL_STORAGE_MOUNT_POINT));
 	path.clear();
 	path = "/";
 	path += EXPAND(TW_INTERNAL_STORAGE_MOUNT_POINT);
-	mConstValues.insert(make_pair(TW_INTERNAL_MOUNT, path));
+	InsertConst(TW_INTERNAL_MOUNT, path);
 	#ifdef TW_EXTERNAL_STORAGE_PATH
 		LOGINFO("External path defined: '%s'\n", EXPAND(TW_EXTERNAL_STORAGE_PATH));
 		// Device has dual storage
-		mConstValues.insert(make_pair(TW_HAS_DUAL_STORAGE, "1"));
-		mConstValues.insert(make_pair(TW_HAS_EXTERNAL, "1"));
-		mConstValues.insert(make_pair(TW_EXTERNAL_PATH, EXPAND(TW_EXTERNAL_STORAGE_PATH)));
-		mConstValues.insert(make_pair(TW_EXTERNAL_LABEL, EXPAND(TW_EXTERNAL_STORAGE_MOUNT_POINT)));
-		mValues.insert(make_pair(TW_ZIP_EXTERNAL_VAR, make_pair(EXPAND(TW_EXTERNAL_STORAGE_PATH), 1)));
+		InsertConst(TW_HAS_DUAL_STORAGE, "1");
+		InsertConst(TW_HAS_EXTERNAL, "1");
+		InsertConst(TW_EXTERNAL_PATH, EXPAND(TW_EXTERNAL_STORAGE_PATH));
+		InsertConst(TW_EXTERNAL_LABEL, EXPAND(TW_EXTERNAL_STORAGE_MOUNT_POINT));
+		InsertValue(TW_ZIP_EXTERNAL_VAR, EXPAND(TW_EXTERNAL_STORAGE_PATH), 1);
 		path.clear();
 		path = "/";
 		path += EXPAND(TW_EXTERNAL_STORAGE_MOUNT_POINT);
-		mConstValues.insert(make_pair(TW_EXTERNAL_MOUNT, path));
+		InsertConst(TW_EXTERNAL_MOUNT, path);
 		if (strcmp(EXPAND(TW_EXTERNAL_STORAGE_PATH), "/sdcard") == 0) {
-			mValues.insert(make_pair(TW_ZIP_INTERNAL_VAR, make_pair("/emmc", 1)));
+			InsertValue(TW_ZIP_INTERNAL_VAR, "/emmc", 1);
 		} else {
-			mValues.insert(make_pair(TW_ZIP_INTERNAL_VAR, make_pair("/sdcard", 1)));
+			InsertValue(TW_ZIP_INTERNAL_VAR, "/sdcard", 1);
 		}
 	#else
 		LOGINFO("Just has internal storage.\n");
 		// Just has internal storage
-		mValues.insert(make_pair(TW_ZIP_INTERNAL_VAR, make_pair("/sdcard", 1)));
-		mConstValues.insert(make_pair(TW_HAS_DUAL_STORAGE, "0"));
-		mConstValues.insert(make_pair(TW_HAS_EXTERNAL, "0"));
-		mConstValues.insert(make_pair(TW_EXTERNAL_PATH, "0"));
-		mConstValues.insert(make_pair(TW_EXTERNAL_MOUNT, "0"));
-		mConstValues.insert(make_pair(TW_EXTERNAL_LABEL, "0"));
+		InsertValue(TW_ZIP_INTERNAL_VAR, "/sdcard", 1);
+		InsertConst(TW_HAS_DUAL_STORAGE, "0");
+		InsertConst(TW_HAS_EXTERNAL, "0");
+		InsertConst(TW_EXTERNAL_PATH, "0");
+		InsertConst(TW_EXTERNAL_MOUNT, "0");
+		InsertConst(TW_EXTERNAL_LABEL, "0");
 	#endif
 #else
 	#ifdef RECOVERY_SDCARD_ON_DATA
 		#ifdef TW_EXTERNAL_STORAGE_PATH
 			LOGINFO("Has /data/media + external storage in '%s'\n", EXPAND(TW_EXTERNAL_STORAGE_PATH));
 			// Device has /data/media + external storage
-			mConstValues.insert(make_pair(TW_HAS_DUAL_STORAGE, "1"));
+			InsertConst(TW_HAS_DUAL_STORAGE, "1");
 		#else
 			LOGINFO("Single storage only -- data/media.\n");
 			// Device just has external storage
-			mConstValues.insert(make_pair(TW_HAS_DUAL_STORAGE, "0"));
-			mConstValues.insert(make_pair(TW_HAS_EXTERNAL, "0"));
+			InsertConst(TW_HAS_DUAL_STORAGE, "0");
+			InsertConst(TW_HAS_EXTERNAL, "0");
 		#endif
 	#else
 		LOGINFO("Single storage only.\n");
 		// Device just has external storage
-		mConstValues.insert(make_pair(TW_HAS_DUAL_STORAGE, "0"));
+		InsertConst(TW_HAS_DUAL_STORAGE, "0");
 	#endif
 	#ifdef RECOVERY_SDCARD_ON_DATA
 		LOGINFO("Device has /data/media defined.\n");
 		// Device has /data/media
-		mConstValues.insert(make_pair(TW_USE_EXTERNAL_STORAGE, "0"));
-		mConstValues.insert(make_pair(TW_HAS_INTERNAL, "1"));
-		mValues.insert(make_pair(TW_INTERNAL_PATH, make_pair("/data/media", 0)));
-		mConstValues.insert(make_pair(TW_INTERNAL_MOUNT, "/data"));
-		mConstValues.insert(make_pair(TW_INTERNAL_LABEL, "data"));
+		InsertConst(TW_USE_EXTERNAL_STORAGE, "0");
+		InsertConst(TW_HAS_INTERNAL, "1");
+		InsertValue(TW_INTERNAL_PATH, "/data/media", 0);
+		InsertConst(TW_INTERNAL_MOUNT, "/data");
+		InsertConst(TW_INTERNAL_LABEL, "data");
 		#ifdef TW_EXTERNAL_STORAGE_PATH
 			if (strcmp(EXPAND(TW_EXTERNAL_STORAGE_PATH), "/sdcard") == 0) {
-				mValues.insert(make_pair(TW_ZIP_INTERNAL_VAR, make_pair("/emmc", 1)));
+				InsertValue(TW_ZIP_INTERNAL_VAR, "/emmc", 1);
 			} else {
-				mValues.insert(make_pair(TW_ZIP_INTERNAL_VAR, make_pair("/sdcard", 1)));
+				InsertValue(TW_ZIP_INTERNAL_VAR, "/sdcard", 1);
 			}
 		#else
-			mValues.insert(make_pair(TW_ZIP_INTERNAL_VAR, make_pair("/sdcard", 1)));
+			InsertValue(TW_ZIP_INTERNAL_VAR, "/sdcard", 1);
 		#endif
 	#else
 		LOGINFO("No internal storage defined.\n");
 		// Device has no internal storage
-		mConstValues.insert(make_pair(TW_USE_EXTERNAL_STORAGE, "1"));
-		mConstValues.insert(make_pair(TW_HAS_INTERNAL, "0"));
-		mValues.insert(make_pair(TW_INTERNAL_PATH, make_pair("0", 0)));
-		mConstValues.insert(make_pair(TW_INTERNAL_MOUNT, "0"));
-		mConstValues.insert(make_pair(TW_INTERNAL_LABEL, "0"));
+		InsertConst(TW_USE_EXTERNAL_STORAGE, "1");
+		InsertConst(TW_HAS_INTERNAL, "0");
+		InsertValue(TW_INTERNAL_PATH, "0", 0);
+		InsertConst(TW_INTERNAL_MOUNT, "0");
+		InsertConst(TW_INTERNAL_LABEL, "0");
 	#endif
 	#ifdef TW_EXTERNAL_STORAGE_PATH
 		LOGINFO("Only external path defined: '%s'\n", EXPAND(TW_EXTERNAL_STORAGE_PATH));
 		// External has custom definition
-		mConstValues.insert(make_pair(TW_HAS_EXTERNAL, "1"));
-		mConstValues.insert(make_pair(TW_EXTERNAL_PATH, EXPAND(TW_EXTERNAL_STORAGE_PATH)));
-		mConstValues.insert(make_pair(TW_EXTERNAL_LABEL, EXPAND(TW_EXTERNAL_STORAGE_MOUNT_POINT)));
-		mValues.insert(make_pair(TW_ZIP_EXTERNAL_VAR, make_pair(EXPAND(TW_EXTERNAL_STORAGE_PATH), 1)));
+		InsertConst(TW_HAS_EXTERNAL, "1");
+		InsertConst(TW_EXTERNAL_PATH, EXPAND(TW_EXTERNAL_STORAGE_PATH));
+		InsertConst(TW_EXTERNAL_LABEL, EXPAND(TW_EXTERNAL_STORAGE_MOUNT_POINT));
+		InsertValue(TW_ZIP_EXTERNAL_VAR, EXPAND(TW_EXTERNAL_STORAGE_PATH), 1);
 		path.clear();
 		path = "/";
 		path += EXPAND(TW_EXTERNAL_STORAGE_MOUNT_POINT);
-		mConstValues.insert(make_pair(TW_EXTERNAL_MOUNT, path));
+		InsertConst(TW_EXTERNAL_MOUNT, path);
 	#else
 		#ifndef RECOVERY_SDCARD_ON_DATA
 			LOGINFO("No storage defined, defaulting to /sdcard.\n");
 			// Standard external definition
-			mConstValues.insert(make_pair(TW_HAS_EXTERNAL, "1"));
-			mConstValues.insert(make_pair(TW_EXTERNAL_PATH, "/sdcard"));
-			mConstValues.insert(make_pair(TW_EXTERNAL_MOUNT, "/sdcard"));
-			mConstValues.insert(make_pair(TW_EXTERNAL_LABEL, "sdcard"));
-			mValues.insert(make_pair(TW_ZIP_EXTERNAL_VAR, make_pair("/sdcard", 1)));
+			InsertConst(TW_HAS_EXTERNAL, "1");
+			InsertConst(TW_EXTERNAL_PATH, "/sdcard");
+			InsertConst(TW_EXTERNAL_MOUNT, "/sdcard");
+			InsertConst(TW_EXTERNAL_LABEL, "sdcard");
+			InsertValue(TW_ZIP_EXTERNAL_VAR, "/sdcard", 1);
 		#endif
 	#endif
 #endif
@@ -737,77 +1138,77 @@ void DataManager::SetDefaultValues()
 
 #ifdef SP1_DISPLAY_NAME
 	printf("SP1_DISPLAY_NAME := %s\n", EXPAND(SP1_DISPLAY_NAME));
-	if (strlen(EXPAND(SP1_DISPLAY_NAME))) mConstValues.insert(make_pair(TW_SP1_PARTITION_NAME_VAR, EXPAND(SP1_DISPLAY_NAME)));
+	if (strlen(EXPAND(SP1_DISPLAY_NAME))) InsertConst(TW_SP1_PARTITION_NAME_VAR, EXPAND(SP1_DISPLAY_NAME));
 #else
 	#ifdef SP1_NAME
 		printf("SP1_NAME := %s\n", EXPAND(SP1_NAME));
-		if (strlen(EXPAND(SP1_NAME))) mConstValues.insert(make_pair(TW_SP1_PARTITION_NAME_VAR, EXPAND(SP1_NAME)));
+		if (strlen(EXPAND(SP1_NAME))) InsertConst(TW_SP1_PARTITION_NAME_VAR, EXPAND(SP1_NAME));
 	#endif
 #endif
 #ifdef SP2_DISPLAY_NAME
 	printf("SP2_DISPLAY_NAME := %s\n", EXPAND(SP2_DISPLAY_NAME));
-	if (strlen(EXPAND(SP2_DISPLAY_NAME))) mConstValues.insert(make_pair(TW_SP2_PARTITION_NAME_VAR, EXPAND(SP2_DISPLAY_NAME)));
+	if (strlen(EXPAND(SP2_DISPLAY_NAME))) InsertConst(TW_SP2_PARTITION_NAME_VAR, EXPAND(SP2_DISPLAY_NAME));
 #else
 	#ifdef SP2_NAME
 		printf("SP2_NAME := %s\n", EXPAND(SP2_NAME));
-		if (strlen(EXPAND(SP2_NAME))) mConstValues.insert(make_pair(TW_SP2_PARTITION_NAME_VAR, EXPAND(SP2_NAME)));
+		if (strlen(EXPAND(SP2_NAME))) InsertConst(TW_SP2_PARTITION_NAME_VAR, EXPAND(SP2_NAME));
 	#endif
 #endif
 #ifdef SP3_DISPLAY_NAME
 	printf("SP3_DISPLAY_NAME := %s\n", EXPAND(SP3_DISPLAY_NAME));
-	if (strlen(EXPAND(SP3_DISPLAY_NAME))) mConstValues.insert(make_pair(TW_SP3_PARTITION_NAME_VAR, EXPAND(SP3_DISPLAY_NAME)));
+	if (strlen(EXPAND(SP3_DISPLAY_NAME))) InsertConst(TW_SP3_PARTITION_NAME_VAR, EXPAND(SP3_DISPLAY_NAME));
 #else
 	#ifdef SP3_NAME
 		printf("SP3_NAME := %s\n", EXPAND(SP3_NAME));
-		if (strlen(EXPAND(SP3_NAME))) mConstValues.insert(make_pair(TW_SP3_PARTITION_NAME_VAR, EXPAND(SP3_NAME)));
+		if (strlen(EXPAND(SP3_NAME))) InsertConst(TW_SP3_PARTITION_NAME_VAR, EXPAND(SP3_NAME));
 	#endif
 #endif
 
-	mConstValues.insert(make_pair(TW_REBOOT_SYSTEM, "1"));
+	InsertConst(TW_REBOOT_SYSTEM, "1");
 #ifdef TW_NO_REBOOT_RECOVERY
 	printf("TW_NO_REBOOT_RECOVERY := true\n");
-	mConstValues.insert(make_pair(TW_REBOOT_RECOVERY, "0"));
+	InsertConst(TW_REBOOT_RECOVERY, "0");
 #else
-	mConstValues.insert(make_pair(TW_REBOOT_RECOVERY, "1"));
+	InsertConst(TW_REBOOT_RECOVERY, "1");
 #endif
-	mConstValues.insert(make_pair(TW_REBOOT_POWEROFF, "1"));
+	InsertConst(TW_REBOOT_POWEROFF, "1");
 #ifdef TW_NO_REBOOT_BOOTLOADER
 	printf("TW_NO_REBOOT_BOOTLOADER := true\n");
-	mConstValues.insert(make_pair(TW_REBOOT_BOOTLOADER, "0"));
+	InsertConst(TW_REBOOT_BOOTLOADER, "0");
 #else
-	mConstValues.insert(make_pair(TW_REBOOT_BOOTLOADER, "1"));
+	InsertConst(TW_REBOOT_BOOTLOADER, "1");
 #endif
 #ifdef RECOVERY_SDCARD_ON_DATA
 	printf("RECOVERY_SDCARD_ON_DATA := true\n");
-	mConstValues.insert(make_pair(TW_HAS_DATA_MEDIA, "1"));
+	InsertConst(TW_HAS_DATA_MEDIA, "1");
 #else
-	mConstValues.insert(make_pair(TW_HAS_DATA_MEDIA, "0"));
+	InsertConst(TW_HAS_DATA_MEDIA, "0");
 #endif
 #ifdef TW_NO_BATT_PERCENT
 	printf("TW_NO_BATT_PERCENT := true\n");
-	mConstValues.insert(make_pair(TW_NO_BATTERY_PERCENT, "1"));
+	InsertConst(TW_NO_BATTERY_PERCENT, "1");
 #else
-	mConstValues.insert(make_pair(TW_NO_BATTERY_PERCENT, "0"));
+	InsertConst(TW_NO_BATTERY_PERCENT, "0");
 #endif
 #ifdef TW_CUSTOM_POWER_BUTTON
 	printf("TW_POWER_BUTTON := %s\n", EXPAND(TW_CUSTOM_POWER_BUTTON));
-	mConstValues.insert(make_pair(TW_POWER_BUTTON, EXPAND(TW_CUSTOM_POWER_BUTTON)));
+	InsertConst(TW_POWER_BUTTON, EXPAND(TW_CUSTOM_POWER_BUTTON));
 #else
-	mConstValues.insert(make_pair(TW_POWER_BUTTON, "0"));
+	InsertConst(TW_POWER_BUTTON, "0");
 #endif
 #ifdef TW_ALWAYS_RMRF
 	printf("TW_ALWAYS_RMRF := true\n");
-	mConstValues.insert(make_pair(TW_RM_RF_VAR, "1"));
+	InsertConst(TW_RM_RF_VAR, "1");
 #endif
 #ifdef TW_NEVER_UNMOUNT_SYSTEM
 	printf("TW_NEVER_UNMOUNT_SYSTEM := true\n");
-	mConstValues.insert(make_pair(TW_DONT_UNMOUNT_SYSTEM, "1"));
+	InsertConst(TW_DONT_UNMOUNT_SYSTEM, "1");
 #else
-	mConstValues.insert(make_pair(TW_DONT_UNMOUNT_SYSTEM, "0"));
+	InsertConst(TW_DONT_UNMOUNT_SYSTEM, "0");
 #endif
 #ifdef TW_NO_USB_STORAGE
 	printf("TW_NO_USB_STORAGE := true\n");
-	mConstValues.insert(make_pair(TW_HAS_USB_STORAGE, "0"));
+	InsertConst(TW_HAS_USB_STORAGE, "0");
 #else
 	char lun_file[255];
 	string Lun_File_str = CUSTOM_LUN_FILE;
@@ -818,160 +1219,161 @@ void DataManager::SetDefaultValues()
 	}
 	if (!TWFunc::Path_Exists(Lun_File_str)) {
 		LOGINFO("Lun file '%s' does not exist, USB storage mode disabled\n", Lun_File_str.c_str());
-		mConstValues.insert(make_pair(TW_HAS_USB_STORAGE, "0"));
+		InsertConst(TW_HAS_USB_STORAGE, "0");
 	} else {
 		LOGINFO("Lun file '%s'\n", Lun_File_str.c_str());
-		mConstValues.insert(make_pair(TW_HAS_USB_STORAGE, "1"));
+		InsertConst(TW_HAS_USB_STORAGE, "1");
 	}
 #endif
 #ifdef TW_INCLUDE_INJECTTWRP
 	printf("TW_INCLUDE_INJECTTWRP := true\n");
-	mConstValues.insert(make_pair(TW_HAS_INJECTTWRP, "1"));
-	mValues.insert(make_pair(TW_INJECT_AFTER_ZIP, make_pair("1", 1)));
+	InsertConst(TW_HAS_INJECTTWRP, "1");
+	InsertValue(TW_INJECT_AFTER_ZIP, "1", 1);
 #else
-	mConstValues.insert(make_pair(TW_HAS_INJECTTWRP, "0"));
-	mValues.insert(make_pair(TW_INJECT_AFTER_ZIP, make_pair("0", 1)));
+	InsertConst(TW_HAS_INJECTTWRP, "0");
+	InsertValue(TW_INJECT_AFTER_ZIP, "0", 1);
 #endif
 #ifdef TW_HAS_DOWNLOAD_MODE
 	printf("TW_HAS_DOWNLOAD_MODE := true\n");
-	mConstValues.insert(make_pair(TW_DOWNLOAD_MODE, "1"));
+	InsertConst(TW_DOWNLOAD_MODE, "1");
 #endif
 #ifdef TW_INCLUDE_CRYPTO
-	mConstValues.insert(make_pair(TW_HAS_CRYPTO, "1"));
+	InsertConst(TW_HAS_CRYPTO, "1");
 	printf("TW_INCLUDE_CRYPTO := true\n");
 #endif
 #ifdef TW_SDEXT_NO_EXT4
 	printf("TW_SDEXT_NO_EXT4 := true\n");
-	mConstValues.insert(make_pair(TW_SDEXT_DISABLE_EXT4, "1"));
+	InsertConst(TW_SDEXT_DISABLE_EXT4, "1");
 #else
-	mConstValues.insert(make_pair(TW_SDEXT_DISABLE_EXT4, "0"));
+	InsertConst(TW_SDEXT_DISABLE_EXT4, "0");
 #endif
 
 #ifdef TW_HAS_NO_BOOT_PARTITION
-	mValues.insert(make_pair("tw_backup_list", make_pair("/system;/data;", 1)));
+	InsertValue("tw_backup_list", "/system;/data;", 1);
 #else
-	mValues.insert(make_pair("tw_backup_list", make_pair("/system;/data;/boot;", 1)));
+	InsertValue("tw_backup_list", "/system;/data;/boot;", 1);
 #endif
-	mConstValues.insert(make_pair(TW_MIN_SYSTEM_VAR, TW_MIN_SYSTEM_SIZE));
-	mValues.insert(make_pair(TW_BACKUP_NAME, make_pair("(Auto Generate)", 0)));
-	mValues.insert(make_pair(TW_BACKUP_SYSTEM_VAR, make_pair("1", 1)));
-	mValues.insert(make_pair(TW_BACKUP_DATA_VAR, make_pair("1", 1)));
-	mValues.insert(make_pair(TW_BACKUP_BOOT_VAR, make_pair("1", 1)));
-	mValues.insert(make_pair(TW_BACKUP_RECOVERY_VAR, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_BACKUP_CACHE_VAR, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_BACKUP_SP1_VAR, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_BACKUP_SP2_VAR, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_BACKUP_SP3_VAR, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_BACKUP_ANDSEC_VAR, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_BACKUP_SDEXT_VAR, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_BACKUP_SYSTEM_SIZE, make_pair("0", 0)));
-	mValues.insert(make_pair(TW_BACKUP_DATA_SIZE, make_pair("0", 0)));
-	mValues.insert(make_pair(TW_BACKUP_BOOT_SIZE, make_pair("0", 0)));
-	mValues.insert(make_pair(TW_BACKUP_RECOVERY_SIZE, make_pair("0", 0)));
-	mValues.insert(make_pair(TW_BACKUP_CACHE_SIZE, make_pair("0", 0)));
-	mValues.insert(make_pair(TW_BACKUP_ANDSEC_SIZE, make_pair("0", 0)));
-	mValues.insert(make_pair(TW_BACKUP_SDEXT_SIZE, make_pair("0", 0)));
-	mValues.insert(make_pair(TW_BACKUP_SP1_SIZE, make_pair("0", 0)));
-	mValues.insert(make_pair(TW_BACKUP_SP2_SIZE, make_pair("0", 0)));
-	mValues.insert(make_pair(TW_BACKUP_SP3_SIZE, make_pair("0", 0)));
-	mValues.insert(make_pair(TW_STORAGE_FREE_SIZE, make_pair("0", 0)));
-
-	mValues.insert(make_pair(TW_REBOOT_AFTER_FLASH_VAR, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_SIGNED_ZIP_VERIFY_VAR, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_FORCE_MD5_CHECK_VAR, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_COLOR_THEME_VAR, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_USE_COMPRESSION_VAR, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_SHOW_SPAM_VAR, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_TIME_ZONE_VAR, make_pair("CST6CDT", 1)));
-	mValues.insert(make_pair(TW_SORT_FILES_BY_DATE_VAR, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_GUI_SORT_ORDER, make_pair("1", 1)));
-	mValues.insert(make_pair(TW_RM_RF_VAR, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_SKIP_MD5_CHECK_VAR, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_SKIP_MD5_GENERATE_VAR, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_SDEXT_SIZE, make_pair("512", 1)));
-	mValues.insert(make_pair(TW_SWAP_SIZE, make_pair("32", 1)));
-	mValues.insert(make_pair(TW_SDPART_FILE_SYSTEM, make_pair("ext3", 1)));
-	mValues.insert(make_pair(TW_TIME_ZONE_GUISEL, make_pair("CST6;CDT", 1)));
-	mValues.insert(make_pair(TW_TIME_ZONE_GUIOFFSET, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_TIME_ZONE_GUIDST, make_pair("1", 1)));
-	mValues.insert(make_pair(TW_ACTION_BUSY, make_pair("0", 0)));
-	mValues.insert(make_pair(TW_BACKUP_AVG_IMG_RATE, make_pair("15000000", 1)));
-	mValues.insert(make_pair(TW_BACKUP_AVG_FILE_RATE, make_pair("3000000", 1)));
-	mValues.insert(make_pair(TW_BACKUP_AVG_FILE_COMP_RATE, make_pair("2000000", 1)));
-	mValues.insert(make_pair(TW_RESTORE_AVG_IMG_RATE, make_pair("15000000", 1)));
-	mValues.insert(make_pair(TW_RESTORE_AVG_FILE_RATE, make_pair("3000000", 1)));
-	mValues.insert(make_pair(TW_RESTORE_AVG_FILE_COMP_RATE, make_pair("2000000", 1)));
-	mValues.insert(make_pair("tw_wipe_cache", make_pair("0", 0)));
-	mValues.insert(make_pair("tw_wipe_dalvik", make_pair("0", 0)));
+	InsertConst(TW_MIN_SYSTEM_VAR, TW_MIN_SYSTEM_SIZE);
+	InsertValue(TW_BACKUP_NAME, "(Auto Generate)", 0);
+	InsertValue(TW_BACKUP_SYSTEM_VAR, "1", 1);
+	InsertValue(TW_BACKUP_DATA_VAR, "1", 1);
+	InsertValue(TW_BACKUP_BOOT_VAR, "1", 1);
+	InsertValue(TW_BACKUP_RECOVERY_VAR, "0", 1);
+	InsertValue(TW_BACKUP_CACHE_VAR, "0", 1);
+	InsertValue(TW_BACKUP_SP1_VAR, "0", 1);
+	InsertValue(TW_BACKUP_SP2_VAR, "0", 1);
+	InsertValue(TW_BACKUP_SP3_VAR, "0", 1);
+	InsertValue(TW_BACKUP_ANDSEC_VAR, "0", 1);
+	InsertValue(TW_BACKUP_SDEXT_VAR, "0", 1);
+	InsertValue(TW_BACKUP_SYSTEM_SIZE, "0", 0);
+	InsertValue(TW_BACKUP_DATA_SIZE, "0", 0);
+	InsertValue(TW_BACKUP_BOOT_SIZE, "0", 0);
+	InsertValue(TW_BACKUP_RECOVERY_SIZE, "0", 0);
+	InsertValue(TW_BACKUP_CACHE_SIZE, "0", 0);
+	InsertValue(TW_BACKUP_ANDSEC_SIZE, "0", 0);
+	InsertValue(TW_BACKUP_SDEXT_SIZE, "0", 0);
+	InsertValue(TW_BACKUP_SP1_SIZE, "0", 0);
+	InsertValue(TW_BACKUP_SP2_SIZE, "0", 0);
+	InsertValue(TW_BACKUP_SP3_SIZE, "0", 0);
+	InsertValue(TW_STORAGE_FREE_SIZE, "0", 0);
+
+	InsertValue(TW_REBOOT_AFTER_FLASH_VAR, "0", 1);
+	InsertValue(TW_SIGNED_ZIP_VERIFY_VAR, "0", 1);
+	InsertValue(TW_FORCE_MD5_CHECK_VAR, "0", 1);
+	InsertValue(TW_COLOR_THEME_VAR, "0", 1);
+	InsertValue(TW_USE_COMPRESSION_VAR, "0", 1);
+	InsertValue(TW_SHOW_SPAM_VAR, "0", 1);
+	InsertValue(TW_TIME_ZONE_VAR, "CST6CDT", 1);
+	InsertValue(TW_SORT_FILES_BY_DATE_VAR, "0", 1);
+	InsertValue(TW_GUI_SORT_ORDER, "1", 1);
+	InsertValue(TW_RM_RF_VAR, "0", 1);
+	InsertValue(TW_SKIP_MD5_CHECK_VAR, "0", 1);
+	InsertValue(TW_SKIP_MD5_GENERATE_VAR, "0", 1);
+	InsertValue(TW_SDEXT_SIZE, "512", 1);
+	InsertValue(TW_SWAP_SIZE, "32", 1);
+	InsertValue(TW_SDPART_FILE_SYSTEM, "ext3", 1);
+	InsertValue(TW_TIME_ZONE_GUISEL, "CST6;CDT", 1);
+	InsertValue(TW_TIME_ZONE_GUIOFFSET, "0", 1);
+	InsertValue(TW_TIME_ZONE_GUIDST, "1", 1);
+	InsertValue(TW_ACTION_BUSY, "0", 0);
+	InsertValue(TW_BACKUP_AVG_IMG_RATE, "15000000", 1);
+	InsertValue(TW_BACKUP_AVG_FILE_RATE, "3000000", 1);
+	InsertValue(TW_BACKUP_AVG_FILE_COMP_RATE, "2000000", 1);
+	InsertValue(TW_RESTORE_AVG_IMG_RATE, "15000000", 1);
+	InsertValue(TW_RESTORE_AVG_FILE_RATE, "3000000", 1);
+	InsertValue(TW_RESTORE_AVG_FILE_COMP_RATE, "2000000", 1);
+	InsertValue("tw_wipe_cache", "0", 0);
+	InsertValue("tw_wipe_dalvik", "0", 0);
 	if (GetIntValue(TW_HAS_INTERNAL) == 1 && GetIntValue(TW_HAS_DATA_MEDIA) == 1 && GetIntValue(TW_HAS_EXTERNAL) == 0)
 		SetValue(TW_HAS_USB_STORAGE, 0, 0);
 	else
 		SetValue(TW_HAS_USB_STORAGE, 1, 0);
-	mValues.insert(make_pair(TW_ZIP_INDEX, make_pair("0", 0)));
-	mValues.insert(make_pair(TW_ZIP_QUEUE_COUNT, make_pair("0", 0)));
-	mValues.insert(make_pair(TW_FILENAME, make_pair("/sdcard", 0)));
-	mValues.insert(make_pair(TW_SIMULATE_ACTIONS, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_SIMULATE_FAIL, make_pair("0", 1)));
-	mValues.insert(make_pair(TW_IS_ENCRYPTED, make_pair("0", 0)));
-	mValues.insert(make_pair(TW_IS_DECRYPTED, make_pair("0", 0)));
-	mValues.insert(make_pair(TW_CRYPTO_PASSWORD, make_pair("0", 0)));
-	mValues.insert(make_pair(TW_DATA_BLK_DEVICE, make_pair("0", 0)));
-	mValues.insert(make_pair("tw_terminal_state", make_pair("0", 0)));
-	mValues.insert(make_pair("tw_background_thread_running", make_pair("0", 0)));
-	mValues.insert(make_pair(TW_RESTORE_FILE_DATE, make_pair("0", 0)));
-	mValues.insert(make_pair("tw_military_time", make_pair("0", 1)));
+	InsertValue(TW_ZIP_INDEX, "0", 0);
+	InsertValue(TW_ZIP_QUEUE_COUNT, "0", 0);
+	InsertValue(TW_FILENAME, "/sdcard", 0);
+	InsertValue(TW_SIMULATE_ACTIONS, "0", 1);
+	InsertValue(TW_SIMULATE_FAIL, "0", 1);
+	InsertValue(TW_IS_ENCRYPTED, "0", 0);
+	InsertValue(TW_IS_DECRYPTED, "0", 0);
+	InsertValue(TW_CRYPTO_PASSWORD, "0", 0);
+	InsertValue(TW_DATA_BLK_DEVICE, "0", 0);
+	InsertValue("tw_terminal_state", "0", 0);
+	InsertValue("tw_background_thread_running", "0", 0);
+	InsertValue(TW_RESTORE_FILE_DATE, "0", 0);
+	InsertValue("tw_military_time", "0", 1);
 #ifdef TW_NO_SCREEN_TIMEOUT
-	mValues.insert(make_pair("tw_screen_timeout_secs", make_pair("0", 1)));
-	mValues.insert(make_pair("tw_no_screen_timeout", make_pair("1", 1)));
+	InsertValue("tw_screen_timeout_secs", "0", 1);
+	InsertValue("tw_no_screen_timeout", "1", 1);
 #else
-	mValues.insert(make_pair("tw_screen_timeout_secs", make_pair("60", 1)));
-	mValues.insert(make_pair("tw_no_screen_timeout", make_pair("0", 1)));
+	InsertValue("tw_screen_timeout_secs", "60", 1);
+	InsertValue("tw_no_screen_timeout", "0", 1);
 #endif
-	mValues.insert(make_pair("tw_gui_done", make_pair("0", 0)));
-	mValues.insert(make_pair("tw_encrypt_backup", make_pair("0", 0)));
+	InsertValue("tw_gui_done", "0", 0);
+	InsertValue("tw_gui_profile", "0", 0);
+	InsertValue("tw_encrypt_backup", "0", 0);
 #ifdef TW_BRIGHTNESS_PATH
 #ifndef TW_MAX_BRIGHTNESS
 #define TW_MAX_BRIGHTNESS 255
 #endif
 	if (strcmp(EXPAND(TW_BRIGHTNESS_PATH), "/nobrightness") != 0) {
 		LOGINFO("TW_BRIGHTNESS_PATH := %s\n", EXPAND(TW_BRIGHTNESS_PATH));
-		mConstValues.insert(make_pair("tw_has_brightnesss_file", "1"));
-		mConstValues.insert(make_pair("tw_brightness_file", EXPAND(TW_BRIGHTNESS_PATH)));
+		InsertConst("tw_has_brightnesss_file", "1");
+		InsertConst("tw_brightness_file", EXPAND(TW_BRIGHTNESS_PATH));
 		ostringstream maxVal;
 		maxVal << TW_MAX_BRIGHTNESS;
-		mConstValues.insert(make_pair("tw_brightness_max", maxVal.str()));
-		mValues.insert(make_pair("tw_brightness", make_pair(maxVal.str(), 1)));
-		mValues.insert(make_pair("tw_brightness_pct", make_pair("100", 1)));
+		InsertConst("tw_brightness_max", maxVal.str());
+		InsertValue("tw_brightness", maxVal.str(), 1);
+		InsertValue("tw_brightness_pct", "100", 1);
 	} else {
-		mConstValues.insert(make_pair("tw_has_brightnesss_file", "0"));
+		InsertConst("tw_has_brightnesss_file", "0");
 	}
 #endif
-	mValues.insert(make_pair(TW_MILITARY_TIME, make_pair("0", 1)));
+	InsertValue(TW_MILITARY_TIME, "0", 1);
 
 #ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
-	mValues.insert(make_pair("tw_include_encrypted_backup", make_pair("1", 0)));
+	InsertValue("tw_include_encrypted_backup", "1", 0);
 #else
 	LOGINFO("TW_EXCLUDE_ENCRYPTED_BACKUPS := true\n");
-	mValues.insert(make_pair("tw_include_encrypted_backup", make_pair("0", 0)));
+	InsertValue("tw_include_encrypted_backup", "0", 0);
 #endif
 
 #if defined(TW_HAS_LANDSCAPE) && defined(TW_DEFAULT_ROTATION)
-	mValues.insert(make_pair(TW_ROTATION, make_pair(EXPAND(TW_DEFAULT_ROTATION), 1)));
+	InsertValue(TW_ROTATION, EXPAND(TW_DEFAULT_ROTATION), 1);
 #else
-	mValues.insert(make_pair(TW_ROTATION, make_pair("0", 1)));
+	InsertValue(TW_ROTATION, "0", 1);
 #endif
-	mValues.insert(make_pair(TW_ENABLE_ROTATION, make_pair("0", 0)));
+	InsertValue(TW_ENABLE_ROTATION, "0", 0);
 
-	mConstValues.insert(make_pair("tw_device_name", TARGET_DEVICE));
+	InsertConst("tw_device_name", TARGET_DEVICE);
 
-	mValues.insert(make_pair(TW_AUTO_INJECT_MROM, make_pair("1", 1)));
+	InsertValue(TW_AUTO_INJECT_MROM, "1", 1);
 }
 
 // Magic Values
-int DataManager::GetMagicValue(const string varName, string& value)
+int DataManager::GetMagicValue(int handle, string& value)
 {
 	// Handle special dynamic cases
-	if (varName == "tw_time")
+	if (handle == mTimeHandle)
 	{
 		char tmp[32];
 
@@ -998,7 +1400,7 @@ int DataManager::GetMagicValue(const string varName, string& value)
 		value = tmp;
 		return 0;
 	}
-	else if (varName == "tw_battery")
+	else if (handle == mBatteryHandle)
 	{
 		char tmp[16];
 		static char charging = ' ';
@@ -17,6 +17,7 @@
 #ifndef _DATAMANAGER_HPP_HEADER
 #define _DATAMANAGER_HPP_HEADER
 
+#include <pthread.h>
 #include <string>
 #include <utility>
 #include <map>
@@ -29,6 +30,9 @@ public:
 	static int ResetDefaults();
 	static int LoadValues(const string filename);
 	static int Flush();
+	static int FlushPending(); // Writes the settings file only if persisted values changed
+	static void LockStorage(); // Flushes pending changes and holds off the settings writer until UnlockStorage(), for unmounting
+	static void UnlockStorage();
 
 	// Core get routines
 	static int GetValue(const string varName, string& value);
@@ -63,21 +67,67 @@ public:
 	static string GetSettingsStoragePath(void);
 	static string& CGetSettingsStoragePath();
 
+	// Handles are stable indexes into the value store that stay valid for
+	// the life of the process, even across ResetDefaults(). Look a variable
+	// up once and use the handle to skip the name lookup on hot paths.
+	static int GetHandle(const string varName);
+	static int GetValue(int handle, string& value);
+	static int GetValue(int handle, int& value);
+	static int GetValue(int handle, float& value);
+	static unsigned long long GetValue(int handle, unsigned long long& value);
+
 protected:
-	typedef pair<string, int> TStrIntPair;
-	typedef pair<string, unsigned long long> TStrULLPair;
-	typedef pair<string, TStrIntPair> TNameValuePair;
-	static map<string, TStrIntPair> mValues;
-	static map<string, TStrULLPair> mULLValues;
+	enum {
+		VAR_SET   = 0x01,
+		VAR_CONST = 0x02,
+		VAR_MAGIC = 0x04,
+	};
+
+	// A value slot. The string value is the master copy; the numeric forms
+	// are converted once when the value is written so typed reads don't
+	// have to parse it again.
+	struct VarSlot {
+		string name;
+		string value;
+		unsigned hash;
+		int flags;
+		int persist;
+		volatile unsigned seq; // odd while a writer is updating the slot
+		int intValue;
+		float floatValue;
+		unsigned long long ullValue;
+	};
+
+	static VarSlot* mSlotPages[];
+	static volatile int mSlotCount;
+	static int mHashTable[];
+	static pthread_mutex_t mLock;
 	static string mBackingFile;
 	static int mInitialized;
-
-	static map<string, string> mConstValues;
+	static int mTimeHandle;
+	static int mBatteryHandle;
+	static pthread_mutex_t mSaveLock;
+	static pthread_cond_t mSaveCond;
+	static int mSaveDirty;
+	static int mSaveQueued;
+	static int mSaveThreadStarted;
 
 protected:
 	static int SaveValues();
-
-	static int GetMagicValue(string varName, string& value);
+	static int WriteValues(); // Must be called with mSaveLock held
+	static void QueueSave();
+	static void* save_thread(void* cookie);
+
+	static int GetMagicValue(int handle, string& value);
+
+	static VarSlot* GetSlot(int handle);
+	static int FindSlot(const char* varName, size_t length);
+	static int FindVar(const string& varName);
+	static int CreateSlot(const string& varName);
+	static void StoreValue(VarSlot* slot, const string& value);
+	static bool ReadNumeric(int handle, int* intValue, float* floatValue, unsigned long long* ullValue);
+	static void InsertValue(const string varName, const string value, int persist);
+	static void InsertConst(const string varName, const string value);
 
 private:
 	static void sanitize_device_id(char* device_id);
@@ -26,19 +26,28 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <dirent.h>
-#include "gui/rapidxml.hpp"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <algorithm>
 #include "fixPermissions.hpp"
 #include "twrp-functions.hpp"
 #include "twcommon.h"
+#include "data.hpp"
 
 using namespace std;
-using namespace rapidxml;
+
+#define MAX_FIX_THREADS 4
+#define MAX_FIX_ERRORS 10                  // Errors logged in full, the rest are only counted
+#define PKG_READ_SIZE (16 * 1024)
+#define PKG_MAX_TAG (64 * 1024)            // Longest package tag kept, other tags are skipped as they stream by
 
 int fixPermissions::fixPerms(bool enable_debug, bool remove_data_for_missing_apps) {
 	packageFile = "/data/system/packages.xml";
 	debug = enable_debug;
 	remove_data = remove_data_for_missing_apps;
 	multi_user = TWFunc::Path_Exists("/data/user");
+	errors = 0;
 
 	if (!(TWFunc::Path_Exists(packageFile))) {
 		gui_print("Can't check permissions\n");
@@ -121,7 +130,8 @@ int fixPermissions::fixPerms(bool enable_debug, bool remove_data_for_missing_app
 }
 
 int fixPermissions::pchown(string fn, int puid, int pgid) {
-	LOGINFO("Fixing %s, uid: %d, gid: %d\n", fn.c_str(), puid, pgid);
+	if (debug)
+		LOGINFO("Fixing %s, uid: %d, gid: %d\n", fn.c_str(), puid, pgid);
 	if (chown(fn.c_str(), puid, pgid) != 0) {
 		LOGERR("Unable to chown '%s' %i %i\n", fn.c_str(), puid, pgid);
 		return -1;
@@ -129,100 +139,42 @@ int fixPermissions::pchown(string fn, int puid, int pgid) {
 	return 0;
 }
 
-int fixPermissions::pchmod(string fn, string mode) {
-	long mask = 0;
-	LOGINFO("Fixing %s, mode: %s\n", fn.c_str(), mode.c_str());
-	for ( std::string::size_type n = 0; n < mode.length(); ++n) {
-		if (n == 0) {
-			if (mode[n] == '0')
-				continue;
-			else if (mode[n] == '1')
-				mask = S_ISVTX;
-			else if (mode[n] == '2')
-				mask = S_ISGID;
-		}
-		else if (n == 1) {
-			if (mode[n] == '7') {
-				mask |= S_IRWXU;
-			}
-			if (mode[n] == '6') {
-				mask |= S_IRUSR;
-				mask |= S_IWUSR;
-			}
-			if (mode[n] == '5') {
-				mask |= S_IRUSR;
-				mask |= S_IXUSR;
-			}
-			if (mode[n] == '4')
-				mask |= S_IRUSR;
-			if (mode[n] == '3') {
-				mask |= S_IWUSR;
-				mask |= S_IRUSR;
-			}
-			if (mode[n] == '2')
-				mask |= S_IWUSR;
-			if (mode[n] == '1')
-				mask |= S_IXUSR;
-		}
-		else if (n == 2) {
-			if (mode[n] == '7') {
-				mask |= S_IRWXG;
-			}
-			if (mode[n] == '6') {
-				mask |= S_IRGRP;
-				mask |= S_IWGRP;
-			}
-			if (mode[n] == '5') {
-				mask |= S_IRGRP;
-				mask |= S_IXGRP;
-			}
-			if (mode[n] == '4')
-				mask |= S_IRGRP;
-			if (mode[n] == '3') {
-				mask |= S_IWGRP;
-				mask |= S_IXGRP;
-			}
-			if (mode[n] == '2')
-				mask |= S_IWGRP;
-			if (mode[n] == '1')
-				mask |= S_IXGRP;
-		}
-		else if (n == 3) {
-			if (mode[n] == '7') {
-				mask |= S_IRWXO;
-			}
-			if (mode[n] == '6') {
-				mask |= S_IROTH;
-				mask |= S_IWOTH;
-			}
-			if (mode[n] == '5') {
-				mask |= S_IROTH;
-				mask |= S_IXOTH;
-			}
-			if (mode[n] == '4')
-				mask |= S_IROTH;
-			if (mode[n] == '3') {
-				mask |= S_IWOTH;
-				mask |= S_IXOTH;
-			}
-			if (mode[n] == '2')
-				mask |= S_IWOTH;
-			if (mode[n] == '1')
-				mask |= S_IXOTH;
-		}
-	} 
-
-	if (chmod(fn.c_str(), mask) != 0) {
-		LOGERR("Unable to chmod '%s' %l\n", fn.c_str(), mask);
+int fixPermissions::pchmod(string fn, mode_t mode) {
+	if (debug)
+		LOGINFO("Fixing %s, mode: %04o\n", fn.c_str(), mode);
+	if (chmod(fn.c_str(), mode) != 0) {
+		LOGERR("Unable to chmod '%s' %04o\n", fn.c_str(), mode);
 		return -1;
 	}
+	return 0;
+}
+
+void fixPermissions::fixError(const char* action, const string& fn, int err) {
+	int count = __sync_add_and_fetch(&errors, 1);
 
+	if (count <= MAX_FIX_ERRORS)
+		LOGERR("Unable to %s '%s': %s\n", action, fn.c_str(), strerror(err));
+	else if (count == MAX_FIX_ERRORS + 1)
+		LOGERR("More permission errors, not showing them.\n");
+}
+
+int fixPermissions::fixEntry(int dirFd, const char* name, const string& path, int uid, int gid, mode_t mode) {
+	if (debug)
+		LOGINFO("Fixing %s/%s, uid: %d, gid: %d, mode: %04o\n", path.c_str(), name, uid, gid, mode);
+	if (fchmodat(dirFd, name, mode, 0) != 0) {
+		fixError("chmod", path + "/" + name, errno);
+		return -1;
+	}
+	if (fchownat(dirFd, name, uid, gid, AT_SYMLINK_NOFOLLOW) != 0) {
+		fixError("chown", path + "/" + name, errno);
+		return -1;
+	}
 	return 0;
 }
 
 int fixPermissions::fixSystemApps() {
-	temp = head;
-	while (temp != NULL) {
+	for (size_t i = 0; i < packages.size(); ++i) {
+		temp = &packages[i];
 		if (TWFunc::Path_Exists(temp->codePath)) {
 			if (temp->appDir.compare("/system/app") == 0) {
 				if (debug)  {
@@ -233,7 +185,7 @@ int fixPermissions::fixSystemApps() {
 				}
 				if (pchown(temp->codePath, 0, 0) != 0)
 					return -1;
-				if (pchmod(temp->codePath, "0644") != 0)
+				if (pchmod(temp->codePath, 0644) != 0)
 					return -1;
 			}
 		} else {
@@ -247,7 +199,6 @@ int fixPermissions::fixSystemApps() {
 				}
 			}
 		}
-		temp = temp->next;
 	}
 	return 0;
 }
@@ -255,19 +206,19 @@ int fixPermissions::fixSystemApps() {
 int fixPermissions::fixDataApps() {
 	bool fix = false;
 	int new_gid = 0;
-	string perms = "0000";
+	mode_t perms = 0;
 
-	temp = head;
-	while (temp != NULL) {
+	for (size_t i = 0; i < packages.size(); ++i) {
+		temp = &packages[i];
 		if (TWFunc::Path_Exists(temp->codePath)) {
 			if (temp->appDir.compare("/data/app") == 0 || temp->appDir.compare("/sd-ext/app") == 0) {
 				fix = true;
 				new_gid = 1000;
-				perms = "0644";
+				perms = 0644;
 			} else if (temp->appDir.compare("/data/app-private") == 0 || temp->appDir.compare("/sd-ext/app-private") == 0) {
 				fix = true;
 				new_gid = temp->gid;
-				perms = "0640";
+				perms = 0640;
 			} else
 				fix = false;
 			if (fix) {
@@ -293,271 +244,361 @@ int fixPermissions::fixDataApps() {
 				}
 			}
 		}
-		temp = temp->next;
 	}
 	return 0;
 }
 
-int fixPermissions::fixAllFiles(string directory, int gid, int uid, string file_perms) {
-	vector <string> files;
-	string file;
-
-	files = listAllFiles(directory);
-	for (unsigned i = 0; i < files.size(); ++i) {
-		file = directory + "/";
-		file.append(files.at(i));
-		if (debug)
-			LOGINFO("Looking at file '%s'\n", file.c_str());
-		if (pchmod(file, file_perms) != 0)
-			return -1;
-		if (pchown(file, uid, gid) != 0)
-			return -1;
+int fixPermissions::fixAllFiles(int dirFd, const string& path, int uid, int gid, mode_t mode, vector <string>* dirs) {
+	struct dirent* de;
+	struct stat st;
+	int ret = 0;
+
+	int fd = dup(dirFd);
+	DIR* d = fd < 0 ? NULL : fdopendir(fd);
+	if (d == NULL) {
+		fixError("open", path, errno);
+		if (fd >= 0)
+			close(fd);
+		return -1;
 	}
-	return 0;
+	while (ret == 0 && (de = readdir(d)) != NULL) {
+		unsigned char type = de->d_type;
+
+		if (type == DT_UNKNOWN && fstatat(dirFd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+			type = S_ISDIR(st.st_mode) ? DT_DIR : (S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN);
+		if (type == DT_REG)
+			ret = fixEntry(dirFd, de->d_name, path, uid, gid, mode);
+		else if (type == DT_DIR && dirs != NULL && strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0)
+			dirs->push_back(de->d_name);
+	}
+	closedir(d);
+	return ret;
 }
 
-int fixPermissions::fixDataData(string dataDir) {
-	string directory, dir;
-
-	temp = head;
-	while (temp != NULL) {
-		dir = dataDir + temp->dDir;
-		if (TWFunc::Path_Exists(dir)) {
-			vector <string> dataDataDirs = listAllDirectories(dir);
-			for (unsigned n = 0; n < dataDataDirs.size(); ++n) {
-				directory = dir + "/";
-				directory.append(dataDataDirs.at(n));
-				if (debug)
-					LOGINFO("Looking at data directory: '%s'\n", directory.c_str());
-				if (dataDataDirs.at(n) == ".") {
-					if (pchmod(directory, "0755") != 0)
-						return -1;
-					if (pchown(directory.c_str(), temp->uid, temp->gid) != 0)
-						return -1;
-					if (fixAllFiles(directory, temp->uid, temp->gid, "0755") != 0)
-						return -1;
-				}
-				else if (dataDataDirs.at(n) == "..") {
-					if (debug)
-						LOGINFO("Skipping ..\n");
-					continue;
-				}
-				else if (dataDataDirs.at(n) == "lib") {
-					if (pchmod(directory.c_str(), "0755") != 0)
-						return -1;
-					if (pchown(directory.c_str(), 1000, 1000) != 0)
-						return -1;
-					if (fixAllFiles(directory, temp->uid, temp->gid, "0755") != 0)
-						return -1;
-				}
-				else if (dataDataDirs.at(n) == "shared_prefs") {
-					if (pchmod(directory.c_str(), "0771") != 0)
-						return -1;
-					if (pchown(directory.c_str(), temp->uid, temp->gid) != 0)
-						return -1;
-					if (fixAllFiles(directory, temp->uid, temp->gid, "0660") != 0)
-						return -1;
-				}
-				else if (dataDataDirs.at(n) == "databases") {
-					if (pchmod(directory.c_str(), "0771") != 0)
-						return -1;
-					if (pchown(directory.c_str(), temp->uid, temp->gid) != 0)
-						return -1;
-					if (fixAllFiles(directory, temp->uid, temp->gid, "0660") != 0)
-						return -1;
-				}
-				else if (dataDataDirs.at(n) == "cache") {
-					if (pchmod(directory.c_str(), "0771") != 0)
-						return -1;
-					if (pchown(directory.c_str(), temp->uid, temp->gid) != 0)
-						return -1;
-					if (fixAllFiles(directory, temp->uid, temp->gid, "0600") != 0)
-						return -1;
-				}
-				else {
-					if (pchmod(directory.c_str(), "0771") != 0)
-						return -1;
-					if (pchown(directory.c_str(), temp->uid, temp->gid) != 0)
-						return -1;
-					if (fixAllFiles(directory, temp->uid, temp->gid, "0755") != 0)
-						return -1;
-				}
-			}
+// Fixes one package's data folder, the files in it and the folders one
+// level down with the files in them, relative to open folders
+int fixPermissions::fixPackageData(const string& dataDir, package* pkg, unsigned long* fixed) {
+	string dir = dataDir + pkg->dDir;
+	vector <string> dataDataDirs;
+	int ret = 0;
+
+	int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		return 0;
+	if (debug)
+		LOGINFO("Looking at data directory: '%s'\n", dir.c_str());
+	if (fixEntry(fd, ".", dir, pkg->uid, pkg->gid, 0755) != 0 ||
+		fixAllFiles(fd, dir, pkg->uid, pkg->gid, 0755, &dataDataDirs) != 0) {
+		close(fd);
+		return -1;
+	}
+	(*fixed)++;
+
+	for (unsigned n = 0; ret == 0 && n < dataDataDirs.size(); ++n) {
+		const string& name = dataDataDirs.at(n);
+		string directory = dir + "/" + name;
+		int dir_uid = pkg->uid, dir_gid = pkg->gid;
+		mode_t dir_mode = 0771, file_mode = 0755;
+
+		if (name == "lib") {
+			dir_uid = dir_gid = 1000;
+			dir_mode = 0755;
+		} else if (name == "shared_prefs" || name == "databases") {
+			file_mode = 0660;
+		} else if (name == "cache") {
+			file_mode = 0600;
 		}
-		temp = temp->next;
+
+		int sub = openat(fd, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		if (sub < 0) {
+			fixError("open", directory, errno);
+			ret = -1;
+			break;
+		}
+		if (debug)
+			LOGINFO("Looking at data directory: '%s'\n", directory.c_str());
+		if (fixEntry(sub, ".", directory, dir_uid, dir_gid, dir_mode) != 0 ||
+			fixAllFiles(sub, directory, pkg->uid, pkg->gid, file_mode, NULL) != 0)
+			ret = -1;
+		close(sub);
+		(*fixed)++;
 	}
-	return 0;
+	close(fd);
+	return ret;
 }
 
-vector <string> fixPermissions::listAllDirectories(string path) {
-	DIR *dir = opendir(path.c_str());
-	vector <string> dirs;
+void* fixPermissions::fixDataDataThread(void* cookie) {
+	fixWork* work = (fixWork*) cookie;
+	unsigned long fixed = 0;
 
-	if (dir == NULL) {
-		LOGERR("Error opening '%s'\n", path.c_str());
-		return dirs;
-	}
-	struct dirent *entry = readdir(dir);
-	while (entry != NULL) {
-		if (entry->d_type == DT_DIR)
-			dirs.push_back(entry->d_name);
-		entry = readdir(dir);
-	}
-	closedir(dir);
-	return dirs;
-}
+	while (1) {
+		package* pkg = NULL;
 
-vector <string> fixPermissions::listAllFiles(string path) {
-	DIR *dir = opendir(path.c_str());
-	vector <string> files;
+		pthread_mutex_lock(&work->lock);
+		if (!work->failed && work->next < work->jobs.size())
+			pkg = work->jobs[work->next++];
+		pthread_mutex_unlock(&work->lock);
+		if (pkg == NULL)
+			break;
 
-	if (dir == NULL) {
-		LOGERR("Error opening '%s'\n", path.c_str());
-		return files;
-	}
-	struct dirent *entry = readdir(dir);
-	while (entry != NULL) {
-		if (entry->d_type == DT_REG)
-			files.push_back(entry->d_name);
-		entry = readdir(dir);
+		int ret = work->self->fixPackageData(work->dataDir, pkg, &fixed);
+
+		pthread_mutex_lock(&work->lock);
+		if (ret != 0)
+			work->failed = true;
+		work->done++;
+		DataManager::SetProgress((float) work->done / work->jobs.size());
+		pthread_mutex_unlock(&work->lock);
 	}
-	closedir(dir);
-	return files;
+
+	pthread_mutex_lock(&work->lock);
+	work->fixed += fixed;
+	pthread_mutex_unlock(&work->lock);
+	return NULL;
 }
 
-int fixPermissions::getPackages() {
-	int len = 0;
-	bool skiploop = false;
-	vector <string> skip;
-	string name;
-	head = NULL;
-
-	skip.push_back("/system/framework/framework-res.apk");
-	skip.push_back("/system/framework/com.htc.resources.apk");
-
-	ifstream xmlFile(packageFile.c_str());
-	xmlFile.seekg(0, ios::end);
-	len = (int) xmlFile.tellg();
-	xmlFile.seekg(0, ios::beg);
-	char xmlBuf[len + 1];
-	xmlFile.read(&xmlBuf[0], len);
-	xmlBuf[len] = '\0';
-	xml_document<> pkgDoc;
-	LOGINFO("parsing package, %i...\n", len);
-	pkgDoc.parse<parse_full>(&xmlBuf[0]);
-
-	xml_node<> * pkgNode = pkgDoc.first_node("packages");
-	if (pkgNode == NULL) {
-		LOGERR("No packages found to fix.\n");
-		return -1;
-	}
-	xml_node <> * next = pkgNode->first_node("package");
-	if (next == NULL) {
-		LOGERR("No package found to fix.\n");
-		return -1;
+// Packages are handed out to a pool of threads, each one walks its
+// package's folders with openat and fixes entries relative to them
+int fixPermissions::fixDataData(string dataDir) {
+	pthread_t threads[MAX_FIX_THREADS];
+	int thread_count = 0, cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	fixWork work;
+
+	work.self = this;
+	work.dataDir = dataDir;
+	work.next = 0;
+	work.done = 0;
+	work.fixed = 0;
+	work.failed = false;
+	for (size_t i = 0; i < packages.size(); ++i)
+		work.jobs.push_back(&packages[i]);
+	if (work.jobs.empty())
+		return 0;
+
+	pthread_mutex_init(&work.lock, NULL);
+	DataManager::SetProgress(0);
+	if (cpus > MAX_FIX_THREADS)
+		cpus = MAX_FIX_THREADS;
+	if (cpus > (int) work.jobs.size())
+		cpus = work.jobs.size();
+	for (int i = 1; i < cpus; i++) {
+		if (pthread_create(&threads[thread_count], NULL, fixDataDataThread, &work) == 0)
+			thread_count++;
 	}
+	fixDataDataThread(&work);
+	for (int i = 0; i < thread_count; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&work.lock);
+
+	LOGINFO("Fixed %lu folders with their files in '%s'\n", work.fixed, dataDir.c_str());
+	if (errors > MAX_FIX_ERRORS)
+		LOGERR("%d permission errors in total.\n", errors);
+	return work.failed ? -1 : 0;
+}
+
+bool fixPermissions::comparePackageUid(const package& a, const package& b) {
+	return a.uid < b.uid;
+}
 
-	//Get packages
-	while (next->first_attribute("name") != NULL) {
-		package* temp = new package;
-		for (unsigned n = 0; n < skip.size(); ++n) {
-			if (skip.at(n).compare(next->first_attribute("codePath")->value()) == 0) {
-				skiploop = true;
+// Decodes the entities the package manager writes into attribute values
+static string xmlUnescape(const string& value) {
+	static const char* entities[][2] = {
+		{ "&amp;", "&" }, { "&lt;", "<" }, { "&gt;", ">" }, { "&quot;", "\"" }, { "&apos;", "'" }
+	};
+	string ret;
+	size_t pos = 0, amp;
+
+	while ((amp = value.find('&', pos)) != string::npos) {
+		ret.append(value, pos, amp - pos);
+		pos = amp + 1;
+		for (unsigned n = 0; n < sizeof(entities) / sizeof(entities[0]); ++n) {
+			if (value.compare(amp, strlen(entities[n][0]), entities[n][0]) == 0) {
+				ret.append(entities[n][1]);
+				pos = amp + strlen(entities[n][0]);
 				break;
 			}
 		}
+		if (pos == amp + 1)
+			ret.append("&");
+	}
+	ret.append(value, pos, string::npos);
+	return ret;
+}
 
-		if (skiploop == true) {
-			if (debug)
-				LOGINFO("Skipping package %s\n", next->first_attribute("codePath")->value());
-			free(temp);
-			next = next->next_sibling();
-			skiploop = false;
-			continue;
+// Picks the attributes we need out of the text between the tag name and
+// the closing '>' of a <package> or <updated-package> tag
+int fixPermissions::addPackage(const string& attrs) {
+	package pkg;
+	string userId, sharedUserId;
+	size_t pos = 0;
+
+	pkg.uid = pkg.gid = -1;
+	while (pos < attrs.size()) {
+		size_t eq = attrs.find('=', pos);
+		if (eq == string::npos)
+			break;
+		size_t start = attrs.find_first_not_of(" \t\r\n", pos);
+		size_t end = attrs.find_last_not_of(" \t\r\n", eq - 1);
+		size_t quote = attrs.find_first_of("\"'", eq);
+		if (quote == string::npos)
+			break;
+		size_t close = attrs.find(attrs[quote], quote + 1);
+		if (close == string::npos)
+			break;
+		if (start != string::npos && start < eq) {
+			string key = attrs.substr(start, end - start + 1);
+			if (key == "name")
+				pkg.pkgName = xmlUnescape(attrs.substr(quote + 1, close - quote - 1));
+			else if (key == "codePath")
+				pkg.codePath = xmlUnescape(attrs.substr(quote + 1, close - quote - 1));
+			else if (key == "userId")
+				userId = attrs.substr(quote + 1, close - quote - 1);
+			else if (key == "sharedUserId")
+				sharedUserId = attrs.substr(quote + 1, close - quote - 1);
 		}
-		name.append((next->first_attribute("name")->value()));
-		temp->pkgName = next->first_attribute("name")->value();
+		pos = close + 1;
+	}
+
+	if (pkg.pkgName.empty())
+		return 0;
+	if (pkg.codePath == "/system/framework/framework-res.apk" || pkg.codePath == "/system/framework/com.htc.resources.apk") {
 		if (debug)
-			LOGINFO("Loading pkg: %s\n", next->first_attribute("name")->value());
-		if (next->first_attribute("codePath") == NULL) {
-			LOGINFO("Problem with codePath on %s\n", next->first_attribute("name")->value());
+			LOGINFO("Skipping package %s\n", pkg.codePath.c_str());
+		return 0;
+	}
+	if (debug)
+		LOGINFO("Loading pkg: %s\n", pkg.pkgName.c_str());
+	if (pkg.codePath.empty()) {
+		LOGINFO("Problem with codePath on %s\n", pkg.pkgName.c_str());
+	} else {
+		size_t slash = pkg.codePath.find_last_of('/');
+		if (slash == string::npos) {
+			pkg.app = pkg.codePath;
+			pkg.appDir = ".";
 		} else {
-			temp->codePath = next->first_attribute("codePath")->value();
-			temp->app = basename(next->first_attribute("codePath")->value());
-			temp->appDir = dirname(next->first_attribute("codePath")->value());
+			pkg.app = pkg.codePath.substr(slash + 1);
+			pkg.appDir = slash == 0 ? "/" : pkg.codePath.substr(0, slash);
 		}
-		temp->dDir = name;
-		if ( next->first_attribute("sharedUserId") != NULL) {
-			temp->uid = atoi(next->first_attribute("sharedUserId")->value());
-			temp->gid = atoi(next->first_attribute("sharedUserId")->value());
-		}
-		else {
-			if (next->first_attribute("userId") == NULL) {
-				LOGINFO("Problem with userID on %s\n", next->first_attribute("name")->value());
-			} else {
-				temp->uid = atoi(next->first_attribute("userId")->value());
-				temp->gid = atoi(next->first_attribute("userId")->value());
-			}
-		}
-		temp->next = head;
-		head = temp;
-		if (next->next_sibling("package") == NULL)
-			break;
-		name.clear();
-		next = next->next_sibling("package");
 	}
-	//Get updated packages	
-	next = pkgNode->first_node("updated-package");
-	if (next != NULL) {
-		while (next->first_attribute("name") != NULL) {
-			package* temp = new package;
-			for (unsigned n = 0; n < skip.size(); ++n) {
-				if (skip.at(n).compare(next->first_attribute("codePath")->value()) == 0) {
-					skiploop = true;
-					break;
-				}
-			}
+	pkg.dDir = pkg.pkgName;
+	if (!sharedUserId.empty())
+		pkg.uid = pkg.gid = atoi(sharedUserId.c_str());
+	else if (!userId.empty())
+		pkg.uid = pkg.gid = atoi(userId.c_str());
+	else
+		LOGINFO("Problem with userID on %s\n", pkg.pkgName.c_str());
+	packages.push_back(pkg);
+	return 0;
+}
 
-			if (skiploop == true) {
-				if (debug)
-					LOGINFO("Skipping package %s\n", next->first_attribute("codePath")->value());
-				free(temp);
-				next = next->next_sibling();
-				skiploop = false;
-				continue;
-			}
-			name.append((next->first_attribute("name")->value()));
-			temp->pkgName = next->first_attribute("name")->value();
-			if (debug)
-				LOGINFO("Loading pkg: %s\n", next->first_attribute("name")->value());
-			if (next->first_attribute("codePath") == NULL) {
-				LOGINFO("Problem with codePath on %s\n", next->first_attribute("name")->value());
-			} else {
-				temp->codePath = next->first_attribute("codePath")->value();
-				temp->app = basename(next->first_attribute("codePath")->value());
-				temp->appDir = dirname(next->first_attribute("codePath")->value());
-			}
+// Streams packages.xml through a fixed size buffer instead of loading it
+// whole. Only the attributes of <package> and <updated-package> tags
+// directly under <packages> are kept, everything else (signatures,
+// permissions, shared users) is skipped a character at a time.
+int fixPermissions::getPackages() {
+	enum { TEXT, NAME, ATTRS, SPECIAL } state = TEXT;
+	vector <char> buf(PKG_READ_SIZE);
+	string tagName, attrs, root;
+	char quote = 0;
+	bool keep = false, closing = false, selfClosing = false, comment = false;
+	int depth = 0, dashes = 0;
+	unsigned long total = 0;
+	ssize_t len;
+
+	packages.clear();
+	int fd = open(packageFile.c_str(), O_RDONLY);
+	if (fd < 0) {
+		LOGERR("Unable to open '%s': %s\n", packageFile.c_str(), strerror(errno));
+		return -1;
+	}
 
-			temp->dDir = name;
-			if ( next->first_attribute("sharedUserId") != NULL) {
-				temp->uid = atoi(next->first_attribute("sharedUserId")->value());
-				temp->gid = atoi(next->first_attribute("sharedUserId")->value());
-			}
-			else {
-				if (next->first_attribute("userId") == NULL) {
-					LOGINFO("Problem with userID on %s\n", next->first_attribute("name")->value());
+	while ((len = read(fd, &buf[0], buf.size())) > 0) {
+		total += len;
+		for (ssize_t i = 0; i < len; i++) {
+			char c = buf[i];
+
+			if (state == TEXT) {
+				if (c == '<') {
+					state = NAME;
+					tagName.clear();
+					attrs.clear();
+					closing = selfClosing = false;
+				}
+			} else if (state == SPECIAL) {
+				// Comments end at "-->", doctype and processing instructions at the first '>'
+				if (c == '>' && (!comment || dashes >= 2))
+					state = TEXT;
+				dashes = c == '-' ? dashes + 1 : 0;
+			} else if (state == NAME && c != '>' && c != '/' && !isspace((unsigned char) c)) {
+				tagName += c;
+				comment = tagName == "!--";
+				if (comment || tagName[0] == '?' || (tagName[0] == '!' && tagName.size() > 1 && c != '-')) {
+					state = SPECIAL;
+					dashes = 0;
+				}
+			} else if (state == NAME && c == '/' && tagName.empty()) {
+				closing = true;
+			} else if (quote != 0) {
+				if (c == quote)
+					quote = 0;
+				if (keep)
+					attrs += c;
+			} else if (c == '"' || c == '\'') {
+				quote = c;
+				if (keep)
+					attrs += c;
+			} else if (c != '>') {
+				if (state == NAME) {
+					state = ATTRS;
+					keep = !closing && depth == 1 && root == "packages" && (tagName == "package" || tagName == "updated-package");
+				}
+				if (keep)
+					attrs += c;
+				if (!isspace((unsigned char) c))
+					selfClosing = c == '/';
+			} else {
+				if (state == NAME)
+					keep = !closing && depth == 1 && root == "packages" && (tagName == "package" || tagName == "updated-package");
+				state = TEXT;
+				if (tagName.empty() || tagName[0] == '!' || tagName[0] == '?') {
+					// Not an element
+				} else if (closing) {
+					depth--;
 				} else {
-					temp->uid = atoi(next->first_attribute("userId")->value());
-					temp->gid = atoi(next->first_attribute("userId")->value());
+					if (depth == 0 && root.empty())
+						root = tagName;
+					if (keep && addPackage(attrs) != 0) {
+						close(fd);
+						return -1;
+					}
+					if (!selfClosing)
+						depth++;
 				}
+				keep = false;
+			}
+			if (keep && attrs.size() > PKG_MAX_TAG) {
+				LOGERR("Package entry in '%s' is too long.\n", packageFile.c_str());
+				close(fd);
+				return -1;
 			}
-			temp->next = head;
-			head = temp;
-			if (next->next_sibling("package") == NULL)
-				break;
-			name.clear();
-			next = next->next_sibling("package");
 		}
 	}
+	close(fd);
+	if (len < 0) {
+		LOGERR("Unable to read '%s': %s\n", packageFile.c_str(), strerror(errno));
+		return -1;
+	}
+	LOGINFO("parsed packages, %lu bytes...\n", total);
+
+	if (root != "packages") {
+		LOGERR("No packages found to fix.\n");
+		return -1;
+	}
+	if (packages.empty()) {
+		LOGERR("No package found to fix.\n");
+		return -1;
+	}
+	// Shared user ids end up next to each other
+	stable_sort(packages.begin(), packages.end(), comparePackageUid);
 	return 0;
 }
@@ -8,7 +8,7 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <dirent.h>
-#include "gui/rapidxml.hpp"
+#include <pthread.h>
 #include "twrp-functions.hpp"
 
 using namespace std;
@@ -19,13 +19,14 @@ class fixPermissions {
 
 	private:
 		int pchown(std::string fn, int puid, int pgid);
-		int pchmod(std::string fn, string mode);
-		vector <string> listAllDirectories(std::string path);
-		vector <string> listAllFiles(std::string path);
+		int pchmod(std::string fn, mode_t mode);
+		int fixEntry(int dirFd, const char* name, const string& path, int uid, int gid, mode_t mode); // name "." is the folder itself
+		int fixAllFiles(int dirFd, const string& path, int uid, int gid, mode_t mode, vector <string>* dirs); // Also lists the folders in dirs
+		void fixError(const char* action, const string& fn, int err);
 		int getPackages();
+		int addPackage(const string& attrs);
 		int fixSystemApps();
 		int fixDataApps();
-		int fixAllFiles(string directory, int gid, int uid, string file_perms);
 		int fixDataData(string dataDir);
 		struct package {
 			string pkgName;
@@ -34,13 +35,26 @@ class fixPermissions {
 			string app;
 			string dDir;
 			int gid;
-			int uid;
-			package *next;
+			int uid;                            // -1 when packages.xml has none
 		};
+		struct fixWork {
+			fixPermissions* self;
+			pthread_mutex_t lock;
+			vector <package*> jobs;
+			string dataDir;
+			size_t next;
+			size_t done;
+			unsigned long fixed;
+			bool failed;
+		};
+		static bool comparePackageUid(const package& a, const package& b);
+		static void* fixDataDataThread(void* cookie);
+		int fixPackageData(const string& dataDir, package* pkg, unsigned long* fixed);
 		bool debug;
 		bool remove_data;
 		bool multi_user;
-		package* head;
-		package* temp;		
+		int errors;
+		vector <package> packages;          // Sorted by uid
+		package* temp;
 		string packageFile;
 };
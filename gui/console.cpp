@@ -14,6 +14,7 @@
 #include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #include <string>
 
@@ -28,24 +29,13 @@ extern "C" {
 
 static std::vector<std::string> gConsole;
 
-extern "C" void gui_print(const char *fmt, ...)
-{
-	char buf[512];		// We're going to limit a single request to 512 bytes
-
-	va_list ap;
-	va_start(ap, fmt);
-	vsnprintf(buf, 512, fmt, ap);
-	va_end(ap);
-
-	fputs(buf, stdout);
+// Partitions are probed from several threads, so lines are added under a lock
+static pthread_mutex_t gConsoleLock = PTHREAD_MUTEX_INITIALIZER;
 
+static void gui_append_lines(char* buf)
+{
 	char *start, *next;
 
-	if (buf[0] == '\n' && strlen(buf) < 2) {
-		// This prevents the double lines bug seen in the console during zip installs
-		return;
-	}
-
 	for (start = next = buf; *next != '\0'; next++)
 	{
 		if (*next == '\n')
@@ -64,7 +54,27 @@ extern "C" void gui_print(const char *fmt, ...)
 	}
 	std::string line = start;
 	gConsole.push_back(line);
-	return;
+}
+
+extern "C" void gui_print(const char *fmt, ...)
+{
+	char buf[512];		// We're going to limit a single request to 512 bytes
+
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(buf, 512, fmt, ap);
+	va_end(ap);
+
+	fputs(buf, stdout);
+
+	if (buf[0] == '\n' && strlen(buf) < 2) {
+		// This prevents the double lines bug seen in the console during zip installs
+		return;
+	}
+
+	pthread_mutex_lock(&gConsoleLock);
+	gui_append_lines(buf);
+	pthread_mutex_unlock(&gConsoleLock);
 }
 
 extern "C" void gui_print_overwrite(const char *fmt, ...)
@@ -78,29 +88,11 @@ extern "C" void gui_print_overwrite(const char *fmt, ...)
 
 	fputs(buf, stdout);
 
+	pthread_mutex_lock(&gConsoleLock);
 	// Pop the last line, and we can continue
 	if (!gConsole.empty())   gConsole.pop_back();
-
-	char *start, *next;
-	for (start = next = buf; *next != '\0'; next++)
-	{
-		if (*next == '\n')
-		{
-			*next = '\0';
-			next++;
-			
-			std::string line = start;
-			gConsole.push_back(line);
-			start = next;
-
-			// Handle the normal \n\0 case
-			if (*next == '\0')
-				return;
-		}
-	}
-	std::string line = start;
-	gConsole.push_back(line);
-	return;
+	gui_append_lines(buf);
+	pthread_mutex_unlock(&gConsoleLock);
 }
 
 GUIConsole::GUIConsole(xml_node<>* node)
@@ -53,7 +53,39 @@ extern "C" {
 #define SCROLLING_FLOOR 10
 #define SCROLLING_MULTIPLIER 6
 
+// Entries are handed from the loader thread to the list in batches this big
+#define LOADER_BATCH 256
+#define DIR_CACHE_MAX 32
+// Folders changed this recently may change again within the same mtime second
+#define DIR_CACHE_RACY_SECONDS 2
+
 int GUIFileSelector::mSortOrder = 0;
+std::map<std::string, GUIFileSelector::DirCache> GUIFileSelector::mDirCache;
+pthread_mutex_t GUIFileSelector::mDirCacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned char Mode_To_D_Type(mode_t mode)
+{
+	if (S_ISDIR(mode))  return DT_DIR;
+	if (S_ISBLK(mode))  return DT_BLK;
+	if (S_ISCHR(mode))  return DT_CHR;
+	if (S_ISFIFO(mode)) return DT_FIFO;
+	if (S_ISLNK(mode))  return DT_LNK;
+	if (S_ISREG(mode))  return DT_REG;
+	if (S_ISSOCK(mode)) return DT_SOCK;
+	return DT_UNKNOWN;
+}
+
+// Sorts a batch and merges it into an already sorted list
+template <class T>
+static void Merge_Sorted(std::vector<T>& list, std::vector<T>& batch, bool (*cmp)(const T&, const T&))
+{
+	if (batch.empty())
+		return;
+	std::sort(batch.begin(), batch.end(), cmp);
+	size_t mid = list.size();
+	list.insert(list.end(), batch.begin(), batch.end());
+	std::inplace_merge(list.begin(), list.begin() + mid, list.end(), cmp);
+}
 
 GUIFileSelector::GUIFileSelector(xml_node<>* node) : Conditional(node)
 {
@@ -86,6 +118,8 @@ GUIFileSelector::GUIFileSelector(xml_node<>* node) : Conditional(node)
 	isHighlighted = false;
 	updateFileList = false;
 	startSelection = -1;
+	pthread_mutex_init(&mLoaderLock, NULL);
+	mLoaderRunning = mLoaderCancel = mLoaderDone = mLoaderFailed = mLoaderReplace = false;
 
 	// Load header text
 	child = node->first_node("header");
@@ -415,6 +449,8 @@ GUIFileSelector::GUIFileSelector(xml_node<>* node) : Conditional(node)
 
 GUIFileSelector::~GUIFileSelector()
 {
+	StopLoader();
+	pthread_mutex_destroy(&mLoaderLock);
 }
 
 int GUIFileSelector::Render(void)
@@ -437,11 +473,10 @@ int GUIFileSelector::Render(void)
 	if (updateFileList) {
 		string value;
 		DataManager::GetValue(mPathVar, value);
-		if (GetFileList(value) == 0)
-			updateFileList = false;
-		else
-			return 0;
+		GetFileList(value);
+		updateFileList = false;
 	}
+	MergeLoadedEntries();
 
 	// This tells us how many lines we can actually render
 	int lines = (mRenderH - mHeaderH) / (actualLineHeight);
@@ -493,10 +528,11 @@ int GUIFileSelector::Render(void)
 		}
 	}
 
+	// Only the rows on screen are laid out
 	for (line = 0; line < lines; line++)
 	{
 		Resource* icon;
-		std::string label;
+		const std::string* label;
 
 		if (isHighlighted && hasFontHighlightColor && line + mStart == actualSelection) {
 			// Use the highlight color for the font
@@ -509,7 +545,7 @@ int GUIFileSelector::Render(void)
 		if (line + mStart < folderSize)
 		{
 			icon = mFolderIcon;
-			label = mFolderList.at(line + mStart).fileName;
+			label = &mFolderList.at(line + mStart).fileName;
 			currentIconHeight = mFolderIconHeight;
 			currentIconWidth = mFolderIconWidth;
 			currentIconOffsetY = folderIconOffsetY;
@@ -518,7 +554,7 @@ int GUIFileSelector::Render(void)
 		else if (line + mStart < folderSize + fileSize)
 		{
 			icon = mFileIcon;
-			label = mFileList.at((line + mStart) - folderSize).fileName;
+			label = &mFileList.at((line + mStart) - folderSize).fileName;
 			currentIconHeight = mFileIconHeight;
 			currentIconWidth = mFileIconWidth;
 			currentIconOffsetY = fileIconOffsetY;
@@ -536,7 +572,7 @@ int GUIFileSelector::Render(void)
 				rect_y = currentIconHeight;
 			gr_blit(icon->GetResource(), 0, 0, currentIconWidth, rect_y, mRenderX + currentIconOffsetX, image_y);
 		}
-		gr_textExWH(mRenderX + mIconWidth + 5, yPos + fontOffsetY, label.c_str(), fontResource, mRenderX + listW, mRenderY + mRenderH);
+		gr_textExWH(mRenderX + mIconWidth + 5, yPos + fontOffsetY, label->c_str(), fontResource, mRenderX + listW, mRenderY + mRenderH);
 
 		// Add the separator
 		if (yPos + actualLineHeight < mRenderH + mRenderY) {
@@ -589,7 +625,8 @@ int GUIFileSelector::Render(void)
 		gr_fill(startX + fWidth/2, mRenderY + mHeaderH, mFastScrollLineW, mRenderH - mHeaderH);
 
 		// rect
-		int pct = ((mStart*actualLineHeight - scrollingY)*100)/((folderSize + fileSize)*actualLineHeight-lines*actualLineHeight);
+		int range = (folderSize + fileSize)*actualLineHeight-lines*actualLineHeight;
+		int pct = range > 0 ? ((mStart*actualLineHeight - scrollingY)*100)/range : 0;
 		mFastScrollRectX = startX + (fWidth - mFastScrollRectW)/2;
 		mFastScrollRectY = mRenderY+mHeaderH + ((fHeight - mFastScrollRectH)*pct)/100;
 
@@ -616,6 +653,10 @@ int GUIFileSelector::Update(void)
 		}
 	}
 
+	// Pick up entries the loader has read since the last frame
+	if (mLoaderRunning && MergeLoadedEntries())
+		mUpdate = 1;
+
 	if (mUpdate)
 	{
 		mUpdate = 0;
@@ -930,7 +971,7 @@ int GUIFileSelector::SetRenderPos(int x, int y, int w /* = 0 */, int h /* = 0 */
 	return 0;
 }
 
-bool GUIFileSelector::fileSort(FileData d1, FileData d2)
+bool GUIFileSelector::fileSort(const FileData& d1, const FileData& d2)
 {
 	if (d1.fileName == ".")
 		return -1;
@@ -965,52 +1006,121 @@ bool GUIFileSelector::fileSort(FileData d1, FileData d2)
 	}
 }
 
-int GUIFileSelector::GetFileList(const std::string folder)
+void GUIFileSelector::AddEntry(FileData& data, std::vector<FileData>& folders, std::vector<FileData>& files)
 {
-	DIR* d;
-	struct dirent* de;
-	struct stat st;
+	// skip excludes
+	if(std::find(mExcludeFiles.begin(), mExcludeFiles.end(), data.fileName) != mExcludeFiles.end())
+		return;
 
-	// Clear all data
-	mFolderList.clear();
-	mFileList.clear();
-
-	d = opendir(folder.c_str());
-	if (d == NULL)
+	if (data.fileType == DT_DIR)
 	{
-		LOGINFO("Unable to open '%s'\n", folder.c_str());
-		if (folder != "/" && (mShowNavFolders != 0 || mShowFiles != 0)) {
-			size_t found;
-			found = folder.find_last_of('/');
-			if (found != string::npos) {
-				string new_folder = folder.substr(0, found);
-
-				if (new_folder.length() < 2)
-					new_folder = "/";
-				DataManager::SetValue(mPathVar, new_folder);
+		if (mShowNavFolders || (data.fileName != "." && data.fileName != TW_FILESELECTOR_UP_A_LEVEL))
+			folders.push_back(data);
+	}
+	else if (data.fileType == DT_REG || data.fileType == DT_LNK || data.fileType == DT_BLK)
+	{
+		if(mExtn.empty())
+			files.push_back(data);
+		else
+		{
+			for(size_t i = 0; i < mExtn.size(); ++i)
+			{
+				const std::string& ext = mExtn[i];
+				if (ext.empty() || (data.fileName.length() > ext.length() && data.fileName.substr(data.fileName.length() - ext.length()) == ext))
+				{
+					files.push_back(data);
+					break;
+				}
 			}
 		}
-		return -1;
+	}
+}
+
+void* GUIFileSelector::loaderThread(void* cookie)
+{
+	((GUIFileSelector*) cookie)->LoadFolder();
+	return NULL;
+}
+
+// Runs on the loader thread. Entries are looked up relative to the folder's
+// fd and only stat'ed when the sort order or a missing d_type needs it.
+void GUIFileSelector::LoadFolder(void)
+{
+	std::vector<FileData> folders, files;
+	std::vector<std::pair<std::string, unsigned char> > names;
+	const std::string& folder = mLoaderFolder;
+	bool need_stat = (mSortOrder == 2 || mSortOrder == -2 || mSortOrder == 3 || mSortOrder == -3);
+	bool cached = false;
+	struct stat st, dir_st;
+	size_t next = 0;
+	DIR* d = NULL;
+
+	int fd = open(folder.c_str(), O_RDONLY | O_DIRECTORY);
+	if (fd >= 0 && fstat(fd, &dir_st) == 0) {
+		pthread_mutex_lock(&mDirCacheLock);
+		std::map<std::string, DirCache>::iterator it = mDirCache.find(folder);
+		if (it != mDirCache.end() && it->second.dev == dir_st.st_dev && it->second.ino == dir_st.st_ino &&
+			it->second.mtime == dir_st.st_mtime && it->second.ctime == dir_st.st_ctime) {
+			names = it->second.entries;
+			cached = true;
+		}
+		pthread_mutex_unlock(&mDirCacheLock);
+
+		if (!cached) {
+			int dir_fd = dup(fd);
+			if (dir_fd >= 0 && (d = fdopendir(dir_fd)) == NULL)
+				close(dir_fd);
+		}
+	}
+	if (fd < 0 || (!cached && d == NULL)) {
+		LOGINFO("Unable to open '%s'\n", folder.c_str());
+		if (fd >= 0)
+			close(fd);
+		pthread_mutex_lock(&mLoaderLock);
+		mLoaderFailed = true;
+		mLoaderDone = true;
+		pthread_mutex_unlock(&mLoaderLock);
+		return;
 	}
 
-	while ((de = readdir(d)) != NULL)
+	while (!mLoaderCancel)
 	{
 		FileData data;
+		unsigned char type;
+		bool have_stat = false;
+
+		if (cached) {
+			if (next >= names.size())
+				break;
+			data.fileName = names[next].first;
+			type = names[next++].second;
+		} else {
+			struct dirent* de = readdir(d);
+			if (de == NULL)
+				break;
+			data.fileName = de->d_name;
+			type = de->d_type;
+			if (type == DT_UNKNOWN && fstatat(fd, de->d_name, &st, 0) == 0) {
+				type = Mode_To_D_Type(st.st_mode);
+				have_stat = true;
+			}
+			names.push_back(std::make_pair(data.fileName, type));
+		}
 
-		data.fileName = de->d_name;
 		if (data.fileName == ".")
 			continue;
 		if (data.fileName == ".." && folder == "/")
 			continue;
+		if (need_stat && !have_stat)
+			have_stat = fstatat(fd, data.fileName.c_str(), &st, 0) == 0;
+		if (!have_stat)
+			memset(&st, 0, sizeof(st));
 		if (data.fileName == "..") {
 			data.fileName = TW_FILESELECTOR_UP_A_LEVEL;
-			data.fileType = DT_DIR;
-		} else {
-			data.fileType = de->d_type;
+			type = DT_DIR;
 		}
 
-		std::string path = folder + "/" + data.fileName;
-		stat(path.c_str(), &st);
+		data.fileType = type;
 		data.protection = st.st_mode;
 		data.userId = st.st_uid;
 		data.groupId = st.st_gid;
@@ -1018,48 +1128,129 @@ int GUIFileSelector::GetFileList(const std::string folder)
 		data.lastAccess = st.st_atime;
 		data.lastModified = st.st_mtime;
 		data.lastStatChange = st.st_ctime;
+		AddEntry(data, folders, files);
+
+		if (!mLoaderReplace && folders.size() + files.size() >= LOADER_BATCH) {
+			pthread_mutex_lock(&mLoaderLock);
+			mLoadedFolders.insert(mLoadedFolders.end(), folders.begin(), folders.end());
+			mLoadedFiles.insert(mLoadedFiles.end(), files.begin(), files.end());
+			pthread_mutex_unlock(&mLoaderLock);
+			folders.clear();
+			files.clear();
+		}
+	}
+	if (d)
+		closedir(d);
+	close(fd);
+
+	if (!cached && !mLoaderCancel && time(NULL) - dir_st.st_mtime >= DIR_CACHE_RACY_SECONDS) {
+		pthread_mutex_lock(&mDirCacheLock);
+		if (mDirCache.size() >= DIR_CACHE_MAX)
+			mDirCache.clear();
+		DirCache& entry = mDirCache[folder];
+		entry.dev = dir_st.st_dev;
+		entry.ino = dir_st.st_ino;
+		entry.mtime = dir_st.st_mtime;
+		entry.ctime = dir_st.st_ctime;
+		entry.entries.swap(names);
+		pthread_mutex_unlock(&mDirCacheLock);
+	}
 
-		// skip excludes
-		if(std::find(mExcludeFiles.begin(), mExcludeFiles.end(), data.fileName) != mExcludeFiles.end())
-			continue;
+	pthread_mutex_lock(&mLoaderLock);
+	mLoadedFolders.insert(mLoadedFolders.end(), folders.begin(), folders.end());
+	mLoadedFiles.insert(mLoadedFiles.end(), files.begin(), files.end());
+	mLoaderDone = true;
+	pthread_mutex_unlock(&mLoaderLock);
+}
 
-		if (data.fileType == DT_UNKNOWN) {
-			data.fileType = TWFunc::Get_D_Type_From_Stat(path);
-		}
+void GUIFileSelector::StopLoader(void)
+{
+	if (mLoaderRunning) {
+		mLoaderCancel = true;
+		pthread_join(mLoaderThread, NULL);
+		mLoaderRunning = false;
+	}
+	pthread_mutex_lock(&mLoaderLock);
+	mLoadedFolders.clear();
+	mLoadedFiles.clear();
+	mLoaderDone = mLoaderFailed = false;
+	pthread_mutex_unlock(&mLoaderLock);
+}
 
-		if (data.fileType == DT_DIR)
-		{
-			if (mShowNavFolders || (data.fileName != "." && data.fileName != TW_FILESELECTOR_UP_A_LEVEL))
-				mFolderList.push_back(data);
-		}
-		else if (data.fileType == DT_REG || data.fileType == DT_LNK || data.fileType == DT_BLK)
-		{
-			if(mExtn.empty())
-				mFileList.push_back(data);
-			else
-			{
-				for(size_t i = 0; i < mExtn.size(); ++i)
-				{
-					const std::string& ext = mExtn[i];
-					if (ext.empty() || (data.fileName.length() > ext.length() && data.fileName.substr(data.fileName.length() - ext.length()) == ext))
-					{
-						mFileList.push_back(data);
-						break;
-					}
-				}
+bool GUIFileSelector::MergeLoadedEntries(void)
+{
+	std::vector<FileData> folders, files;
+	bool done, failed;
+
+	pthread_mutex_lock(&mLoaderLock);
+	folders.swap(mLoadedFolders);
+	files.swap(mLoadedFiles);
+	done = mLoaderDone;
+	failed = mLoaderFailed;
+	mLoaderDone = mLoaderFailed = false;
+	pthread_mutex_unlock(&mLoaderLock);
+
+	if (done && mLoaderRunning) {
+		pthread_join(mLoaderThread, NULL);
+		mLoaderRunning = false;
+	}
+
+	if (failed) {
+		std::string folder = mLoaderFolder;
+
+		mLoaderFolder.clear();
+		if (folder != "/" && (mShowNavFolders != 0 || mShowFiles != 0)) {
+			size_t found;
+			found = folder.find_last_of('/');
+			if (found != string::npos) {
+				string new_folder = folder.substr(0, found);
+
+				if (new_folder.length() < 2)
+					new_folder = "/";
+				DataManager::SetValue(mPathVar, new_folder);
 			}
 		}
+		return true;
 	}
-	closedir(d);
+	if (!done && folders.empty() && files.empty())
+		return false;
 
-	std::sort(mFolderList.begin(), mFolderList.end(), fileSort);
-	std::sort(mFileList.begin(), mFileList.end(), fileSort);
+	if (done && mLoaderReplace) {
+		mFolderList.clear();
+		mFileList.clear();
+	}
+	Merge_Sorted(mFolderList, folders, fileSort);
+	Merge_Sorted(mFileList, files, fileSort);
+
+	if (done) {
+		int lines = (mRenderH - mHeaderH) / (actualLineHeight) - 1;
+		int totalSize = (mShowFolders ? mFolderList.size() : 0) + (mShowFiles ? mFileList.size() : 0);
+		if(mStart > totalSize - lines)
+			mStart = std::max(0, totalSize - lines);
+	}
+	return true;
+}
 
-	int lines = (mRenderH - mHeaderH) / (actualLineHeight) - 1;
-	int totalSize = (mShowFolders ? mFolderList.size() : 0) + (mShowFiles ? mFileList.size() : 0);
-	if(mStart > totalSize - lines)
-		mStart = std::max(0, totalSize - lines);
+int GUIFileSelector::GetFileList(const std::string folder)
+{
+	StopLoader();
+
+	// Reloading the folder on screen keeps the old lists up until the new
+	// ones are complete so the list doesn't flash empty
+	mLoaderReplace = (folder == mLoaderFolder);
+	if (!mLoaderReplace) {
+		mFolderList.clear();
+		mFileList.clear();
+	}
+	mLoaderFolder = folder;
+	mLoaderCancel = false;
 
+	if (pthread_create(&mLoaderThread, NULL, loaderThread, this) == 0) {
+		mLoaderRunning = true;
+	} else {
+		LoadFolder();
+		MergeLoadedEntries();
+	}
 	return 0;
 }
 
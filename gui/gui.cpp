@@ -51,6 +51,7 @@ extern "C"
 #include "../variables.h"
 #include "../partitions.hpp"
 #include "../twrp-functions.hpp"
+#include "profiler.hpp"
 #ifndef TW_NO_SCREEN_TIMEOUT
 #include "blanktimer.hpp"
 #endif
@@ -210,6 +211,8 @@ static void * input_thread(void *cookie)
 		int state = 0, ret = 0;
 
 		ret = ev_get(&ev, dontwait);
+		if (ret >= 0 && (ev.type == EV_ABS || ev.type == EV_KEY))
+			GUIProfiler::InputEvent();
 
 		if (ret < 0)
 		{
@@ -427,17 +430,28 @@ static inline void doRenderIteration(void)
 
 	if(gRenderState == RENDER_NORMAL)
 	{
+		GUIProfiler::FrameStart();
 		int ret = PageManager::Update();
+		GUIProfiler::PhaseEnd(GUIProfiler::PHASE_UPDATE);
 		if(ret > 1)
 			PageManager::Render();
+		GUIProfiler::PhaseEnd(GUIProfiler::PHASE_RENDER);
 		if(ret > 0)
+		{
+			GUIProfiler::DrawOverlay();
 			flip();
+		}
+		GUIProfiler::FrameEnd(ret > 0);
 	}
 	else if(gRenderState & RENDER_FORCE)
 	{
 		gRenderState &= ~(RENDER_FORCE);
+		GUIProfiler::FrameStart();
 		PageManager::Render ();
+		GUIProfiler::PhaseEnd(GUIProfiler::PHASE_RENDER);
+		GUIProfiler::DrawOverlay();
 		flip ();
+		GUIProfiler::FrameEnd(true);
 	}
 
 	pthread_mutex_unlock(&gRenderStateMutex);
@@ -466,6 +480,14 @@ static void runPageLoop(const std::string& stopVar)
 
 		if(DataManager::GetIntValue(stopVar) != 0)
 			break;
+
+		int profile = DataManager::GetIntValue("tw_gui_profile");
+		if (profile != GUIProfiler::GetMode())
+		{
+			// Redraw the page so the overlay shows up or goes away
+			GUIProfiler::SetMode(profile);
+			gui_forceRender();
+		}
 	}
 
 	gGuiRunning = 0;
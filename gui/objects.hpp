@@ -21,6 +21,7 @@
 #define _OBJECTS_HEADER
 
 #include "rapidxml.hpp"
+#include <pthread.h>
 #include <vector>
 #include <string>
 #include <map>
@@ -197,9 +198,19 @@ public:
 public:
 	bool isHighlighted;
 
+protected:
+	// A piece of the text template: either literal text, or a %variable%
+	// reference holding the last value fetched from the DataManager
+	struct TextSegment {
+		std::string varName; // empty for literal text
+		std::string value;
+		int handle;          // DataManager handle for varName
+	};
+
 protected:
 	std::string mText;
 	std::string mLastValue;
+	std::vector<TextSegment> mSegments;
 	COLOR mColor;
 	COLOR mHighlightColor;
 	Resource* mFont;
@@ -211,7 +222,9 @@ protected:
 	bool hasHighlightColor;
 
 protected:
-	std::string parseText(void);
+	void compileText(void);
+	bool isReferenced(const std::string& varName);
+	bool parseText(void);
 };
 
 // GUIImage - Used for static image
@@ -459,15 +472,43 @@ protected:
 		time_t lastStatChange;	  // Uses time_t format from stat
 	};
 
+	// Names and d_types of a folder, reused while the folder's mtime and ctime don't change
+	struct DirCache {
+		dev_t dev;
+		ino_t ino;
+		time_t mtime;
+		time_t ctime;
+		std::vector<std::pair<std::string, unsigned char> > entries;
+	};
+
 protected:
 	virtual int GetSelection(int x, int y);
 
 	virtual int GetFileList(const std::string folder);
-	static bool fileSort(FileData d1, FileData d2);
+	static bool fileSort(const FileData& d1, const FileData& d2);
+
+	// The folder is read on a loader thread, entries are merged into the lists as they come in
+	static void* loaderThread(void* cookie);
+	void LoadFolder(void);
+	void AddEntry(FileData& data, std::vector<FileData>& folders, std::vector<FileData>& files);
+	void StopLoader(void);
+	bool MergeLoadedEntries(void);                  // Returns true if the lists changed
 
 protected:
 	std::vector<FileData> mFolderList;
 	std::vector<FileData> mFileList;
+	pthread_t mLoaderThread;
+	pthread_mutex_t mLoaderLock;
+	bool mLoaderRunning;
+	volatile bool mLoaderCancel;
+	bool mLoaderDone;                               // The rest are guarded by mLoaderLock
+	bool mLoaderFailed;
+	bool mLoaderReplace;                            // Keep showing the old lists until the load is done
+	std::string mLoaderFolder;
+	std::vector<FileData> mLoadedFolders;
+	std::vector<FileData> mLoadedFiles;
+	static std::map<std::string, DirCache> mDirCache;
+	static pthread_mutex_t mDirCacheLock;
 	std::vector<std::string> mExcludeFiles;
 	std::string mPathVar;
 	std::vector<std::string> mExtn;
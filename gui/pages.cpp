@@ -41,6 +41,7 @@ extern "C" {
 
 #include "rapidxml.hpp"
 #include "objects.hpp"
+#include "profiler.hpp"
 #ifndef TW_NO_SCREEN_TIMEOUT
 #include "blanktimer.hpp"
 #endif
@@ -171,6 +172,7 @@ Page::Page(xml_node<>* page, xml_node<>* templates /* = NULL */)
 
 		GUIConsole* element = new GUIConsole(NULL);
 		mRenders.push_back(element);
+		mRenderNames.push_back("console");
 		mActions.push_back(element);
 		return;
 	}
@@ -219,6 +221,7 @@ bool Page::ProcessNode(xml_node<>* page, xml_node<>* templates /* = NULL */, int
 			break;
 
 		std::string type = child->first_attribute("type")->value();
+		size_t renders = mRenders.size();
 
 		if (type == "text")
 		{
@@ -347,6 +350,15 @@ bool Page::ProcessNode(xml_node<>* page, xml_node<>* templates /* = NULL */, int
 		{
 			LOGERR("Unknown object type.\n");
 		}
+
+		// Profiling totals are kept by object type and name
+		if (type != "template" && mRenders.size() > renders)
+		{
+			std::string label = type;
+			if (child->first_attribute("name"))
+				label = label + ":" + child->first_attribute("name")->value();
+			mRenderNames.push_back(label);
+		}
 		child = child->next_sibling("object");
 	}
 	return true;
@@ -359,11 +371,14 @@ int Page::Render(void)
 	gr_fill(0, 0, gr_fb_width(), gr_fb_height());
 
 	// Render remaining objects
-	std::vector<RenderObject*>::iterator iter;
-	for (iter = mRenders.begin(); iter != mRenders.end(); iter++)
+	bool profile = GUIProfiler::Enabled();
+	for (size_t i = 0; i < mRenders.size(); i++)
 	{
-		if ((*iter)->Render())
+		uint64_t start = profile ? GUIProfiler::Now() : 0;
+		if (mRenders[i]->Render())
 			LOGERR("A render request has failed.\n");
+		if (profile)
+			GUIProfiler::ObjectRendered(mRenderNames[i], start);
 	}
 	return 0;
 }
@@ -52,6 +52,7 @@ public:
 protected:
 	std::string mName;
 	std::vector<RenderObject*> mRenders;
+	std::vector<std::string> mRenderNames;      // "type:name" of each of mRenders, for the profiler
 	std::vector<ActionObject*> mActions;
 	std::vector<InputObject*> mInputs;
 
@@ -0,0 +1,271 @@
+/*
+        Copyright 2013 TeamWin
+        This file is part of TWRP/TeamWin Recovery Project.
+
+        TWRP is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        TWRP is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <vector>
+
+extern "C" {
+#include "../twcommon.h"
+#include "../minuitwrp/minui.h"
+}
+
+#include "profiler.hpp"
+
+#define FRAME_LOG "/tmp/gui_frames.csv"
+#define OBJECT_LOG "/tmp/gui_objects.csv"
+
+// The object totals are rewritten this often and when profiling stops
+#define OBJECT_LOG_FRAMES 300
+
+#define OVERLAY_OBJECTS 3
+
+int GUIProfiler::mMode = 0;
+FILE* GUIProfiler::mFrameLog = NULL;
+unsigned long GUIProfiler::mFrames = 0;
+uint64_t GUIProfiler::mFrameStart = 0;
+uint64_t GUIProfiler::mMark = 0;
+uint64_t GUIProfiler::mPhase[PHASE_COUNT];
+uint64_t GUIProfiler::mLastPhase[PHASE_COUNT];
+uint64_t GUIProfiler::mLastLatency = 0;
+uint64_t GUIProfiler::mMaxFrame = 0;
+uint64_t GUIProfiler::mFpsStart = 0;
+unsigned long GUIProfiler::mFpsFrames = 0;
+unsigned long GUIProfiler::mFps = 0;
+std::map<std::string, GUIProfiler::ObjectStats> GUIProfiler::mObjects;
+pthread_mutex_t GUIProfiler::mInputLock = PTHREAD_MUTEX_INITIALIZER;
+uint64_t GUIProfiler::mInputTime = 0;
+
+uint64_t GUIProfiler::Now(void)
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void GUIProfiler::SetMode(int mode)
+{
+	if (mode == mMode)
+		return;
+
+	if (mode == 0)
+	{
+		CloseLogs();
+		mMode = 0;
+		LOGINFO("GUI profiling stopped after %lu frames\n", mFrames);
+		return;
+	}
+
+	if (mMode == 0)
+	{
+		mFrameLog = fopen(FRAME_LOG, "w");
+		if (mFrameLog)
+			fprintf(mFrameLog, "frame,time_us,update_us,render_us,flip_us,total_us,input_latency_us\n");
+		else
+			LOGINFO("Unable to open '%s' for GUI profiling\n", FRAME_LOG);
+
+		mObjects.clear();
+		mFrames = 0;
+		mMaxFrame = 0;
+		mLastLatency = 0;
+		mFps = 0;
+		mFpsFrames = 0;
+		mFpsStart = Now();
+		memset(mLastPhase, 0, sizeof(mLastPhase));
+		pthread_mutex_lock(&mInputLock);
+		mInputTime = 0;
+		pthread_mutex_unlock(&mInputLock);
+		LOGINFO("GUI profiling started, logging to '%s' and '%s'\n", FRAME_LOG, OBJECT_LOG);
+	}
+	mMode = mode;
+}
+
+void GUIProfiler::FrameStart(void)
+{
+	if (!mMode)
+		return;
+
+	mFrameStart = mMark = Now();
+	memset(mPhase, 0, sizeof(mPhase));
+}
+
+void GUIProfiler::PhaseEnd(Phase phase)
+{
+	if (!mMode)
+		return;
+
+	uint64_t now = Now();
+	mPhase[phase] += now - mMark;
+	mMark = now;
+}
+
+void GUIProfiler::FrameEnd(bool flipped)
+{
+	if (!mMode)
+		return;
+
+	PhaseEnd(PHASE_FLIP);
+	if (!flipped)
+		return;
+
+	uint64_t latency = 0;
+	pthread_mutex_lock(&mInputLock);
+	if (mInputTime)
+	{
+		latency = mMark - mInputTime;
+		mInputTime = 0;
+	}
+	pthread_mutex_unlock(&mInputLock);
+	if (latency)
+		mLastLatency = latency;
+
+	uint64_t total = mMark - mFrameStart;
+	if (total > mMaxFrame)
+		mMaxFrame = total;
+	memcpy(mLastPhase, mPhase, sizeof(mPhase));
+	mFrames++;
+
+	// Drawn frames per second, the loop is capped at 30
+	mFpsFrames++;
+	if (mMark - mFpsStart >= 1000000)
+	{
+		mFps = (mFpsFrames * 1000000 + (mMark - mFpsStart) / 2) / (mMark - mFpsStart);
+		mFpsFrames = 0;
+		mFpsStart = mMark;
+	}
+
+	if (mFrameLog)
+	{
+		fprintf(mFrameLog, "%lu,%llu,%llu,%llu,%llu,%llu,%llu\n", mFrames,
+			(unsigned long long) mFrameStart,
+			(unsigned long long) mPhase[PHASE_UPDATE],
+			(unsigned long long) mPhase[PHASE_RENDER],
+			(unsigned long long) mPhase[PHASE_FLIP],
+			(unsigned long long) total,
+			(unsigned long long) latency);
+	}
+	if (mFrames % OBJECT_LOG_FRAMES == 0)
+	{
+		if (mFrameLog)
+			fflush(mFrameLog);
+		WriteObjects();
+	}
+}
+
+void GUIProfiler::ObjectRendered(const std::string& name, uint64_t start)
+{
+	if (!mMode)
+		return;
+
+	uint64_t elapsed = Now() - start;
+	ObjectStats& stats = mObjects[name];
+	stats.calls++;
+	stats.total += elapsed;
+	if (elapsed > stats.max)
+		stats.max = elapsed;
+}
+
+void GUIProfiler::InputEvent(void)
+{
+	if (!mMode)
+		return;
+
+	pthread_mutex_lock(&mInputLock);
+	if (!mInputTime)
+		mInputTime = Now();
+	pthread_mutex_unlock(&mInputLock);
+}
+
+static bool Sort_By_Total(const std::pair<std::string, uint64_t>& a, const std::pair<std::string, uint64_t>& b)
+{
+	return a.second > b.second;
+}
+
+void GUIProfiler::DrawOverlay(void)
+{
+	if (mMode < 2)
+		return;
+
+	std::vector<std::string> lines;
+	char line[128];
+
+	snprintf(line, sizeof(line), "%lu fps, max frame %.1f ms", mFps, mMaxFrame / 1000.0);
+	lines.push_back(line);
+	snprintf(line, sizeof(line), "update %.1f render %.1f flip %.1f ms",
+		mLastPhase[PHASE_UPDATE] / 1000.0, mLastPhase[PHASE_RENDER] / 1000.0, mLastPhase[PHASE_FLIP] / 1000.0);
+	lines.push_back(line);
+	snprintf(line, sizeof(line), "input to screen %.1f ms", mLastLatency / 1000.0);
+	lines.push_back(line);
+
+	// The objects that have cost the most so far
+	std::vector<std::pair<std::string, uint64_t> > totals;
+	std::map<std::string, ObjectStats>::iterator it;
+	for (it = mObjects.begin(); it != mObjects.end(); it++)
+		totals.push_back(std::make_pair(it->first, it->second.total));
+	std::sort(totals.begin(), totals.end(), Sort_By_Total);
+	for (size_t i = 0; i < totals.size() && i < OVERLAY_OBJECTS; i++)
+	{
+		const ObjectStats& stats = mObjects[totals[i].first];
+		snprintf(line, sizeof(line), "%s %.2f ms", totals[i].first.c_str(), stats.total / 1000.0 / stats.calls);
+		lines.push_back(line);
+	}
+
+	int fontWidth = 0, fontHeight = 0, width = 0;
+	gr_font_size(&fontWidth, &fontHeight);
+	for (size_t i = 0; i < lines.size(); i++)
+		width = std::max(width, gr_measure(lines[i].c_str()));
+
+	gr_color(0, 0, 0, 192);
+	gr_fill(0, 0, width + fontWidth, (lines.size() + 1) * fontHeight);
+	gr_color(255, 255, 0, 255);
+	for (size_t i = 0; i < lines.size(); i++)
+		gr_text(fontWidth / 2, fontHeight / 2 + i * fontHeight, lines[i].c_str());
+
+	// Drawing the overlay isn't part of the flip
+	mMark = Now();
+}
+
+void GUIProfiler::WriteObjects(void)
+{
+	FILE* fp = fopen(OBJECT_LOG, "w");
+	if (!fp)
+		return;
+
+	fprintf(fp, "object,calls,total_us,avg_us,max_us\n");
+	std::map<std::string, ObjectStats>::iterator it;
+	for (it = mObjects.begin(); it != mObjects.end(); it++)
+	{
+		fprintf(fp, "%s,%lu,%llu,%llu,%llu\n", it->first.c_str(), it->second.calls,
+			(unsigned long long) it->second.total,
+			(unsigned long long) (it->second.total / it->second.calls),
+			(unsigned long long) it->second.max);
+	}
+	fclose(fp);
+}
+
+void GUIProfiler::CloseLogs(void)
+{
+	if (mFrameLog)
+	{
+		fclose(mFrameLog);
+		mFrameLog = NULL;
+	}
+	WriteObjects();
+}
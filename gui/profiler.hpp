@@ -0,0 +1,87 @@
+/*
+        Copyright 2013 TeamWin
+        This file is part of TWRP/TeamWin Recovery Project.
+
+        TWRP is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        TWRP is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __GUI_PROFILER_HPP
+#define __GUI_PROFILER_HPP
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <map>
+#include <string>
+
+// Frame timing for theme tuning, switched on with tw_gui_profile:
+//   0 - off
+//   1 - log every drawn frame to /tmp/gui_frames.csv and the cost of each
+//       page object to /tmp/gui_objects.csv
+//   2 - log and draw the numbers in the top left corner of the screen
+// All calls but InputEvent come from the render thread.
+class GUIProfiler
+{
+public:
+	enum Phase
+	{
+		PHASE_UPDATE = 0,
+		PHASE_RENDER,
+		PHASE_FLIP,
+		PHASE_COUNT
+	};
+
+public:
+	static void SetMode(int mode);
+	static int GetMode(void)                                    { return mMode; }
+	static bool Enabled(void)                                   { return mMode != 0; }
+	static uint64_t Now(void);                                  // Monotonic microseconds
+
+	static void FrameStart(void);
+	static void PhaseEnd(Phase phase);                          // The phase ran from the last mark until now
+	static void FrameEnd(bool flipped);                         // Only flipped frames are logged
+	static void ObjectRendered(const std::string& name, uint64_t start);
+	static void InputEvent(void);                               // Called by the input thread for every touch and key
+	static void DrawOverlay(void);
+
+private:
+	struct ObjectStats
+	{
+		unsigned long calls;
+		uint64_t total;
+		uint64_t max;
+	};
+
+	static void WriteObjects(void);
+	static void CloseLogs(void);
+
+	static int mMode;
+	static FILE* mFrameLog;
+	static unsigned long mFrames;
+	static uint64_t mFrameStart;
+	static uint64_t mMark;
+	static uint64_t mPhase[PHASE_COUNT];
+	static uint64_t mLastPhase[PHASE_COUNT];
+	static uint64_t mLastLatency;
+	static uint64_t mMaxFrame;
+	static uint64_t mFpsStart;
+	static unsigned long mFpsFrames;
+	static unsigned long mFps;
+	static std::map<std::string, ObjectStats> mObjects;
+
+	static pthread_mutex_t mInputLock;
+	static uint64_t mInputTime;                                 // Oldest input not yet on screen, 0 if none
+};
+
+#endif // __GUI_PROFILER_HPP
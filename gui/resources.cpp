@@ -1,6 +1,8 @@
 // resource.cpp - Source to manage GUI resources
 
 #include <stdarg.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,9 +13,13 @@
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/statfs.h>
+#include <dirent.h>
 #include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <zlib.h>
 
 #include <string>
 #include <sstream>
@@ -27,9 +33,287 @@ extern "C" {
 
 #include "rapidxml.hpp"
 #include "objects.hpp"
+#include "../variables.h"
 
 #define TMP_RESOURCE_NAME   "/tmp/extract.bin"
 
+// Zip compression methods, minzip doesn't export these
+#define ZIP_METHOD_STORED   0
+#define ZIP_METHOD_DEFLATED 8
+
+#define MAX_LOADER_THREADS  4
+
+// The surface cache lives on /cache when there is room for it so it
+// survives a reboot, otherwise in /tmp for theme reloads and rotation.
+// Cached surfaces are read into memory, no file stays open on /cache.
+#define SURFACE_CACHE_TMP_DIR       "/tmp/surfaces/"
+#define SURFACE_CACHE_MAX_BYTES     (48L * 1024 * 1024)
+#define SURFACE_CACHE_MIN_FREE      (128LL * 1024 * 1024)
+
+SurfaceLoader::SurfaceLoader(ZipArchive* pZip)
+{
+	mZip = pZip;
+	mNextJob = 0;
+	mCacheBytes = 0;
+	SetupCache();
+}
+
+void SurfaceLoader::SetupCache(void)
+{
+	struct statfs st;
+
+	if (statfs("/cache/recovery", &st) == 0 &&
+		(unsigned long long) st.f_bavail * st.f_bsize >= (unsigned long long) SURFACE_CACHE_MIN_FREE &&
+		(mkdir(SURFACE_CACHE_DIR, 0700) == 0 || errno == EEXIST) && access(SURFACE_CACHE_DIR, W_OK) == 0)
+		mCacheDir = SURFACE_CACHE_DIR "/";
+	else if ((mkdir(SURFACE_CACHE_TMP_DIR, 0700) == 0 || errno == EEXIST) && access(SURFACE_CACHE_TMP_DIR, W_OK) == 0)
+		mCacheDir = SURFACE_CACHE_TMP_DIR;
+	else
+		return;
+
+	DIR* d = opendir(mCacheDir.c_str());
+	if (!d)
+	{
+		mCacheDir.clear();
+		return;
+	}
+
+	std::vector<std::string> files;
+	struct dirent* de;
+	while ((de = readdir(d)) != NULL)
+	{
+		struct stat sb;
+		if (de->d_name[0] == '.')
+			continue;
+		std::string path = mCacheDir + de->d_name;
+		if (lstat(path.c_str(), &sb) == 0 && S_ISREG(sb.st_mode))
+		{
+			files.push_back(path);
+			mCacheBytes += sb.st_size;
+		}
+	}
+	closedir(d);
+
+	// Surfaces from old themes pile up, start over once the cache is full
+	if (mCacheBytes >= SURFACE_CACHE_MAX_BYTES)
+	{
+		LOGINFO("Surface cache in '%s' is full, clearing it.\n", mCacheDir.c_str());
+		for (size_t i = 0; i < files.size(); i++)
+			unlink(files[i].c_str());
+		mCacheBytes = 0;
+	}
+}
+
+// The key names the exact source data: a zip entry by its CRC and size,
+// a file by its path, size and modification time. Keys are hashed into
+// the file name and stored in full inside the file to catch collisions.
+std::string SurfaceLoader::CachePath(const std::string& key)
+{
+	unsigned long long hash = 14695981039346656037ULL;
+	char name[32];
+
+	for (size_t i = 0; i < key.size(); i++)
+	{
+		hash ^= (unsigned char) key[i];
+		hash *= 1099511628211ULL;
+	}
+	sprintf(name, "%016llx.surf", hash);
+	return mCacheDir + name;
+}
+
+int SurfaceLoader::LoadCached(const std::string& key, gr_surface* surface)
+{
+	if (mCacheDir.empty())
+		return -1;
+	return res_load_surface(CachePath(key).c_str(), key.c_str(), surface);
+}
+
+void SurfaceLoader::SaveCached(const std::string& key, gr_surface surface)
+{
+	if (mCacheDir.empty())
+		return;
+
+	long size = (long) gr_get_width(surface) * gr_get_height(surface) * 4;
+	if (__sync_add_and_fetch(&mCacheBytes, size) > SURFACE_CACHE_MAX_BYTES)
+		return;
+	res_save_surface(CachePath(key).c_str(), key.c_str(), surface);
+}
+
+bool SurfaceLoader::QueueZipEntry(std::string name, gr_surface* surface)
+{
+	if (!mZip)
+		return false;
+
+	const ZipEntry* entry = mzFindZipEntry(mZip, name.c_str());
+	if (entry == NULL)
+		return false;
+
+	Job job;
+	job.entry = entry;
+	job.name = name;
+	job.surface = surface;
+	job.sequence = NULL;
+	*surface = NULL;
+	mJobs.push_back(job);
+	return true;
+}
+
+void SurfaceLoader::QueueFile(std::string name, gr_surface* surface)
+{
+	Job job;
+	job.entry = NULL;
+	job.name = name;
+	job.surface = surface;
+	job.sequence = NULL;
+	*surface = NULL;
+	mJobs.push_back(job);
+}
+
+void SurfaceLoader::QueueSequence(std::string name, std::vector<gr_surface>* surfaces)
+{
+	Job job;
+	job.entry = NULL;
+	job.name = name;
+	job.surface = NULL;
+	job.sequence = surfaces;
+	mJobs.push_back(job);
+}
+
+// Decodes straight out of the mapped zip. Stored entries are decoded in
+// place, deflated ones are inflated into a temporary buffer first. This
+// only touches the read-only mapping, so it is safe to run in parallel
+// unlike mzExtractZipEntryToBuffer() which seeks the shared zip fd.
+int SurfaceLoader::DecodeZipEntry(const ZipEntry* entry, gr_surface* surface)
+{
+	const unsigned char* data = (const unsigned char*) mZip->map.addr + entry->offset;
+	long length = mzGetZipEntryUncompLen(entry);
+	int ret = -1;
+
+	if (entry->offset + entry->compLen > (long) mZip->map.length)
+		return -1;
+
+	if (entry->compression == ZIP_METHOD_STORED)
+		return res_create_surface_mem(data, length, surface);
+	if (entry->compression != ZIP_METHOD_DEFLATED)
+		return -1;
+
+	unsigned char* buffer = (unsigned char*) malloc(length);
+	if (!buffer)
+		return -1;
+
+	z_stream zstream;
+	memset(&zstream, 0, sizeof(zstream));
+	zstream.next_in = (Bytef*) data;
+	zstream.avail_in = entry->compLen;
+	zstream.next_out = buffer;
+	zstream.avail_out = length;
+
+	// Zip entries are raw deflate streams without a zlib header
+	if (inflateInit2(&zstream, -MAX_WBITS) == Z_OK)
+	{
+		if (inflate(&zstream, Z_FINISH) == Z_STREAM_END && zstream.total_out == (unsigned long) length)
+			ret = res_create_surface_mem(buffer, length, surface);
+		inflateEnd(&zstream);
+	}
+	free(buffer);
+	return ret;
+}
+
+int SurfaceLoader::DecodeFile(std::string name, gr_surface* surface)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	if (res_surface_path(name.c_str(), path, sizeof(path)) != 0 || stat(path, &st) != 0)
+		return -1;
+
+	std::ostringstream key;
+	key << "file:" << gr_get_rotation() << ":" << path << ":" << st.st_size << ":" << st.st_mtime;
+	if (LoadCached(key.str(), surface) == 0)
+		return 0;
+
+	if (res_create_surface(name.c_str(), surface) != 0)
+		return -1;
+	SaveCached(key.str(), *surface);
+	return 0;
+}
+
+void SurfaceLoader::DecodeJob(Job* job)
+{
+	if (job->sequence)
+	{
+		for (int fileNum = 1; ; fileNum++)
+		{
+			std::ostringstream fileName;
+			fileName << job->name << std::setfill ('0') << std::setw (3) << fileNum;
+
+			gr_surface surface;
+			if (DecodeFile(fileName.str(), &surface))
+				break;
+			job->sequence->push_back(surface);
+		}
+	}
+	else if (job->entry)
+	{
+		std::ostringstream key;
+		key << "zip:" << gr_get_rotation() << ":" << job->name << ":" << std::hex
+			<< (unsigned long) mzGetZipEntryCrc32(job->entry) << ":" << mzGetZipEntryUncompLen(job->entry);
+
+		if (LoadCached(key.str(), job->surface) == 0)
+			return;
+		if (DecodeZipEntry(job->entry, job->surface) != 0)
+			*job->surface = NULL;
+		else
+			SaveCached(key.str(), *job->surface);
+	}
+	else
+	{
+		if (DecodeFile(job->name, job->surface) != 0)
+			*job->surface = NULL;
+	}
+}
+
+void* SurfaceLoader::worker_thread(void* cookie)
+{
+	SurfaceLoader* loader = (SurfaceLoader*) cookie;
+	int count = loader->mJobs.size();
+
+	while (1)
+	{
+		int index = __sync_fetch_and_add(&loader->mNextJob, 1);
+		if (index >= count)
+			break;
+		loader->DecodeJob(&loader->mJobs[index]);
+	}
+	return NULL;
+}
+
+void SurfaceLoader::Run(void)
+{
+	pthread_t threads[MAX_LOADER_THREADS];
+	int thread_count = 0;
+	int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (cpus > MAX_LOADER_THREADS)
+		cpus = MAX_LOADER_THREADS;
+	if (cpus > (int) mJobs.size())
+		cpus = mJobs.size();
+
+	mNextJob = 0;
+	// The calling thread works through the queue too
+	for (int i = 1; i < cpus; i++)
+	{
+		if (pthread_create(&threads[thread_count], NULL, worker_thread, this) == 0)
+			thread_count++;
+	}
+	worker_thread(this);
+
+	for (int i = 0; i < thread_count; i++)
+		pthread_join(threads[i], NULL);
+
+	mJobs.clear();
+}
+
 Resource::Resource(xml_node<>* node, ZipArchive* pZip)
 {
 	if (node && node->first_attribute("name"))
@@ -88,7 +372,7 @@ FontResource::~FontResource()
 {
 }
 
-ImageResource::ImageResource(xml_node<>* node, ZipArchive* pZip)
+ImageResource::ImageResource(xml_node<>* node, ZipArchive* pZip, SurfaceLoader* loader)
  : Resource(node, pZip)
 {
 	std::string file;
@@ -100,19 +384,10 @@ ImageResource::ImageResource(xml_node<>* node, ZipArchive* pZip)
 	if (node->first_attribute("filename"))
 		file = node->first_attribute("filename")->value();
 
-	if (ExtractResource(pZip, "images", file, ".png", TMP_RESOURCE_NAME) == 0)
-	{
-		res_create_surface(TMP_RESOURCE_NAME, &mSurface);
-		unlink(TMP_RESOURCE_NAME);
-	}
-	else if (ExtractResource(pZip, "images", file, "", TMP_RESOURCE_NAME) == 0)
-	{
-		// JPG includes the .jpg extension in the filename so extension should be blank
-		res_create_surface(TMP_RESOURCE_NAME, &mSurface);
-		unlink(TMP_RESOURCE_NAME);
-	}
-	else
-		res_create_surface(file.c_str(), &mSurface);
+	// JPG includes the .jpg extension in the filename so extension should be blank
+	if (!loader->QueueZipEntry("images/" + file + ".png", &mSurface) &&
+		!loader->QueueZipEntry("images/" + file, &mSurface))
+		loader->QueueFile(file, &mSurface);
 }
 
 ImageResource::~ImageResource()
@@ -121,11 +396,11 @@ ImageResource::~ImageResource()
 		res_free_surface(mSurface);
 }
 
-AnimationResource::AnimationResource(xml_node<>* node, ZipArchive* pZip)
+AnimationResource::AnimationResource(xml_node<>* node, ZipArchive* pZip, SurfaceLoader* loader)
  : Resource(node, pZip)
 {
 	std::string file;
-	int fileNum = 1;
+	int frames = 0;
 
 	if (!node)
 		return;
@@ -133,32 +408,50 @@ AnimationResource::AnimationResource(xml_node<>* node, ZipArchive* pZip)
 	if (node->first_attribute("filename"))
 		file = node->first_attribute("filename")->value();
 
+	if (!pZip)
+	{
+		loader->QueueSequence(file, &mSurfaces);
+		return;
+	}
+
+	// Count the frames first, the loader fills mSurfaces in place so it
+	// must not be resized once frames are queued
 	for (;;)
 	{
 		std::ostringstream fileName;
-		fileName << file << std::setfill ('0') << std::setw (3) << fileNum;
+		fileName << "images/" << file << std::setfill ('0') << std::setw (3) << (frames + 1) << ".png";
 
-		gr_surface surface;
-		if (pZip)
-		{
-			if (ExtractResource(pZip, "images", fileName.str(), ".png", TMP_RESOURCE_NAME) != 0)
-				break;
-	
-			if (res_create_surface(TMP_RESOURCE_NAME, &surface))
-				break;
+		if (mzFindZipEntry(pZip, fileName.str().c_str()) == NULL)
+			break;
+		frames++;
+	}
 
-			unlink(TMP_RESOURCE_NAME);
-		}
-		else
-		{
-			if (res_create_surface(fileName.str().c_str(), &surface))
-				break;
-		}
-		mSurfaces.push_back(surface);
-		fileNum++;
+	mSurfaces.resize(frames, NULL);
+	for (int i = 0; i < frames; i++)
+	{
+		std::ostringstream fileName;
+		fileName << "images/" << file << std::setfill ('0') << std::setw (3) << (i + 1) << ".png";
+		loader->QueueZipEntry(fileName.str(), &mSurfaces[i]);
 	}
 }
 
+void AnimationResource::TrimFrames(void)
+{
+	std::vector<gr_surface>::iterator it;
+
+	for (it = mSurfaces.begin(); it != mSurfaces.end(); ++it)
+	{
+		if (*it == NULL)
+			break;
+	}
+	for (std::vector<gr_surface>::iterator rest = it; rest != mSurfaces.end(); ++rest)
+	{
+		if (*rest)
+			res_free_surface(*rest);
+	}
+	mSurfaces.erase(it, mSurfaces.end());
+}
+
 AnimationResource::~AnimationResource()
 {
 	std::vector<gr_surface>::iterator it;
@@ -184,6 +477,8 @@ Resource* ResourceManager::FindResource(std::string name)
 ResourceManager::ResourceManager(xml_node<>* resList, ZipArchive* pZip)
 {
 	xml_node<>* child;
+	SurfaceLoader loader(pZip);
+	std::vector<std::pair<Resource*, xml_node<>*> > loaded;
 
 	if (!resList)
 		return;
@@ -196,73 +491,51 @@ ResourceManager::ResourceManager(xml_node<>* resList, ZipArchive* pZip)
 			break;
 
 		std::string type = attr->value();
+		Resource* res = NULL;
 
 		if (type == "font")
-		{
-			FontResource* res = new FontResource(child, pZip);
-			if (res == NULL || res->GetResource() == NULL)
-			{
-				xml_attribute<>* attr_name = child->first_attribute("name");
-
-				if (!attr_name) {
-					std::string res_name = attr_name->value();
-					LOGERR("Resource (%s)-(%s) failed to load\n", type.c_str(), res_name.c_str());
-				} else
-					LOGERR("Resource type (%s) failed to load\n", type.c_str());
-
-				delete res;
-			}
-			else
-			{
-				mResources.push_back((Resource*) res);
-			}
-		}
+			res = new FontResource(child, pZip);
 		else if (type == "image")
-		{
-			ImageResource* res = new ImageResource(child, pZip);
-			if (res == NULL || res->GetResource() == NULL)
-			{
-				xml_attribute<>* attr_name = child->first_attribute("name");
-
-				if (!attr_name) {
-					std::string res_name = attr_name->value();
-					LOGERR("Resource (%s)-(%s) failed to load\n", type.c_str(), res_name.c_str());
-				} else
-					LOGERR("Resource type (%s) failed to load\n", type.c_str());
-
-				delete res;
-			}
-			else
-			{
-				mResources.push_back((Resource*) res);
-			}
-		}
+			res = new ImageResource(child, pZip, &loader);
 		else if (type == "animation")
+			res = new AnimationResource(child, pZip, &loader);
+		else
+			LOGERR("Resource type (%s) not supported.\n", type.c_str());
+
+		if (res)
+			loaded.push_back(std::make_pair(res, child));
+
+		child = child->next_sibling("resource");
+	}
+
+	// Decode all of the images at once
+	loader.Run();
+
+	std::vector<std::pair<Resource*, xml_node<>*> >::iterator iter;
+	for (iter = loaded.begin(); iter != loaded.end(); ++iter)
+	{
+		Resource* res = iter->first;
+		std::string type = iter->second->first_attribute("type")->value();
+
+		if (type == "animation")
+			((AnimationResource*) res)->TrimFrames();
+
+		if (res->GetResource() == NULL)
 		{
-			AnimationResource* res = new AnimationResource(child, pZip);
-			if (res == NULL || res->GetResource() == NULL)
-			{
-				xml_attribute<>* attr_name = child->first_attribute("name");
-
-				if (!attr_name) {
-					std::string res_name = attr_name->value();
-					LOGERR("Resource (%s)-(%s) failed to load\n", type.c_str(), res_name.c_str());
-				} else
-					LOGERR("Resource type (%s) failed to load\n", type.c_str());
-
-				delete res;
-			}
-			else
-			{
-				mResources.push_back((Resource*) res);
-			}
+			xml_attribute<>* attr_name = iter->second->first_attribute("name");
+
+			if (attr_name) {
+				std::string res_name = attr_name->value();
+				LOGERR("Resource (%s)-(%s) failed to load\n", type.c_str(), res_name.c_str());
+			} else
+				LOGERR("Resource type (%s) failed to load\n", type.c_str());
+
+			delete res;
 		}
 		else
 		{
-			LOGERR("Resource type (%s) not supported.\n", type.c_str());
+			mResources.push_back(res);
 		}
-
-		child = child->next_sibling("resource");
 	}
 }
 
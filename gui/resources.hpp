@@ -9,6 +9,49 @@
 #include "../minzipold/Zip.h"
 #endif
 
+// Decodes image files on a pool of worker threads. Image and animation
+// resources queue the surfaces they need while they are constructed and
+// ResourceManager decodes the whole theme in one batch. Decoded surfaces
+// are kept in a cache folder and read back in on the next load.
+class SurfaceLoader
+{
+public:
+	SurfaceLoader(ZipArchive* pZip);
+
+public:
+	// Queues a file from the theme zip, returns false if it isn't in the zip
+	bool QueueZipEntry(std::string name, gr_surface* surface);
+	// Queues a file for res_create_surface, outside of the zip
+	void QueueFile(std::string name, gr_surface* surface);
+	// Queues name001, name002, ... for res_create_surface until one fails to load
+	void QueueSequence(std::string name, std::vector<gr_surface>* surfaces);
+	void Run(void);
+
+private:
+	struct Job {
+		const ZipEntry* entry;
+		std::string name;
+		gr_surface* surface;
+		std::vector<gr_surface>* sequence;
+	};
+
+	static void* worker_thread(void* cookie);
+	void DecodeJob(Job* job);
+	int DecodeZipEntry(const ZipEntry* entry, gr_surface* surface);
+	int DecodeFile(std::string name, gr_surface* surface);
+
+	void SetupCache(void);
+	std::string CachePath(const std::string& key);
+	int LoadCached(const std::string& key, gr_surface* surface);
+	void SaveCached(const std::string& key, gr_surface surface);
+
+	ZipArchive* mZip;
+	std::vector<Job> mJobs;
+	volatile int mNextJob;
+	std::string mCacheDir;
+	volatile long mCacheBytes;
+};
+
 // Base Objects
 class Resource
 {
@@ -51,7 +94,7 @@ protected:
 class ImageResource : public Resource
 {
 public:
-	ImageResource(xml_node<>* node, ZipArchive* pZip);
+	ImageResource(xml_node<>* node, ZipArchive* pZip, SurfaceLoader* loader);
 	virtual ~ImageResource();
 
 public:
@@ -64,11 +107,14 @@ protected:
 class AnimationResource : public Resource
 {
 public:
-	AnimationResource(xml_node<>* node, ZipArchive* pZip);
+	AnimationResource(xml_node<>* node, ZipArchive* pZip, SurfaceLoader* loader);
 	virtual ~AnimationResource();
 
 public:
-	virtual void* GetResource(void) { return mSurfaces.at(0); }
+	// Drops the frames after the first one that failed to decode
+	void TrimFrames(void);
+
+	virtual void* GetResource(void) { return mSurfaces.empty() ? NULL : mSurfaces.at(0); }
 	virtual void* GetResource(int entry) { return mSurfaces.at(entry); }
 	virtual int GetResourceCount(void) { return mSurfaces.size(); }
 
@@ -93,9 +93,15 @@ GUIText::GUIText(xml_node<>* node)
 	child = node->first_node("text");
 	if (child)  mText = child->value();
 
-	// Simple way to check for static state
-	mLastValue = parseText();
-	if (mLastValue != mText)   mIsStatic = 0;
+	// Split the text into literal and variable segments once, the text is
+	// static if it doesn't reference any variables
+	compileText();
+	for (std::vector<TextSegment>::iterator iter = mSegments.begin(); iter != mSegments.end(); ++iter)
+	{
+		if (!iter->varName.empty())
+			mIsStatic = 0;
+	}
+	parseText();
 
 	gr_getFontDetails(mFont ? mFont->GetResource() : NULL, (unsigned*) &mFontHeight, NULL);
 	return;
@@ -112,7 +118,7 @@ int GUIText::Render(void)
 	if (mFont)
 		fontResource = mFont->GetResource();
 
-	mLastValue = parseText();
+	parseText();
 	displayValue = mLastValue;
 
 	if (charSkip)
@@ -168,11 +174,11 @@ int GUIText::Update(void)
 	if (mIsStatic || !mVarChanged)
 		return 0;
 
-	std::string newValue = parseText();
-	if (mLastValue == newValue)
+	if (!parseText())
+	{
+		mVarChanged = 0;
 		return 0;
-	else
-		mLastValue = newValue;
+	}
 	return 2;
 }
 
@@ -184,47 +190,111 @@ int GUIText::GetCurrentBounds(int& w, int& h)
 		fontResource = mFont->GetResource();
 
 	h = mFontHeight;
-	mLastValue = parseText();
+	parseText();
 	w = gr_measureEx(mLastValue.c_str(), fontResource);
 	return 0;
 }
 
-std::string GUIText::parseText(void)
+void GUIText::compileText(void)
 {
-	static int counter = 0;
-	std::string str = mText;
+	TextSegment segment;
+	std::string literal;
 	size_t pos = 0;
 	size_t next = 0, end = 0;
 
-	while (1)
+	mSegments.clear();
+	while (pos < mText.length())
 	{
-		next = str.find('%', pos);
-		if (next == std::string::npos) return str;
-		end = str.find('%', next + 1);
-		if (end == std::string::npos) return str;
-
-		// We have a block of data
-		std::string var = str.substr(next + 1, (end - next) - 1);
-		str.erase(next, (end - next) + 1);
+		next = mText.find('%', pos);
+		if (next != std::string::npos)
+			end = mText.find('%', next + 1);
+		if (next == std::string::npos || end == std::string::npos)
+		{
+			literal.append(mText, pos, std::string::npos);
+			break;
+		}
 
+		literal.append(mText, pos, next - pos);
 		if (next + 1 == end)
 		{
-			str.insert(next, 1, '%');
+			// %% is an escaped percent sign
+			literal += '%';
 		}
 		else
 		{
-			std::string value;
-			if (DataManager::GetValue(var, value) == 0)
-				str.insert(next, value);
+			if (!literal.empty())
+			{
+				segment.varName.clear();
+				segment.value = literal;
+				segment.handle = -1;
+				mSegments.push_back(segment);
+				literal.clear();
+			}
+			segment.varName = mText.substr(next + 1, (end - next) - 1);
+			segment.value.clear();
+			segment.handle = DataManager::GetHandle(segment.varName);
+			mSegments.push_back(segment);
 		}
+		pos = end + 1;
+	}
+
+	if (!literal.empty())
+	{
+		segment.varName.clear();
+		segment.value = literal;
+		segment.handle = -1;
+		mSegments.push_back(segment);
+	}
+	mLastValue.clear();
+	for (std::vector<TextSegment>::iterator iter = mSegments.begin(); iter != mSegments.end(); ++iter)
+		mLastValue += iter->value;
+}
+
+bool GUIText::isReferenced(const std::string& varName)
+{
+	for (std::vector<TextSegment>::iterator iter = mSegments.begin(); iter != mSegments.end(); ++iter)
+	{
+		if (iter->varName == varName)
+			return true;
+	}
+	return false;
+}
+
+// Refreshes the variable segments and rebuilds mLastValue only if one of
+// them changed. Returns true if the displayed text changed.
+bool GUIText::parseText(void)
+{
+	std::vector<TextSegment>::iterator iter;
+	bool changed = false;
+
+	for (iter = mSegments.begin(); iter != mSegments.end(); ++iter)
+	{
+		if (iter->varName.empty())
+			continue;
 
-		pos = next + 1;
+		std::string value;
+		DataManager::GetValue(iter->handle, value);
+		if (value != iter->value)
+		{
+			iter->value.swap(value);
+			changed = true;
+		}
 	}
+
+	if (!changed)
+		return false;
+
+	mLastValue.clear();
+	for (iter = mSegments.begin(); iter != mSegments.end(); ++iter)
+		mLastValue += iter->value;
+	return true;
 }
 
 int GUIText::NotifyVarChange(std::string varName, std::string value)
 {
-	mVarChanged = 1;
+	// An empty name is a forced refresh, otherwise only care about our own variables
+	if (varName.empty() || isReferenced(varName))
+		mVarChanged = 1;
 	return 0;
 }
 
@@ -107,7 +107,7 @@ tar_append_tree(TAR *t, char *realdir, char *savedir, char *exclude)
 	char * p = NULL;
 	if (exclude) {
 		strcpy(temp, exclude);
-		p = strtok(exclude, " ");
+		p = strtok(temp, " ");
 		if (p == NULL) {
 			excluded = realloc(excluded, sizeof(char*) * (++n_spaces));
 			excluded[0] = temp;
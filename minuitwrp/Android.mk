@@ -10,6 +10,13 @@ else
     LOCAL_SRC_FILES += graphics.c
 endif
 
+# The drawing kernels use NEON when the target has it, SSE2 on x86
+ifeq ($(TARGET_ARCH)-$(ARCH_ARM_HAVE_NEON),arm-true)
+    LOCAL_SRC_FILES += blit.c.neon
+else
+    LOCAL_SRC_FILES += blit.c
+endif
+
 LOCAL_C_INCLUDES += \
     external/libpng \
     external/zlib \
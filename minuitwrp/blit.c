@@ -0,0 +1,496 @@
+/*
+ * Copyright (C) 2013 TeamWin Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <pixelflinger/pixelflinger.h>
+
+#include "blit.h"
+
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define GR_SIMD 1
+typedef uint32x4_t gr_vec;
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define GR_SIMD 1
+typedef __m128i gr_vec;
+#endif
+
+// Blending rounds the same way everywhere so the SIMD and plain paths give
+// identical pixels: t = s * a + d * (255 - a) + 128, out = (t + (t >> 8)) >> 8
+
+static inline uint32_t swap_rb(uint32_t p)
+{
+    return (p & 0xff00ff00) | ((p >> 16) & 0xff) | ((p & 0xff) << 16);
+}
+
+static inline uint32_t blend_px32(uint32_t d, uint32_t s)
+{
+    uint32_t a = s >> 24, ia = 255 - a;
+    uint32_t rb = (s & 0xff00ff) * a + (d & 0xff00ff) * ia + 0x800080;
+    uint32_t ag = ((s >> 8) & 0xff00ff) * a + ((d >> 8) & 0xff00ff) * ia + 0x800080;
+
+    rb = ((rb + ((rb >> 8) & 0xff00ff)) >> 8) & 0xff00ff;
+    ag = (ag + ((ag >> 8) & 0xff00ff)) & 0xff00ff00;
+    return rb | ag;
+}
+
+#ifdef GR_SIMD
+#if defined(__ARM_NEON__)
+static inline gr_vec vec_load(const uint32_t* p)       { return vld1q_u32(p); }
+static inline void vec_store(uint32_t* p, gr_vec v)    { vst1q_u32(p, v); }
+static inline gr_vec vec_set(uint32_t v)               { return vdupq_n_u32(v); }
+static inline gr_vec vec_set4(const uint32_t* v)       { return vld1q_u32(v); }
+
+static inline gr_vec vec_swap_rb(gr_vec p)
+{
+    gr_vec ag = vandq_u32(p, vdupq_n_u32(0xff00ff00));
+    gr_vec b = vandq_u32(vshrq_n_u32(p, 16), vdupq_n_u32(0xff));
+    gr_vec r = vandq_u32(vshlq_n_u32(p, 16), vdupq_n_u32(0xff0000));
+    return vorrq_u32(ag, vorrq_u32(b, r));
+}
+
+static inline uint8x8_t blend_half(uint8x8_t d, uint8x8_t s)
+{
+    static const uint8_t alpha_index[8] = { 3, 3, 3, 3, 7, 7, 7, 7 };
+    uint8x8_t a = vtbl1_u8(s, vld1_u8(alpha_index));
+    uint16x8_t t = vmull_u8(s, a);
+
+    t = vmlal_u8(t, d, vmvn_u8(a));
+    t = vaddq_u16(t, vdupq_n_u16(128));
+    return vshrn_n_u16(vaddq_u16(t, vshrq_n_u16(t, 8)), 8);
+}
+
+static inline gr_vec vec_blend(gr_vec d, gr_vec s)
+{
+    uint8x16_t d8 = vreinterpretq_u8_u32(d), s8 = vreinterpretq_u8_u32(s);
+    uint8x8_t lo = blend_half(vget_low_u8(d8), vget_low_u8(s8));
+    uint8x8_t hi = blend_half(vget_high_u8(d8), vget_high_u8(s8));
+    return vreinterpretq_u32_u8(vcombine_u8(lo, hi));
+}
+
+static inline gr_vec vec_reverse32(gr_vec v)
+{
+    v = vrev64q_u32(v);
+    return vcombine_u32(vget_high_u32(v), vget_low_u32(v));
+}
+
+static inline gr_vec vec_reverse16(gr_vec v)
+{
+    uint16x8_t h = vrev64q_u16(vreinterpretq_u16_u32(v));
+    return vreinterpretq_u32_u16(vcombine_u16(vget_high_u16(h), vget_low_u16(h)));
+}
+
+static inline void vec_transpose(gr_vec* r0, gr_vec* r1, gr_vec* r2, gr_vec* r3)
+{
+    uint32x4x2_t p = vtrnq_u32(*r0, *r1), q = vtrnq_u32(*r2, *r3);
+    *r0 = vcombine_u32(vget_low_u32(p.val[0]), vget_low_u32(q.val[0]));
+    *r1 = vcombine_u32(vget_low_u32(p.val[1]), vget_low_u32(q.val[1]));
+    *r2 = vcombine_u32(vget_high_u32(p.val[0]), vget_high_u32(q.val[0]));
+    *r3 = vcombine_u32(vget_high_u32(p.val[1]), vget_high_u32(q.val[1]));
+}
+#else
+static inline gr_vec vec_load(const uint32_t* p)       { return _mm_loadu_si128((const __m128i*) p); }
+static inline void vec_store(uint32_t* p, gr_vec v)    { _mm_storeu_si128((__m128i*) p, v); }
+static inline gr_vec vec_set(uint32_t v)               { return _mm_set1_epi32((int) v); }
+static inline gr_vec vec_set4(const uint32_t* v)       { return _mm_loadu_si128((const __m128i*) v); }
+
+static inline gr_vec vec_swap_rb(gr_vec p)
+{
+    gr_vec ag = _mm_and_si128(p, _mm_set1_epi32((int) 0xff00ff00));
+    gr_vec b = _mm_and_si128(_mm_srli_epi32(p, 16), _mm_set1_epi32(0xff));
+    gr_vec r = _mm_and_si128(_mm_slli_epi32(p, 16), _mm_set1_epi32(0xff0000));
+    return _mm_or_si128(ag, _mm_or_si128(b, r));
+}
+
+static inline gr_vec vec_blend(gr_vec d, gr_vec s)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i max = _mm_set1_epi16(255);
+    const __m128i round = _mm_set1_epi16(128);
+    __m128i a = _mm_srli_epi32(s, 24);
+    __m128i a_lo, a_hi, lo, hi;
+
+    a = _mm_or_si128(a, _mm_slli_epi32(a, 16));
+    a_lo = _mm_unpacklo_epi32(a, a);
+    a_hi = _mm_unpackhi_epi32(a, a);
+
+    lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), a_lo),
+            _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_sub_epi16(max, a_lo)));
+    hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), a_hi),
+            _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_sub_epi16(max, a_hi)));
+    lo = _mm_add_epi16(lo, round);
+    hi = _mm_add_epi16(hi, round);
+    lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+    hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+    return _mm_packus_epi16(lo, hi);
+}
+
+static inline gr_vec vec_reverse32(gr_vec v)
+{
+    return _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+}
+
+static inline gr_vec vec_reverse16(gr_vec v)
+{
+    v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+    v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+    return _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+}
+
+static inline void vec_transpose(gr_vec* r0, gr_vec* r1, gr_vec* r2, gr_vec* r3)
+{
+    __m128i t0 = _mm_unpacklo_epi32(*r0, *r1), t1 = _mm_unpacklo_epi32(*r2, *r3);
+    __m128i t2 = _mm_unpackhi_epi32(*r0, *r1), t3 = _mm_unpackhi_epi32(*r2, *r3);
+    *r0 = _mm_unpacklo_epi64(t0, t1);
+    *r1 = _mm_unpackhi_epi64(t0, t1);
+    *r2 = _mm_unpacklo_epi64(t2, t3);
+    *r3 = _mm_unpackhi_epi64(t2, t3);
+}
+#endif
+#endif // GR_SIMD
+
+/* 32 bit surfaces. RGBX keeps the source byte order, BGRA swaps red and blue. */
+
+static inline void fill32(uint32_t* d, int n, uint32_t color, int swap)
+{
+    uint32_t s = swap ? swap_rb(color) : color;
+    uint32_t a = s >> 24;
+    int i = 0;
+
+    if (a == 0)
+        return;
+#ifdef GR_SIMD
+    gr_vec v = vec_set(s);
+    if (a == 255) {
+        for (; i + 4 <= n; i += 4)
+            vec_store(d + i, v);
+    } else {
+        for (; i + 4 <= n; i += 4)
+            vec_store(d + i, vec_blend(vec_load(d + i), v));
+    }
+#endif
+    for (; i < n; i++)
+        d[i] = (a == 255) ? s : blend_px32(d[i], s);
+}
+
+static inline void copy32(uint32_t* d, const uint32_t* src, int n, int swap)
+{
+    int i = 0;
+
+    if (!swap) {
+        memcpy(d, src, n * 4);
+        return;
+    }
+#ifdef GR_SIMD
+    for (; i + 4 <= n; i += 4)
+        vec_store(d + i, vec_swap_rb(vec_load(src + i)));
+#endif
+    for (; i < n; i++)
+        d[i] = swap_rb(src[i]);
+}
+
+static inline void blend32(uint32_t* d, const uint32_t* src, int n, int swap)
+{
+    int i = 0;
+
+#ifdef GR_SIMD
+    // Images are mostly fully opaque or fully clear runs, those skip the math
+    for (; i + 4 <= n; i += 4) {
+        uint32_t all = src[i] & src[i + 1] & src[i + 2] & src[i + 3];
+        uint32_t any = src[i] | src[i + 1] | src[i + 2] | src[i + 3];
+        gr_vec s;
+
+        if ((any >> 24) == 0)
+            continue;
+        s = vec_load(src + i);
+        if (swap)
+            s = vec_swap_rb(s);
+        if ((all >> 24) == 255)
+            vec_store(d + i, s);
+        else
+            vec_store(d + i, vec_blend(vec_load(d + i), s));
+    }
+#endif
+    for (; i < n; i++) {
+        uint32_t s = swap ? swap_rb(src[i]) : src[i];
+        uint32_t a = s >> 24;
+
+        if (a == 255)
+            d[i] = s;
+        else if (a)
+            d[i] = blend_px32(d[i], s);
+    }
+}
+
+static inline void mask32(uint32_t* d, const uint8_t* m, int n, uint32_t color, int swap)
+{
+    uint32_t c = (swap ? swap_rb(color) : color) & 0xffffff;
+    int i = 0;
+
+#ifdef GR_SIMD
+    for (; i + 4 <= n; i += 4) {
+        uint32_t s[4];
+
+        if ((m[i] | m[i + 1] | m[i + 2] | m[i + 3]) == 0)
+            continue;
+        s[0] = c | (m[i] << 24);
+        s[1] = c | (m[i + 1] << 24);
+        s[2] = c | (m[i + 2] << 24);
+        s[3] = c | (m[i + 3] << 24);
+        vec_store(d + i, vec_blend(vec_load(d + i), vec_set4(s)));
+    }
+#endif
+    for (; i < n; i++) {
+        if (m[i] == 255)
+            d[i] = c | 0xff000000;
+        else if (m[i])
+            d[i] = blend_px32(d[i], c | (m[i] << 24));
+    }
+}
+
+static void reverse32(void* dst, const void* src, int n)
+{
+    uint32_t* d = (uint32_t*) dst;
+    const uint32_t* s = (const uint32_t*) src + n;
+    int i = 0;
+
+#ifdef GR_SIMD
+    for (; i + 4 <= n; i += 4)
+        vec_store(d + i, vec_reverse32(vec_load(s - i - 4)));
+#endif
+    for (; i < n; i++)
+        d[i] = *(s - i - 1);
+}
+
+static void fill_rgbx(void* d, int n, uint32_t c)                          { fill32((uint32_t*) d, n, c, 0); }
+static void copy_rgbx(void* d, const uint32_t* s, int n)                   { copy32((uint32_t*) d, s, n, 0); }
+static void blend_rgbx(void* d, const uint32_t* s, int n)                  { blend32((uint32_t*) d, s, n, 0); }
+static void mask_rgbx(void* d, const uint8_t* m, int n, uint32_t c)        { mask32((uint32_t*) d, m, n, c, 0); }
+
+static void fill_bgra(void* d, int n, uint32_t c)                          { fill32((uint32_t*) d, n, c, 1); }
+static void copy_bgra(void* d, const uint32_t* s, int n)                   { copy32((uint32_t*) d, s, n, 1); }
+static void blend_bgra(void* d, const uint32_t* s, int n)                  { blend32((uint32_t*) d, s, n, 1); }
+static void mask_bgra(void* d, const uint8_t* m, int n, uint32_t c)        { mask32((uint32_t*) d, m, n, c, 1); }
+
+/* RGB 565 surfaces, red in the top bits as pixelflinger writes them */
+
+static inline uint16_t pack565(uint32_t p)
+{
+    return ((p & 0xf8) << 8) | ((p & 0xfc00) >> 5) | ((p & 0xf80000) >> 19);
+}
+
+static inline uint16_t blend_px565(uint16_t d, uint32_t s)
+{
+    uint32_t r = (d >> 11) & 0x1f, g = (d >> 5) & 0x3f, b = d & 0x1f;
+    uint32_t d32 = ((r << 3) | (r >> 2)) | (((g << 2) | (g >> 4)) << 8) | (((b << 3) | (b >> 2)) << 16);
+    return pack565(blend_px32(d32, s));
+}
+
+static void fill_565(void* dst, int n, uint32_t color)
+{
+    uint16_t* d = (uint16_t*) dst;
+    uint16_t p = pack565(color);
+    uint32_t a = color >> 24;
+    int i = 0;
+
+    if (a == 0)
+        return;
+    if (a < 255) {
+        for (; i < n; i++)
+            d[i] = blend_px565(d[i], color);
+        return;
+    }
+    // Fill two pixels at a time once the pointer is aligned for it
+    if (((uintptr_t) d & 2) && n > 0)
+        d[i++] = p;
+    uint32_t* d32 = (uint32_t*) (d + i);
+    uint32_t pp = p | ((uint32_t) p << 16);
+    for (; i + 2 <= n; i += 2)
+        *d32++ = pp;
+    if (i < n)
+        d[i] = p;
+}
+
+static void copy_565(void* dst, const uint32_t* s, int n)
+{
+    uint16_t* d = (uint16_t*) dst;
+    int i;
+
+    for (i = 0; i < n; i++)
+        d[i] = pack565(s[i]);
+}
+
+static void blend_565(void* dst, const uint32_t* s, int n)
+{
+    uint16_t* d = (uint16_t*) dst;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        uint32_t a = s[i] >> 24;
+
+        if (a == 255)
+            d[i] = pack565(s[i]);
+        else if (a)
+            d[i] = blend_px565(d[i], s[i]);
+    }
+}
+
+static void mask_565(void* dst, const uint8_t* m, int n, uint32_t color)
+{
+    uint16_t* d = (uint16_t*) dst;
+    uint16_t p = pack565(color);
+    uint32_t c = color & 0xffffff;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (m[i] == 255)
+            d[i] = p;
+        else if (m[i])
+            d[i] = blend_px565(d[i], c | (m[i] << 24));
+    }
+}
+
+static void reverse16(void* dst, const void* src, int n)
+{
+    uint16_t* d = (uint16_t*) dst;
+    const uint16_t* s = (const uint16_t*) src + n;
+    int i = 0;
+
+#ifdef GR_SIMD
+    for (; i + 8 <= n; i += 8)
+        vec_store((uint32_t*) (d + i), vec_reverse16(vec_load((const uint32_t*) (s - i - 8))));
+#endif
+    for (; i < n; i++)
+        d[i] = *(s - i - 1);
+}
+
+static const gr_blitter blitter_rgbx = { 4, fill_rgbx, copy_rgbx, blend_rgbx, mask_rgbx, reverse32 };
+static const gr_blitter blitter_bgra = { 4, fill_bgra, copy_bgra, blend_bgra, mask_bgra, reverse32 };
+static const gr_blitter blitter_565 = { 2, fill_565, copy_565, blend_565, mask_565, reverse16 };
+
+const gr_blitter* gr_get_blitter(int format)
+{
+    switch (format) {
+        case GGL_PIXEL_FORMAT_RGBX_8888:
+        case GGL_PIXEL_FORMAT_RGBA_8888:
+            return &blitter_rgbx;
+        case GGL_PIXEL_FORMAT_BGRA_8888:
+            return &blitter_bgra;
+        case GGL_PIXEL_FORMAT_RGB_565:
+            return &blitter_565;
+    }
+    return NULL;
+}
+
+/* Rotation. The 90 and 270 degree cases walk the destination in tiles so
+ * the source rows being read stay in the cache. */
+
+#define ROTATE_TILE 32
+
+#define ROTATE_PIXELS(type, dst, dst_stride, src, w, h, src_stride, angle, r0, r1, c0, c1)\
+    do {                                                                                \
+        int _r, _c;                                                                     \
+        for (_r = r0; _r < r1; _r++) {                                                  \
+            type* d = (type*) dst + _r * dst_stride;                                    \
+            for (_c = c0; _c < c1; _c++) {                                              \
+                if (angle == 90)                                                        \
+                    d[_c] = ((const type*) src)[(h - 1 - _c) * src_stride + _r];        \
+                else                                                                    \
+                    d[_c] = ((const type*) src)[_c * src_stride + (w - 1 - _r)];        \
+            }                                                                           \
+        }                                                                               \
+    } while (0)
+
+#ifdef GR_SIMD
+// One tile of a 32 bit rotation, 4x4 blocks are moved with vector transposes
+static void rotate_tile32(uint32_t* dst, int dst_stride, const uint32_t* src, int w, int h, int src_stride, int angle, int r0, int r1, int c0, int c1)
+{
+    int r, c;
+
+    for (r = r0; r + 4 <= r1; r += 4) {
+        for (c = c0; c + 4 <= c1; c += 4) {
+            gr_vec v0, v1, v2, v3;
+
+            if (angle == 90) {
+                // Destination columns c..c+3 come from source rows h-1-c down
+                v0 = vec_load(src + (h - 1 - c) * src_stride + r);
+                v1 = vec_load(src + (h - 2 - c) * src_stride + r);
+                v2 = vec_load(src + (h - 3 - c) * src_stride + r);
+                v3 = vec_load(src + (h - 4 - c) * src_stride + r);
+                vec_transpose(&v0, &v1, &v2, &v3);
+            } else {
+                // Destination rows r..r+3 come from source columns w-1-r down
+                gr_vec t0 = vec_load(src + c * src_stride + w - 4 - r);
+                gr_vec t1 = vec_load(src + (c + 1) * src_stride + w - 4 - r);
+                gr_vec t2 = vec_load(src + (c + 2) * src_stride + w - 4 - r);
+                gr_vec t3 = vec_load(src + (c + 3) * src_stride + w - 4 - r);
+                vec_transpose(&t0, &t1, &t2, &t3);
+                v0 = t3;
+                v1 = t2;
+                v2 = t1;
+                v3 = t0;
+            }
+            vec_store(dst + r * dst_stride + c, v0);
+            vec_store(dst + (r + 1) * dst_stride + c, v1);
+            vec_store(dst + (r + 2) * dst_stride + c, v2);
+            vec_store(dst + (r + 3) * dst_stride + c, v3);
+        }
+        if (c < c1)
+            ROTATE_PIXELS(uint32_t, dst, dst_stride, src, w, h, src_stride, angle, r, r + 4, c, c1);
+    }
+    if (r < r1)
+        ROTATE_PIXELS(uint32_t, dst, dst_stride, src, w, h, src_stride, angle, r, r1, c0, c1);
+}
+#endif
+
+void gr_rotate_surface(void* dst, int dst_stride, const void* src, int src_width, int src_height, int src_stride, int pixel_size, int angle)
+{
+    int r, c;
+
+    if (angle == 0 || angle == 180) {
+        const gr_blitter* b = (pixel_size == 4) ? &blitter_rgbx : &blitter_565;
+
+        for (r = 0; r < src_height; r++) {
+            unsigned char* d = (unsigned char*) dst + r * dst_stride * pixel_size;
+            if (angle == 0) {
+                memcpy(d, (const unsigned char*) src + r * src_stride * pixel_size, src_width * pixel_size);
+            } else {
+                b->reverse(d, (const unsigned char*) src + (src_height - 1 - r) * src_stride * pixel_size, src_width);
+            }
+        }
+        return;
+    }
+
+    // The destination is src_height wide and src_width tall
+    for (r = 0; r < src_width; r += ROTATE_TILE) {
+        int r1 = (r + ROTATE_TILE < src_width) ? r + ROTATE_TILE : src_width;
+        for (c = 0; c < src_height; c += ROTATE_TILE) {
+            int c1 = (c + ROTATE_TILE < src_height) ? c + ROTATE_TILE : src_height;
+            if (pixel_size == 4) {
+#ifdef GR_SIMD
+                rotate_tile32((uint32_t*) dst, dst_stride, (const uint32_t*) src, src_width, src_height, src_stride, angle, r, r1, c, c1);
+#else
+                ROTATE_PIXELS(uint32_t, dst, dst_stride, src, src_width, src_height, src_stride, angle, r, r1, c, c1);
+#endif
+            } else {
+                ROTATE_PIXELS(uint16_t, dst, dst_stride, src, src_width, src_height, src_stride, angle, r, r1, c, c1);
+            }
+        }
+    }
+}
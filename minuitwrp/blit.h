@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2013 TeamWin Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MINUI_BLIT_H_
+#define _MINUI_BLIT_H_
+
+#include <stdint.h>
+
+// Span kernels for drawing straight into the in-memory surface without
+// going through pixelflinger. Colors and source pixels are 32 bit RGBA in
+// memory order (r | g << 8 | b << 16 | a << 24), the kernels convert them
+// to the format of the surface they draw into.
+typedef struct {
+    int pixel_size;
+    void (*fill)(void* dst, int count, uint32_t color);                    // Blends when the color's alpha is below 255
+    void (*copy)(void* dst, const uint32_t* src, int count);               // Opaque source, alpha ignored
+    void (*blend)(void* dst, const uint32_t* src, int count);              // Source alpha blended over dst
+    void (*mask)(void* dst, const uint8_t* mask, int count, uint32_t color); // 8 bit coverage, as for font glyphs
+    void (*reverse)(void* dst, const void* src, int count);                // dst gets src back to front
+} gr_blitter;
+
+// Kernels for a GGL_PIXEL_FORMAT_* surface, NULL if there are none
+const gr_blitter* gr_get_blitter(int format);
+
+// Copies a surface rotated clockwise by 90, 180 or 270 degrees, strides are
+// in pixels
+void gr_rotate_surface(void* dst, int dst_stride, const void* src, int src_width, int src_height, int src_stride, int pixel_size, int angle);
+
+#endif
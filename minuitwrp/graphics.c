@@ -16,7 +16,9 @@
 
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include <fcntl.h>
 #include <stdio.h>
@@ -31,6 +33,7 @@
 #include <pixelflinger/pixelflinger.h>
 
 #include "minui.h"
+#include "blit.h"
 
 #ifdef BOARD_USE_CUSTOM_RECOVERY_FONT
 #include BOARD_USE_CUSTOM_RECOVERY_FONT
@@ -60,8 +63,32 @@ typedef struct {
     unsigned offset[97];
     unsigned cheight;
     unsigned ascent;
+    unsigned id;                // Tells fonts apart in the layout cache
 } GRFont;
 
+/* A glyph run, the glyphs of a string as strips of the font texture */
+typedef struct {
+    unsigned short x;
+    unsigned short width;
+} GRGlyph;
+
+/* Text layouts are cached by font and string, the GUI draws and measures
+ * the same strings every frame */
+#define LAYOUT_CACHE_SIZE 1024
+
+typedef struct {
+    unsigned font_id;
+    uint32_t hash;
+    char *text;
+    int width;
+    int count;
+    GRGlyph *glyphs;
+} GRLayout;
+
+static GRLayout gr_layouts[LAYOUT_CACHE_SIZE];
+static pthread_mutex_t gr_layout_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned gr_next_font_id = 1;
+
 static GRFont *gr_font = 0;
 static GGLContext *gr_context = 0;
 static GGLSurface gr_font_texture;
@@ -70,8 +97,9 @@ static GGLSurface gr_mem_surface;
 static unsigned gr_active_fb = 0;
 static unsigned double_buffering = 0;
 static int gr_rotation = 0; // angle - 0, 90, 180, 270
-static uint8_t **gr_rot_helpers = NULL;
 static int gr_freeze = 0;
+static const gr_blitter *gr_blitter_ops = NULL;
+static uint32_t gr_current_color = 0xffffffff; // RGBA, as the blitter takes it
 
 static int gr_fb_fd = -1;
 static int gr_vt_fd = -1;
@@ -256,34 +284,25 @@ void gr_flip(void)
     if(gr_freeze)
         return;
 
-    GGLContext *gl = gr_context;
-
     /* swap front and back buffers */
     if (double_buffering)
         gr_active_fb = (gr_active_fb + 1) & 1;
 
+    /* copy data from the in-memory surface to the buffer we're about
+     * to make active, rotating it on the way if needed. */
 #ifdef BOARD_HAS_FLIPPED_SCREEN
     /* flip buffer 180 degrees for devices with physicaly inverted screens */
-    unsigned int i;
-    unsigned int j;
-    uint8_t tmp;
-    for (i = 0; i < ((vi.xres_virtual * vi.yres)/2); i++) {
-	for (j = 0; j < PIXEL_SIZE; j++) {
-		tmp = gr_mem_surface.data[i * PIXEL_SIZE + j];
-		gr_mem_surface.data[i * PIXEL_SIZE + j] = gr_mem_surface.data[(vi.xres_virtual * vi.yres * PIXEL_SIZE) - ((i+1) * PIXEL_SIZE) + j];
-		gr_mem_surface.data[(vi.xres_virtual * vi.yres * PIXEL_SIZE) - ((i+1) * PIXEL_SIZE) + j] = tmp;
-	}
-    }
-#endif
-
-    /* copy data from the in-memory surface to the buffer we're about
-     * to make active. */
-#ifndef TW_HAS_LANDSCAPE
-    memcpy(gr_framebuffer[gr_active_fb].data, gr_mem_surface.data,
-           vi.xres_virtual * vi.yres * PIXEL_SIZE);
+    int angle = (gr_rotation + 180) % 360;
 #else
-    gr_cpy_fb_with_rotation(gr_framebuffer[gr_active_fb].data, gr_mem_surface.data);
+    int angle = gr_rotation;
 #endif
+    if (angle == 0 && gr_mem_surface.stride == vi.xres_virtual)
+        memcpy(gr_framebuffer[gr_active_fb].data, gr_mem_surface.data,
+               vi.xres_virtual * vi.yres * PIXEL_SIZE);
+    else
+        gr_rotate_surface(gr_framebuffer[gr_active_fb].data, vi.xres_virtual,
+                          gr_mem_surface.data, gr_mem_surface.width, gr_mem_surface.height,
+                          gr_mem_surface.stride, PIXEL_SIZE, angle);
 
     /* inform the display driver */
     set_active_framebuffer(gr_active_fb);
@@ -298,23 +317,163 @@ void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a
     color[2] = ((b << 8) | b) + 1;
     color[3] = ((a << 8) | a) + 1;
     gl->color4xv(gl, color);
+    gr_current_color = r | (g << 8) | (b << 16) | ((uint32_t) a << 24);
+}
+
+/* Draws straight into the memory surface when there are kernels for its
+ * format and the source's, returns 0 if pixelflinger has to do it. */
+static int gr_native_blit(GGLSurface *src, int sx, int sy, int w, int h, int dx, int dy)
+{
+    const gr_blitter *b = gr_blitter_ops;
+    unsigned char *dst;
+    int y;
+
+    if (!b || (src->format != GGL_PIXEL_FORMAT_RGBA_8888 &&
+            src->format != GGL_PIXEL_FORMAT_RGBX_8888 &&
+            src->format != GGL_PIXEL_FORMAT_A_8))
+        return 0;
+
+    /* clip to both surfaces */
+    if (dx < 0) { sx -= dx; w += dx; dx = 0; }
+    if (dy < 0) { sy -= dy; h += dy; dy = 0; }
+    if (sx < 0) { dx -= sx; w += sx; sx = 0; }
+    if (sy < 0) { dy -= sy; h += sy; sy = 0; }
+    if (dx + w > (int) gr_mem_surface.width)    w = gr_mem_surface.width - dx;
+    if (dy + h > (int) gr_mem_surface.height)   h = gr_mem_surface.height - dy;
+    if (sx + w > (int) src->width)              w = src->width - sx;
+    if (sy + h > (int) src->height)             h = src->height - sy;
+    if (w <= 0 || h <= 0)
+        return 1;
+
+    dst = gr_mem_surface.data + (dy * gr_mem_surface.stride + dx) * b->pixel_size;
+    for (y = 0; y < h; y++) {
+        if (src->format == GGL_PIXEL_FORMAT_A_8) {
+            const uint8_t *row = src->data + (sy + y) * src->stride + sx;
+            b->mask(dst, row, w, gr_current_color);
+        } else {
+            const uint32_t *row = (const uint32_t*) src->data + (sy + y) * src->stride + sx;
+            if (src->format == GGL_PIXEL_FORMAT_RGBX_8888)
+                b->copy(dst, row, w);
+            else
+                b->blend(dst, row, w);
+        }
+        dst += gr_mem_surface.stride * b->pixel_size;
+    }
+    return 1;
+}
+
+static void gr_blit_rect(GGLSurface *src, int sx, int sy, int w, int h, int dx, int dy)
+{
+    if (gr_native_blit(src, sx, sy, w, h, dx, dy))
+        return;
+
+    GGLContext *gl = gr_context;
+    gl->bindTexture(gl, src);
+    gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
+    gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
+    gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
+    gl->enable(gl, GGL_TEXTURE_2D);
+    gl->texCoord2i(gl, sx - dx, sy - dy);
+    gl->recti(gl, dx, dy, dx + w, dy + h);
+}
+
+/* Returns the next code point of a UTF-8 string, bytes that aren't part of
+ * a valid sequence come back on their own */
+static uint32_t utf8_next(const unsigned char **s)
+{
+    static const uint32_t utf8_min[4] = { 0, 0x80, 0x800, 0x10000 };
+    const unsigned char *p = *s;
+    uint32_t cp = p[0];
+    int extra = 0, i;
+
+    if (p[0] >= 0xf8)           extra = 0;
+    else if (p[0] >= 0xf0)      { cp &= 0x07; extra = 3; }
+    else if (p[0] >= 0xe0)      { cp &= 0x0f; extra = 2; }
+    else if (p[0] >= 0xc0)      { cp &= 0x1f; extra = 1; }
+
+    for (i = 1; i <= extra; i++) {
+        if ((p[i] & 0xc0) != 0x80)
+            break;
+        cp = (cp << 6) | (p[i] & 0x3f);
+    }
+    /* overlong forms would sneak ASCII past the byte checks */
+    if (i <= extra || cp < utf8_min[extra]) {
+        *s = p + 1;
+        return p[0];
+    }
+    *s = p + 1 + extra;
+    return cp;
+}
+
+/* The font files only have the printable ASCII glyphs, anything else takes
+ * no space, as it always has */
+static int gr_find_glyph(GRFont *font, uint32_t cp, GRGlyph *glyph)
+{
+    if (cp < 32 || cp - 32 >= 96)
+        return 0;
+    glyph->x = font->offset[cp - 32];
+    glyph->width = font->offset[cp - 31] - font->offset[cp - 32];
+    return 1;
+}
+
+/* Finds or builds the layout of a string, call with gr_layout_lock held */
+static GRLayout* gr_get_layout(GRFont *font, const char *s)
+{
+    const unsigned char *p;
+    uint32_t hash = 2166136261u ^ font->id;
+    GRLayout *layout;
+    GRGlyph glyph;
+    int len;
+
+    for (p = (const unsigned char*) s; *p; p++)
+        hash = (hash ^ *p) * 16777619u;
+    len = p - (const unsigned char*) s;
+
+    layout = &gr_layouts[hash % LAYOUT_CACHE_SIZE];
+    if (layout->text && layout->hash == hash && layout->font_id == font->id &&
+            strcmp(layout->text, s) == 0)
+        return layout;
+
+    free(layout->text);
+    free(layout->glyphs);
+    layout->text = malloc(len + 1);
+    layout->glyphs = malloc(len * sizeof(GRGlyph) + 1);
+    if (!layout->text || !layout->glyphs) {
+        free(layout->text);
+        free(layout->glyphs);
+        layout->text = NULL;
+        layout->glyphs = NULL;
+        return NULL;
+    }
+    memcpy(layout->text, s, len + 1);
+    layout->font_id = font->id;
+    layout->hash = hash;
+    layout->width = 0;
+    layout->count = 0;
+
+    p = (const unsigned char*) s;
+    while (*p) {
+        if (gr_find_glyph(font, utf8_next(&p), &glyph)) {
+            layout->glyphs[layout->count++] = glyph;
+            layout->width += glyph.width;
+        }
+    }
+    return layout;
 }
 
 int gr_measureEx(const char *s, void* font)
 {
     GRFont* fnt = (GRFont*) font;
+    GRLayout *layout;
     int total = 0;
-    unsigned pos;
-    unsigned off;
 
     if (!fnt)   fnt = gr_font;
 
-    while ((off = *s++))
-    {
-        off -= 32;
-        if (off < 96)
-            total += (fnt->offset[off+1] - fnt->offset[off]);
-    }
+    pthread_mutex_lock(&gr_layout_lock);
+    layout = gr_get_layout(fnt, s);
+    if (layout)
+        total = layout->width;
+    pthread_mutex_unlock(&gr_layout_lock);
     return total;
 }
 
@@ -333,136 +492,81 @@ unsigned character_width(const char *s, void* pFont)
 	return font->offset[off+1] - font->offset[off];
 }
 
-int gr_textEx(int x, int y, const char *s, void* pFont)
+/* Draws a string, clipped to max_width and max_height when they're not -1 */
+static int gr_draw_layout(int x, int y, const char *s, GRFont *font, int max_width, int max_height)
 {
-    GGLContext *gl = gr_context;
-    GRFont *font = (GRFont*) pFont;
-    unsigned off;
-    unsigned cwidth;
+    GRLayout *layout;
+    int i, h = font->cheight;
 
-    /* Handle default font */
-    if (!font)  font = gr_font;
+    if (max_height != -1 && y + h > max_height)
+        h = max_height - y;
 
-    gl->bindTexture(gl, &font->texture);
-    gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
-    gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
-    gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
-    gl->enable(gl, GGL_TEXTURE_2D);
+    pthread_mutex_lock(&gr_layout_lock);
+    layout = gr_get_layout(font, s);
+    for (i = 0; layout && i < layout->count; i++) {
+        GRGlyph *glyph = &layout->glyphs[i];
 
-    while((off = *s++)) {
-        off -= 32;
-        cwidth = 0;
-        if (off < 96) {
-            cwidth = font->offset[off+1] - font->offset[off];
-			gl->texCoord2i(gl, (font->offset[off]) - x, 0 - y);
-			gl->recti(gl, x, y, x + cwidth, y + font->cheight);
-			x += cwidth;
+        if (max_width != -1 && x + glyph->width >= max_width) {
+            gr_blit_rect(&font->texture, glyph->x, 0, max_width - x, h, x, y);
+            if (max_height == -1) {
+                x = max_width;
+                break;
+            }
+            x += glyph->width;
+            if (x > max_width)
+                break;
+            continue;
         }
+        gr_blit_rect(&font->texture, glyph->x, 0, glyph->width, h, x, y);
+        x += glyph->width;
     }
-
+    pthread_mutex_unlock(&gr_layout_lock);
     return x;
 }
 
-int gr_textExW(int x, int y, const char *s, void* pFont, int max_width)
+int gr_textEx(int x, int y, const char *s, void* pFont)
 {
-    GGLContext *gl = gr_context;
     GRFont *font = (GRFont*) pFont;
-    unsigned off;
-    unsigned cwidth;
 
     /* Handle default font */
     if (!font)  font = gr_font;
 
-    gl->bindTexture(gl, &font->texture);
-    gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
-    gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
-    gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
-    gl->enable(gl, GGL_TEXTURE_2D);
+    return gr_draw_layout(x, y, s, font, -1, -1);
+}
 
-    while((off = *s++)) {
-        off -= 32;
-        cwidth = 0;
-        if (off < 96) {
-            cwidth = font->offset[off+1] - font->offset[off];
-			if ((x + (int)cwidth) < max_width) {
-				gl->texCoord2i(gl, (font->offset[off]) - x, 0 - y);
-				gl->recti(gl, x, y, x + cwidth, y + font->cheight);
-				x += cwidth;
-			} else {
-				gl->texCoord2i(gl, (font->offset[off]) - x, 0 - y);
-				gl->recti(gl, x, y, max_width, y + font->cheight);
-				x = max_width;
-				return x;
-			}
-        }
-    }
+int gr_textExW(int x, int y, const char *s, void* pFont, int max_width)
+{
+    GRFont *font = (GRFont*) pFont;
 
-    return x;
+    /* Handle default font */
+    if (!font)  font = gr_font;
+
+    return gr_draw_layout(x, y, s, font, max_width, -1);
 }
 
 int gr_textExWH(int x, int y, const char *s, void* pFont, int max_width, int max_height)
 {
-    GGLContext *gl = gr_context;
     GRFont *font = (GRFont*) pFont;
-    unsigned off;
-    unsigned cwidth;
-	int rect_x, rect_y;
 
     /* Handle default font */
     if (!font)  font = gr_font;
 
-    gl->bindTexture(gl, &font->texture);
-    gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
-    gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
-    gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
-    gl->enable(gl, GGL_TEXTURE_2D);
-
-    while((off = *s++)) {
-        off -= 32;
-        cwidth = 0;
-        if (off < 96) {
-            cwidth = font->offset[off+1] - font->offset[off];
-			if ((x + (int)cwidth) < max_width)
-				rect_x = x + cwidth;
-			else
-				rect_x = max_width;
-			if (y + font->cheight < (unsigned int)(max_height))
-				rect_y = y + font->cheight;
-			else
-				rect_y = max_height;
-
-			gl->texCoord2i(gl, (font->offset[off]) - x, 0 - y);
-			gl->recti(gl, x, y, rect_x, rect_y);
-			x += cwidth;
-			if (x > max_width)
-				return x;
-        }
-    }
-
-    return x;
+    return gr_draw_layout(x, y, s, font, max_width, max_height);
 }
 
 int twgr_text(int x, int y, const char *s)
 {
-    GGLContext *gl = gr_context;
     GRFont *font = gr_font;
     unsigned off;
     unsigned cwidth = 0;
 
     y -= font->ascent;
 
-    gl->bindTexture(gl, &font->texture);
-    gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
-    gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
-    gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
-    gl->enable(gl, GGL_TEXTURE_2D);
-
     while((off = *s++)) {
         off -= 32;
         if (off < 96) {
             cwidth = font->offset[off+1] - font->offset[off];
-            gl->texCoord2i(gl, (off * cwidth) - x, 0 - y);
-            gl->recti(gl, x, y, x + cwidth, y + font->cheight);
+            gr_blit_rect(&font->texture, off * cwidth, 0, cwidth, font->cheight, x, y);
         }
         x += cwidth;
     }
@@ -472,6 +576,26 @@ int twgr_text(int x, int y, const char *s)
 
 void gr_fill(int x, int y, int w, int h)
 {
+    const gr_blitter *b = gr_blitter_ops;
+
+    if (b) {
+        unsigned char *dst;
+
+        if (x < 0) { w += x; x = 0; }
+        if (y < 0) { h += y; y = 0; }
+        if (x + w > (int) gr_mem_surface.width)     w = gr_mem_surface.width - x;
+        if (y + h > (int) gr_mem_surface.height)    h = gr_mem_surface.height - y;
+        if (w <= 0 || h <= 0)
+            return;
+
+        dst = gr_mem_surface.data + (y * gr_mem_surface.stride + x) * b->pixel_size;
+        while (h--) {
+            b->fill(dst, w, gr_current_color);
+            dst += gr_mem_surface.stride * b->pixel_size;
+        }
+        return;
+    }
+
     GGLContext *gl = gr_context;
     gl->disable(gl, GGL_TEXTURE_2D);
     gl->recti(gl, x, y, x + w, y + h);
@@ -482,14 +606,7 @@ void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy) {
         return;
     }
 
-    GGLContext *gl = gr_context;
-    gl->bindTexture(gl, (GGLSurface*) source);
-    gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
-    gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
-    gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
-    gl->enable(gl, GGL_TEXTURE_2D);
-    gl->texCoord2i(gl, sx - dx, sy - dy);
-    gl->recti(gl, dx, dy, dx + w, dy + h);
+    gr_blit_rect((GGLSurface*) source, sx, sy, w, h, dx, dy);
 }
 
 unsigned int gr_get_width(gr_surface surface) {
@@ -568,6 +685,7 @@ void* gr_loadFont(const char* fontName)
     ftex->format = GGL_PIXEL_FORMAT_A_8;
     font->cheight = height;
     font->ascent = height - 2;
+    font->id = __sync_fetch_and_add(&gr_next_font_id, 1);
     return (void*) font;
 }
 
@@ -632,6 +750,7 @@ static void gr_init_font(void)
     ftex->format = GGL_PIXEL_FORMAT_A_8;
     gr_font->cheight = height;
     gr_font->ascent = height - 2;
+    gr_font->id = __sync_fetch_and_add(&gr_next_font_id, 1);
     return;
 }
 
@@ -659,6 +778,7 @@ int gr_init(void)
     }
 
     get_memory_surface(&gr_mem_surface);
+    gr_blitter_ops = gr_get_blitter(gr_mem_surface.format);
 
     fprintf(stderr, "framebuffer: fd %d (%d x %d)\n",
             gr_fb_fd, gr_framebuffer[0].width, gr_framebuffer[0].height);
@@ -685,8 +805,6 @@ void gr_exit(void)
 
     free(gr_mem_surface.data);
 
-    free(gr_rot_helpers);
-
     ioctl(gr_vt_fd, KDSETMODE, (void*) KD_TEXT);
     close(gr_vt_fd);
     gr_vt_fd = -1;
@@ -771,39 +889,8 @@ int gr_get_rotation(void)
 #ifdef TW_HAS_LANDSCAPE
 void gr_cpy_fb_with_rotation(void *dst, void *src)
 {
-    switch(gr_rotation)
-    {
-        case 0:
-            memcpy(dst, src, vi.xres_virtual * vi.yres * PIXEL_SIZE);
-            break;
-        case 90:
-        {
-#if PIXEL_SIZE == 4
-            gr_rotate_90deg_4b((uint32_t*)dst, (uint32_t*)src);
-#elif PIXEL_SIZE == 2
-            gr_rotate_90deg_2b((uint16_t*)dst, (uint16_t*)src);
-#endif
-            break;
-        }
-        case 180:
-        {
-#if PIXEL_SIZE == 4
-            gr_rotate_180deg_4b((uint32_t*)dst, (uint32_t*)src);
-#elif PIXEL_SIZE == 2
-            gr_rotate_180deg_2b((uint16_t*)dst, (uint16_t*)src);
-#endif
-            break;
-        }
-        case 270:
-        {
-#if PIXEL_SIZE == 4
-            gr_rotate_270deg_4b((uint32_t*)dst, (uint32_t*)src);
-#elif PIXEL_SIZE == 2
-            gr_rotate_270deg_2b((uint16_t*)dst, (uint16_t*)src);
-#endif
-            break;
-        }
-    }
+    gr_rotate_surface(dst, vi.xres_virtual, src, gr_mem_surface.width,
+                      gr_mem_surface.height, gr_mem_surface.stride, PIXEL_SIZE, gr_rotation);
 }
 
 void gr_update_surface_dimensions()
@@ -827,116 +914,6 @@ void gr_update_surface_dimensions()
     gl->colorBuffer(gl, &gr_mem_surface);
 }
 
-void gr_rotate_90deg_4b(uint32_t *dst, uint32_t *src)
-{
-    uint32_t i;
-    int32_t x;
-
-    if(!gr_rot_helpers)
-        gr_rot_helpers = malloc(gr_mem_surface.height*sizeof(uint32_t*));
-
-    uint32_t **helpers = (uint32_t**)gr_rot_helpers;
-
-    helpers[0] = src;
-    for(i = 1; i < gr_mem_surface.height; ++i)
-        helpers[i] = helpers[i-1] + gr_mem_surface.width;
-
-    for(i = 0; i < gr_mem_surface.width; ++i)
-    {
-        for(x = gr_mem_surface.height-1; x >= 0; --x)
-            *dst++ = *(helpers[x]++);
-        dst += vi.xres_virtual - vi.xres;
-    }
-}
-
-void gr_rotate_90deg_2b(uint16_t *dst, uint16_t *src)
-{
-    uint32_t i;
-    int32_t x;
-
-    if(!gr_rot_helpers)
-        gr_rot_helpers = malloc(gr_mem_surface.height*sizeof(uint16_t*));
-
-    uint16_t **helpers = (uint16_t**)gr_rot_helpers;
-
-    helpers[0] = src;
-    for(i = 1; i < gr_mem_surface.height; ++i)
-        helpers[i] = helpers[i-1] + gr_mem_surface.width;
-
-    for(i = 0; i < gr_mem_surface.width; ++i)
-    {
-        for(x = gr_mem_surface.height-1; x >= 0; --x)
-            *dst++ = *(helpers[x]++);
-        dst += vi.xres_virtual - vi.xres;
-    }
-}
-
-void gr_rotate_270deg_4b(uint32_t *dst, uint32_t *src)
-{
-    if(!gr_rot_helpers)
-        gr_rot_helpers = malloc(gr_mem_surface.height*sizeof(uint32_t*));
-
-    uint32_t i, x;
-    uint32_t **helpers = (uint32_t**)gr_rot_helpers;
-
-    helpers[0] = src + gr_mem_surface.width-1;
-    for(i = 1; i < gr_mem_surface.height; ++i)
-        helpers[i] = helpers[i-1] + gr_mem_surface.width;
-
-    for(i = 0; i < gr_mem_surface.width; ++i)
-    {
-        for(x = 0; x < gr_mem_surface.height; ++x)
-            *dst++ = *(helpers[x]--);
-        dst += vi.xres_virtual - vi.xres;
-    }
-}
-
-void gr_rotate_270deg_2b(uint16_t *dst, uint16_t *src)
-{
-    if(!gr_rot_helpers)
-        gr_rot_helpers = malloc(gr_mem_surface.height*sizeof(uint16_t*));
-
-    uint32_t i, x;
-    uint16_t **helpers = (uint16_t**)gr_rot_helpers;
-
-    helpers[0] = src + gr_mem_surface.width-1;
-    for(i = 1; i < gr_mem_surface.height; ++i)
-        helpers[i] = helpers[i-1] + gr_mem_surface.width;
-
-    for(i = 0; i < gr_mem_surface.width; ++i)
-    {
-        for(x = 0; x < gr_mem_surface.height; ++x)
-            *dst++ = *(helpers[x]--);
-        dst += vi.xres_virtual - vi.xres;
-    }
-}
-
-void gr_rotate_180deg_4b(uint32_t *dst, uint32_t *src)
-{
-    uint32_t i, x;
-    int len = vi.xres * vi.yres;
-    src += len;
-    for(i = 0; i < gr_mem_surface.height; ++i)
-    {
-        for(x = 0; x < gr_mem_surface.width; ++x)
-            *dst++ = *src--;
-        dst += vi.xres_virtual - vi.xres;
-    }
-}
-
-void gr_rotate_180deg_2b(uint16_t *dst, uint16_t *src)
-{
-    uint32_t i, x;
-    int len = vi.xres * vi.yres;
-    src += len;
-    for(i = 0; i < gr_mem_surface.height; ++i)
-    {
-        for(x = 0; x < gr_mem_surface.width; ++x)
-            *dst++ = *src--;
-        dst += vi.xres_virtual - vi.xres;
-    }
-}
-
 #endif // TW_HAS_LANDSCAPE
 
 void gr_freeze_fb(int freeze)
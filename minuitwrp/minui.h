@@ -17,6 +17,8 @@
 #ifndef _MINUI_H_
 #define _MINUI_H_
 
+#include <stddef.h>
+
 typedef void* gr_surface;
 typedef unsigned short gr_pixel;
 
@@ -60,12 +62,6 @@ void gr_update_surface_dimensions(void);
 
 #ifdef TW_HAS_LANDSCAPE
 inline void gr_cpy_fb_with_rotation(void *dst, void *src);
-inline void gr_rotate_90deg_4b(uint32_t *dst, uint32_t *src);
-inline void gr_rotate_90deg_2b(uint16_t *dst, uint16_t *src);
-inline void gr_rotate_270deg_4b(uint32_t *dst, uint32_t *src);
-inline void gr_rotate_270deg_2b(uint16_t *dst, uint16_t *src);
-inline void gr_rotate_180deg_4b(uint32_t *dst, uint32_t *src);
-inline void gr_rotate_180deg_2b(uint16_t *dst, uint16_t *src);
 #endif
 
 // input event structure, include <linux/input.h> for the definition.
@@ -80,6 +76,14 @@ int ev_get(struct input_event *ev, unsigned dont_wait);
 
 // Returns 0 if no error, else negative.
 int res_create_surface(const char* name, gr_surface* pSurface);
+// Decodes a PNG or JPG image already in memory, safe to call from multiple threads.
+int res_create_surface_mem(const unsigned char* data, size_t length, gr_surface* pSurface);
+// Finds the file res_create_surface would load for name.
+int res_surface_path(const char* name, char* path, size_t length);
+// Surface cache files: the decoded pixels in a form that can be read
+// back in later. The key must match for a cached surface to be used.
+int res_save_surface(const char* path, const char* key, gr_surface surface);
+int res_load_surface(const char* path, const char* key, gr_surface* pSurface);
 void res_free_surface(gr_surface surface);
 
 // Needed for AOSP:
@@ -15,6 +15,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <fcntl.h>
@@ -22,7 +23,11 @@
 
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 
 #include <linux/fb.h>
 #include <linux/kd.h>
@@ -42,37 +47,82 @@ double pow(double x, double y) {
     return x;
 }
 
-int res_create_surface_png(const char* name, gr_surface* pSurface) {
+// Surface cache file layout: this header, the key string, then the pixel
+// data at dataOffset so it can be read straight in and blitted as is
+#define SURFACE_CACHE_MAGIC     0x46535754 /* "TWSF" */
+#define SURFACE_CACHE_VERSION   1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t keyLength;
+    uint32_t format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t dataOffset;
+} SurfaceCacheHeader;
+
+// Opens an image by name, or from the theme images in the ramdisk.
+// resPath receives the path that was tried last.
+static FILE* res_open_image(const char* name, const char* ext, char* resPath, size_t len) {
+    FILE* fp = fopen(name, "rb");
+    if (fp != NULL) {
+        snprintf(resPath, len, "%s", name);
+        return fp;
+    }
+
+#ifndef TW_HAS_LANDSCAPE
+    snprintf(resPath, len, "/res/images/%s%s", name, ext);
+#else
+    if(gr_get_rotation()%180 == 0)
+        snprintf(resPath, len, "/res/images/%s%s", name, ext);
+    else
+        snprintf(resPath, len, "/res/landscape/images/%s%s", name, ext);
+#endif
+    return fopen(resPath, "rb");
+}
+
+// In-memory image source, used to decode images straight out of a
+// theme zip without extracting them to a file first
+typedef struct {
+    const unsigned char* data;
+    size_t length;
+    size_t offset;
+} MemSource;
+
+static void png_read_mem(png_structp png_ptr, png_bytep out, png_size_t length) {
+    MemSource* mem = (MemSource*) png_get_io_ptr(png_ptr);
+
+    if (mem->length - mem->offset < length) {
+        png_error(png_ptr, "Read past end of image data");
+        return;
+    }
+    memcpy(out, mem->data + mem->offset, length);
+    mem->offset += length;
+}
+
+// Decodes a PNG from either fp or mem
+static int res_read_png(FILE* fp, MemSource* mem, gr_surface* pSurface) {
     GGLSurface* surface = NULL;
     int result = 0;
     unsigned char header[8];
     png_structp png_ptr = NULL;
     png_infop info_ptr = NULL;
 
-    FILE* fp = fopen(name, "rb");
-    if (fp == NULL) {
-        char resPath[256];
-#ifndef TW_HAS_LANDSCAPE
-        snprintf(resPath, sizeof(resPath)-1, "/res/images/%s.png", name);
-#else
-        if(gr_get_rotation()%180 == 0)
-            snprintf(resPath, sizeof(resPath)-1, "/res/images/%s.png", name);
-        else
-            snprintf(resPath, sizeof(resPath)-1, "/res/landscape/images/%s.png", name);
-#endif
-        resPath[sizeof(resPath)-1] = '\0';
-        fp = fopen(resPath, "rb");
-        if (fp == NULL)
-        {
-            result = -1;
+    if (fp) {
+        size_t bytesRead = fread(header, 1, sizeof(header), fp);
+        if (bytesRead != sizeof(header)) {
+            result = -2;
             goto exit;
         }
-    }
-
-    size_t bytesRead = fread(header, 1, sizeof(header), fp);
-    if (bytesRead != sizeof(header)) {
-        result = -2;
-        goto exit;
+    } else {
+        if (mem->length < sizeof(header)) {
+            result = -2;
+            goto exit;
+        }
+        memcpy(header, mem->data, sizeof(header));
+        mem->offset = sizeof(header);
     }
 
     if (png_sig_cmp(header, 0, sizeof(header))) {
@@ -99,7 +149,10 @@ int res_create_surface_png(const char* name, gr_surface* pSurface) {
 
     png_set_packing(png_ptr);
 
-    png_init_io(png_ptr, fp);
+    if (fp)
+        png_init_io(png_ptr, fp);
+    else
+        png_set_read_fn(png_ptr, mem, png_read_mem);
     png_set_sig_bytes(png_ptr, sizeof(header));
     png_read_info(png_ptr, info_ptr);
 
@@ -115,7 +168,7 @@ int res_create_surface_png(const char* name, gr_surface* pSurface) {
           ((channels == 3 && color_type == PNG_COLOR_TYPE_RGB) ||
            (channels == 4 && color_type == PNG_COLOR_TYPE_RGBA) ||
            (channels == 1 && color_type == PNG_COLOR_TYPE_PALETTE)))) {
-        return -7;
+        result = -7;
         goto exit;
     }
 
@@ -169,9 +222,6 @@ int res_create_surface_png(const char* name, gr_surface* pSurface) {
 exit:
     png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
 
-    if (fp != NULL) {
-        fclose(fp);
-    }
     if (result < 0) {
         if (surface) {
             free(surface);
@@ -180,40 +230,73 @@ exit:
     return result;
 }
 
-int res_create_surface_jpg(const char* name, gr_surface* pSurface) {
+int res_create_surface_png(const char* name, gr_surface* pSurface) {
+    char resPath[256];
+    int result;
+
+    FILE* fp = res_open_image(name, ".png", resPath, sizeof(resPath));
+    if (fp == NULL)
+        return -1;
+
+    result = res_read_png(fp, NULL, pSurface);
+    fclose(fp);
+    return result;
+}
+
+static void jpg_init_source(j_decompress_ptr cinfo) {
+}
+
+static boolean jpg_fill_input_buffer(j_decompress_ptr cinfo) {
+    // Out of data, feed the decoder an EOI marker like jdatasrc.c does
+    static const JOCTET eoi[2] = { 0xFF, JPEG_EOI };
+
+    cinfo->src->next_input_byte = eoi;
+    cinfo->src->bytes_in_buffer = 2;
+    return TRUE;
+}
+
+static void jpg_skip_input_data(j_decompress_ptr cinfo, long num_bytes) {
+    if (num_bytes <= 0)
+        return;
+    if ((size_t) num_bytes > cinfo->src->bytes_in_buffer)
+        num_bytes = cinfo->src->bytes_in_buffer;
+    cinfo->src->next_input_byte += num_bytes;
+    cinfo->src->bytes_in_buffer -= num_bytes;
+}
+
+static void jpg_term_source(j_decompress_ptr cinfo) {
+}
+
+// Decodes a JPG from either fp or mem
+static int res_read_jpg(FILE* fp, MemSource* mem, gr_surface* pSurface) {
     GGLSurface* surface = NULL;
     int result = 0;
     struct jpeg_decompress_struct cinfo;
     struct jpeg_error_mgr jerr;
-
-    FILE* fp = fopen(name, "rb");
-    if (fp == NULL) {
-        char resPath[256];
-#ifndef TW_HAS_LANDSCAPE
-        snprintf(resPath, sizeof(resPath)-1, "/res/images/%s", name);
-#else
-        if(gr_get_rotation()%180 == 0)
-            snprintf(resPath, sizeof(resPath)-1, "/res/images/%s", name);
-        else
-            snprintf(resPath, sizeof(resPath)-1, "/res/landscape/images/%s", name);
-#endif
-        resPath[sizeof(resPath)-1] = '\0';
-        fp = fopen(resPath, "rb");
-        if (fp == NULL) {
-            result = -1;
-            goto exit;
-        }
-    }
+    struct jpeg_source_mgr src;
 
     cinfo.err = jpeg_std_error(&jerr);
     jpeg_create_decompress(&cinfo);
 
     /* Specify data source for decompression */
-    jpeg_stdio_src(&cinfo, fp);
+    if (fp) {
+        jpeg_stdio_src(&cinfo, fp);
+    } else {
+        src.next_input_byte = mem->data;
+        src.bytes_in_buffer = mem->length;
+        src.init_source = jpg_init_source;
+        src.fill_input_buffer = jpg_fill_input_buffer;
+        src.skip_input_data = jpg_skip_input_data;
+        src.resync_to_restart = jpeg_resync_to_restart;
+        src.term_source = jpg_term_source;
+        cinfo.src = &src;
+    }
 
     /* Read file header, set default decompression parameters */
-    if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK)
+    if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK) {
+        result = -2;
         goto exit;
+    }
 
     /* Start decompressor */
     (void) jpeg_start_decompress(&cinfo);
@@ -259,19 +342,178 @@ int res_create_surface_jpg(const char* name, gr_surface* pSurface) {
     *pSurface = (gr_surface) surface;
 
 exit:
-    if (fp != NULL)
+    if (surface)
     {
-        if (surface)
+        (void) jpeg_finish_decompress(&cinfo);
+        if (result < 0)
         {
-            (void) jpeg_finish_decompress(&cinfo);
-            if (result < 0)
-            {
-                free(surface);
-            }
+            free(surface);
         }
-        jpeg_destroy_decompress(&cinfo);
-        fclose(fp);
     }
+    jpeg_destroy_decompress(&cinfo);
+    return result;
+}
+
+int res_create_surface_jpg(const char* name, gr_surface* pSurface) {
+    char resPath[256];
+    int result;
+
+    FILE* fp = res_open_image(name, "", resPath, sizeof(resPath));
+    if (fp == NULL)
+        return -1;
+
+    result = res_read_jpg(fp, NULL, pSurface);
+    fclose(fp);
+    return result;
+}
+
+int res_create_surface_mem(const unsigned char* data, size_t length, gr_surface* pSurface) {
+    MemSource mem;
+
+    if (!data)      return -1;
+
+    mem.data = data;
+    mem.length = length;
+    mem.offset = 0;
+
+    // Pick the decoder by signature, PNG starts with 0x89 'P' 'N' 'G'
+    // and JPG with the 0xFF 0xD8 start of image marker
+    if (length >= 8 && png_sig_cmp((png_bytep) data, 0, 8) == 0)
+        return res_read_png(NULL, &mem, pSurface);
+    if (length >= 2 && data[0] == 0xFF && data[1] == 0xD8)
+        return res_read_jpg(NULL, &mem, pSurface);
+    return -3;
+}
+
+int res_surface_path(const char* name, char* path, size_t length) {
+    FILE* fp = NULL;
+
+    if (!name)      return -1;
+
+    if (strlen(name) <= 4 || strcmp(name + strlen(name) - 4, ".jpg") != 0)
+        fp = res_open_image(name, ".png", path, length);
+    if (fp == NULL)
+        fp = res_open_image(name, "", path, length);
+    if (fp == NULL)
+        return -1;
+
+    fclose(fp);
+    return 0;
+}
+
+int res_save_surface(const char* path, const char* key, gr_surface surface) {
+    GGLSurface* pSurface = (GGLSurface*) surface;
+    SurfaceCacheHeader header;
+    char tmpPath[PATH_MAX];
+    static const char padding[16] = { 0 };
+    int result = -1;
+
+    if (!pSurface || (pSurface->format != GGL_PIXEL_FORMAT_RGBA_8888 &&
+            pSurface->format != GGL_PIXEL_FORMAT_RGBX_8888))
+        return -1;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = SURFACE_CACHE_MAGIC;
+    header.version = SURFACE_CACHE_VERSION;
+    header.keyLength = strlen(key);
+    header.format = pSurface->format;
+    header.width = pSurface->width;
+    header.height = pSurface->height;
+    header.stride = pSurface->stride;
+    header.dataOffset = (sizeof(header) + header.keyLength + 15) & ~15;
+
+    // Several loader threads may be writing, so write privately and rename
+    snprintf(tmpPath, sizeof(tmpPath), "%s.%d.%lx", path, getpid(), (unsigned long) pthread_self());
+    FILE* fp = fopen(tmpPath, "wb");
+    if (fp == NULL)
+        return -1;
+
+    size_t dataLength = (size_t) header.stride * header.height * 4;
+    size_t padLength = header.dataOffset - sizeof(header) - header.keyLength;
+    if (fwrite(&header, sizeof(header), 1, fp) == 1 &&
+            fwrite(key, 1, header.keyLength, fp) == header.keyLength &&
+            fwrite(padding, 1, padLength, fp) == padLength &&
+            fwrite(pSurface->data, 1, dataLength, fp) == dataLength)
+        result = 0;
+
+    if (fclose(fp) != 0)
+        result = -1;
+    if (result == 0 && rename(tmpPath, path) != 0)
+        result = -1;
+    if (result != 0)
+        unlink(tmpPath);
+    return result;
+}
+
+static int res_read_full(int fd, void* buf, size_t length) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = read(fd, (char*) buf + done, length - done);
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+int res_load_surface(const char* path, const char* key, gr_surface* pSurface) {
+    SurfaceCacheHeader header;
+    GGLSurface* surface = NULL;
+    char* fileKey = NULL;
+    size_t keyLength = strlen(key);
+    size_t pixelSize;
+    struct stat st;
+    int result = -2;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) != 0 || res_read_full(fd, &header, sizeof(header)) != 0) {
+        result = -1;
+        goto exit;
+    }
+    pixelSize = (size_t) header.stride * header.height * 4;
+    if (header.magic != SURFACE_CACHE_MAGIC || header.version != SURFACE_CACHE_VERSION ||
+            (header.format != GGL_PIXEL_FORMAT_RGBA_8888 && header.format != GGL_PIXEL_FORMAT_RGBX_8888) ||
+            header.keyLength != keyLength ||
+            header.dataOffset < sizeof(SurfaceCacheHeader) + header.keyLength ||
+            header.dataOffset + pixelSize > (size_t) st.st_size)
+        goto exit;
+
+    fileKey = malloc(keyLength);
+    if (fileKey == NULL) {
+        result = -8;
+        goto exit;
+    }
+    if (res_read_full(fd, fileKey, keyLength) != 0 || memcmp(fileKey, key, keyLength) != 0)
+        goto exit;
+
+    // Read in like a decoded surface, nothing keeps the cache file open
+    surface = malloc(sizeof(GGLSurface) + pixelSize);
+    if (surface == NULL) {
+        result = -8;
+        goto exit;
+    }
+    if (lseek(fd, header.dataOffset, SEEK_SET) != (off_t) header.dataOffset ||
+            res_read_full(fd, surface + 1, pixelSize) != 0) {
+        free(surface);
+        result = -1;
+        goto exit;
+    }
+    surface->version = sizeof(GGLSurface);
+    surface->width = header.width;
+    surface->height = header.height;
+    surface->stride = header.stride;
+    surface->data = (unsigned char*) (surface + 1);
+    surface->format = header.format;
+
+    *pSurface = (gr_surface) surface;
+    result = 0;
+
+exit:
+    free(fileKey);
+    close(fd);
     return result;
 }
 
@@ -1,6 +1,7 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/vfs.h>
 #include <fcntl.h>
 #include <ctype.h>
 
@@ -11,6 +12,10 @@
 #include "multirom.h"
 #include "partitions.hpp"
 #include "twrp-functions.hpp"
+#include "twrpBlockIO.hpp"
+#include "twrpRemove.hpp"
+#include "twrpExec.hpp"
+#include "twrpTar.hpp"
 #include "twinstall.h"
 #include "minzip/Zip.h"
 #include "variables.h"
@@ -18,7 +23,9 @@
 
 extern "C" {
 #include "twcommon.h"
-#include "digest/md5.h"
+#ifdef USE_EXT4
+#include "make_ext4fs.h"
+#endif
 }
 
 std::string MultiROM::m_path = "";
@@ -225,13 +232,7 @@ bool MultiROM::erase(std::string name)
 
 	gui_print("Erasing ROM \"%s\"...\n", name.c_str());
 
-	int res = system_args("chattr -R -i \"%s\"", path.c_str());
-	if(res != 0)
-	{
-		gui_print("Failed to remove immutable attribute from that folder!\n");
-		return false;
-	}
-	res = system_args("rm -rf \"%s\"", path.c_str());
+	int res = twrpRemove::Remove_Tree(path, false, NULL, true, true);
 	sync();
 	return res == 0;
 }
@@ -245,28 +246,27 @@ bool MultiROM::wipe(std::string name, std::string what)
 		return false;
 	}
 
-	char cmd[256];
 	bool res = true;
 	if(what == "dalvik")
 	{
 		static const char *dirs[] = {
-			"data/dalvik-cache",
-			"cache/dalvik-cache",
-			"cache/dc",
+			"/data/dalvik-cache",
+			"/cache/dalvik-cache",
+			"/cache/dc",
 		};
 
 		for(uint8_t i = 0; res && i < sizeof(dirs)/sizeof(dirs[0]); ++i)
 		{
-			sprintf(cmd, "rm -rf \"/%s\"", dirs[i]);
-			gui_print("Wiping dalvik: %s...\n", dirs[i]);
-			res = (system(cmd) == 0);
+			if(!TWFunc::Path_Exists(dirs[i]))
+				continue;
+			gui_print("Wiping dalvik: %s...\n", dirs[i] + 1);
+			res = (twrpRemove::Remove_Tree(dirs[i], false, NULL, true, true) == 0);
 		}
 	}
 	else
 	{
-		sprintf(cmd, "rm -rf \"/%s/\"*", what.c_str());
 		gui_print("Wiping ROM's /%s...\n", what.c_str());
-		res = (system(cmd) == 0);
+		res = (twrpRemove::Remove_Tree("/" + what, true, NULL, true, true) == 0);
 	}
 
 	sync();
@@ -744,7 +744,7 @@ bool MultiROM::flashZip(std::string rom, std::string file)
 	if(format_system)
 	{
 		gui_print("Clearing ROM's /system dir\n");
-		system("chattr -R -i /system/*; rm -rf /system/*");
+		twrpRemove::Remove_Tree("/system", true, NULL, true, true);
 	}
 
 	int wipe_cache = 0;
@@ -952,6 +952,7 @@ bool MultiROM::injectBoot(std::string img_path, bool only_if_older)
 {
 	int rd_cmpr;
 	struct bootimg img;
+	twrpRamdisk rd;
 	std::string path_trampoline = m_path + "/trampoline";
 
 	if (access(path_trampoline.c_str(), F_OK) < 0)
@@ -973,10 +974,8 @@ bool MultiROM::injectBoot(std::string img_path, bool only_if_older)
 
 	// DECOMPRESS RAMDISK
 	gui_print("Decompressing ramdisk...\n");
-	system("mkdir /tmp/boot/rd");
-
-	rd_cmpr = decompressRamdisk("/tmp/boot/initrd.img", "/tmp/boot/rd/");
-	if(rd_cmpr == -1 || access("/tmp/boot/rd/init", F_OK) < 0)
+	rd_cmpr = decompressRamdisk("/tmp/boot/initrd.img", rd);
+	if(rd_cmpr == -1 || !rd.Exists("init"))
 	{
 		gui_print("Failed to decompress ramdisk!\n");
 		goto fail;
@@ -984,7 +983,9 @@ bool MultiROM::injectBoot(std::string img_path, bool only_if_older)
 
 	if(only_if_older)
 	{
-		int tr_rd_ver = getTrampolineVersion("/tmp/boot/rd/init", true);
+		int tr_rd_ver = -1;
+		if(rd.Extract_File("init", "/tmp/boot/init"))
+			tr_rd_ver = getTrampolineVersion("/tmp/boot/init", true);
 		int tr_my_ver = getTrampolineVersion();
 
 		if(tr_rd_ver >= tr_my_ver && tr_my_ver > 0)
@@ -998,21 +999,25 @@ bool MultiROM::injectBoot(std::string img_path, bool only_if_older)
 
 	// COPY TRAMPOLINE
 	gui_print("Copying trampoline...\n");
-	if(access("/tmp/boot/rd/main_init", F_OK) < 0)
-		system("mv /tmp/boot/rd/init /tmp/boot/rd/main_init");
+	if(!rd.Exists("main_init"))
+		rd.Rename("init", "main_init");
 
-	system_args("cp \"%s\" /tmp/boot/rd/init", path_trampoline.c_str());
-	system("chmod 750 /tmp/boot/rd/init");
-	system("ln -sf ../main_init /tmp/boot/rd/sbin/ueventd");
-	system("ln -sf ../main_init /tmp/boot/rd/sbin/watchdogd");
+	if(!rd.Add_File_From("init", path_trampoline, 0750))
+	{
+		gui_print("Failed to copy trampoline!\n");
+		goto fail;
+	}
+	rd.Add_Symlink("sbin/ueventd", "../main_init");
+	rd.Add_Symlink("sbin/watchdogd", "../main_init");
 
 #ifdef MR_USE_MROM_FSTAB
-	system_args("cp \"%s/mrom.fstab\" /tmp/boot/rd/mrom.fstab", m_path.c_str());
+	if(!rd.Add_File_From("mrom.fstab", m_path + "/mrom.fstab"))
+		gui_print("Failed to copy mrom.fstab!\n");
 #endif
 
 	// COMPRESS RAMDISK
 	gui_print("Compressing ramdisk...\n");
-	if(!compressRamdisk("/tmp/boot/rd", "/tmp/boot/initrd.img", rd_cmpr))
+	if(!compressRamdisk(rd, "/tmp/boot/initrd.img", rd_cmpr))
 		goto fail;
 
 	// PACK BOOT IMG
@@ -1038,10 +1043,11 @@ bool MultiROM::injectBoot(std::string img_path, bool only_if_older)
 	}
 	system("rm -r /tmp/boot");
 
-	if(img_path == m_boot_dev)
-		system_args("dd bs=4096 if=/tmp/newboot.img of=\"%s\"", m_boot_dev.c_str());
-	else
-		system_args("cp /tmp/newboot.img \"%s\"", img_path.c_str());
+	if(twrpBlockIO::Copy("/tmp/newboot.img", img_path) != 0)
+	{
+		gui_print("Failed to write boot image to %s!\n", img_path.c_str());
+		return false;
+	}
 	return true;
 
 fail:
@@ -1049,79 +1055,29 @@ fail:
 	return false;
 }
 
-int MultiROM::decompressRamdisk(const char *src, const char* dest)
+int MultiROM::decompressRamdisk(const char *src, twrpRamdisk& rd)
 {
-	FILE *f = fopen(src, "r");
-	if(!f)
-	{
-		gui_print("Failed to open initrd\n");
-		return -1;
-	}
+	static const char *names[] = { "GZIP", "LZ4", "LZMA" };
 
-	char m[4];
-	if(fread(m, 1, sizeof(m), f) != sizeof(m))
+	// The ramdisk is unpacked in memory, nothing is written to /tmp
+	if(!rd.Load(src))
 	{
-		gui_print("Failed to read initrd magic\n");
-		fclose(f);
+		gui_print("Failed to read ramdisk %s\n", src);
 		return -1;
 	}
-	fclose(f);
-
-	char cmd[256];
-	// gzip
-	if(*((uint16_t*)m) == 0x8B1F)
-	{
-		gui_print("Ramdisk uses GZIP compression\n");
-		sprintf(cmd, "cd \"%s\" && gzip -d -c \"%s\" | cpio -i", dest, src);
-		system(cmd);
-		return CMPR_GZIP;
-	}
-	// lz4
-	else if(*((uint32_t*)m) == 0x184C2102)
-	{
-		gui_print("Ramdisk uses LZ4 compression\n");
-		sprintf(cmd, "cd \"%s\" && lz4 -d \"%s\" stdout | cpio -i", dest, src);
-		system(cmd);
-		return CMPR_LZ4;
-	}
-	// lzma
-	else if(*((uint32_t*)m) == 0x0000005D || *((uint32_t*)m) == 0x8000005D)
-	{
-		gui_print("Ramdisk uses LZMA compression\n");
-		sprintf(cmd, "cd \"%s\" && lzma -d -c \"%s\" | cpio -i", dest, src);
-		system(cmd);
-		return CMPR_LZMA;
-	}
-	else
-		gui_print("Unknown ramdisk compression (%X %X %X %X)\n", m[0], m[1], m[2], m[3]);
 
-	return -1;
+	gui_print("Ramdisk uses %s compression\n", names[rd.Get_Compression()]);
+	return rd.Get_Compression();
 }
 
-bool MultiROM::compressRamdisk(const char* src, const char* dst, int cmpr)
+bool MultiROM::compressRamdisk(twrpRamdisk& rd, const char* dst, int cmpr)
 {
-	char cmd[256];
-	switch(cmpr)
+	if(!rd.Save(dst, cmpr))
 	{
-		case CMPR_GZIP:
-			sprintf(cmd, "cd \"%s\" && find . | cpio -o -H newc | gzip > \"%s\"", src, dst);
-			system(cmd);
-			return true;
-		case CMPR_LZ4:
-			sprintf(cmd, "cd \"%s\" && find . | cpio -o -H newc | lz4 stdin \"%s\"", src, dst);
-			system(cmd);
-			return true;
-		// FIXME: busybox can't compress with lzma
-		case CMPR_LZMA:
-			gui_print("Recovery can't compress ramdisk using LZMA!\n");
-			return false;
-//			sprintf(cmd, "cd \"%s\" && find . | cpio -o -H newc | lzma > \"%s\"", src, dst);
-//			system(cmd);
-//			return true;
-		default:
-			gui_print("Invalid compression type: %d", cmpr);
-			return false;
+		gui_print("Failed to compress ramdisk to %s!\n", dst);
+		return false;
 	}
+	return true;
 }
 
 int MultiROM::copyBoot(std::string& orig, std::string rom)
@@ -1213,24 +1169,35 @@ bool MultiROM::createImage(const std::string& base, const char *img, int size)
 		return false;
 	}
 
-	char cmd[256];
-	sprintf(cmd, "dd if=/dev/zero of=\"%s/%s.img\" bs=1M count=%d", base.c_str(), img, size);
-	if(system(cmd) != 0)
+	std::string path = base + "/" + img + ".img";
+	uint64_t bytes = (uint64_t)size << 20;
+
+	// The image is formatted first, which only writes the metadata, and
+	// then the rest is reserved, so no gigabytes of zeros are written
+	struct statfs st;
+	if(statfs(base.c_str(), &st) == 0 && (uint64_t)st.f_bavail * st.f_bsize < bytes)
 	{
-		gui_print("Failed to create %s image, probably not enough space.\n", img);
+		gui_print("Failed to create %s image, not enough space.\n", img);
 		return false;
 	}
 
-	struct stat info;
-	sprintf(cmd, "%s/%s.img", base.c_str(), img);
-	if(stat(cmd, &info) < 0)
+#ifdef USE_EXT4
+	if(make_ext4fs(path.c_str(), bytes, img, NULL) != 0)
+#else
+	if(system_args("make_ext4fs -l %dM \"%s\"", size, path.c_str()) != 0)
+#endif
 	{
-		gui_print("Failed to create %s image, probably not enough space.\n", img);
+		gui_print("Failed to format %s image!\n", img);
+		unlink(path.c_str());
 		return false;
 	}
 
-	sprintf(cmd, "make_ext4fs -l %dM \"%s/%s.img\"", size, base.c_str(), img);
-	system(cmd);
+	if(!twrpBlockIO::Allocate_File(path, bytes))
+	{
+		gui_print("Failed to create %s image, probably not enough space.\n", img);
+		unlink(path.c_str());
+		return false;
+	}
 	return true;
 }
 
@@ -1323,7 +1290,6 @@ bool MultiROM::createDirs(std::string name, int type)
 
 bool MultiROM::extractBootForROM(std::string base)
 {
-	char path[256];
 	struct bootimg img;
 
 	gui_print("Extracting contents of boot.img...\n");
@@ -1343,11 +1309,9 @@ bool MultiROM::extractBootForROM(std::string base)
 
 	libbootimg_destroy(&img);
 
-	system("rm -r /tmp/boot");
-	system("mkdir /tmp/boot");
-
-	int rd_cmpr = decompressRamdisk((base + "/boot/initrd.img").c_str(), "/tmp/boot");
-	if(rd_cmpr == -1 || access("/tmp/boot/init", F_OK) < 0)
+	twrpRamdisk rd;
+	int rd_cmpr = decompressRamdisk((base + "/boot/initrd.img").c_str(), rd);
+	if(rd_cmpr == -1 || !rd.Exists("init"))
 	{
 		gui_print("Failed to extract ramdisk!\n");
 		return false;
@@ -1361,15 +1325,20 @@ bool MultiROM::extractBootForROM(std::string base)
 		NULL
 	};
 
+	std::vector<std::string> files;
 	for(int i = 0; cp_f[i]; ++i)
-		system_args("cp -a /tmp/boot/%s \"%s/boot/\"", cp_f[i], base.c_str());
+		rd.List(cp_f[i], files);
 
-	// check if main_init exists
-	sprintf(path, "%s/boot/main_init", base.c_str());
-	if(access(path, F_OK) < 0)
-		system_args("mv \"%s/boot/init\" \"%s/boot/main_init\"", base.c_str(), base.c_str());
+	// main_init is the real init if the ramdisk already has a trampoline
+	bool has_main_init = rd.Exists("main_init");
+	for(size_t i = 0; i < files.size(); ++i)
+	{
+		std::string dest = base + "/boot/" + files[i];
+		if(files[i] == "init" && !has_main_init)
+			dest = base + "/boot/main_init";
+		rd.Extract_File(files[i], dest);
+	}
 
-	system("rm -r /tmp/boot");
 	system_args("cd \"%s/boot\" && rm cmdline ramdisk.gz zImage", base.c_str());
 
 	if (DataManager::GetIntValue("tw_multirom_share_kernel") == 0)
@@ -1749,8 +1718,7 @@ bool MultiROM::addROM(std::string zip, int os, std::string loc)
 	if(!res)
 	{
 		gui_print("Erasing incomplete ROM...\n");
-		std::string cmd = "rm -rf \"" + root + "\"";
-		system(cmd.c_str());
+		twrpRemove::Remove_Tree(root, false, NULL, true);
 	}
 
 	sync();
@@ -1812,7 +1780,6 @@ bool MultiROM::patchInit(std::string name)
 bool MultiROM::installFromBackup(std::string name, std::string path, int type)
 {
 	struct stat info;
-	char cmd[256];
 	std::string base = getRomsPath() + "/" + name;
 	int has_system = 0, has_data = 0;
 
@@ -1845,8 +1812,12 @@ bool MultiROM::installFromBackup(std::string name, std::string path, int type)
 		return false;
 	}
 
-	sprintf(cmd, "cp \"%s/boot.emmc.win\" \"%s/boot.img\"", path.c_str(), base.c_str());
-	system(cmd);
+	// Backups of emmc partitions may be sparse images, write it out in full
+	if(twrpBlockIO::Restore_Image(path + "/boot.emmc.win", base + "/boot.img") != 0)
+	{
+		gui_print("Failed to copy boot image!\n");
+		return false;
+	}
 
 	if(!extractBootForROM(base))
 		return false;
@@ -1862,51 +1833,102 @@ bool MultiROM::installFromBackup(std::string name, std::string path, int type)
 	if(path.find("/data/media") == 0)
 		path.replace(0, 5, REALDATA);
 
-	bool res = (extractBackupFile(path, "system") && (!has_data || extractBackupFile(path, "data")));
+	unsigned long long system_size = getBackupSize(path, "system");
+	unsigned long long data_size = has_data ? getBackupSize(path, "data") : 0;
+	unsigned long long total = system_size + data_size;
+
+	DataManager::SetProgress(0.0);
+	bool res = (extractBackupFile(path, "system", 0, total) && (!has_data || extractBackupFile(path, "data", system_size, total)));
 	restoreMounts();
 	return res;
 }
 
-bool MultiROM::extractBackupFile(std::string path, std::string part)
+unsigned long long MultiROM::getBackupSize(const std::string& path, const std::string& part)
 {
-	gui_print("Extracting backup of %s partition...\n", part.c_str());
-
+	// Single archive or the split parts: system.ext4.win000, 001, 100...
+	std::string prefix = part + ".ext4.win";
+	unsigned long long size = 0;
+	struct dirent *dr;
 	struct stat info;
-	std::string filename = part + ".ext4.win";
-	std::string full_path =  path + "/" + filename;
-	int index = 0;
-	char split_index[5];
-	char cmd[256];
 
-	if (stat(full_path.c_str(), &info) < 0) // multiple archives
+	DIR *d = opendir(path.c_str());
+	if(!d)
+		return 0;
+
+	while((dr = readdir(d)))
 	{
-		sprintf(split_index, "%03i", index);
-		full_path = path + "/" + filename + split_index;
-		while (stat(full_path.c_str(), &info) >= 0)
+		if(strncmp(dr->d_name, prefix.c_str(), prefix.size()) == 0 &&
+			stat((path + "/" + dr->d_name).c_str(), &info) >= 0)
 		{
-			gui_print("Restoring archive #%i...\n", ++index);
+			size += info.st_size;
+		}
+	}
+	closedir(d);
+	return size;
+}
 
-			sprintf(cmd, "cd / && gnutar -xf \"%s\"", full_path.c_str());
-			LOGINFO("Restore cmd: %s\n", cmd);
-			system(cmd);
+bool MultiROM::extractBackupFile(std::string path, std::string part, unsigned long long done, unsigned long long total)
+{
+	gui_print("Extracting backup of %s partition...\n", part.c_str());
+	TWFunc::GUI_Operation_Text(TW_RESTORE_TEXT, part, "Restoring");
 
-			sprintf(split_index, "%03i", index);
-			full_path = path + "/" + filename + split_index;
-		}
+	// Same estimate as a regular restore, the progress bar runs on time
+	unsigned long long size = getBackupSize(path, part);
+	unsigned long long file_bps = 0;
+	DataManager::GetValue(TW_RESTORE_AVG_FILE_RATE, file_bps);
+	if(total > 0 && file_bps > 0)
+	{
+		DataManager::SetProgress(done / (float)total);
+		DataManager::ShowProgress(size / (float)total, size / file_bps);
+	}
 
-		if (index == 0)
-		{
-			gui_print("Failed to locate backup file %s\n", full_path.c_str());
-			return false;
-		}
+	std::string file = path + "/" + part + ".ext4.win";
+	if(twrpBlockIO::Is_Sparse_Image(file))
+		return extractBackupImage(file, part);
+
+	// twrpTar finds split archives itself and extracts them in parallel,
+	// compressed and encrypted backups included
+	twrpTar tar;
+	tar.setdir("/" + part);
+	tar.setfn(file);
+	tar.backup_name = part;
+	if(tar.extractTarFork() != 0)
+	{
+		gui_print("Failed to extract backup of %s partition!\n", part.c_str());
+		return false;
 	}
+	return true;
+}
+
+// Block based backups are sparse images of the whole partition. It is
+// written out in full next to the backup and the files are copied from it.
+bool MultiROM::extractBackupImage(const std::string& file, const std::string& part)
+{
+	std::string img = file + ".img";
+	bool res = false;
+
+	if(twrpBlockIO::Restore_Image(file, img) != 0)
+	{
+		gui_print("Failed to expand image of %s partition!\n", part.c_str());
+		unlink(img.c_str());
+		return false;
+	}
+
+	mkdir("/mnt_backup", 0777);
+	if(TWFunc::Exec_Cmd(twrpExec::Argv("mount", "-o", "loop,ro", "-t", "ext4", img.c_str(), "/mnt_backup", NULL)) != 0)
+		gui_print("Failed to mount image of %s partition!\n", part.c_str());
 	else
 	{
-		sprintf(cmd, "cd /%s && gnutar -xf \"%s\"", part.c_str(), full_path.c_str());
-		LOGINFO("Restore cmd: %s\n", cmd);
-		system(cmd);
+		std::string dest = "/" + part + "/";
+		res = (TWFunc::Exec_Cmd(twrpExec::Argv("cp", "-a", "/mnt_backup/.", dest.c_str(), NULL)) == 0);
+		if(!res)
+			gui_print("Failed to copy files of %s partition!\n", part.c_str());
+		sync();
+		TWFunc::Exec_Cmd(twrpExec::Argv("umount", "-d", "/mnt_backup", NULL));
 	}
-	return true;
+	rmdir("/mnt_backup");
+	unlink(img.c_str());
+	return res;
 }
 
 void MultiROM::setInstaller(MROMInstaller *i)
@@ -2012,6 +2034,7 @@ bool MultiROM::ubuntuTouchProcessBoot(const std::string& root, const char *init_
 {
 	int rd_cmpr;
 	struct bootimg img;
+	twrpRamdisk rd;
 
 	gui_print("Processing boot.img for Ubuntu Touch\n");
 	system("rm /tmp/boot.img");
@@ -2037,21 +2060,26 @@ bool MultiROM::ubuntuTouchProcessBoot(const std::string& root, const char *init_
 
 	// DECOMPRESS RAMDISK
 	gui_print("Decompressing ramdisk...\n");
-	system("mkdir /tmp/boot/rd");
-	rd_cmpr = decompressRamdisk("/tmp/boot/initrd.img", "/tmp/boot/rd/");
-	if(rd_cmpr == -1 || access("/tmp/boot/rd/init", F_OK) < 0)
+	rd_cmpr = decompressRamdisk("/tmp/boot/initrd.img", rd);
+	if(rd_cmpr == -1 || !rd.Exists("init"))
 	{
 		gui_print("Failed to decompress ramdisk!\n");
 		goto fail_inject;
 	}
 
 	// COPY INIT FILES
-	system_args("cp -ra %s/%s/* /tmp/boot/rd/; chmod 755 /tmp/boot/rd/init", m_path.c_str(), init_folder);
+	if(!rd.Add_Tree(m_path + "/" + init_folder))
+	{
+		gui_print("Failed to copy init files!\n");
+		goto fail_inject;
+	}
+	if(rd.Exists("init"))
+		rd.Find("init")->mode = S_IFREG | 0755;
 
 	// COMPRESS RAMDISK
 	gui_print("Compressing ramdisk...\n");
-	if(!compressRamdisk("/tmp/boot/rd", "/tmp/boot/initrd.img", rd_cmpr))
-		return false;
+	if(!compressRamdisk(rd, "/tmp/boot/initrd.img", rd_cmpr))
+		goto fail_inject;
 
 	// DEPLOY
 	system_args("cp /tmp/boot/initrd.img %s/initrd.img", root.c_str());
@@ -2159,7 +2187,7 @@ bool MultiROM::fakeBootPartition(const char *fakeImg)
 		close(fd);
 
 		// Copy current boot.img as base
-		system_args("dd if=\"%s\" of=\"%s\"", m_boot_dev.c_str(), fakeImg);
+		twrpBlockIO::Copy(m_boot_dev, fakeImg);
 		gui_print("Current boot sector was used as base for fake boot.img!\n");
 	}
 
@@ -2203,42 +2231,12 @@ void MultiROM::failsafeCheckBootPartition()
 	remove("/tmp/mrom_fakebootpart");
 }
 
-bool MultiROM::calculateMD5(const char *path, unsigned char *md5sum/*len: 16*/)
-{
-	FILE *f = fopen(path, "rb");
-	if(!f)
-	{
-		gui_print("Failed to open file %s to calculate MD5 sum!\n", path);
-		return false;
-	}
-
-	struct MD5Context md5c;
-	int len;
-	unsigned char buff[1024];
-
-	MD5Init(&md5c);
-	while((len = fread(buff, 1, sizeof(buff), f)) > 0)
-		MD5Update(&md5c, buff, len);
-
-	MD5Final(md5sum ,&md5c);
-	fclose(f);
-	return true;
-}
-
 bool MultiROM::compareFiles(const char *path1, const char *path2)
 {
-	unsigned char md5sum1[MD5LENGTH];
-	unsigned char md5sum2[MD5LENGTH];
-
-	if(!calculateMD5(path1, md5sum1) || !calculateMD5(path2, md5sum2))
-		return false;
-
-	int i;
-	for(i = 0; i < MD5LENGTH; ++i)
-		if(md5sum1[i] != md5sum2[i])
-			return false;
-
-	return true;
+	int ret = twrpBlockIO::Compare(path1, path2);
+	if(ret < 0)
+		gui_print("Failed to compare %s and %s!\n", path1, path2);
+	return ret == 0;
 }
 
 int MultiROM::getTrampolineVersion()
@@ -2248,20 +2246,21 @@ int MultiROM::getTrampolineVersion()
 
 int MultiROM::getTrampolineVersion(const std::string& path, bool silent)
 {
-	std::string result = "";
-	char cmd[384];
+	std::string data, result;
+	char buf[16384];
+	size_t len;
 
-	// check the return value, if the -v is cut off, bad things happen.
-	if (snprintf(cmd, sizeof(cmd),
-		"strings \"%s\" | grep -q 'Running trampoline' && \"%s\" -v",
-		path.c_str(), path.c_str()) >= (int)sizeof(cmd))
+	// only run binaries which really are trampoline
+	FILE *f = fopen(path.c_str(), "re");
+	if(f)
 	{
-		if(!silent)
-			gui_print("Failed to get trampoline version, path is too long!\n");
-		return -1;
+		while((len = fread(buf, 1, sizeof(buf), f)) > 0)
+			data.append(buf, len);
+		fclose(f);
 	}
 
-	if(TWFunc::Exec_Cmd(cmd, result) != 0)
+	if(data.find("Running trampoline") == std::string::npos ||
+		!twrpExec::Run(twrpExec::Argv(path.c_str(), "-v", NULL), &result, 5000).Success())
 	{
 		if(!silent)
 			gui_print("Failed to get trampoline version!\n");
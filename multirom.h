@@ -11,6 +11,7 @@
 
 #include "data.hpp"
 #include "mrominstaller.h"
+#include "twrpRamdisk.hpp"
 
 enum { INSTALL_SUCCESS, INSTALL_ERROR, INSTALL_CORRUPT };
 
@@ -32,13 +33,6 @@ enum
 	ROM_UNKNOWN,
 };
 
-enum
-{
-	CMPR_GZIP   = 0,
-	CMPR_LZ4    = 1,
-	CMPR_LZMA   = 2,
-};
-
 #define M(x) (1 << x)
 #define MASK_UBUNTU (M(ROM_UBUNTU_INTERNAL) | M(ROM_UBUNTU_USB_IMG)| M(ROM_UBUNTU_USB_DIR))
 #define MASK_ANDROID (M(ROM_ANDROID_USB_DIR) | M(ROM_ANDROID_USB_IMG) | M(ROM_ANDROID_INTERNAL))
@@ -160,10 +154,12 @@ private:
 	static bool skipLine(const char *line);
 	static std::string getNewRomName(std::string zip, std::string def);
 	static bool createDirs(std::string name, int type);
-	static bool compressRamdisk(const char *src, const char *dest, int cmpr);
-	static int decompressRamdisk(const char *src, const char *dest);
+	static bool compressRamdisk(twrpRamdisk& rd, const char *dest, int cmpr);
+	static int decompressRamdisk(const char *src, twrpRamdisk& rd);
 	static bool installFromBackup(std::string name, std::string path, int type);
-	static bool extractBackupFile(std::string path, std::string part);
+	static bool extractBackupFile(std::string path, std::string part, unsigned long long done, unsigned long long total);
+	static bool extractBackupImage(const std::string& file, const std::string& part);
+	static unsigned long long getBackupSize(const std::string& path, const std::string& part);
 	static int getType(int os, std::string loc);
 	static int getTrampolineVersion();
 	static int getTrampolineVersion(const std::string& path, bool silent = false);
@@ -185,7 +181,6 @@ private:
 
 	static int system_args(const char *fmt, ...);
 	static void translateToRealdata(std::string& path);
-	static bool calculateMD5(const char *path, unsigned char *md5sum/*len: 16*/);
 	static void normalizeROMPath(std::string& path);
 	static void restoreROMPath();
 
@@ -26,7 +26,10 @@
 #include <sys/stat.h>
 #include <sys/vfs.h>
 #include <unistd.h>
+#include <ctype.h>
+#include <pthread.h>
 #include <vector>
+#include <algorithm>
 #include <dirent.h>
 #include <time.h>
 #include <errno.h>
@@ -40,13 +43,30 @@
 #include "variables.h"
 #include "adb_install.h"
 #include "data.hpp"
+#include "twrpDigest.hpp"
+#include "twrpBenchmark.hpp"
 extern "C" {
 	#include "twinstall.h"
 	#include "gui/gui.h"
-	int TWinstall_zip(const char* path, int* wipe_cache);
 }
 
 #define SCRIPT_COMMAND_SIZE 512
+#define MAX_VERIFY_THREADS 4
+
+struct ORS_Verify_Job {
+	ORS_Verify_Job(size_t Command, const string& Path, bool Zip) : command(Command), path(Path), zip(Zip), ok(false) {}
+
+	size_t command;                                                                // Index into the script
+	string path;
+	bool zip;                                                                      // All zip checks, otherwise only the MD5
+	bool ok;
+};
+
+struct ORS_Verify_Work {
+	pthread_mutex_t lock;
+	vector<ORS_Verify_Job> jobs;
+	size_t next;
+};
 
 int OpenRecoveryScript::check_for_script_file(void) {
 	if (!PartitionManager.Mount_By_Path(SCRIPT_FILE_CACHE, false)) {
@@ -64,306 +84,321 @@ int OpenRecoveryScript::check_for_script_file(void) {
 	return 0;
 }
 
-int OpenRecoveryScript::run_script_file(void) {
-	FILE *fp = fopen(SCRIPT_FILE_TMP, "r");
-	int ret_val = 0, cindex, line_len, i, remove_nl, install_cmd = 0, sideload = 0;
-	char script_line[SCRIPT_COMMAND_SIZE], command[SCRIPT_COMMAND_SIZE],
-		 value[SCRIPT_COMMAND_SIZE], mount[SCRIPT_COMMAND_SIZE],
-		 value1[SCRIPT_COMMAND_SIZE], value2[SCRIPT_COMMAND_SIZE];
-	char *val_start, *tok;
-
-	if (fp != NULL) {
-		DataManager::SetValue(TW_SIMULATE_ACTIONS, 0);
-		DataManager::SetValue("ui_progress", 0); // Reset the progress bar
-		while (fgets(script_line, SCRIPT_COMMAND_SIZE, fp) != NULL && ret_val == 0) {
-			cindex = 0;
-			line_len = strlen(script_line);
-			if (line_len < 2)
-				continue; // there's a blank line or line is too short to contain a command
-			//gui_print("script line: '%s'\n", script_line);
-			for (i=0; i<line_len; i++) {
-				if ((int)script_line[i] == 32) {
-					cindex = i;
-					i = line_len;
-				}
+bool OpenRecoveryScript::Parse_Script(const char* File, vector<ORS_Command>& Script) {
+	FILE *fp = fopen(File, "r");
+	char script_line[SCRIPT_COMMAND_SIZE];
+	bool ret = true;
+
+	if (fp == NULL) {
+		LOGERR("Error opening script file '%s'\n", File);
+		return false;
+	}
+	while (ret && fgets(script_line, SCRIPT_COMMAND_SIZE, fp) != NULL) {
+		string line = script_line;
+		ORS_Command cmd;
+
+		while (!line.empty() && (line[line.size() - 1] == '\n' || line[line.size() - 1] == '\r'))
+			line.resize(line.size() - 1);
+		if (line.empty())
+			continue; // there's a blank line
+
+		size_t cindex = line.find(' ');
+		cmd.has_value = (cindex != string::npos && cindex != 0);
+		cmd.zip_verify = 0;
+		if (cmd.has_value) {
+			size_t val_start = cindex + 1;
+			cmd.command = line.substr(0, cindex);
+			if (val_start < line.size() && line[val_start] == ' ')
+				val_start++; //get rid of space
+			if (val_start < line.size() && line[val_start] == '=')
+				val_start++; //get rid of = at the beginning
+			if (val_start < line.size() && line[val_start] == ' ')
+				val_start++; //get rid of space
+			cmd.value = line.substr(val_start);
+			LOGINFO("command is: '%s' and value is: '%s'\n", cmd.command.c_str(), cmd.value.c_str());
+		} else {
+			cmd.command = line;
+			gui_print("command is: '%s' and there is no value\n", cmd.command.c_str());
+		}
+
+		if (cmd.command == "wipe") {
+			const string& value = cmd.value;
+			if (value == "cache" || value == "/cache")
+				cmd.wipes.push_back("cache");
+			else if (value == "dalvik" || value == "dalvick" || value == "dalvikcache" || value == "dalvickcache")
+				cmd.wipes.push_back("dalvik");
+			else if (value == "data" || value == "/data" || value == "factory" || value == "factoryreset")
+				cmd.wipes.push_back("data");
+			else {
+				LOGERR("Error with wipe command value: '%s'\n", value.c_str());
+				ret = false;
 			}
-			memset(command, 0, sizeof(command));
-			memset(value, 0, sizeof(value));
-			if ((int)script_line[line_len - 1] == 10)
-					remove_nl = 2;
-				else
-					remove_nl = 1;
-			if (cindex != 0) {
-				strncpy(command, script_line, cindex);
-				LOGINFO("command is: '%s' and ", command);
-				val_start = script_line;
-				val_start += cindex + 1;
-				if ((int) *val_start == 32)
-					val_start++; //get rid of space
-				if ((int) *val_start == 51)
-					val_start++; //get rid of = at the beginning
-				if ((int) *val_start == 32)
-					val_start++; //get rid of space
-				strncpy(value, val_start, line_len - cindex - remove_nl);
-				LOGINFO("value is: '%s'\n", value);
-			} else {
-				strncpy(command, script_line, line_len - remove_nl + 1);
-				gui_print("command is: '%s' and there is no value\n", command);
+		} else if (cmd.command != "install" && cmd.command != "backup" && cmd.command != "restore" &&
+			cmd.command != "mount" && cmd.command != "unmount" && cmd.command != "umount" &&
+			cmd.command != "set" && cmd.command != "mkdir" && cmd.command != "reboot" &&
+			cmd.command != "cmd" && cmd.command != "print" && cmd.command != "sideload" &&
+			cmd.command != "benchmark") {
+			LOGERR("Unrecognized script command: '%s'\n", cmd.command.c_str());
+			ret = false;
+		}
+		Script.push_back(cmd);
+	}
+	fclose(fp);
+	return ret;
+}
+
+void OpenRecoveryScript::Merge_Wipes(vector<ORS_Command>& Script) {
+	vector<ORS_Command> merged;
+
+	for (size_t i = 0; i < Script.size(); i++) {
+		if (Script[i].command == "wipe" && !merged.empty() && merged.back().command == "wipe") {
+			vector<string>& wipes = merged.back().wipes;
+			if (find(wipes.begin(), wipes.end(), Script[i].wipes[0]) == wipes.end())
+				wipes.push_back(Script[i].wipes[0]);
+			LOGINFO("Merged 'wipe %s' into the wipe before it\n", Script[i].value.c_str());
+		} else {
+			merged.push_back(Script[i]);
+		}
+	}
+	Script.swap(merged);
+}
+
+void OpenRecoveryScript::Run_Wipes(const vector<string>& Wipes) {
+	bool factory = find(Wipes.begin(), Wipes.end(), "data") != Wipes.end();
+	// A factory reset usually takes /cache and with it the dalvik cache too
+	bool cache_wiped = factory && PartitionManager.Is_Wiped_By_Factory_Reset("/cache");
+	bool dalvik_wiped = cache_wiped && PartitionManager.Is_Wiped_By_Factory_Reset("/data") &&
+		(PartitionManager.Find_Partition_By_Path("/sd-ext") == NULL || PartitionManager.Is_Wiped_By_Factory_Reset("/sd-ext"));
+
+	if (factory) {
+		gui_print("-- Wiping Data Partition...\n");
+		PartitionManager.Factory_Reset();
+		gui_print("-- Data Partition Wipe Complete!\n");
+	}
+	for (size_t i = 0; i < Wipes.size(); i++) {
+		if (Wipes[i] == "cache") {
+			if (cache_wiped) {
+				gui_print("-- Cache Partition was wiped with data\n");
+				continue;
 			}
-			if (strcmp(command, "install") == 0) {
-				// Install Zip
-				DataManager::SetValue("tw_action_text2", "Installing Zip");
-				PartitionManager.Mount_All_Storage();
-				ret_val = Install_Command(value);
-				install_cmd = -1;
-			} else if (strcmp(command, "wipe") == 0) {
-				// Wipe
-				if (strcmp(value, "cache") == 0 || strcmp(value, "/cache") == 0) {
-					gui_print("-- Wiping Cache Partition...\n");
-					PartitionManager.Wipe_By_Path("/cache");
-					gui_print("-- Cache Partition Wipe Complete!\n");
-				} else if (strcmp(value, "dalvik") == 0 || strcmp(value, "dalvick") == 0 || strcmp(value, "dalvikcache") == 0 || strcmp(value, "dalvickcache") == 0) {
-					gui_print("-- Wiping Dalvik Cache...\n");
-					PartitionManager.Wipe_Dalvik_Cache();
-					gui_print("-- Dalvik Cache Wipe Complete!\n");
-				} else if (strcmp(value, "data") == 0 || strcmp(value, "/data") == 0 || strcmp(value, "factory") == 0 || strcmp(value, "factoryreset") == 0) {
-					gui_print("-- Wiping Data Partition...\n");
-					PartitionManager.Factory_Reset();
-					gui_print("-- Data Partition Wipe Complete!\n");
-				} else {
-					LOGERR("Error with wipe command value: '%s'\n", value);
-					ret_val = 1;
-				}
-			} else if (strcmp(command, "backup") == 0) {
-				// Backup
-				DataManager::SetValue("tw_action_text2", "Backing Up");
-				tok = strtok(value, " ");
-				strcpy(value1, tok);
-				tok = strtok(NULL, " ");
-				if (tok != NULL) {
-					memset(value2, 0, sizeof(value2));
-					strcpy(value2, tok);
-					line_len = strlen(tok);
-					if ((int)value2[line_len - 1] == 10 || (int)value2[line_len - 1] == 13) {
-						if ((int)value2[line_len - 1] == 10 || (int)value2[line_len - 1] == 13)
-							remove_nl = 2;
-						else
-							remove_nl = 1;
-					} else
-						remove_nl = 0;
-					strncpy(value2, tok, line_len - remove_nl);
-					DataManager::SetValue(TW_BACKUP_NAME, value2);
-					gui_print("Backup folder set to '%s'\n", value2);
-					if (PartitionManager.Check_Backup_Name(true) != 0) {
-						ret_val = 1;
-						continue;
-					}
-				} else {
-					char empt[50];
-					strcpy(empt, "(Current Date)");
-					DataManager::SetValue(TW_BACKUP_NAME, empt);
-				}
-				ret_val = Backup_Command(value1);
-			} else if (strcmp(command, "restore") == 0) {
-				// Restore
-				DataManager::SetValue("tw_action_text2", "Restoring");
-				PartitionManager.Mount_All_Storage();
-				DataManager::SetValue(TW_SKIP_MD5_CHECK_VAR, 0);
-				char folder_path[512], partitions[512];
-
-				string val = value, restore_folder, restore_partitions;
-				size_t pos = val.find_last_of(" ");
-				if (pos == string::npos) {
-					restore_folder = value;
-					partitions[0] = '\0';
-				} else {
-					restore_folder = val.substr(0, pos);
-					restore_partitions = val.substr(pos + 1, val.size() - pos - 1);
-					strcpy(partitions, restore_partitions.c_str());
-				}
-				strcpy(folder_path, restore_folder.c_str());
-				LOGINFO("Restore folder is: '%s' and partitions: '%s'\n", folder_path, partitions);
-				gui_print("Restoring '%s'\n", folder_path);
-
-				if (folder_path[0] != '/') {
-					char backup_folder[512];
-					string folder_var;
-					DataManager::GetValue(TW_BACKUPS_FOLDER_VAR, folder_var);
-					sprintf(backup_folder, "%s/%s", folder_var.c_str(), folder_path);
-					LOGINFO("Restoring relative path: '%s'\n", backup_folder);
-					if (!TWFunc::Path_Exists(backup_folder)) {
-						if (DataManager::GetIntValue(TW_HAS_DUAL_STORAGE)) {
-							if (DataManager::GetIntValue(TW_USE_EXTERNAL_STORAGE)) {
-								LOGINFO("Backup folder '%s' not found on external storage, trying internal...\n", folder_path);
-								DataManager::SetValue(TW_USE_EXTERNAL_STORAGE, 0);
-							} else {
-								LOGINFO("Backup folder '%s' not found on internal storage, trying external...\n", folder_path);
-								DataManager::SetValue(TW_USE_EXTERNAL_STORAGE, 1);
-							}
-							DataManager::GetValue(TW_BACKUPS_FOLDER_VAR, folder_var);
-							sprintf(backup_folder, "%s/%s", folder_var.c_str(), folder_path);
-							LOGINFO("2Restoring relative path: '%s'\n", backup_folder);
-						}
-					}
-					strcpy(folder_path, backup_folder);
-				} else {
-					if (folder_path[strlen(folder_path) - 1] == '/')
-						strcat(folder_path, ".");
-					else
-						strcat(folder_path, "/.");
-				}
-				if (!TWFunc::Path_Exists(folder_path)) {
-					gui_print("Unable to locate backup '%s'\n", folder_path);
-					ret_val = 1;
+			gui_print("-- Wiping Cache Partition...\n");
+			PartitionManager.Wipe_By_Path("/cache");
+			gui_print("-- Cache Partition Wipe Complete!\n");
+		} else if (Wipes[i] == "dalvik") {
+			if (dalvik_wiped) {
+				gui_print("-- Dalvik Cache was wiped with data\n");
+				continue;
+			}
+			gui_print("-- Wiping Dalvik Cache...\n");
+			PartitionManager.Wipe_Dalvik_Cache();
+			gui_print("-- Dalvik Cache Wipe Complete!\n");
+		}
+	}
+}
+
+static void Split_Restore_Value(const string& Value, string& Folder, string& Partitions) {
+	size_t pos = Value.find_last_of(" ");
+	if (pos == string::npos) {
+		Folder = Value;
+		Partitions.clear();
+	} else {
+		Folder = Value.substr(0, pos);
+		Partitions = Value.substr(pos + 1, Value.size() - pos - 1);
+	}
+}
+
+static bool Add_Verified_File(ORS_Command& Command, const string& Path) {
+	struct stat st;
+	ORS_File file;
+
+	if (stat(Path.c_str(), &st) != 0)
+		return false;
+	file.path = Path;
+	file.size = st.st_size;
+	file.mtime = st.st_mtime;
+	Command.verified_files.push_back(file);
+	return true;
+}
+
+void* OpenRecoveryScript::Verify_Thread(void* cookie) {
+	ORS_Verify_Work* work = (ORS_Verify_Work*) cookie;
+
+	while (1) {
+		ORS_Verify_Job* job = NULL;
+
+		pthread_mutex_lock(&work->lock);
+		if (work->next < work->jobs.size())
+			job = &work->jobs[work->next++];
+		pthread_mutex_unlock(&work->lock);
+		if (job == NULL)
+			break;
+
+		if (job->zip) {
+			job->ok = (TWverify_zip(job->path.c_str()) == 0);
+		} else {
+			twrpDigest md5sum;
+			md5sum.setfn(job->path);
+			job->ok = (md5sum.verify_md5digest() == 0);
+		}
+	}
+	return NULL;
+}
+
+// Zips and backups are resolved the same way the commands will resolve them
+// later. That can change which storage is in use, so the setting is put
+// back afterwards, and a command only skips its own checks when it ends up
+// with the same path and files that were checked here.
+bool OpenRecoveryScript::Verify_Script(vector<ORS_Command>& Script) {
+	static const struct {
+		char letter;
+		const char* name;
+	} restore_parts[] = {
+		{ 's', "system" }, { 'd', "data" }, { 'c', "cache" }, { 'b', "boot" }, { 'a', "and-sec" }, { 'e', "sd-ext" },
+	};
+	int use_external = DataManager::GetIntValue(TW_USE_EXTERNAL_STORAGE);
+	size_t first_change = Script.size();
+	pthread_t threads[MAX_VERIFY_THREADS];
+	int thread_count = 0, cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	ORS_Verify_Work work;
+	bool ret = true;
+
+	for (size_t i = 0; i < Script.size(); i++) {
+		ORS_Command& cmd = Script[i];
+
+		// Commands and sideloaded zips can change any file and set can
+		// change what gets checked, checks of anything used after them
+		// can't stop the script from starting
+		if (first_change == Script.size() && (cmd.command == "cmd" || cmd.command == "sideload" || cmd.command == "set"))
+			first_change = i;
+
+		if (cmd.command == "install") {
+			string zip = Resolve_Zip(cmd.value);
+			if (!Add_Verified_File(cmd, zip))
+				continue;
+			cmd.verified_path = zip;
+			cmd.zip_verify = DataManager::GetIntValue(TW_SIGNED_ZIP_VERIFY_VAR);
+			work.jobs.push_back(ORS_Verify_Job(i, zip, true));
+		} else if (cmd.command == "restore") {
+			string folder, partitions;
+			vector<string> prefixes;
+			DIR* d;
+			struct dirent* de;
+
+			Split_Restore_Value(cmd.value, folder, partitions);
+			if (folder.empty() || partitions.find_first_of("Mm") == string::npos)
+				continue; // MD5 checks are only done when asked for
+			for (size_t j = 0; j < sizeof(restore_parts) / sizeof(restore_parts[0]); j++) {
+				if (partitions.find(restore_parts[j].letter) != string::npos || partitions.find((char) toupper(restore_parts[j].letter)) != string::npos)
+					prefixes.push_back(string(restore_parts[j].name) + ".");
+			}
+			folder = Resolve_Backup_Folder(folder);
+			if (prefixes.empty() || (d = opendir(folder.c_str())) == NULL)
+				continue;
+
+			size_t first_job = work.jobs.size();
+			bool complete = true;
+			while (complete && (de = readdir(d)) != NULL) {
+				string name = de->d_name;
+				if (name.size() > 4 && name.substr(name.size() - 4) == ".md5")
 					continue;
+				for (size_t j = 0; j < prefixes.size(); j++) {
+					if (name.compare(0, prefixes[j].size(), prefixes[j]) != 0)
+						continue;
+					string file = folder + "/" + name;
+					// Without an MD5 the restore reports the error itself
+					complete = TWFunc::Path_Exists(file + ".md5") && Add_Verified_File(cmd, file);
+					if (complete)
+						work.jobs.push_back(ORS_Verify_Job(i, file, false));
+					break;
 				}
-				DataManager::SetValue("tw_restore", folder_path);
-
-				PartitionManager.Set_Restore_Files(folder_path);
-				string Partition_List;
-				int is_encrypted = 0;
-				DataManager::GetValue("tw_restore_encrypted", is_encrypted);
-				DataManager::GetValue("tw_restore_list", Partition_List);
-				if (strlen(partitions) != 0) {
-					string Restore_List;
-
-					memset(value2, 0, sizeof(value2));
-					strcpy(value2, partitions);
-					gui_print("Setting restore options: '%s':\n", value2);
-					line_len = strlen(value2);
-					for (i=0; i<line_len; i++) {
-						if ((value2[i] == 'S' || value2[i] == 's') && Partition_List.find("/system;") != string::npos) {
-							Restore_List += "/system;";
-							gui_print("System\n");
-						} else if ((value2[i] == 'D' || value2[i] == 'd') && Partition_List.find("/data;") != string::npos) {
-							Restore_List += "/data;";
-							gui_print("Data\n");
-						} else if ((value2[i] == 'C' || value2[i] == 'c') && Partition_List.find("/cache;") != string::npos) {
-							Restore_List += "/cache;";
-							gui_print("Cache\n");
-						} else if ((value2[i] == 'R' || value2[i] == 'r') && Partition_List.find("/recovery;") != string::npos) {
-							gui_print("Recovery -- Not allowed to restore recovery\n");
-						} else if (value2[i] == '1' && DataManager::GetIntValue(TW_RESTORE_SP1_VAR) > 0) {
-							gui_print("%s\n", "Special1 -- No Longer Supported...");
-						} else if (value2[i] == '2' && DataManager::GetIntValue(TW_RESTORE_SP2_VAR) > 0) {
-							gui_print("%s\n", "Special2 -- No Longer Supported...");
-						} else if (value2[i] == '3' && DataManager::GetIntValue(TW_RESTORE_SP3_VAR) > 0) {
-							gui_print("%s\n", "Special3 -- No Longer Supported...");
-						} else if ((value2[i] == 'B' || value2[i] == 'b') && Partition_List.find("/boot;") != string::npos) {
-							Restore_List += "/boot;";
-							gui_print("Boot\n");
-						} else if ((value2[i] == 'A' || value2[i] == 'a')  && Partition_List.find("/and-sec;") != string::npos) {
-							Restore_List += "/and-sec;";
-							gui_print("Android Secure\n");
-						} else if ((value2[i] == 'E' || value2[i] == 'e')  && Partition_List.find("/sd-ext;") != string::npos) {
-							Restore_List += "/sd-ext;";
-							gui_print("SD-Ext\n");
-						} else if (value2[i] == 'M' || value2[i] == 'm') {
-							DataManager::SetValue(TW_SKIP_MD5_CHECK_VAR, 1);
-							gui_print("MD5 check skip is on\n");
-						}
-					}
-
-					DataManager::SetValue("tw_restore_selected", Restore_List);
-				} else {
-					DataManager::SetValue("tw_restore_selected", Partition_List);
-				}
-				if (is_encrypted) {
-					LOGERR("Unable to use OpenRecoveryScript to restore an encrypted backup.\n");
-					ret_val = 1;
-				} else if (!PartitionManager.Run_Restore(folder_path))
-					ret_val = 1;
-				else
-					gui_print("Restore complete!\n");
-			} else if (strcmp(command, "mount") == 0) {
-				// Mount
-				DataManager::SetValue("tw_action_text2", "Mounting");
-				if (value[0] != '/') {
-					strcpy(mount, "/");
-					strcat(mount, value);
-				} else
-					strcpy(mount, value);
-				if (PartitionManager.Mount_By_Path(mount, true))
-					gui_print("Mounted '%s'\n", mount);
-			} else if (strcmp(command, "unmount") == 0 || strcmp(command, "umount") == 0) {
-				// Unmount
-				DataManager::SetValue("tw_action_text2", "Unmounting");
-				if (value[0] != '/') {
-					strcpy(mount, "/");
-					strcat(mount, value);
-				} else
-					strcpy(mount, value);
-				if (PartitionManager.UnMount_By_Path(mount, true))
-					gui_print("Unmounted '%s'\n", mount);
-			} else if (strcmp(command, "set") == 0) {
-				// Set value
-				tok = strtok(value, " ");
-				strcpy(value1, tok);
-				tok = strtok(NULL, " ");
-				strcpy(value2, tok);
-				gui_print("Setting '%s' to '%s'\n", value1, value2);
-				DataManager::SetValue(value1, value2);
-			} else if (strcmp(command, "mkdir") == 0) {
-				// Make directory (recursive)
-				DataManager::SetValue("tw_action_text2", "Making Directory");
-				gui_print("Making directory (recursive): '%s'\n", value);
-				if (TWFunc::Recursive_Mkdir(value)) {
-					LOGERR("Unable to create folder: '%s'\n", value);
-					ret_val = 1;
-				}
-			} else if (strcmp(command, "reboot") == 0) {
-				// Reboot
-			} else if (strcmp(command, "cmd") == 0) {
-				DataManager::SetValue("tw_action_text2", "Running Command");
-				if (cindex != 0) {
-					TWFunc::Exec_Cmd(value);
-				} else {
-					LOGERR("No value given for cmd\n");
-				}
-			} else if (strcmp(command, "print") == 0) {
-				gui_print("%s\n", value);
-			} else if (strcmp(command, "sideload") == 0) {
-				// ADB Sideload
-				DataManager::SetValue("tw_action_text2", "ADB Sideload");
-				install_cmd = -1;
-
-				int wipe_cache = 0;
-				string result, Sideload_File;
-
-				if (!PartitionManager.Mount_Current_Storage(true)) {
-					ret_val = 1; // failure
-				} else {
-					Sideload_File = DataManager::GetCurrentStoragePath() + "/sideload.zip";
-					if (TWFunc::Path_Exists(Sideload_File)) {
-						unlink(Sideload_File.c_str());
-					}
-					gui_print("Starting ADB sideload feature...\n");
-					DataManager::SetValue("tw_has_cancel", 1);
-					DataManager::SetValue("tw_cancel_action", "adbsideloadcancel");
-					ret_val = apply_from_adb(Sideload_File.c_str());
-					DataManager::SetValue("tw_has_cancel", 0);
-					if (ret_val != 0)
-						ret_val = 1; // failure
-					else if (TWinstall_zip(Sideload_File.c_str(), &wipe_cache) == 0) {
-						if (wipe_cache)
-							PartitionManager.Wipe_By_Path("/cache");
-					} else {
-						ret_val = 1; // failure
-					}
-					sideload = 1; // Causes device to go to the home screen afterwards
-					gui_print("Sideload finished.\n");
-				}
+			}
+			closedir(d);
+			if (complete && work.jobs.size() > first_job) {
+				cmd.verified_path = folder;
 			} else {
-				LOGERR("Unrecognized script command: '%s'\n", command);
-				ret_val = 1;
+				work.jobs.erase(work.jobs.begin() + first_job, work.jobs.end());
+				cmd.verified_files.clear();
 			}
 		}
-		fclose(fp);
-		gui_print("Done processing script file\n");
-	} else {
-		LOGERR("Error opening script file '%s'\n", SCRIPT_FILE_TMP);
-		return 1;
 	}
+	DataManager::SetValue(TW_USE_EXTERNAL_STORAGE, use_external);
+	if (work.jobs.empty())
+		return true;
+
+	gui_print("Verifying %lu files before running the script...\n", (unsigned long) work.jobs.size());
+	pthread_mutex_init(&work.lock, NULL);
+	work.next = 0;
+	if (cpus > MAX_VERIFY_THREADS)
+		cpus = MAX_VERIFY_THREADS;
+	if (cpus > (int) work.jobs.size())
+		cpus = work.jobs.size();
+	for (int i = 1; i < cpus; i++) {
+		if (pthread_create(&threads[thread_count], NULL, Verify_Thread, &work) == 0)
+			thread_count++;
+	}
+	Verify_Thread(&work);
+	for (int i = 0; i < thread_count; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&work.lock);
+
+	for (size_t i = 0; i < work.jobs.size(); i++) {
+		ORS_Verify_Job& job = work.jobs[i];
+		if (job.ok)
+			continue;
+
+		ORS_Command& cmd = Script[job.command];
+		cmd.verified_path.clear();
+		cmd.verified_files.clear();
+		if (job.command < first_change) {
+			LOGERR("Verification of '%s' failed.\n", job.path.c_str());
+			ret = false;
+		} else {
+			LOGINFO("Verification of '%s' failed, it will be checked again when it is used\n", job.path.c_str());
+		}
+	}
+	if (!ret)
+		LOGERR("Nothing in the script was run.\n");
+	return ret;
+}
+
+bool OpenRecoveryScript::Is_Verified(const ORS_Command* Planned, const string& Path) {
+	struct stat st;
+
+	if (Planned == NULL || Planned->verified_path.empty() || Planned->verified_path != Path)
+		return false;
+	// A set since the check may have turned signature checks on
+	if (Planned->command == "install" && !Planned->zip_verify && DataManager::GetIntValue(TW_SIGNED_ZIP_VERIFY_VAR))
+		return false;
+	for (size_t i = 0; i < Planned->verified_files.size(); i++) {
+		const ORS_File& file = Planned->verified_files[i];
+		if (stat(file.path.c_str(), &st) != 0 || st.st_size != file.size || st.st_mtime != file.mtime)
+			return false;
+	}
+	return true;
+}
+
+int OpenRecoveryScript::run_script_file(void) {
+	vector<ORS_Command> script;
+	int ret_val = 0, install_cmd = 0, sideload = 0;
+	bool storage_mounted;
+
+	if (!Parse_Script(SCRIPT_FILE_TMP, script))
+		return 1;
+
+	DataManager::SetValue(TW_SIMULATE_ACTIONS, 0);
+	DataManager::SetValue("ui_progress", 0); // Reset the progress bar
+	Merge_Wipes(script);
+	PartitionManager.Mount_All_Storage();
+	storage_mounted = true;
+	if (!Verify_Script(script))
+		ret_val = 1;
+
+	PartitionManager.Set_Batch_Mode(true);
+	for (size_t i = 0; i < script.size() && ret_val == 0; i++)
+		ret_val = Run_Command(script[i], storage_mounted, install_cmd, sideload);
+	PartitionManager.Set_Batch_Mode(false);
+	gui_print("Done processing script file\n");
+
 	if (install_cmd && DataManager::GetIntValue(TW_HAS_INJECTTWRP) == 1 && DataManager::GetIntValue(TW_INJECT_AFTER_ZIP) == 1) {
 		gui_print("Injecting TWRP into boot image...\n");
 		TWPartition* Boot = PartitionManager.Find_Partition_By_Path("/boot");
@@ -380,6 +415,242 @@ int OpenRecoveryScript::run_script_file(void) {
 	return ret_val;
 }
 
+int OpenRecoveryScript::Run_Command(ORS_Command& Command, bool& Storage_Mounted, int& Install_Cmd, int& Sideload) {
+	const string& command = Command.command;
+	string value = Command.value;
+	int ret_val = 0;
+
+	if (command == "install") {
+		// Install Zip
+		DataManager::SetValue("tw_action_text2", "Installing Zip");
+		if (PartitionManager.Finish_Batch_Operations())
+			Storage_Mounted = false;
+		if (!Storage_Mounted)
+			PartitionManager.Mount_All_Storage();
+		ret_val = Install_Command(value, &Command);
+		Install_Cmd = -1;
+	} else if (command == "wipe") {
+		// Wipe, adjacent wipes were merged by Merge_Wipes
+		Run_Wipes(Command.wipes);
+	} else if (command == "backup") {
+		// Backup
+		DataManager::SetValue("tw_action_text2", "Backing Up");
+		size_t pos = value.find(' ');
+		string options = value.substr(0, pos);
+		if (pos != string::npos && pos + 1 < value.size()) {
+			string name = value.substr(pos + 1);
+			pos = name.find(' ');
+			if (pos != string::npos)
+				name.resize(pos);
+			DataManager::SetValue(TW_BACKUP_NAME, name);
+			gui_print("Backup folder set to '%s'\n", name.c_str());
+			if (PartitionManager.Check_Backup_Name(true) != 0)
+				return 1;
+		} else {
+			DataManager::SetValue(TW_BACKUP_NAME, "(Current Date)");
+		}
+		ret_val = Backup_Command(options);
+	} else if (command == "restore") {
+		// Restore
+		DataManager::SetValue("tw_action_text2", "Restoring");
+		if (!Storage_Mounted)
+			PartitionManager.Mount_All_Storage();
+		ret_val = Restore_Command(value, &Command);
+	} else if (command == "mount") {
+		// Mount
+		DataManager::SetValue("tw_action_text2", "Mounting");
+		string mount = (value.empty() || value[0] != '/') ? "/" + value : value;
+		if (PartitionManager.Mount_By_Path(mount, true))
+			gui_print("Mounted '%s'\n", mount.c_str());
+	} else if (command == "unmount" || command == "umount") {
+		// Unmount
+		DataManager::SetValue("tw_action_text2", "Unmounting");
+		string mount = (value.empty() || value[0] != '/') ? "/" + value : value;
+		if (PartitionManager.UnMount_By_Path(mount, true))
+			gui_print("Unmounted '%s'\n", mount.c_str());
+	} else if (command == "set") {
+		// Set value
+		size_t pos = value.find(' ');
+		string var = value.substr(0, pos), val;
+		if (pos != string::npos) {
+			val = value.substr(pos + 1);
+			pos = val.find(' ');
+			if (pos != string::npos)
+				val.resize(pos);
+		}
+		gui_print("Setting '%s' to '%s'\n", var.c_str(), val.c_str());
+		DataManager::SetValue(var, val);
+	} else if (command == "mkdir") {
+		// Make directory (recursive)
+		DataManager::SetValue("tw_action_text2", "Making Directory");
+		gui_print("Making directory (recursive): '%s'\n", value.c_str());
+		if (TWFunc::Recursive_Mkdir(value)) {
+			LOGERR("Unable to create folder: '%s'\n", value.c_str());
+			ret_val = 1;
+		}
+	} else if (command == "reboot") {
+		// Reboot
+	} else if (command == "cmd") {
+		DataManager::SetValue("tw_action_text2", "Running Command");
+		if (Command.has_value) {
+			TWFunc::Exec_Cmd(value);
+		} else {
+			LOGERR("No value given for cmd\n");
+		}
+	} else if (command == "print") {
+		gui_print("%s\n", value.c_str());
+	} else if (command == "benchmark") {
+		// Time backups and restores of generated files, see twrpBenchmark.hpp
+		DataManager::SetValue("tw_action_text2", "Benchmarking");
+		ret_val = twrpBenchmark::Run(value);
+	} else if (command == "sideload") {
+		// ADB Sideload
+		DataManager::SetValue("tw_action_text2", "ADB Sideload");
+		Install_Cmd = -1;
+
+		int wipe_cache = 0;
+		string result, Sideload_File;
+
+		PartitionManager.Finish_Batch_Operations();
+		if (!PartitionManager.Mount_Current_Storage(true)) {
+			ret_val = 1; // failure
+		} else {
+			Sideload_File = DataManager::GetCurrentStoragePath() + "/sideload.zip";
+			if (TWFunc::Path_Exists(Sideload_File)) {
+				unlink(Sideload_File.c_str());
+			}
+			gui_print("Starting ADB sideload feature...\n");
+			DataManager::SetValue("tw_has_cancel", 1);
+			DataManager::SetValue("tw_cancel_action", "adbsideloadcancel");
+			ret_val = apply_from_adb(Sideload_File.c_str());
+			DataManager::SetValue("tw_has_cancel", 0);
+			if (ret_val != 0)
+				ret_val = 1; // failure
+			else if (TWinstall_zip(Sideload_File.c_str(), &wipe_cache) == 0) {
+				if (wipe_cache)
+					PartitionManager.Wipe_By_Path("/cache");
+			} else {
+				ret_val = 1; // failure
+			}
+			Sideload = 1; // Causes device to go to the home screen afterwards
+			gui_print("Sideload finished.\n");
+		}
+	}
+
+	// The next install or restore mounts storage again if this command
+	// could have unmounted any of it
+	Storage_Mounted = (command == "backup" || command == "mount" || command == "set" ||
+		command == "mkdir" || command == "reboot" || command == "print" || command == "benchmark");
+	return ret_val;
+}
+
+string OpenRecoveryScript::Resolve_Backup_Folder(string Folder) {
+	if (Folder.empty())
+		return Folder;
+	if (Folder[0] == '/') {
+		if (Folder[Folder.size() - 1] == '/')
+			return Folder + ".";
+		return Folder + "/.";
+	}
+
+	string folder_var, backup_folder;
+	DataManager::GetValue(TW_BACKUPS_FOLDER_VAR, folder_var);
+	backup_folder = folder_var + "/" + Folder;
+	LOGINFO("Restoring relative path: '%s'\n", backup_folder.c_str());
+	if (!TWFunc::Path_Exists(backup_folder)) {
+		if (DataManager::GetIntValue(TW_HAS_DUAL_STORAGE)) {
+			if (DataManager::GetIntValue(TW_USE_EXTERNAL_STORAGE)) {
+				LOGINFO("Backup folder '%s' not found on external storage, trying internal...\n", Folder.c_str());
+				DataManager::SetValue(TW_USE_EXTERNAL_STORAGE, 0);
+			} else {
+				LOGINFO("Backup folder '%s' not found on internal storage, trying external...\n", Folder.c_str());
+				DataManager::SetValue(TW_USE_EXTERNAL_STORAGE, 1);
+			}
+			DataManager::GetValue(TW_BACKUPS_FOLDER_VAR, folder_var);
+			backup_folder = folder_var + "/" + Folder;
+			LOGINFO("2Restoring relative path: '%s'\n", backup_folder.c_str());
+		}
+	}
+	return backup_folder;
+}
+
+int OpenRecoveryScript::Restore_Command(string Value, const ORS_Command* Planned) {
+	string restore_folder, partitions, folder_path;
+	int check_md5 = 0;
+
+	DataManager::SetValue(TW_SKIP_MD5_CHECK_VAR, 0);
+	Split_Restore_Value(Value, restore_folder, partitions);
+	LOGINFO("Restore folder is: '%s' and partitions: '%s'\n", restore_folder.c_str(), partitions.c_str());
+	gui_print("Restoring '%s'\n", restore_folder.c_str());
+
+	folder_path = Resolve_Backup_Folder(restore_folder);
+	if (folder_path.empty() || !TWFunc::Path_Exists(folder_path)) {
+		gui_print("Unable to locate backup '%s'\n", folder_path.c_str());
+		return 1;
+	}
+	DataManager::SetValue("tw_restore", folder_path);
+
+	PartitionManager.Set_Restore_Files(folder_path);
+	string Partition_List;
+	int is_encrypted = 0;
+	DataManager::GetValue("tw_restore_encrypted", is_encrypted);
+	DataManager::GetValue("tw_restore_list", Partition_List);
+	if (!partitions.empty()) {
+		string Restore_List;
+
+		gui_print("Setting restore options: '%s':\n", partitions.c_str());
+		for (size_t i = 0; i < partitions.size(); i++) {
+			char c = partitions[i];
+			if ((c == 'S' || c == 's') && Partition_List.find("/system;") != string::npos) {
+				Restore_List += "/system;";
+				gui_print("System\n");
+			} else if ((c == 'D' || c == 'd') && Partition_List.find("/data;") != string::npos) {
+				Restore_List += "/data;";
+				gui_print("Data\n");
+			} else if ((c == 'C' || c == 'c') && Partition_List.find("/cache;") != string::npos) {
+				Restore_List += "/cache;";
+				gui_print("Cache\n");
+			} else if ((c == 'R' || c == 'r') && Partition_List.find("/recovery;") != string::npos) {
+				gui_print("Recovery -- Not allowed to restore recovery\n");
+			} else if (c == '1' && DataManager::GetIntValue(TW_RESTORE_SP1_VAR) > 0) {
+				gui_print("%s\n", "Special1 -- No Longer Supported...");
+			} else if (c == '2' && DataManager::GetIntValue(TW_RESTORE_SP2_VAR) > 0) {
+				gui_print("%s\n", "Special2 -- No Longer Supported...");
+			} else if (c == '3' && DataManager::GetIntValue(TW_RESTORE_SP3_VAR) > 0) {
+				gui_print("%s\n", "Special3 -- No Longer Supported...");
+			} else if ((c == 'B' || c == 'b') && Partition_List.find("/boot;") != string::npos) {
+				Restore_List += "/boot;";
+				gui_print("Boot\n");
+			} else if ((c == 'A' || c == 'a')  && Partition_List.find("/and-sec;") != string::npos) {
+				Restore_List += "/and-sec;";
+				gui_print("Android Secure\n");
+			} else if ((c == 'E' || c == 'e')  && Partition_List.find("/sd-ext;") != string::npos) {
+				Restore_List += "/sd-ext;";
+				gui_print("SD-Ext\n");
+			} else if (c == 'M' || c == 'm') {
+				DataManager::SetValue(TW_SKIP_MD5_CHECK_VAR, 1);
+				gui_print("MD5 check skip is on\n");
+			}
+		}
+
+		DataManager::SetValue("tw_restore_selected", Restore_List);
+	} else {
+		DataManager::SetValue("tw_restore_selected", Partition_List);
+	}
+	DataManager::GetValue(TW_SKIP_MD5_CHECK_VAR, check_md5);
+	if (check_md5 > 0 && Is_Verified(Planned, folder_path)) {
+		gui_print("MD5 was verified before the script started.\n");
+		DataManager::SetValue(TW_SKIP_MD5_CHECK_VAR, 0);
+	}
+	if (is_encrypted) {
+		LOGERR("Unable to use OpenRecoveryScript to restore an encrypted backup.\n");
+		return 1;
+	} else if (!PartitionManager.Run_Restore(folder_path))
+		return 1;
+	gui_print("Restore complete!\n");
+	return 0;
+}
+
 int OpenRecoveryScript::Insert_ORS_Command(string Command) {
 	ofstream ORSfile(SCRIPT_FILE_TMP);
 	if (ORSfile.is_open()) {
@@ -394,12 +665,9 @@ int OpenRecoveryScript::Insert_ORS_Command(string Command) {
 	return 0;
 }
 
-int OpenRecoveryScript::Install_Command(string Zip) {
-	// Install zip
+string OpenRecoveryScript::Resolve_Zip(string Zip) {
 	string ret_string;
-	int ret_val = 0, wipe_cache = 0;
 
-	PartitionManager.Mount_All_Storage();
 	if (Zip.substr(0, 1) != "/") {
 		// Relative path given
 		string Full_Path;
@@ -427,20 +695,30 @@ int OpenRecoveryScript::Install_Command(string Zip) {
 					Full_Path = ret_string;
 			}
 		}
-		Zip = Full_Path;
-	} else {
-		// Full path given
-		if (!TWFunc::Path_Exists(Zip)) {
-			ret_string = Locate_Zip_File(Zip, DataManager::GetCurrentStoragePath());
-			if (!ret_string.empty())
-				Zip = ret_string;
-		}
+		return Full_Path;
+	}
+
+	// Full path given
+	if (!TWFunc::Path_Exists(Zip)) {
+		ret_string = Locate_Zip_File(Zip, DataManager::GetCurrentStoragePath());
+		if (!ret_string.empty())
+			Zip = ret_string;
 	}
+	return Zip;
+}
+
+int OpenRecoveryScript::Install_Command(string Zip, const ORS_Command* Planned) {
+	// Install zip
+	int ret_val = 0, wipe_cache = 0;
 
+	Zip = Resolve_Zip(Zip);
 	if (!TWFunc::Path_Exists(Zip)) {
 		// zip file doesn't exist
 		gui_print("Unable to locate zip file '%s'.\n", Zip.c_str());
 		ret_val = 1;
+	} else if (Is_Verified(Planned, Zip)) {
+		gui_print("Installing zip file '%s', verified before the script started\n", Zip.c_str());
+		ret_val = TWinstall_verified_zip(Zip.c_str(), &wipe_cache);
 	} else {
 		gui_print("Installing zip file '%s'\n", Zip.c_str());
 		ret_val = TWinstall_zip(Zip.c_str(), &wipe_cache);
@@ -23,10 +23,29 @@
 #ifndef _OPENRECOVERYSCRIPT_HPP
 #define _OPENRECOVERYSCRIPT_HPP
 
+#include <sys/types.h>
 #include <string>
+#include <vector>
 
 using namespace std;
 
+struct ORS_File {
+	string path;
+	off_t size;
+	time_t mtime;
+};
+
+// One line of the script, or a run of wipe lines merged into one
+struct ORS_Command {
+	string command;
+	string value;
+	bool has_value;
+	vector<string> wipes;                                                          // "cache", "dalvik" and/or "data" for a wipe
+	string verified_path;                                                          // Zip or backup folder checked before the script started
+	vector<ORS_File> verified_files;                                               // What was checked, to notice changes made since
+	int zip_verify;                                                                // tw_signed_zip_verify the zip was checked with
+};
+
 // Partition class
 class OpenRecoveryScript
 {
@@ -34,10 +53,21 @@ public:
 	static int check_for_script_file();                                            // Checks to see if the ORS file is present in /cache
 	static int run_script_file();                                                  // Executes the commands in the ORS file
 	static int Insert_ORS_Command(string Command);                                 // Inserts the Command into the SCRIPT_FILE_TMP file
-	static int Install_Command(string Zip);                                        // Installs a zip
+	static int Install_Command(string Zip, const ORS_Command* Planned = NULL);     // Installs a zip
 	static string Locate_Zip_File(string Path, string File);                       // Attempts to locate the zip file in storage
 	static int Backup_Command(string Options);                                     // Runs a backup
+	static int Restore_Command(string Value, const ORS_Command* Planned = NULL);    // Runs a restore
 	static void Run_OpenRecoveryScript();                                          // Starts the GUI Page for running OpenRecoveryScript
-};
 
+private:
+	static bool Parse_Script(const char* File, vector<ORS_Command>& Script);       // Reads every line up front and rejects unknown commands
+	static void Merge_Wipes(vector<ORS_Command>& Script);                          // Turns adjacent wipes into one without repeats
+	static bool Verify_Script(vector<ORS_Command>& Script);                        // Checks all zips and backups at once, false to stop before anything runs
+	static int Run_Command(ORS_Command& Command, bool& Storage_Mounted, int& Install_Cmd, int& Sideload);
+	static void Run_Wipes(const vector<string>& Wipes);
+	static string Resolve_Zip(string Zip);                                         // Full path of a zip named in the script
+	static string Resolve_Backup_Folder(string Folder);                            // Full path of a backup named in the script
+	static bool Is_Verified(const ORS_Command* Planned, const string& Path);
+	static void* Verify_Thread(void* cookie);
+};
 #endif // _OPENRECOVERYSCRIPT_HPP
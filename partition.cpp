@@ -28,8 +28,10 @@
 #include <sys/mount.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <pthread.h>
 #include <iostream>
 #include <sstream>
+#include <map>
 
 #ifdef TW_INCLUDE_CRYPTO
 	#include "cutils/properties.h"
@@ -43,6 +45,10 @@
 #include "twrp-functions.hpp"
 #include "twrpDigest.hpp"
 #include "twrpTar.hpp"
+#include "twrpDU.hpp"
+#include "twrpBlockIO.hpp"
+#include "twrpRemove.hpp"
+#include "twrpExec.hpp"
 extern "C" {
 	#include "mtdutils/mtdutils.h"
 	#include "mtdutils/mounts.h"
@@ -56,6 +62,16 @@ extern "C" {
 
 using namespace std;
 
+#define SURFACE_WIPE_DIR "/tmp/surfaces-wipe"
+
+// Shared results of the startup probe. Process_Fstab fills these once so
+// every partition doesn't rescan /proc/partitions and rerun blkid.
+static pthread_mutex_t probe_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool probe_snapshot = false;
+static bool probe_sizes_valid = false;
+static map<string, unsigned long long> probe_sizes;
+static map<string, string> probe_types;
+
 extern struct selabel_handle *selinux_handle;
 
 TWPartition::TWPartition(const string& fstab_line) {
@@ -450,6 +466,8 @@ bool TWPartition::Process_Flags(string Flags, bool Display_Error) {
 			Ignore_Blkid = true;
 		} else if (strcmp(ptr, "retainlayoutversion") == 0) {
 			Retain_Layout_Version = true;
+		} else if (strcmp(ptr, "blockbackup") == 0) {
+			Backup_Method = BLOCKS;
 		} else if (ptr_len > 8 && strncmp(ptr, "symlink=", 8) == 0) {
 			ptr += 8;
 			Symlink_Path = ptr;
@@ -710,54 +728,22 @@ bool TWPartition::Get_Size_Via_statfs(bool Display_Error) {
 	return true;
 }
 
-bool TWPartition::Get_Size_Via_df(bool Display_Error) {
-	FILE* fp;
-	char command[255], line[512];
-	int include_block = 1;
-	unsigned int min_len;
+bool TWPartition::Get_Size_Via_Mounts(bool Display_Error) {
+	uint64_t size, used, free;
 
 	if (!Mount(Display_Error))
 		return false;
 
-	min_len = Actual_Block_Device.size() + 2;
-	sprintf(command, "df %s > /tmp/dfoutput.txt", Mount_Point.c_str());
-	TWFunc::Exec_Cmd(command);
-	fp = fopen("/tmp/dfoutput.txt", "rt");
-	if (fp == NULL) {
-		LOGINFO("Unable to open /tmp/dfoutput.txt.\n");
+	// The mount point itself may not statfs, e.g. a bind mount in the way,
+	// so look for wherever the block device is mounted
+	if (!twrpBlockIO::Get_Mount_Usage(Actual_Block_Device, size, used, free)) {
+		LOGINFO("Unable to find '%s' in /proc/mounts.\n", Actual_Block_Device.c_str());
 		return false;
 	}
-
-	while (fgets(line, sizeof(line), fp) != NULL)
-	{
-		unsigned long blocks, used, available;
-		char device[64];
-		char tmpString[64];
-
-		if (strncmp(line, "Filesystem", 10) == 0)
-			continue;
-		if (strlen(line) < min_len) {
-			include_block = 0;
-			continue;
-		}
-		if (include_block) {
-			sscanf(line, "%s %lu %lu %lu", device, &blocks, &used, &available);
-		} else {
-			// The device block string is so long that the df information is on the next line
-			int space_count = 0;
-			sprintf(tmpString, "/dev/block/%s", Actual_Block_Device.c_str());
-			while (tmpString[space_count] == 32)
-				space_count++;
-			sscanf(line + space_count, "%lu %lu %lu", &blocks, &used, &available);
-		}
-
-		// Adjust block size to byte size
-		Size = blocks * 1024ULL;
-		Used = used * 1024ULL;
-		Free = available * 1024ULL;
-		Backup_Size = Used;
-	}
-	fclose(fp);
+	Size = size;
+	Used = used;
+	Free = free;
+	Backup_Size = Used;
 	return true;
 }
 
@@ -789,6 +775,16 @@ bool TWPartition::Find_Partition_Size(void) {
 		}
 	}
 
+	if (probe_sizes_valid) {
+		map<string, unsigned long long>::iterator size = probe_sizes.find(Primary_Block_Device);
+		if (size == probe_sizes.end())
+			size = probe_sizes.find(Alternate_Block_Device);
+		if (size == probe_sizes.end())
+			return false;
+		Size = size->second;
+		return true;
+	}
+
 	// In this case, we'll first get the partitions we care about (with labels)
 	fp = fopen("/proc/partitions", "rt");
 	if (fp == NULL)
@@ -877,9 +873,8 @@ bool TWPartition::Mount(bool Display_Error) {
 	{
 		PartitionManager.Mount_By_Path(Primary_Block_Device, false);
 
-		std::string cmd = "mount -o loop -t ";
-		cmd += Fstab_File_System + " " + Primary_Block_Device + " " + Mount_Point.c_str();
-		if(TWFunc::Exec_Cmd(cmd) != 0)
+		if(TWFunc::Exec_Cmd(twrpExec::Argv("mount", "-o", "loop", "-t", Fstab_File_System.c_str(),
+			Primary_Block_Device.c_str(), Mount_Point.c_str(), NULL)) != 0)
 		{
 			if(Display_Error)
 				LOGERR("Failed to mount image %s!\n", Primary_Block_Device.c_str());
@@ -894,8 +889,9 @@ bool TWPartition::Mount(bool Display_Error) {
 	Check_FS_Type();
 
 	if (Current_File_System == "exfat" && TWFunc::Path_Exists("/sbin/exfat-fuse") && !mounted) {
-		string cmd = "/sbin/exfat-fuse -o big_writes,max_read=131072,max_write=131072 " + Actual_Block_Device + " " + Mount_Point;
-		LOGINFO("cmd: %s\n", cmd.c_str());
+		vector<string> cmd = twrpExec::Argv("/sbin/exfat-fuse", "-o", "big_writes,max_read=131072,max_write=131072",
+			Actual_Block_Device.c_str(), Mount_Point.c_str(), NULL);
+		LOGINFO("cmd: %s\n", twrpExec::To_String(cmd).c_str());
 		string result;
 		if (TWFunc::Exec_Cmd(cmd, result) != 0) {
 			LOGINFO("exfat-fuse failed to mount with result '%s', trying vfat\n", result.c_str());
@@ -994,8 +990,7 @@ bool TWPartition::Mount(bool Display_Error) {
 		Update_Size(Display_Error);
 
 	if (!Symlink_Mount_Point.empty()) {
-		string Command = "mount '" + Symlink_Path + "' '" + Symlink_Mount_Point + "'";
-		TWFunc::Exec_Cmd(Command);
+		TWFunc::Exec_Cmd(twrpExec::Argv("mount", Symlink_Path.c_str(), Symlink_Mount_Point.c_str(), NULL));
 	}
 	return true;
 }
@@ -1008,6 +1003,12 @@ bool TWPartition::UnMount(bool Display_Error) {
 		if (never_unmount_system == 1 && Mount_Point == "/system")
 			return true; // Never unmount system if you're not supposed to unmount it
 
+		// Write out any pending settings changes before their storage goes
+		// away, and keep the settings writer off it until it is unmounted
+		bool settings_storage = PartitionManager.Find_Partition_By_Path(DataManager::GetSettingsStoragePath()) == this;
+		if (settings_storage)
+			DataManager::LockStorage();
+
 #ifdef TW_INCLUDE_CRYPTO_SAMSUNG
 		if (EcryptFS_Password.size() > 0) {
 			if (unmount_ecryptfs_drive(Mount_Point.c_str()) != 0) {
@@ -1027,9 +1028,12 @@ bool TWPartition::UnMount(bool Display_Error) {
 		if(!Is_ImageMount)
 			umount(Mount_Point.c_str());
 		else
-			TWFunc::Exec_Cmd(string("umount -d ") + Mount_Point);
+			TWFunc::Exec_Cmd(twrpExec::Argv("umount", "-d", Mount_Point.c_str(), NULL));
 
-		if (Is_Mounted()) {
+		bool unmounted = !Is_Mounted();
+		if (settings_storage)
+			DataManager::UnlockStorage();
+		if (!unmounted) {
 			if (Display_Error)
 				LOGERR("Unable to unmount '%s'\n", Mount_Point.c_str());
 			else
@@ -1052,6 +1056,9 @@ bool TWPartition::Wipe(string New_File_System) {
 		return false;
 	}
 
+	// Folder sizes cached before the wipe can't be trusted afterwards
+	twrpDU::Clear_Cache();
+
 	if (Mount_Point == "/cache")
 		Log_Offset = 0;
 
@@ -1067,6 +1074,14 @@ bool TWPartition::Wipe(string New_File_System) {
 	else
 		unlink("/.layout_version");
 
+	// Decoded theme images survive a cache wipe the same way
+	bool keep_surfaces = false;
+	if (Mount_Point == "/cache" && Mount(false) && TWFunc::Path_Exists(SURFACE_CACHE_DIR)) {
+		if (TWFunc::Path_Exists(SURFACE_WIPE_DIR))
+			twrpRemove::Remove_Tree(SURFACE_WIPE_DIR, false);
+		keep_surfaces = TWFunc::Exec_Cmd(twrpExec::Argv("cp", "-a", SURFACE_CACHE_DIR, SURFACE_WIPE_DIR, NULL)) == 0;
+	}
+
 	if (Has_Data_Media) {
 		wiped = Wipe_Data_Without_Wiping_Media();
 	} else {
@@ -1111,6 +1126,9 @@ bool TWPartition::Wipe(string New_File_System) {
 		if (TWFunc::Path_Exists("/.layout_version") && Mount(false))
 			TWFunc::copy_file("/.layout_version", Layout_Filename, 0600);
 
+		if (keep_surfaces && Mount(false) && TWFunc::Recursive_Mkdir(SURFACE_CACHE_DIR "/"))
+			TWFunc::Exec_Cmd(twrpExec::Argv("cp", "-a", SURFACE_WIPE_DIR "/.", SURFACE_CACHE_DIR, NULL));
+
 		if (update_crypt) {
 			Setup_File_System(false);
 			if (Is_Encrypted && !Is_Decrypted) {
@@ -1125,6 +1143,8 @@ bool TWPartition::Wipe(string New_File_System) {
 			}
 		}
 	}
+	if (keep_surfaces)
+		twrpRemove::Remove_Tree(SURFACE_WIPE_DIR, false);
 	return wiped;
 }
 
@@ -1154,6 +1174,8 @@ bool TWPartition::Backup(string backup_folder) {
 		return Backup_DD(backup_folder);
 	else if (Backup_Method == FLASH_UTILS)
 		return Backup_Dump_Image(backup_folder);
+	else if (Backup_Method == BLOCKS)
+		return Backup_Blocks(backup_folder);
 	LOGERR("Unknown backup method for '%s'\n", Mount_Point.c_str());
 	return false;
 }
@@ -1210,6 +1232,7 @@ bool TWPartition::Restore(string restore_folder) {
 	size_t first_period, second_period;
 	string Restore_File_System;
 
+	twrpDU::Clear_Cache();
 	TWFunc::GUI_Operation_Text(TW_RESTORE_TEXT, Display_Name, "Restoring");
 	LOGINFO("Restore filename is: %s\n", Backup_FileName.c_str());
 
@@ -1228,8 +1251,12 @@ bool TWPartition::Restore(string restore_folder) {
 	Restore_File_System.resize(second_period);
 	LOGINFO("Restore file system is: '%s'.\n", Restore_File_System.c_str());
 
-	if (Is_File_System(Restore_File_System))
+	if (Is_File_System(Restore_File_System)) {
+		// Block backups keep the file system name, they are told apart by content
+		if (twrpBlockIO::Is_Sparse_Image(restore_folder + "/" + Backup_FileName))
+			return Restore_Blocks(restore_folder, Restore_File_System);
 		return Restore_Tar(restore_folder, Restore_File_System);
+	}
 	else if (Is_Image(Restore_File_System)) {
 		if (Restore_File_System == "emmc")
 			return Restore_DD(restore_folder);
@@ -1250,6 +1277,8 @@ string TWPartition::Backup_Method_By_Name() {
 		return "dd";
 	else if (Backup_Method == FLASH_UTILS)
 		return "flash_utils";
+	else if (Backup_Method == BLOCKS)
+		return "blocks";
 	else
 		return "undefined";
 	return "ERROR!";
@@ -1297,6 +1326,22 @@ void TWPartition::Check_FS_Type() {
 	if (!Is_Present)
 		return;
 
+	if (probe_snapshot) {
+		map<string, string>::iterator probed;
+		bool found = false;
+
+		pthread_mutex_lock(&probe_lock);
+		probed = probe_types.find(Actual_Block_Device);
+		if (probed != probe_types.end()) {
+			found = true;
+			if (!probed->second.empty())
+				Current_File_System = probed->second;
+		}
+		pthread_mutex_unlock(&probe_lock);
+		if (found)
+			return;
+	}
+
 	pr = blkid_new_probe_from_filename(Actual_Block_Device.c_str());
 	if (blkid_do_fullprobe(pr)) {
 		blkid_free_probe(pr);
@@ -1314,17 +1359,100 @@ void TWPartition::Check_FS_Type() {
 	blkid_free_probe(pr);
 }
 
+void TWPartition::Start_Probe_Snapshot(void) {
+	FILE* fp;
+	char line[512];
+
+	probe_sizes.clear();
+	probe_types.clear();
+	probe_snapshot = true;
+	// dumchar_info devices are looked up the old way, there is no snapshot for them
+	if (TWFunc::Path_Exists("/proc/dumchar_info"))
+		return;
+
+	fp = fopen("/proc/partitions", "rt");
+	if (fp == NULL)
+		return;
+
+	while (fgets(line, sizeof(line), fp) != NULL)
+	{
+		unsigned long major, minor, blocks;
+		char device[512];
+
+		if (strlen(line) < 7 || line[0] == 'm')	 continue;
+		if (sscanf(line + 1, "%lu %lu %lu %s", &major, &minor, &blocks, device) != 4)
+			continue;
+
+		// Adjust block size to byte size
+		probe_sizes[string("/dev/block/") + device] = blocks * 1024ULL;
+	}
+	fclose(fp);
+	probe_sizes_valid = true;
+}
+
+void TWPartition::Probe_Block_Device(string Block_Device) {
+	const char* type;
+	string result;
+	blkid_probe pr;
+
+	if (!probe_snapshot)
+		return;
+
+	pthread_mutex_lock(&probe_lock);
+	bool probed = probe_types.find(Block_Device) != probe_types.end();
+	pthread_mutex_unlock(&probe_lock);
+	if (probed || !TWFunc::Path_Exists(Block_Device))
+		return;
+
+	// Failed probes are kept too, Check_FS_Type would only fail again
+	pr = blkid_new_probe_from_filename(Block_Device.c_str());
+	if (pr == NULL)
+		return;
+	if (blkid_do_fullprobe(pr) == 0 && blkid_probe_lookup_value(pr, "TYPE", &type, NULL) >= 0)
+		result = type;
+	blkid_free_probe(pr);
+
+	pthread_mutex_lock(&probe_lock);
+	probe_types[Block_Device] = result;
+	pthread_mutex_unlock(&probe_lock);
+}
+
+void TWPartition::End_Probe_Snapshot(void) {
+	probe_snapshot = false;
+	probe_sizes_valid = false;
+	probe_sizes.clear();
+	probe_types.clear();
+}
+
+void TWPartition::Discard_Block_Device(void) {
+	uint64_t size, length = 0;
+
+	if (!twrpBlockIO::Get_Size(Actual_Block_Device, size))
+		return;
+	// Length only applies to the raw device, a decrypted device is all file system
+	if (!Is_Decrypted && Length < 0) {
+		if ((uint64_t)(-Length) >= size)
+			return;
+		length = size + Length;
+	} else if (!Is_Decrypted && Length > 0) {
+		length = Length;
+	}
+	if (twrpBlockIO::Discard(Actual_Block_Device, length))
+		LOGINFO("Discarded '%s'\n", Actual_Block_Device.c_str());
+}
+
 bool TWPartition::Wipe_EXT23(string File_System) {
 	if (!UnMount(true))
 		return false;
 
 	if (TWFunc::Path_Exists("/sbin/mke2fs")) {
-		string command;
+		vector<string> command;
 
 		gui_print("Formatting %s using mke2fs...\n", Display_Name.c_str());
 		Find_Actual_Block_Device();
-		command = "mke2fs -t " + File_System + " -m 0 " + Actual_Block_Device;
-		LOGINFO("mke2fs command: %s\n", command.c_str());
+		Discard_Block_Device();
+		command = twrpExec::Argv("mke2fs", "-t", File_System.c_str(), "-m", "0", Actual_Block_Device.c_str(), NULL);
+		LOGINFO("mke2fs command: %s\n", twrpExec::To_String(command).c_str());
 		if (TWFunc::Exec_Cmd(command) == 0) {
 			Current_File_System = File_System;
 			Recreate_AndSec_Folder();
@@ -1346,6 +1474,7 @@ bool TWPartition::Wipe_EXT4() {
 
 #if defined(HAVE_SELINUX) && defined(USE_EXT4)
 	gui_print("Formatting %s using make_ext4fs function.\n", Display_Name.c_str());
+	Discard_Block_Device();
 	if (make_ext4fs(Actual_Block_Device.c_str(), Length, Mount_Point.c_str(), selinux_handle) != 0) {
 		LOGERR("Unable to wipe '%s' using function call.\n", Mount_Point.c_str());
 		return false;
@@ -1354,23 +1483,27 @@ bool TWPartition::Wipe_EXT4() {
 	}
 #else
 	if (TWFunc::Path_Exists("/sbin/make_ext4fs")) {
-		string Command;
+		vector<string> Command;
 
 		gui_print("Formatting %s using make_ext4fs...\n", Display_Name.c_str());
 		Find_Actual_Block_Device();
-		Command = "make_ext4fs";
+		Discard_Block_Device();
+		Command.push_back("make_ext4fs");
 		if (!Is_Decrypted && Length != 0) {
 			// Only use length if we're not decrypted
 			char len[32];
 			sprintf(len, "%i", Length);
-			Command += " -l ";
-			Command += len;
+			Command.push_back("-l");
+			Command.push_back(len);
 		}
 		if (TWFunc::Path_Exists("/file_contexts")) {
-			Command += " -S /file_contexts";
+			Command.push_back("-S");
+			Command.push_back("/file_contexts");
 		}
-		Command += " -a " + Mount_Point + " " + Actual_Block_Device;
-		LOGINFO("make_ext4fs command: %s\n", Command.c_str());
+		Command.push_back("-a");
+		Command.push_back(Mount_Point);
+		Command.push_back(Actual_Block_Device);
+		LOGINFO("make_ext4fs command: %s\n", twrpExec::To_String(Command).c_str());
 		if (TWFunc::Exec_Cmd(Command) == 0) {
 			Current_File_System = "ext4";
 			Recreate_AndSec_Folder();
@@ -1387,16 +1520,13 @@ bool TWPartition::Wipe_EXT4() {
 }
 
 bool TWPartition::Wipe_FAT() {
-	string command;
-
 	if (TWFunc::Path_Exists("/sbin/mkdosfs")) {
 		if (!UnMount(true))
 			return false;
 
 		gui_print("Formatting %s using mkdosfs...\n", Display_Name.c_str());
 		Find_Actual_Block_Device();
-		command = "mkdosfs " + Actual_Block_Device;
-		if (TWFunc::Exec_Cmd(command) == 0) {
+		if (TWFunc::Exec_Cmd(twrpExec::Argv("mkdosfs", Actual_Block_Device.c_str(), NULL)) == 0) {
 			Current_File_System = "vfat";
 			Recreate_AndSec_Folder();
 			gui_print("Done.\n");
@@ -1414,16 +1544,13 @@ bool TWPartition::Wipe_FAT() {
 }
 
 bool TWPartition::Wipe_EXFAT() {
-	string command;
-
 	if (TWFunc::Path_Exists("/sbin/mkexfatfs")) {
 		if (!UnMount(true))
 			return false;
 
 		gui_print("Formatting %s using mkexfatfs...\n", Display_Name.c_str());
 		Find_Actual_Block_Device();
-		command = "mkexfatfs " + Actual_Block_Device;
-		if (TWFunc::Exec_Cmd(command) == 0) {
+		if (TWFunc::Exec_Cmd(twrpExec::Argv("mkexfatfs", Actual_Block_Device.c_str(), NULL)) == 0) {
 			Recreate_AndSec_Folder();
 			gui_print("Done.\n");
 			return true;
@@ -1480,16 +1607,14 @@ bool TWPartition::Wipe_RMRF() {
 }
 
 bool TWPartition::Wipe_F2FS() {
-	string command;
-
 	if (TWFunc::Path_Exists("/sbin/mkfs.f2fs")) {
 		if (!UnMount(true))
 			return false;
 
 		gui_print("Formatting %s using mkfs.f2fs...\n", Display_Name.c_str());
 		Find_Actual_Block_Device();
-		command = "mkfs.f2fs " + Actual_Block_Device;
-		if (TWFunc::Exec_Cmd(command) == 0) {
+		Discard_Block_Device();
+		if (TWFunc::Exec_Cmd(twrpExec::Argv("mkfs.f2fs", Actual_Block_Device.c_str(), NULL)) == 0) {
 			Recreate_AndSec_Folder();
 			gui_print("Done.\n");
 			return true;
@@ -1506,7 +1631,7 @@ bool TWPartition::Wipe_F2FS() {
 }
 
 bool TWPartition::Wipe_Data_Without_Wiping_Media() {
-	string dir;
+	vector<string> keep;
 
 	// This handles wiping data on devices with "sdcard" in /data/media
 	if (!Mount(true))
@@ -1514,32 +1639,15 @@ bool TWPartition::Wipe_Data_Without_Wiping_Media() {
 
 	gui_print("Wiping data without wiping /data/media ...\n");
 
-	DIR* d;
-	d = opendir("/data");
-	if (d != NULL) {
-		struct dirent* de;
-		while ((de = readdir(d)) != NULL) {
-			if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)   continue;
-			// The media folder is the "internal sdcard"
-			// The .layout_version file is responsible for determining whether 4.2 decides up upgrade
-			// the media folder for multi-user.
-			if (strcmp(de->d_name, "media") == 0 || strcmp(de->d_name, ".layout_version") == 0)   continue;
-			
-			dir = "/data/";
-			dir.append(de->d_name);
-			if (de->d_type == DT_DIR) {
-				TWFunc::removeDir(dir, false);
-			} else if (de->d_type == DT_REG || de->d_type == DT_LNK || de->d_type == DT_FIFO || de->d_type == DT_SOCK) {
-				if (!unlink(dir.c_str()))
-					LOGINFO("Unable to unlink '%s'\n", dir.c_str());
-			}
-		}
-		closedir(d);
-		gui_print("Done.\n");
-		return true;
-	}
-	gui_print("Dirent failed to open /data, error!\n");
-	return false;
+	// The media folder is the "internal sdcard"
+	// The .layout_version file is responsible for determining whether 4.2 decides up upgrade
+	// the media folder for multi-user.
+	keep.push_back("media");
+	keep.push_back(".layout_version");
+	if (twrpRemove::Remove_Tree("/data", true, &keep) != 0)
+		LOGINFO("Unable to remove everything under /data\n");
+	gui_print("Done.\n");
+	return true;
 }
 
 bool TWPartition::Backup_Tar(string backup_folder) {
@@ -1561,6 +1669,8 @@ bool TWPartition::Backup_Tar(string backup_folder) {
 	tar.use_compression = use_compression;
 	//exclude Google Music Cache
 	tar.setexcl("/data/data/com.google.android.music/files");
+	if (Mount_Point == "/cache")
+		tar.setexcl(SURFACE_CACHE_DIR);
 #ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
 	DataManager::GetValue("tw_encrypt_backup", use_encryption);
 	if (use_encryption && Can_Encrypt_Backup) {
@@ -1608,13 +1718,30 @@ bool TWPartition::Backup_Tar(string backup_folder) {
 	return true;
 }
 
-bool TWPartition::Backup_DD(string backup_folder) {
-	char back_name[255], backup_size[32];
-	string Full_FileName, Command, DD_BS;
-	int use_compression;
+// Shows how far along an image backup or restore is on the console line
+// that announced it
+struct Image_Progress_State {
+	const char* Text;
+	const char* Name;
+	int Last_Percent;
+};
+
+static void Image_Progress(uint64_t Done, uint64_t Total, void* Cookie) {
+	Image_Progress_State* State = (Image_Progress_State*) Cookie;
+
+	if (Total == 0)
+		return;
+	int Percent = (int)(Done * 100 / Total);
+	if (Percent >= State->Last_Percent + 5 || (Percent == 100 && State->Last_Percent != 100)) {
+		State->Last_Percent = Percent;
+		gui_print_overwrite("%s %s... %i%%\n", State->Text, State->Name, Percent);
+	}
+}
 
-	sprintf(backup_size, "%llu", Backup_Size);
-	DD_BS = backup_size;
+bool TWPartition::Backup_DD(string backup_folder) {
+	char back_name[255];
+	string Full_FileName;
+	Image_Progress_State Progress = { "Backing up", Display_Name.c_str(), 0 };
 
 	TWFunc::GUI_Operation_Text(TW_BACKUP_TEXT, Display_Name, "Backing Up");
 	gui_print("Backing up %s...\n", Display_Name.c_str());
@@ -1624,9 +1751,16 @@ bool TWPartition::Backup_DD(string backup_folder) {
 
 	Full_FileName = backup_folder + "/" + Backup_FileName;
 
-	Command = "dd if=" + Actual_Block_Device + " of='" + Full_FileName + "'" + " bs=" + DD_BS + "c count=1";
-	LOGINFO("Backup command: '%s'\n", Command.c_str());
-	TWFunc::Exec_Cmd(Command);
+	LOGINFO("Backing up '%s' to '%s' (%llu bytes)\n", Actual_Block_Device.c_str(), Full_FileName.c_str(), Backup_Size);
+#ifdef TW_NO_SPARSE_BACKUP
+	if (twrpBlockIO::Copy(Actual_Block_Device, Full_FileName, Backup_Size, Image_Progress, &Progress) != 0) {
+#else
+	// Mostly empty partitions shrink a lot as sparse images, Restore_DD takes either kind
+	if (twrpBlockIO::Backup_Sparse(Actual_Block_Device, Full_FileName, Backup_Size, Image_Progress, &Progress) != 0) {
+#endif
+		LOGERR("Unable to back up '%s'.\n", Mount_Point.c_str());
+		return false;
+	}
 	if (TWFunc::Get_File_Size(Full_FileName) == 0) {
 		LOGERR("Backup file size for '%s' is 0 bytes.\n", Full_FileName.c_str());
 		return false;
@@ -1634,9 +1768,46 @@ bool TWPartition::Backup_DD(string backup_folder) {
 	return true;
 }
 
+bool TWPartition::Backup_Blocks(string backup_folder) {
+	char back_name[255];
+	string Full_FileName;
+	vector<Block_Range> Ranges;
+	uint64_t device_size;
+	int use_encryption = 0;
+	Image_Progress_State Progress = { "Backing up", Backup_Display_Name.c_str(), 0 };
+
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+	DataManager::GetValue("tw_encrypt_backup", use_encryption);
+#endif
+	// Encrypted backups and /data/media need tar, so does anything we can't read the bitmaps of
+	if ((use_encryption && Can_Encrypt_Backup) || Has_Data_Media || Current_File_System.compare(0, 3, "ext") != 0)
+		return Backup_Tar(backup_folder);
+	if (!UnMount(true))
+		return false;
+	if (!twrpBlockIO::Get_Size(Actual_Block_Device, device_size) || device_size % 4096 != 0 ||
+		!twrpBlockIO::Get_Ext4_Used_Ranges(Actual_Block_Device, Ranges)) {
+		LOGINFO("Unable to read the block layout of '%s', backing up files instead.\n", Actual_Block_Device.c_str());
+		return Backup_Tar(backup_folder);
+	}
+
+	TWFunc::GUI_Operation_Text(TW_BACKUP_TEXT, Backup_Display_Name, "Backing Up");
+	gui_print("Backing up %s...\n", Backup_Display_Name.c_str());
+
+	sprintf(back_name, "%s.%s.win", Backup_Name.c_str(), Current_File_System.c_str());
+	Backup_FileName = back_name;
+	Full_FileName = backup_folder + "/" + Backup_FileName;
+
+	LOGINFO("Backing up allocated blocks of '%s' to '%s'\n", Actual_Block_Device.c_str(), Full_FileName.c_str());
+	if (twrpBlockIO::Backup_Sparse(Actual_Block_Device, Full_FileName, device_size, Image_Progress, &Progress, &Ranges) != 0) {
+		LOGERR("Unable to back up '%s'.\n", Mount_Point.c_str());
+		return false;
+	}
+	return true;
+}
+
 bool TWPartition::Backup_Dump_Image(string backup_folder) {
 	char back_name[255];
-	string Full_FileName, Command;
+	string Full_FileName;
 	int use_compression;
 
 	TWFunc::GUI_Operation_Text(TW_BACKUP_TEXT, Display_Name, "Backing Up");
@@ -1647,8 +1818,8 @@ bool TWPartition::Backup_Dump_Image(string backup_folder) {
 
 	Full_FileName = backup_folder + "/" + Backup_FileName;
 
-	Command = "dump_image " + MTD_Name + " '" + Full_FileName + "'";
-	LOGINFO("Backup command: '%s'\n", Command.c_str());
+	vector<string> Command = twrpExec::Argv("dump_image", MTD_Name.c_str(), Full_FileName.c_str(), NULL);
+	LOGINFO("Backup command: '%s'\n", twrpExec::To_String(Command).c_str());
 	TWFunc::Exec_Cmd(Command);
 	if (TWFunc::Get_File_Size(Full_FileName) == 0) {
 		// Actual size may not match backup size due to bad blocks on MTD devices so just check for 0 bytes
@@ -1713,16 +1884,25 @@ bool TWPartition::Restore_Tar(string restore_folder, string Restore_File_System)
 }
 
 bool TWPartition::Restore_DD(string restore_folder) {
-	string Full_FileName, Command;
+	string Full_FileName;
+	Image_Progress_State Progress = { "Restoring", Display_Name.c_str(), 0 };
 
 	TWFunc::GUI_Operation_Text(TW_RESTORE_TEXT, Display_Name, "Restoring");
 	Full_FileName = restore_folder + "/" + Backup_FileName;
 
 	if (!Find_Partition_Size()) {
-		LOGERR("Unable to find partition size for '%s'\n", Mount_Point.c_str());
+		uint64_t device_size;
+		if (!twrpBlockIO::Get_Size(Actual_Block_Device, device_size)) {
+			LOGERR("Unable to find partition size for '%s'\n", Mount_Point.c_str());
+			return false;
+		}
+		Size = device_size;
+	}
+	uint64_t backup_size;
+	if (!twrpBlockIO::Get_Image_Size(Full_FileName, backup_size)) {
+		LOGERR("Unable to read backup '%s'\n", Full_FileName.c_str());
 		return false;
 	}
-	unsigned long long backup_size = TWFunc::Get_File_Size(Full_FileName);
 	if (backup_size > Size) {
 		LOGERR("Size (%iMB) of backup '%s' is larger than target device '%s' (%iMB)\n",
 			(int)(backup_size / 1048576LLU), Full_FileName.c_str(),
@@ -1731,23 +1911,56 @@ bool TWPartition::Restore_DD(string restore_folder) {
 	}
 
 	gui_print("Restoring %s...\n", Display_Name.c_str());
-	Command = "dd bs=4096 if='" + Full_FileName + "' of=" + Actual_Block_Device;
-	LOGINFO("Restore command: '%s'\n", Command.c_str());
-	TWFunc::Exec_Cmd(Command);
+	LOGINFO("Restoring '%s' to '%s'\n", Full_FileName.c_str(), Actual_Block_Device.c_str());
+	if (twrpBlockIO::Restore_Image(Full_FileName, Actual_Block_Device, Image_Progress, &Progress) != 0) {
+		LOGERR("Unable to restore '%s'.\n", Mount_Point.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool TWPartition::Restore_Blocks(string restore_folder, string Restore_File_System) {
+	string Full_FileName;
+	uint64_t image_size, device_size;
+	Image_Progress_State Progress = { "Restoring", Backup_Display_Name.c_str(), 0 };
+
+	TWFunc::GUI_Operation_Text(TW_RESTORE_TEXT, Backup_Display_Name, "Restoring");
+	Full_FileName = restore_folder + "/" + Backup_FileName;
+
+	if (!UnMount(true))
+		return false;
+	if (!twrpBlockIO::Get_Image_Size(Full_FileName, image_size) || !twrpBlockIO::Get_Size(Actual_Block_Device, device_size)) {
+		LOGERR("Unable to read the sizes of '%s' and '%s'\n", Full_FileName.c_str(), Actual_Block_Device.c_str());
+		return false;
+	}
+	if (image_size > device_size) {
+		LOGERR("Size (%iMB) of backup '%s' is larger than target device '%s' (%iMB)\n",
+			(int)(image_size / 1048576LLU), Full_FileName.c_str(),
+			Actual_Block_Device.c_str(), (int)(device_size / 1048576LLU));
+		return false;
+	}
+
+	gui_print("Restoring %s...\n", Backup_Display_Name.c_str());
+	if (twrpBlockIO::Restore_Image(Full_FileName, Actual_Block_Device, Image_Progress, &Progress) != 0) {
+		LOGERR("Unable to restore '%s'.\n", Mount_Point.c_str());
+		return false;
+	}
+	Current_File_System = Restore_File_System;
 	return true;
 }
 
 bool TWPartition::Restore_Flash_Image(string restore_folder) {
-	string Full_FileName, Command;
+	string Full_FileName;
+	vector<string> Command;
 
 	gui_print("Restoring %s...\n", Display_Name.c_str());
 	Full_FileName = restore_folder + "/" + Backup_FileName;
 	// Sometimes flash image doesn't like to flash due to the first 2KB matching, so we erase first to ensure that it flashes
-	Command = "erase_image " + MTD_Name;
-	LOGINFO("Erase command: '%s'\n", Command.c_str());
+	Command = twrpExec::Argv("erase_image", MTD_Name.c_str(), NULL);
+	LOGINFO("Erase command: '%s'\n", twrpExec::To_String(Command).c_str());
 	TWFunc::Exec_Cmd(Command);
-	Command = "flash_image " + MTD_Name + " '" + Full_FileName + "'";
-	LOGINFO("Restore command: '%s'\n", Command.c_str());
+	Command = twrpExec::Argv("flash_image", MTD_Name.c_str(), Full_FileName.c_str(), NULL);
+	LOGINFO("Restore command: '%s'\n", twrpExec::To_String(Command).c_str());
 	TWFunc::Exec_Cmd(Command);
 	return true;
 }
@@ -1767,7 +1980,7 @@ bool TWPartition::Update_Size(bool Display_Error) {
 
 	ret = Get_Size_Via_statfs(Display_Error);
 	if (!ret || Size == 0) {
-		if (!Get_Size_Via_df(Display_Error)) {
+		if (!Get_Size_Via_Mounts(Display_Error)) {
 			if (!Was_Already_Mounted)
 				UnMount(false);
 			return false;
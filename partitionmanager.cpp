@@ -31,8 +31,11 @@
 #include <time.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <iostream>
 #include <iomanip>
+#include <sstream>
+#include <limits.h>
 #include "variables.h"
 #include "twcommon.h"
 #include "partitions.hpp"
@@ -50,10 +53,90 @@
 	#include "cutils/properties.h"
 #endif
 
+#define MAX_PROBE_THREADS 4
+
+struct Parallel_Work {
+	void (*Task)(void* Cookie, size_t Index);
+	void* Cookie;
+	size_t Count;
+	volatile int Next;
+};
+
+static void* Parallel_Worker(void* Cookie) {
+	Parallel_Work* Work = (Parallel_Work*) Cookie;
+	size_t Index;
+
+	while ((Index = (size_t) __sync_fetch_and_add(&Work->Next, 1)) < Work->Count)
+		Work->Task(Work->Cookie, Index);
+	return NULL;
+}
+
+// Calls Task for each index on a small pool of threads, the calling thread included
+static void Run_Parallel(size_t Count, void (*Task)(void* Cookie, size_t Index), void* Cookie) {
+	pthread_t threads[MAX_PROBE_THREADS];
+	int thread_count = 0, cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	Parallel_Work Work;
+
+	Work.Task = Task;
+	Work.Cookie = Cookie;
+	Work.Count = Count;
+	Work.Next = 0;
+
+	if (cpus > MAX_PROBE_THREADS)
+		cpus = MAX_PROBE_THREADS;
+	if (cpus > (int) Count)
+		cpus = Count;
+	for (int i = 1; i < cpus; i++) {
+		if (pthread_create(&threads[thread_count], NULL, Parallel_Worker, &Work) == 0)
+			thread_count++;
+	}
+	Parallel_Worker(&Work);
+	for (int i = 0; i < thread_count; i++)
+		pthread_join(threads[i], NULL);
+}
+
+static void Probe_Task(void* Cookie, size_t Index) {
+	vector<string>* Devices = (vector<string>*) Cookie;
+	TWPartition::Probe_Block_Device(Devices->at(Index));
+}
+
+// Picks the block devices out of the fstab lines so they can be probed
+// before the lines are processed. Devices blkid must not touch are skipped.
+static void Find_Probe_Devices(const vector<string>& Lines, vector<string>& Devices) {
+	for (size_t i = 0; i < Lines.size(); i++) {
+		istringstream line(Lines[i]);
+		vector<string> items;
+		string item, flags;
+
+		while (line >> item)
+			items.push_back(item);
+		if (items.size() < 3)
+			continue;
+		if (items[1] == "mtd" || items[1] == "yaffs2" || items[1] == "bml" || items[1] == "emmc")
+			continue;
+		for (size_t j = 3; j < items.size(); j++) {
+			if (items[j].compare(0, 6, "flags=") == 0)
+				flags = items[j];
+		}
+		if (flags.find("ignoreblkid") != string::npos)
+			continue;
+
+		for (size_t j = 2; j < items.size(); j++) {
+			char device[PATH_MAX];
+
+			if (items[j][0] != '/')
+				continue;
+			if (realpath(items[j].c_str(), device) != NULL)
+				Devices.push_back(device);
+		}
+	}
+}
+
 int TWPartitionManager::Process_Fstab(string Fstab_Filename, bool Display_Error) {
 	FILE *fstabFile;
 	char fstab_line[MAX_FSTAB_LINE_LENGTH];
 	bool Found_Settings_Storage = false;
+	vector<string> lines, devices;
 
 	fstabFile = fopen(Fstab_Filename.c_str(), "rt");
 	if (fstabFile == NULL) {
@@ -68,9 +151,20 @@ int TWPartitionManager::Process_Fstab(string Fstab_Filename, bool Display_Error)
 		if (fstab_line[strlen(fstab_line) - 1] != '\n')
 			fstab_line[strlen(fstab_line)] = '\n';
 
-		TWPartition* partition = new TWPartition();
-		string line = fstab_line;
+		lines.push_back(fstab_line);
 		memset(fstab_line, 0, sizeof(fstab_line));
+	}
+	fclose(fstabFile);
+
+	// Probe every block device up front in parallel, the lines below are
+	// still processed in fstab order and pick up the results
+	TWPartition::Start_Probe_Snapshot();
+	Find_Probe_Devices(lines, devices);
+	Run_Parallel(devices.size(), Probe_Task, &devices);
+
+	for (size_t i = 0; i < lines.size(); i++) {
+		TWPartition* partition = new TWPartition();
+		string line = lines[i];
 
 		if (partition->Process_Fstab_Line(line, Display_Error)) {
 			if (!Found_Settings_Storage && partition->Is_Settings_Storage) {
@@ -87,7 +181,6 @@ int TWPartitionManager::Process_Fstab(string Fstab_Filename, bool Display_Error)
 			delete partition;
 		}
 	}
-	fclose(fstabFile);
 	if (!Found_Settings_Storage) {
 		std::vector<TWPartition*>::iterator iter;
 		for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
@@ -111,6 +204,7 @@ int TWPartitionManager::Process_Fstab(string Fstab_Filename, bool Display_Error)
 	}
 	Update_System_Details();
 	UnMount_Main_Partitions();
+	TWPartition::End_Probe_Snapshot();
 	return true;
 }
 
@@ -803,14 +897,44 @@ int TWPartitionManager::Run_Backup(void) {
 		DataManager::SetValue(TW_BACKUP_AVG_FILE_RATE, file_bps);
 
 	gui_print("[%llu MB TOTAL BACKED UP]\n", actual_backup_size);
-	Update_System_Details();
-	UnMount_Main_Partitions();
+	Finish_Operation();
 	gui_print("[BACKUP COMPLETED IN %d SECONDS]\n\n", total_time); // the end
 	string backup_log = Full_Backup_Path + "recovery.log";
 	TWFunc::copy_file("/tmp/recovery.log", backup_log, 0644);
 	return true;
 }
 
+void TWPartitionManager::Finish_Operation(void) {
+	if (Batch_Mode) {
+		Details_Stale = true;
+		return;
+	}
+	TWFunc::GUI_Operation_Text(TW_UPDATE_SYSTEM_DETAILS_TEXT, "Updating System Details");
+	Update_System_Details();
+	UnMount_Main_Partitions();
+}
+
+// Back to back backups and restores from OpenRecoveryScript only need the
+// details refreshed and the main partitions unmounted once at the end.
+// Run_Backup still refreshes them before it starts, it needs the sizes.
+void TWPartitionManager::Set_Batch_Mode(bool Enable) {
+	Finish_Batch_Operations();
+	Batch_Mode = Enable;
+}
+
+// Anything that runs an updater binary expects the main partitions to be
+// unmounted, just like after a backup or restore outside of a batch
+bool TWPartitionManager::Finish_Batch_Operations(void) {
+	if (!Details_Stale)
+		return false;
+	bool batch = Batch_Mode;
+	Batch_Mode = false;
+	Finish_Operation();
+	Batch_Mode = batch;
+	Details_Stale = false;
+	return true;
+}
+
 bool TWPartitionManager::Restore_Partition(TWPartition* Part, string Restore_Name, int partition_count) {
 	time_t Start, Stop;
 	time(&Start);
@@ -907,9 +1031,7 @@ int TWPartitionManager::Run_Restore(string Restore_Name) {
 		}
 	}
 
-	TWFunc::GUI_Operation_Text(TW_UPDATE_SYSTEM_DETAILS_TEXT, "Updating System Details");
-	Update_System_Details();
-	UnMount_Main_Partitions();
+	Finish_Operation();
 	time(&rStop);
 	gui_print("[RESTORE COMPLETED IN %d SECONDS]\n\n",(int)difftime(rStop,rStart));
 	return true;
@@ -1091,6 +1213,12 @@ int TWPartitionManager::Factory_Reset(void) {
 	return ret;
 }
 
+bool TWPartitionManager::Is_Wiped_By_Factory_Reset(string Path) {
+	TWPartition* Part = Find_Partition_By_Path(Path);
+
+	return Part != NULL && Part->Wipe_During_Factory_Reset && Part->Is_Present;
+}
+
 int TWPartitionManager::Wipe_Dalvik_Cache(void) {
 	struct stat st;
 	vector <string> dir;
@@ -1223,9 +1351,9 @@ void TWPartitionManager::Update_System_Details(void) {
 	int data_size = 0;
 
 	gui_print("Updating partition details...\n");
+	Update_Sizes();
 	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
 		if ((*iter)->Can_Be_Mounted) {
-			(*iter)->Update_Size(true);
 			if ((*iter)->Mount_Point == "/system") {
 				int backup_display_size = (int)((*iter)->Backup_Size / 1048576LLU);
 				DataManager::SetValue(TW_BACKUP_SYSTEM_SIZE, backup_display_size);
@@ -1327,6 +1455,56 @@ void TWPartitionManager::Update_System_Details(void) {
 	return;
 }
 
+static void Update_Size_Task(void* Cookie, size_t Index) {
+	vector<TWPartition*>* Parts = (vector<TWPartition*>*) Cookie;
+	Parts->at(Index)->Update_Size(true);
+}
+
+void TWPartitionManager::Update_Sizes(void) {
+	std::vector<TWPartition*> independent, dependent;
+	std::vector<TWPartition*>::iterator iter, other;
+
+#ifdef TW_INCLUDE_CRYPTO_SAMSUNG
+	bool ecryptfs = false;
+
+	// Storage with an ecryptfs password mounts /data to get at its keys
+	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
+		if (!(*iter)->EcryptFS_Password.empty())
+			ecryptfs = true;
+	}
+#endif
+
+	// Partitions that mount other partitions or are mounted inside of one
+	// are updated one at a time afterwards, the rest don't affect each other
+	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
+		if (!(*iter)->Can_Be_Mounted)
+			continue;
+
+		bool nested = !(*iter)->Bind_Of.empty() || (*iter)->Is_ImageMount;
+#ifdef TW_INCLUDE_CRYPTO_SAMSUNG
+		if (!(*iter)->EcryptFS_Password.empty() || (ecryptfs && (*iter)->Mount_Point == "/data"))
+			nested = true;
+#endif
+		for (other = Partitions.begin(); !nested && other != Partitions.end(); other++) {
+			if (other == iter || !(*other)->Can_Be_Mounted)
+				continue;
+			const string& a = (*iter)->Mount_Point;
+			const string& b = (*other)->Mount_Point;
+			if ((a.size() > b.size() && a.compare(0, b.size(), b) == 0 && a[b.size()] == '/') ||
+				(b.size() > a.size() && b.compare(0, a.size(), a) == 0 && b[a.size()] == '/'))
+				nested = true;
+		}
+		if (nested)
+			dependent.push_back(*iter);
+		else
+			independent.push_back(*iter);
+	}
+
+	Run_Parallel(independent.size(), Update_Size_Task, &independent);
+	for (iter = dependent.begin(); iter != dependent.end(); iter++)
+		(*iter)->Update_Size(true);
+}
+
 void TWPartitionManager::Update_Storage_Sizes()
 {
 	string current_storage_path = DataManager::GetCurrentStoragePath();
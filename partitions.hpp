@@ -46,6 +46,7 @@ public:
 		FILES = 1,
 		DD = 2,
 		FLASH_UTILS = 3,
+		BLOCKS = 4,
 	};
 
 public:
@@ -72,6 +73,11 @@ public:
 	bool Update_Size(bool Display_Error);                                     // Updates size information
 	void Recreate_Media_Folder();                                             // Recreates the /data/media folder
 
+public:
+	static void Start_Probe_Snapshot();                                       // Reads /proc/partitions once for the size lookups that follow
+	static void Probe_Block_Device(string Block_Device);                      // Runs blkid on a block device ahead of time for Check_FS_Type, safe to call from several threads
+	static void End_Probe_Snapshot();                                         // Drops the snapshot and probe results, later lookups read the devices again
+
 public:
 	string Current_File_System;                                               // Current file system
 	string Actual_Block_Device;                                               // Actual block device (one of primary, alternate, or decrypted)
@@ -101,14 +107,17 @@ private:
 	bool Wipe_Data_Without_Wiping_Media();                                    // Uses rm -rf to wipe but does not wipe /data/media
 	bool Backup_Tar(string backup_folder);                                    // Backs up using tar for file systems
 	bool Backup_DD(string backup_folder);                                     // Backs up using dd for emmc memory types
+	bool Backup_Blocks(string backup_folder);                                 // Backs up only the allocated blocks of an ext file system as a sparse image
 	bool Backup_Dump_Image(string backup_folder);                             // Backs up using dump_image for MTD memory types
 	bool Restore_Tar(string restore_folder, string Restore_File_System);      // Restore using tar for file systems
 	bool Restore_DD(string restore_folder);                                   // Restore using dd for emmc memory types
+	bool Restore_Blocks(string restore_folder, string Restore_File_System);   // Restore a sparse image made by Backup_Blocks
 	bool Restore_Flash_Image(string restore_folder);                          // Restore using flash_image for MTD memory types
 	bool Get_Size_Via_statfs(bool Display_Error);                             // Get Partition size, used, and free space using statfs
-	bool Get_Size_Via_df(bool Display_Error);                                 // Get Partition size, used, and free space using df command
+	bool Get_Size_Via_Mounts(bool Display_Error);                             // Get Partition size, used, and free space from wherever /proc/mounts has it mounted
 	bool Make_Dir(string Path, bool Display_Error);                           // Creates a directory if it doesn't already exist
 	bool Find_MTD_Block_Device(string MTD_Name);                              // Finds the mtd block device based on the name from the fstab
+	void Discard_Block_Device(void);                                          // Discards the part of the block device that a new file system covers
 	void Recreate_AndSec_Folder(void);                                        // Recreates the .android_secure folder
 	void Mount_Storage_Retry(void);                                           // Tries multiple times with a half second delay to mount a device in case storage is slow to mount
 
@@ -170,7 +179,7 @@ friend class MultiROM;
 class TWPartitionManager
 {
 public:
-	TWPartitionManager() {}
+	TWPartitionManager() : Batch_Mode(false), Details_Stale(false) {}
 	~TWPartitionManager() {}
 
 public:
@@ -199,6 +208,7 @@ public:
 	int Wipe_By_Block(string Block);                                          // Wipes a partition based on block device
 	int Wipe_By_Name(string Name);                                            // Wipes a partition based on display name
 	int Factory_Reset();                                                      // Performs a factory reset
+	bool Is_Wiped_By_Factory_Reset(string Path);                              // Checks if Factory_Reset wipes the partition at Path
 	int Wipe_Dalvik_Cache();                                                  // Wipes dalvik cache
 	int Wipe_Rotate_Data();                                                   // Wipes rotation data --
 	int Wipe_Battery_Stats();                                                 // Wipe battery stats -- /data/system/batterystats.bin
@@ -212,6 +222,8 @@ public:
 	int usb_storage_disable(void);                                            // Disable USB storage mode
 	void Mount_All_Storage(void);                                             // Mounts all storage locations
 	void UnMount_Main_Partitions(void);                                       // Unmounts system and data if not data/media and boot if boot is mountable
+	void Set_Batch_Mode(bool Enable);                                         // While enabled, backups and restores leave refreshing details and unmounting to the end of the batch
+	bool Finish_Batch_Operations(void);                                       // Does the refresh and unmount a batch put off right away, true if there was one
 	int Partition_SDCard(void);                                               // Repartitions the sdcard
 
 	int Fix_Permissions();
@@ -231,11 +243,15 @@ private:
 	bool Backup_Partition(TWPartition* Part, string Backup_Folder, bool generate_md5, unsigned long long* img_bytes_remaining, unsigned long long* file_bytes_remaining, unsigned long *img_time, unsigned long *file_time, unsigned long long *img_bytes, unsigned long long *file_bytes);
 	bool Restore_Partition(TWPartition* Part, string Restore_Name, int partition_count);
 	void Output_Partition(TWPartition* Part);
+	void Update_Sizes();                                                      // Updates the sizes of all mountable partitions, independent partitions in parallel
 	int Open_Lun_File(string Partition_Path, string Lun_File);
+	void Finish_Operation(void);                                              // Refreshes details and unmounts after a backup or restore
 
 private:
 	std::vector<TWPartition*> Partitions;                                     // Vector list of all partitions
 	std::list< std::vector<TWPartition*> > Contexts;
+	bool Batch_Mode;
+	bool Details_Stale;                                                       // A backup or restore ran during the batch
 };
 
 extern TWPartitionManager PartitionManager;
@@ -166,7 +166,7 @@ static int Run_Update_Binary(const char *path, ZipArchive *Zip, int* wipe_cache)
 	return INSTALL_SUCCESS;
 }
 
-extern "C" int TWinstall_zip(const char* path, int* wipe_cache) {
+static int Install_Zip(const char* path, int* wipe_cache, bool verify) {
 	int ret_val, zip_verify, md5_return, key_count;
 	twrpDigest md5sum;
 	string strpath = path;
@@ -177,22 +177,26 @@ extern "C" int TWinstall_zip(const char* path, int* wipe_cache) {
 		return -1;
 	}
 
-	gui_print("Installing '%s'...\nChecking for MD5 file...\n", path);
-
-	md5sum.setfn(strpath);
-	md5_return = md5sum.verify_md5digest();
-	if (md5_return == -2) {
-		// MD5 did not match.
-		LOGERR("Zip MD5 does not match.\nUnable to install zip.\n");
-		return INSTALL_CORRUPT;
-	} else if (md5_return == -1) {
-		gui_print("Skipping MD5 check: no MD5 file found.\n");
-	} else if (md5_return == 0)
-		gui_print("Zip MD5 matched.\n"); // MD5 found and matched.
+	if (verify) {
+		gui_print("Installing '%s'...\nChecking for MD5 file...\n", path);
+
+		md5sum.setfn(strpath);
+		md5_return = md5sum.verify_md5digest();
+		if (md5_return == -2) {
+			// MD5 did not match.
+			LOGERR("Zip MD5 does not match.\nUnable to install zip.\n");
+			return INSTALL_CORRUPT;
+		} else if (md5_return == -1) {
+			gui_print("Skipping MD5 check: no MD5 file found.\n");
+		} else if (md5_return == 0)
+			gui_print("Zip MD5 matched.\n"); // MD5 found and matched.
+	} else {
+		gui_print("Installing '%s'...\n", path);
+	}
 
 	DataManager::GetValue(TW_SIGNED_ZIP_VERIFY_VAR, zip_verify);
 	DataManager::SetProgress(0);
-	if (zip_verify) {
+	if (verify && zip_verify) {
 		gui_print("Verifying zip signature...\n");
 		ret_val = verify_file(path);
 		if (ret_val != VERIFY_SUCCESS) {
@@ -207,3 +211,34 @@ extern "C" int TWinstall_zip(const char* path, int* wipe_cache) {
 	}
 	return Run_Update_Binary(path, &Zip, wipe_cache);
 }
+
+extern "C" int TWinstall_zip(const char* path, int* wipe_cache) {
+	return Install_Zip(path, wipe_cache, true);
+}
+
+extern "C" int TWinstall_verified_zip(const char* path, int* wipe_cache) {
+	return Install_Zip(path, wipe_cache, false);
+}
+
+extern "C" int TWverify_zip(const char* path) {
+	twrpDigest md5sum;
+	ZipArchive Zip;
+	int zip_verify;
+
+	md5sum.setfn(path);
+	if (md5sum.verify_md5digest() == -2) {
+		LOGINFO("Zip MD5 does not match for '%s'\n", path);
+		return INSTALL_CORRUPT;
+	}
+	DataManager::GetValue(TW_SIGNED_ZIP_VERIFY_VAR, zip_verify);
+	if (zip_verify && verify_file(path) != VERIFY_SUCCESS) {
+		LOGINFO("Zip signature verification failed for '%s'\n", path);
+		return -1;
+	}
+	if (mzOpenZipArchive(path, &Zip) != 0) {
+		LOGINFO("Zip file '%s' is corrupt\n", path);
+		return INSTALL_CORRUPT;
+	}
+	mzCloseZipArchive(&Zip);
+	return INSTALL_SUCCESS;
+}
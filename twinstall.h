@@ -6,6 +6,8 @@ extern "C" {
 #endif
 
 int TWinstall_zip(const char* path, int* wipe_cache);
+int TWinstall_verified_zip(const char* path, int* wipe_cache); // Skips the MD5 and signature checks
+int TWverify_zip(const char* path);                            // Only the checks, quiet and safe to run from several threads
 
 #ifdef __cplusplus
 }
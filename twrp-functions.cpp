@@ -21,6 +21,9 @@
 #include <fstream>
 #include <sstream>
 #include "twrp-functions.hpp"
+#include "twrpDU.hpp"
+#include "twrpRemove.hpp"
+#include "twrpExec.hpp"
 #include "partitions.hpp"
 #include "twcommon.h"
 #include "data.hpp"
@@ -39,64 +42,23 @@ extern "C" {
 
 /* Execute a command */
 int TWFunc::Exec_Cmd(const string& cmd, string &result) {
-	FILE* exec;
-	char buffer[130];
-	int ret = 0;
-	exec = __popen(cmd.c_str(), "r");
-	if (!exec) return -1;
-	while(!feof(exec)) {
-		memset(&buffer, 0, sizeof(buffer));
-		if (fgets(buffer, 128, exec) != NULL) {
-			buffer[128] = '\n';
-			buffer[129] = NULL;
-			result += buffer;
-		}
-	}
-	ret = __pclose(exec);
-	return ret;
+	return twrpExec::Run_Shell(cmd, &result).Return_Code();
 }
 
 int TWFunc::Exec_Cmd(const string& cmd) {
-	pid_t pid;
-	int status;
-	switch(pid = fork())
-	{
-		case -1:
-			LOGERR("Exec_Cmd(): vfork failed!\n");
-			return -1;
-		case 0: // child
-			execl("/sbin/sh", "sh", "-c", cmd.c_str(), NULL);
-			_exit(127);
-			break;
-		default:
-		{
-			if (TWFunc::Wait_For_Child(pid, &status, cmd) != 0)
-				return -1;
-			else
-				return 0;
-		}
-	}
+	return twrpExec::Run_Shell(cmd).Success() ? 0 : -1;
 }
 
-int TWFunc::Exec_Cmd_Show_Output(const string& cmd) {
-	FILE* exec;
-	char buffer[130];
-	int ret = 0;
-	exec = __popen(cmd.c_str(), "r");
+int TWFunc::Exec_Cmd(const vector<string>& args, string &result) {
+	return twrpExec::Run(args, &result).Return_Code();
+}
 
-	if (!exec)
-		return -1;
+int TWFunc::Exec_Cmd(const vector<string>& args) {
+	return twrpExec::Run(args).Success() ? 0 : -1;
+}
 
-	while(!feof(exec)) {
-		memset(buffer, 0, sizeof(buffer));
-		if (fgets(buffer, 128, exec) != NULL) {
-			buffer[128] = '\n';
-			buffer[129] = NULL;
-			gui_print(buffer);
-		}
-	}
-	ret = __pclose(exec);
-	return ret;
+int TWFunc::Exec_Cmd_Show_Output(const string& cmd) {
+	return twrpExec::Run_Shell(cmd, NULL, 0, twrpExec::SHOW_OUTPUT).Return_Code();
 }
 
 // Returns "file.name" from a full /path/to/file.name
@@ -213,68 +175,12 @@ int TWFunc::Recursive_Mkdir(string Path) {
 }
 
 unsigned long long TWFunc::Get_Folder_Size(const string& Path, bool Display_Error) {
-	DIR* d;
-	struct dirent* de;
-	struct stat st;
-	unsigned long long dusize = 0;
-	unsigned long long dutemp = 0;
-
-	d = opendir(Path.c_str());
-	if (d == NULL)
-	{
-		LOGERR("error opening '%s'\n", Path.c_str());
-		LOGERR("error: %s\n", strerror(errno));
-		return 0;
-	}
-
-	while ((de = readdir(d)) != NULL)
-	{
-		if (de->d_type == DT_DIR && strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0 && strcmp(de->d_name, "lost+found") != 0)
-		{
-			dutemp = Get_Folder_Size((Path + "/" + de->d_name), Display_Error);
-			dusize += dutemp;
-			dutemp = 0;
-		}
-		else if (de->d_type == DT_REG)
-		{
-			stat((Path + "/" + de->d_name).c_str(), &st);
-			dusize += (unsigned long long)(st.st_size);
-		}
-	}
-	closedir(d);
-	return dusize;
+	return twrpDU::Get_Folder_Size(Path, Display_Error);
 }
 
 uint64_t TWFunc::Get_DataExceptMedia_Size(const string& Path, bool Display_Error)
 {
-	DIR* d;
-	struct dirent* de;
-	struct stat st;
-	uint64_t dusize = 0;
-
-	d = opendir(Path.c_str());
-	if (d == NULL)
-	{
-		LOGERR("error opening '%s'\n", Path.c_str());
-		LOGERR("error: %s\n", strerror(errno));
-		return 0;
-	}
-
-	while ((de = readdir(d)) != NULL)
-	{
-		if (de->d_type == DT_DIR && strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0 &&
-			strcmp(de->d_name, "lost+found") != 0 && strcmp(de->d_name, "media") != 0)
-		{
-			dusize += Get_Folder_Size((Path + "/" + de->d_name), Display_Error);
-		}
-		else if (de->d_type == DT_REG)
-		{
-			stat((Path + "/" + de->d_name).c_str(), &st);
-			dusize += (uint64_t)(st.st_size);
-		}
-	}
-	closedir(d);
-	return dusize;
+	return twrpDU::Get_Folder_Size(Path, Display_Error, "media");
 }
 
 bool TWFunc::Path_Exists(string Path) {
@@ -388,6 +294,9 @@ void TWFunc::Update_Intent_File(string Intent) {
 // reboot: Reboot the system. Return -1 on error, no return on success
 int TWFunc::tw_reboot(RebootCommand command)
 {
+	// Write out any settings changes that haven't been saved yet
+	DataManager::FlushPending();
+
 	// Always force a sync before we reboot
 	sync();
 
@@ -433,47 +342,7 @@ void TWFunc::check_and_run_script(const char* script_file, const char* display_n
 }
 
 int TWFunc::removeDir(const string path, bool skipParent) {
-	DIR *d = opendir(path.c_str());
-	int r = 0;
-	string new_path;
-
-	if (d == NULL) {
-		LOGERR("Error opening '%s'\n", path.c_str());
-		return -1;
-	}
-
-	if (d) {
-		struct dirent *p;
-		while (!r && (p = readdir(d))) {
-			if (!strcmp(p->d_name, ".") || !strcmp(p->d_name, ".."))
-				continue;
-			new_path = path + "/";
-			new_path.append(p->d_name);
-			if (p->d_type == DT_DIR) {
-				r = removeDir(new_path, true);
-				if (!r) {
-					if (p->d_type == DT_DIR) 
-						r = rmdir(new_path.c_str());
-					else
-						LOGINFO("Unable to removeDir '%s': %s\n", new_path.c_str(), strerror(errno));
-				}
-			} else if (p->d_type == DT_REG || p->d_type == DT_LNK || p->d_type == DT_FIFO || p->d_type == DT_SOCK) {
-				r = unlink(new_path.c_str());
-				if (r != 0) {
-					LOGINFO("Unable to unlink '%s: %s'\n", new_path.c_str(), strerror(errno));
-				}
-			}
-		}
-		closedir(d);
-
-		if (!r) { 
-			if (skipParent)
-				return 0;
-			else
-				r = rmdir(path.c_str());
-		}
-	}
-	return r;
+	return twrpRemove::Remove_Tree(path, skipParent);
 }
 
 int TWFunc::copy_file(string src, string dst, int mode) {
@@ -106,6 +106,8 @@ int main(int argc, char **argv) {
 		return -1;
 	}
 	PartitionManager.Output_Partition_Logging();
+	// Mount cache before the theme loads so the decoded surface cache is there
+	PartitionManager.Mount_By_Path("/cache", true);
 	// Load up all the resources
 	gui_loadResources();
 
@@ -120,8 +122,6 @@ int main(int argc, char **argv) {
 		printf("SELinux contexts loaded from /file_contexts\n");
 #endif
 
-	PartitionManager.Mount_By_Path("/cache", true);
-
 	string Zip_File, Reboot_Value;
 	bool Cache_Wipe = false, Factory_Reset = false, Perform_Backup = false;
 
@@ -0,0 +1,396 @@
+/*
+        Copyright 2013 TeamWin
+        This file is part of TWRP/TeamWin Recovery Project.
+
+        TWRP is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        TWRP is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <vector>
+#include "twrpBenchmark.hpp"
+#include "twrpTar.hpp"
+#include "twrpRemove.hpp"
+#include "twrpExec.hpp"
+#include "twrp-functions.hpp"
+#include "twcommon.h"
+#include "data.hpp"
+
+#define BENCHMARK_RESULTS "/tmp/twrp_benchmark.csv"
+#define BENCHMARK_PASSWORD "benchmark"
+#define BENCHMARK_IMAGE_SIZE (160LLU * 1024LLU * 1024LLU) // Room for the largest tree and its archives
+#define BENCHMARK_CHUNK (64 * 1024)
+#define BENCHMARK_SPLIT_SIZE (4LLU * 1024LLU * 1024LLU) // Small enough that every tree is split
+
+static const char* set_names[] = { "small", "large", "mixed", "random" };
+static const char* mode_names[] = { "plain", "compressed", "encrypted", "split", "threaded" };
+
+int twrpBenchmark::Run(const string& Targets) {
+	vector<string> targets = TWFunc::split_string(Targets, ' ', true);
+	string backup_password, restore_password;
+	int ret = 0;
+
+	if (targets.empty())
+		targets.push_back("tmpfs");
+	FILE* fp = fopen(BENCHMARK_RESULTS, "w");
+	if (fp == NULL) {
+		LOGERR("Unable to open '%s': %s\n", BENCHMARK_RESULTS, strerror(errno));
+		return 1;
+	}
+	fprintf(fp, "target,data_set,mode,phase,files,bytes,archive_bytes,seconds,mb_per_sec,files_per_sec,user_cpu,sys_cpu,peak_rss_kb,result\n");
+	fflush(fp); // Forked children must not inherit it still buffered
+
+	DataManager::GetValue("tw_backup_password", backup_password);
+	DataManager::GetValue("tw_restore_password", restore_password);
+	DataManager::SetValue("tw_backup_password", BENCHMARK_PASSWORD);
+	DataManager::SetValue("tw_restore_password", BENCHMARK_PASSWORD);
+
+	for (size_t t = 0; t < targets.size(); t++) {
+		string folder, image;
+
+		gui_print("Benchmarking on %s...\n", targets[t].c_str());
+		if (!Prepare_Target(targets[t], folder, image)) {
+			ret = 1;
+			continue;
+		}
+		string tree = folder + "/tree", archive_folder = folder + "/archive";
+		for (int set = 0; set < SET_COUNT; set++) {
+			unsigned long files = 0;
+			unsigned long long bytes = 0;
+
+			if (!Generate(tree, set, files, bytes)) {
+				LOGERR("Unable to create the %s test files in '%s'.\n", set_names[set], tree.c_str());
+				ret = 1;
+				break;
+			}
+			for (int mode = 0; mode < MODE_COUNT; mode++) {
+#ifdef TW_EXCLUDE_ENCRYPTED_BACKUPS
+				if (mode == MODE_ENCRYPTED)
+					continue;
+#endif
+				Benchmark_Result result;
+				result.target = targets[t];
+				result.data_set = set_names[set];
+				result.mode = mode_names[mode];
+				result.files = files;
+				result.bytes = bytes;
+
+				gui_print("  %s files, %s...\n", set_names[set], mode_names[mode]);
+				mkdir(archive_folder.c_str(), 0755);
+				string archive = archive_folder + "/benchmark.win";
+				bool restored = false;
+				if (Run_Phase(tree, archive, mode, false, result)) {
+					Write_Result(fp, result);
+					// Like a real restore the tree is wiped before it is extracted
+					twrpRemove::Remove_Tree(tree, true);
+					restored = Run_Phase(tree, archive, mode, true, result) && Count_Files(tree) == files;
+					result.success = restored;
+				}
+				Write_Result(fp, result);
+				if (!restored)
+					ret = 1;
+				twrpRemove::Remove_Tree(archive_folder, false);
+				if (!restored && !Generate(tree, set, files, bytes)) {
+					ret = 1;
+					break;
+				}
+			}
+			twrpRemove::Remove_Tree(tree, false);
+		}
+		Release_Target(folder, image);
+	}
+
+	DataManager::SetValue("tw_backup_password", backup_password);
+	DataManager::SetValue("tw_restore_password", restore_password);
+	fclose(fp);
+	gui_print("Benchmark results are in %s\n", BENCHMARK_RESULTS);
+	return ret;
+}
+
+// tmpfs works in /tmp, ext4 and exfat in an image of their own that is
+// loop mounted from /tmp, anything else is taken as a folder to work in
+bool twrpBenchmark::Prepare_Target(const string& Target, string& Folder, string& Image) {
+	Image.clear();
+	if (Target == "tmpfs") {
+		Folder = "/tmp/benchmark";
+	} else if (Target == "ext4" || Target == "exfat") {
+		Folder = "/tmp/benchmark-" + Target;
+		Image = Folder + ".img";
+		int fd = open(Image.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (fd < 0 || ftruncate(fd, BENCHMARK_IMAGE_SIZE) != 0) {
+			LOGERR("Unable to create '%s': %s\n", Image.c_str(), strerror(errno));
+			if (fd >= 0)
+				close(fd);
+			unlink(Image.c_str());
+			return false;
+		}
+		close(fd);
+
+		vector<string> format, mount;
+		if (Target == "ext4" && TWFunc::Path_Exists("/sbin/make_ext4fs")) {
+			char size[32];
+			sprintf(size, "%llu", BENCHMARK_IMAGE_SIZE);
+			format = twrpExec::Argv("make_ext4fs", "-l", size, Image.c_str(), NULL);
+		} else if (Target == "ext4") {
+			format = twrpExec::Argv("mke2fs", "-t", "ext4", "-m", "0", "-F", Image.c_str(), NULL);
+		} else {
+			format = twrpExec::Argv("mkexfatfs", Image.c_str(), NULL);
+		}
+		if (Target == "exfat" && TWFunc::Path_Exists("/sbin/exfat-fuse"))
+			mount = twrpExec::Argv("/sbin/exfat-fuse", "-o", "big_writes,max_read=131072,max_write=131072", Image.c_str(), Folder.c_str(), NULL);
+		else
+			mount = twrpExec::Argv("mount", "-o", "loop", "-t", Target.c_str(), Image.c_str(), Folder.c_str(), NULL);
+		mkdir(Folder.c_str(), 0755);
+		if (TWFunc::Exec_Cmd(format) != 0 || TWFunc::Exec_Cmd(mount) != 0) {
+			LOGERR("Unable to set up a %s image in '%s'.\n", Target.c_str(), Image.c_str());
+			rmdir(Folder.c_str());
+			unlink(Image.c_str());
+			return false;
+		}
+	} else if (!Target.empty() && Target[0] == '/') {
+		Folder = Target + "/twrp-benchmark";
+	} else {
+		LOGERR("Unknown benchmark target '%s'\n", Target.c_str());
+		return false;
+	}
+	if (!TWFunc::Recursive_Mkdir(Folder + "/")) {
+		Release_Target(Folder, Image);
+		return false;
+	}
+	return true;
+}
+
+void twrpBenchmark::Release_Target(const string& Folder, const string& Image) {
+	if (Image.empty()) {
+		twrpRemove::Remove_Tree(Folder, false);
+		return;
+	}
+	TWFunc::Exec_Cmd(twrpExec::Argv("umount", "-d", Folder.c_str(), NULL));
+	rmdir(Folder.c_str());
+	unlink(Image.c_str());
+}
+
+bool twrpBenchmark::Generate(const string& Folder, int Set, unsigned long& Files, unsigned long long& Bytes) {
+	char name[64];
+	unsigned seed = 0;
+
+	Files = 0;
+	Bytes = 0;
+	if (TWFunc::Path_Exists(Folder))
+		twrpRemove::Remove_Tree(Folder, false);
+	if (mkdir(Folder.c_str(), 0755) != 0)
+		return false;
+
+	if (Set == SET_SMALL || Set == SET_MIXED) {
+		int dirs = Set == SET_SMALL ? 64 : 16, per_dir = Set == SET_SMALL ? 64 : 32;
+		for (int d = 0; d < dirs; d++) {
+			sprintf(name, "/dir%02i", d);
+			string dir = Folder + name;
+			if (mkdir(dir.c_str(), 0755) != 0)
+				return false;
+			for (int f = 0; f < per_dir; f++) {
+				unsigned long long size = Set == SET_SMALL ? 4096 : 1024LLU << ((d + f) % 7);
+				sprintf(name, "/file%02i", f);
+				if (!Write_File(dir + name, size, false, seed++))
+					return false;
+				Files++;
+				Bytes += size;
+			}
+		}
+	}
+	if (Set != SET_SMALL) {
+		// The large files are spread over folders of their own since
+		// threaded and encrypted backups only divide up what is in folders
+		int dirs = Set == SET_MIXED ? 2 : 8;
+		for (int d = 0; d < dirs; d++) {
+			sprintf(name, "/big%i", d);
+			string dir = Folder + name;
+			if (mkdir(dir.c_str(), 0755) != 0)
+				return false;
+			for (int f = 0; f < 8; f++) {
+				unsigned long long size = 512 * 1024;
+				sprintf(name, "/large%i", f);
+				if (!Write_File(dir + name, size, Set == SET_RANDOM, seed++))
+					return false;
+				Files++;
+				Bytes += size;
+			}
+		}
+	}
+	return true;
+}
+
+// Compressible files are numbered text lines, random ones come from a
+// xorshift generator since /dev/urandom is too slow to keep up
+bool twrpBenchmark::Write_File(const string& Path, unsigned long long Size, bool Random, unsigned Seed) {
+	vector<char> buf(BENCHMARK_CHUNK);
+	uint32_t state = Seed * 2654435761U + 1;
+	unsigned long line = 0;
+
+	int fd = open(Path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return false;
+	while (Size > 0) {
+		size_t len = Size < buf.size() ? (size_t) Size : buf.size();
+		if (Random) {
+			for (size_t i = 0; i + 4 <= buf.size(); i += 4) {
+				state ^= state << 13;
+				state ^= state >> 17;
+				state ^= state << 5;
+				memcpy(&buf[i], &state, 4);
+			}
+		} else {
+			size_t pos = 0;
+			while (pos < buf.size()) {
+				char text[64];
+				int n = snprintf(text, sizeof(text), "%08lx file %u benchmark data line\n", line++, Seed);
+				size_t copy = buf.size() - pos < (size_t) n ? buf.size() - pos : (size_t) n;
+				memcpy(&buf[pos], text, copy);
+				pos += copy;
+			}
+		}
+		if (write(fd, &buf[0], len) != (ssize_t) len) {
+			close(fd);
+			return false;
+		}
+		Size -= len;
+	}
+	return close(fd) == 0;
+}
+
+unsigned long twrpBenchmark::Count_Files(const string& Folder) {
+	unsigned long count = 0;
+	struct dirent* de;
+
+	DIR* d = opendir(Folder.c_str());
+	if (d == NULL)
+		return 0;
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_type == DT_REG)
+			count++;
+		else if (de->d_type == DT_DIR && strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0)
+			count += Count_Files(Folder + "/" + de->d_name);
+	}
+	closedir(d);
+	return count;
+}
+
+// Each phase runs in a child of its own so wait4 can report the CPU time
+// and peak memory of it and of the tar, pigz and openaes processes under it.
+// The child starts out with the recovery's own pages resident, so those are
+// taken off the peak to leave what the phase itself needed.
+bool twrpBenchmark::Run_Phase(const string& Tree, const string& Archive, int Mode, bool Restore, Benchmark_Result& Result) {
+	struct timespec start, stop;
+	struct rusage usage;
+	int status;
+
+	Result.phase = Restore ? "restore" : "backup";
+	Result.archive_bytes = 0;
+	Result.seconds = Result.user_cpu = Result.sys_cpu = 0;
+	Result.peak_rss_kb = 0;
+	Result.success = false;
+
+	// Start from the disk, not the page cache
+	sync();
+	TWFunc::drop_caches();
+
+	long baseline_kb = Resident_Kb();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pid_t pid = fork();
+	if (pid < 0) {
+		LOGERR("Unable to fork for the benchmark: %s\n", strerror(errno));
+		return false;
+	}
+	if (pid == 0) {
+		twrpTar tar;
+		int ret;
+
+		tar.setfn(Archive);
+		tar.use_compression = Mode == MODE_COMPRESSED;
+		tar.use_encryption = Mode == MODE_ENCRYPTED;
+		tar.userdata_encryption = Mode == MODE_THREADED;
+		if (Mode == MODE_SPLIT)
+			tar.max_archive_size = BENCHMARK_SPLIT_SIZE;
+		if (Restore) {
+			// Archives hold paths without the first folder, restores go back into it
+			tar.setdir(Tree.substr(0, Tree.find('/', 1)));
+			ret = tar.extractTarFork();
+		} else {
+			tar.setdir(Tree);
+			ret = Mode == MODE_SPLIT ? tar.splitArchiveFork() : tar.createTarFork();
+		}
+		_exit(ret == 0 ? 0 : 1);
+	}
+	if (wait4(pid, &status, 0, &usage) != pid) {
+		LOGERR("Unable to wait for the benchmark: %s\n", strerror(errno));
+		return false;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+
+	timespec diff = TWFunc::timespec_diff(start, stop);
+	Result.seconds = diff.tv_sec + diff.tv_nsec / 1000000000.0;
+	Result.user_cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1000000.0;
+	Result.sys_cpu = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1000000.0;
+	Result.peak_rss_kb = usage.ru_maxrss > baseline_kb ? usage.ru_maxrss - baseline_kb : 0;
+	Result.success = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+	if (!Restore && Mode == MODE_COMPRESSED) {
+		// Same as Backup_Tar, pigz leaves the archive with a .gz on the end
+		string gzname = Archive + ".gz";
+		rename(gzname.c_str(), Archive.c_str());
+	}
+	Result.archive_bytes = TWFunc::Get_Folder_Size(Archive.substr(0, Archive.rfind('/')), false);
+	return Result.success;
+}
+
+long twrpBenchmark::Resident_Kb(void) {
+	unsigned long size, resident;
+
+	FILE* fp = fopen("/proc/self/statm", "r");
+	if (fp == NULL)
+		return 0;
+	if (fscanf(fp, "%lu %lu", &size, &resident) != 2)
+		resident = 0;
+	fclose(fp);
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+void twrpBenchmark::Write_Result(FILE* Fp, const Benchmark_Result& Result) {
+	double mb_per_sec = 0, files_per_sec = 0;
+
+	// Failed phases stop early, their rates would only be misleading
+	if (Result.success && Result.seconds > 0) {
+		mb_per_sec = Result.bytes / Result.seconds / (1024 * 1024);
+		files_per_sec = Result.files / Result.seconds;
+	}
+	fprintf(Fp, "%s,%s,%s,%s,%lu,%llu,%llu,%.3f,%.2f,%.1f,%.3f,%.3f,%ld,%s\n",
+		Result.target.c_str(), Result.data_set.c_str(), Result.mode.c_str(), Result.phase.c_str(),
+		Result.files, Result.bytes, Result.archive_bytes, Result.seconds, mb_per_sec, files_per_sec,
+		Result.user_cpu, Result.sys_cpu, Result.peak_rss_kb, Result.success ? "ok" : "failed");
+	fflush(Fp);
+	if (Result.success)
+		gui_print("  %s %s: %.2f MB/sec, %.1f files/sec\n", Result.mode.c_str(), Result.phase.c_str(), mb_per_sec, files_per_sec);
+	else
+		gui_print("  %s %s failed\n", Result.mode.c_str(), Result.phase.c_str());
+}
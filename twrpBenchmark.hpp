@@ -0,0 +1,79 @@
+/*
+        Copyright 2013 TeamWin
+        This file is part of TWRP/TeamWin Recovery Project.
+
+        TWRP is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        TWRP is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRP_BENCHMARK_HPP
+#define __TWRP_BENCHMARK_HPP
+
+#include <stdio.h>
+#include <string>
+
+using namespace std;
+
+struct Benchmark_Result {
+	string target;
+	string data_set;
+	string mode;
+	string phase;                                                             // "backup" or "restore"
+	unsigned long files;
+	unsigned long long bytes;                                                 // Size of the files in the tree
+	unsigned long long archive_bytes;                                         // Size of all archives written
+	double seconds;                                                           // Wall clock time
+	double user_cpu;                                                          // Includes pigz and openaes
+	double sys_cpu;
+	long peak_rss_kb;                                                         // Largest process of the phase, less what the recovery had resident when it forked
+	bool success;
+};
+
+// Times twrpTar backups and restores of generated folder trees so the
+// archive code can be compared between builds. Every target gets small,
+// large, mixed and incompressible trees, each backed up and restored plain,
+// compressed, encrypted, split and threaded. Results are written to
+// /tmp/twrp_benchmark.csv with one line per phase.
+class twrpBenchmark
+{
+public:
+	static int Run(const string& Targets);                                   // Space separated tmpfs, ext4, exfat or folders, empty runs tmpfs only
+
+private:
+	enum {
+		SET_SMALL = 0,                                                        // 4096 files of 4 KB
+		SET_LARGE,                                                            // 64 files of 512 KB in 8 folders
+		SET_MIXED,                                                            // 512 files of 1 KB to 64 KB and 16 of 512 KB
+		SET_RANDOM,                                                           // Same as large but incompressible
+		SET_COUNT
+	};
+	enum {
+		MODE_PLAIN = 0,
+		MODE_COMPRESSED,
+		MODE_ENCRYPTED,
+		MODE_SPLIT,
+		MODE_THREADED,
+		MODE_COUNT
+	};
+
+	static bool Prepare_Target(const string& Target, string& Folder, string& Image);
+	static void Release_Target(const string& Folder, const string& Image);
+	static bool Generate(const string& Folder, int Set, unsigned long& Files, unsigned long long& Bytes);
+	static bool Write_File(const string& Path, unsigned long long Size, bool Random, unsigned Seed);
+	static unsigned long Count_Files(const string& Folder);
+	static bool Run_Phase(const string& Tree, const string& Archive, int Mode, bool Restore, Benchmark_Result& Result);
+	static long Resident_Kb(void);                                            // Resident size of this process
+	static void Write_Result(FILE* Fp, const Benchmark_Result& Result);
+};
+
+#endif // __TWRP_BENCHMARK_HPP
@@ -0,0 +1,909 @@
+/*
+        Copyright 2013 TeamWin
+        This file is part of TWRP/TeamWin Recovery Project.
+
+        TWRP is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        TWRP is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/vfs.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <set>
+#include "twrpBlockIO.hpp"
+#include "twcommon.h"
+
+#ifndef O_DIRECT
+#define O_DIRECT 040000
+#endif
+
+#ifndef BLKDISCARD
+#define BLKDISCARD _IO(0x12,119)
+#endif
+#ifndef BLKDISCARDZEROES
+#define BLKDISCARDZEROES _IO(0x12,124)
+#endif
+#ifndef BLKZEROOUT
+#define BLKZEROOUT _IO(0x12,127)
+#endif
+
+#define BLOCKIO_BUFFER_SIZE (1024 * 1024)
+#define BLOCKIO_ALIGN       4096
+
+// Files changed this recently may change again within the same mtime
+// second, so their comparisons aren't remembered
+#define COMPARE_RACY_SECONDS 2
+#define COMPARE_CACHE_MAX    64
+
+// Android sparse image format, as written by libsparse and read by fastboot
+#define SPARSE_HEADER_MAGIC     0xed26ff3a
+#define SPARSE_BLOCK_SIZE       4096
+#define CHUNK_TYPE_RAW          0xCAC1
+#define CHUNK_TYPE_FILL         0xCAC2
+#define CHUNK_TYPE_DONT_CARE    0xCAC3
+#define CHUNK_TYPE_CRC32        0xCAC4
+
+struct sparse_header {
+	uint32_t magic;
+	uint16_t major_version;
+	uint16_t minor_version;
+	uint16_t file_hdr_sz;
+	uint16_t chunk_hdr_sz;
+	uint32_t blk_sz;
+	uint32_t total_blks;
+	uint32_t total_chunks;
+	uint32_t image_checksum;
+};
+
+struct sparse_chunk_header {
+	uint16_t chunk_type;
+	uint16_t reserved1;
+	uint32_t chunk_sz;                                                        // In blocks
+	uint32_t total_sz;                                                        // In bytes, header included
+};
+
+// Opens a path for the copy. Block devices get O_DIRECT if the driver takes
+// it, regular files go through the page cache as usual.
+static int Open_Path(const string& Path, int Flags, bool* Direct) {
+	struct stat st;
+	int fd;
+
+	*Direct = false;
+	if (stat(Path.c_str(), &st) == 0 && S_ISBLK(st.st_mode)) {
+		fd = open(Path.c_str(), Flags | O_DIRECT);
+		if (fd >= 0) {
+			*Direct = true;
+			return fd;
+		}
+		if (errno != EINVAL)
+			return -1;
+	}
+	return open(Path.c_str(), Flags, 0644);
+}
+
+// O_DIRECT wants aligned lengths, drop it for the unaligned tail or when
+// the driver refuses it after all
+static bool Drop_Direct(int fd, bool* Direct) {
+	if (!*Direct)
+		return false;
+	*Direct = false;
+	return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT) == 0;
+}
+
+int twrpBlockIO::Copy(const string& Source, const string& Dest, uint64_t Length, Block_Progress Progress, void* Cookie) {
+	bool src_direct, dst_direct;
+	uint64_t done = 0;
+	int ret = -1;
+
+	int src = Open_Path(Source, O_RDONLY, &src_direct);
+	if (src < 0) {
+		LOGERR("Unable to open '%s' for reading: %s\n", Source.c_str(), strerror(errno));
+		return -1;
+	}
+	int dst = Open_Path(Dest, O_WRONLY | O_CREAT | O_TRUNC, &dst_direct);
+	if (dst < 0) {
+		LOGERR("Unable to open '%s' for writing: %s\n", Dest.c_str(), strerror(errno));
+		close(src);
+		return -1;
+	}
+
+	unsigned char* buffer = (unsigned char*) memalign(BLOCKIO_ALIGN, BLOCKIO_BUFFER_SIZE);
+	if (buffer == NULL) {
+		LOGERR("Unable to allocate copy buffer\n");
+		close(src);
+		close(dst);
+		return -1;
+	}
+
+	while (Length == 0 || done < Length) {
+		size_t want = BLOCKIO_BUFFER_SIZE;
+		if (Length != 0 && Length - done < want)
+			want = Length - done;
+		if (want % BLOCKIO_ALIGN)
+			Drop_Direct(src, &src_direct);
+
+		ssize_t got = read(src, buffer, want);
+		if (got < 0 && errno == EINVAL && Drop_Direct(src, &src_direct))
+			got = read(src, buffer, want);
+		if (got < 0) {
+			if (errno == EINTR)
+				continue;
+			LOGERR("Error reading '%s': %s\n", Source.c_str(), strerror(errno));
+			goto exit;
+		}
+		if (got == 0)
+			break;
+
+		if (got % BLOCKIO_ALIGN)
+			Drop_Direct(dst, &dst_direct);
+		for (ssize_t written = 0; written < got; ) {
+			ssize_t w = write(dst, buffer + written, got - written);
+			if (w < 0 && errno == EINVAL && Drop_Direct(dst, &dst_direct))
+				continue;
+			if (w < 0 && errno == EINTR)
+				continue;
+			if (w <= 0) {
+				LOGERR("Error writing '%s': %s\n", Dest.c_str(), strerror(errno));
+				goto exit;
+			}
+			written += w;
+		}
+
+		done += got;
+		if (Progress)
+			Progress(done, Length, Cookie);
+	}
+
+	if (fsync(dst) != 0 && errno != EINVAL) {
+		LOGERR("Error syncing '%s': %s\n", Dest.c_str(), strerror(errno));
+		goto exit;
+	}
+	ret = 0;
+
+exit:
+	free(buffer);
+	close(src);
+	if (close(dst) != 0 && ret == 0) {
+		LOGERR("Error closing '%s': %s\n", Dest.c_str(), strerror(errno));
+		ret = -1;
+	}
+	return ret;
+}
+
+bool twrpBlockIO::Get_Size(const string& Path, uint64_t& Size) {
+	struct stat st;
+
+	if (stat(Path.c_str(), &st) != 0)
+		return false;
+	if (!S_ISBLK(st.st_mode)) {
+		Size = st.st_size;
+		return true;
+	}
+
+	int fd = open(Path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	uint64_t bytes;
+	bool ret = ioctl(fd, BLKGETSIZE64, &bytes) == 0;
+	if (ret)
+		Size = bytes;
+	close(fd);
+	return ret;
+}
+
+bool twrpBlockIO::Get_Mount_Usage(const string& Block_Device, uint64_t& Size, uint64_t& Used, uint64_t& Free) {
+	char line[1024], device[512], mount_point[512];
+	struct statfs st;
+	bool found = false;
+
+	FILE* fp = fopen("/proc/mounts", "rt");
+	if (fp == NULL)
+		return false;
+
+	while (!found && fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "%511s %511s", device, mount_point) != 2)
+			continue;
+		if (Block_Device == device && statfs(mount_point, &st) == 0)
+			found = true;
+	}
+	fclose(fp);
+
+	if (found) {
+		Size = (uint64_t) st.f_blocks * st.f_bsize;
+		Used = (uint64_t) (st.f_blocks - st.f_bfree) * st.f_bsize;
+		Free = (uint64_t) st.f_bfree * st.f_bsize;
+	}
+	return found;
+}
+
+static bool Read_Full(int fd, void* buf, size_t len) {
+	unsigned char* p = (unsigned char*) buf;
+
+	while (len > 0) {
+		ssize_t r = read(fd, p, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return false;
+		p += r;
+		len -= r;
+	}
+	return true;
+}
+
+static bool Write_Full(int fd, const void* buf, size_t len) {
+	const unsigned char* p = (const unsigned char*) buf;
+
+	while (len > 0) {
+		ssize_t w = write(fd, p, len);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			return false;
+		p += w;
+		len -= w;
+	}
+	return true;
+}
+
+// Pairs of regular files found equal, keyed by what stat says about both,
+// so an unchanged pair isn't read again
+static set<string> compare_cache;
+static pthread_mutex_t compare_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool Compare_Key(const string& Path1, const string& Path2, string& Key) {
+	struct stat st[2];
+	char buf[2][128];
+	time_t now = time(NULL);
+
+	if (stat(Path1.c_str(), &st[0]) != 0 || stat(Path2.c_str(), &st[1]) != 0)
+		return false;
+	for (int i = 0; i < 2; i++) {
+		if (!S_ISREG(st[i].st_mode) || now - st[i].st_mtime < COMPARE_RACY_SECONDS)
+			return false;
+		snprintf(buf[i], sizeof(buf[i]), "%llx:%llx:%llx:%lx:%lx",
+			(unsigned long long) st[i].st_dev, (unsigned long long) st[i].st_ino,
+			(unsigned long long) st[i].st_size, (long) st[i].st_mtime, (long) st[i].st_ctime);
+	}
+	if (strcmp(buf[0], buf[1]) > 0)
+		Key = string(buf[1]) + "|" + buf[0];
+	else
+		Key = string(buf[0]) + "|" + buf[1];
+	return true;
+}
+
+int twrpBlockIO::Compare(const string& Path1, const string& Path2) {
+	uint64_t size1, size2, done = 0;
+	string key;
+	int ret = 0;
+
+	if (!Get_Size(Path1, size1) || !Get_Size(Path2, size2)) {
+		LOGINFO("Unable to get the size of '%s' or '%s'\n", Path1.c_str(), Path2.c_str());
+		return -1;
+	}
+	if (size1 != size2)
+		return 1;
+
+	bool cacheable = Compare_Key(Path1, Path2, key);
+	if (cacheable) {
+		pthread_mutex_lock(&compare_lock);
+		bool found = compare_cache.count(key) != 0;
+		pthread_mutex_unlock(&compare_lock);
+		if (found)
+			return 0;
+	}
+
+	int fd1 = open(Path1.c_str(), O_RDONLY);
+	int fd2 = open(Path2.c_str(), O_RDONLY);
+	unsigned char* buf1 = (unsigned char*) malloc(BLOCKIO_BUFFER_SIZE);
+	unsigned char* buf2 = (unsigned char*) malloc(BLOCKIO_BUFFER_SIZE);
+	if (fd1 < 0 || fd2 < 0 || !buf1 || !buf2) {
+		LOGINFO("Unable to open '%s' and '%s' to compare them\n", Path1.c_str(), Path2.c_str());
+		ret = -1;
+	}
+
+	// Stops at the first chunk that differs
+	while (ret == 0 && done < size1) {
+		size_t len = BLOCKIO_BUFFER_SIZE;
+		if (size1 - done < len)
+			len = size1 - done;
+		if (!Read_Full(fd1, buf1, len) || !Read_Full(fd2, buf2, len)) {
+			LOGINFO("Error reading '%s' or '%s': %s\n", Path1.c_str(), Path2.c_str(), strerror(errno));
+			ret = -1;
+		} else if (memcmp(buf1, buf2, len) != 0) {
+			ret = 1;
+		}
+		done += len;
+	}
+
+	free(buf1);
+	free(buf2);
+	if (fd1 >= 0)
+		close(fd1);
+	if (fd2 >= 0)
+		close(fd2);
+
+	if (ret == 0 && cacheable) {
+		pthread_mutex_lock(&compare_lock);
+		if (compare_cache.size() >= COMPARE_CACHE_MAX)
+			compare_cache.clear();
+		compare_cache.insert(key);
+		pthread_mutex_unlock(&compare_lock);
+	}
+	return ret;
+}
+
+// A block is a fill block when every 32 bit word matches the first one.
+// Comparing the block against itself shifted by a word lets memcmp do the
+// scan with its word sized loads.
+static bool Is_Fill_Block(const unsigned char* block, uint32_t* fill) {
+	if (memcmp(block, block + 4, SPARSE_BLOCK_SIZE - 4) != 0)
+		return false;
+	memcpy(fill, block, 4);
+	return true;
+}
+
+static bool Write_Chunk(int fd, uint16_t type, uint32_t blocks, const void* data, size_t data_len, uint32_t* chunks) {
+	struct sparse_chunk_header chunk;
+
+	chunk.chunk_type = type;
+	chunk.reserved1 = 0;
+	chunk.chunk_sz = blocks;
+	chunk.total_sz = sizeof(chunk) + data_len;
+	(*chunks)++;
+	return Write_Full(fd, &chunk, sizeof(chunk)) && Write_Full(fd, data, data_len);
+}
+
+int twrpBlockIO::Backup_Sparse(const string& Source, const string& Dest, uint64_t Length, Block_Progress Progress, void* Cookie, const vector<Block_Range>* Used) {
+	struct sparse_header header;
+	vector<Block_Range> whole;
+	bool src_direct;
+	uint64_t done = 0, position = 0;
+	uint32_t chunks = 0, fill_value = 0, fill_blocks = 0;
+	int ret = -1;
+
+	if (Length == 0 || Length % SPARSE_BLOCK_SIZE != 0 || Length / SPARSE_BLOCK_SIZE > 0xffffffffULL) {
+		if (Used)
+			return -1;
+		return Copy(Source, Dest, Length, Progress, Cookie);
+	}
+	if (Used == NULL) {
+		Block_Range all = { 0, Length };
+		whole.push_back(all);
+		Used = &whole;
+	}
+
+	int src = Open_Path(Source, O_RDONLY, &src_direct);
+	if (src < 0) {
+		LOGERR("Unable to open '%s' for reading: %s\n", Source.c_str(), strerror(errno));
+		return -1;
+	}
+	int dst = open(Dest.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (dst < 0) {
+		LOGERR("Unable to open '%s' for writing: %s\n", Dest.c_str(), strerror(errno));
+		close(src);
+		return -1;
+	}
+	unsigned char* buffer = (unsigned char*) memalign(BLOCKIO_ALIGN, BLOCKIO_BUFFER_SIZE);
+	if (buffer == NULL) {
+		LOGERR("Unable to allocate copy buffer\n");
+		close(src);
+		close(dst);
+		return -1;
+	}
+
+	// The chunk count goes in once the image is written
+	memset(&header, 0, sizeof(header));
+	header.magic = SPARSE_HEADER_MAGIC;
+	header.major_version = 1;
+	header.minor_version = 0;
+	header.file_hdr_sz = sizeof(header);
+	header.chunk_hdr_sz = sizeof(struct sparse_chunk_header);
+	header.blk_sz = SPARSE_BLOCK_SIZE;
+	header.total_blks = Length / SPARSE_BLOCK_SIZE;
+	if (!Write_Full(dst, &header, sizeof(header)))
+		goto write_error;
+
+	// Gaps between the used ranges, and the end of the device after the
+	// last one, are left out as don't care chunks
+	for (size_t r = 0; r <= Used->size(); r++) {
+		uint64_t start = Length, end = Length;
+		if (r < Used->size()) {
+			start = (*Used)[r].start;
+			end = start + (*Used)[r].length;
+			if (start % SPARSE_BLOCK_SIZE || end % SPARSE_BLOCK_SIZE || start < position || end > Length) {
+				LOGERR("Bad block range for '%s'\n", Source.c_str());
+				goto exit;
+			}
+		}
+		if (start > position) {
+			if (fill_blocks) {
+				if (!Write_Chunk(dst, CHUNK_TYPE_FILL, fill_blocks, &fill_value, 4, &chunks))
+					goto write_error;
+				fill_blocks = 0;
+			}
+			if (!Write_Chunk(dst, CHUNK_TYPE_DONT_CARE, (start - position) / SPARSE_BLOCK_SIZE, NULL, 0, &chunks))
+				goto write_error;
+			position = start;
+			if (lseek64(src, position, SEEK_SET) < 0) {
+				LOGERR("Error seeking '%s': %s\n", Source.c_str(), strerror(errno));
+				goto exit;
+			}
+		}
+
+		while (position < end) {
+			size_t want = BLOCKIO_BUFFER_SIZE;
+			if (end - position < want)
+				want = end - position;
+			if (!Read_Full(src, buffer, want)) {
+				LOGERR("Error reading '%s': %s\n", Source.c_str(), errno ? strerror(errno) : "short read");
+				goto exit;
+			}
+
+			// Raw runs are written as they end or when the buffer does,
+			// fill runs carry on into the next buffer
+			size_t raw_start = 0, raw_blocks = 0;
+			for (size_t offset = 0; offset < want; offset += SPARSE_BLOCK_SIZE) {
+				uint32_t fill;
+
+				if (!Is_Fill_Block(buffer + offset, &fill)) {
+					if (fill_blocks) {
+						if (!Write_Chunk(dst, CHUNK_TYPE_FILL, fill_blocks, &fill_value, 4, &chunks))
+							goto write_error;
+						fill_blocks = 0;
+					}
+					if (raw_blocks == 0)
+						raw_start = offset;
+					raw_blocks++;
+					continue;
+				}
+
+				if (raw_blocks) {
+					if (!Write_Chunk(dst, CHUNK_TYPE_RAW, raw_blocks, buffer + raw_start, raw_blocks * SPARSE_BLOCK_SIZE, &chunks))
+						goto write_error;
+					raw_blocks = 0;
+				}
+				if (fill_blocks && fill != fill_value) {
+					if (!Write_Chunk(dst, CHUNK_TYPE_FILL, fill_blocks, &fill_value, 4, &chunks))
+						goto write_error;
+					fill_blocks = 0;
+				}
+				fill_value = fill;
+				fill_blocks++;
+			}
+			if (raw_blocks && !Write_Chunk(dst, CHUNK_TYPE_RAW, raw_blocks, buffer + raw_start, raw_blocks * SPARSE_BLOCK_SIZE, &chunks))
+				goto write_error;
+
+			position += want;
+			done += want;
+			if (Progress)
+				Progress(done, Length, Cookie);
+		}
+	}
+	if (fill_blocks && !Write_Chunk(dst, CHUNK_TYPE_FILL, fill_blocks, &fill_value, 4, &chunks))
+		goto write_error;
+
+	header.total_chunks = chunks;
+	if (lseek(dst, 0, SEEK_SET) != 0 || !Write_Full(dst, &header, sizeof(header)) || fsync(dst) != 0)
+		goto write_error;
+	ret = 0;
+	goto exit;
+
+write_error:
+	LOGERR("Error writing '%s': %s\n", Dest.c_str(), strerror(errno));
+exit:
+	free(buffer);
+	close(src);
+	if (close(dst) != 0 && ret == 0) {
+		LOGERR("Error closing '%s': %s\n", Dest.c_str(), strerror(errno));
+		ret = -1;
+	}
+	return ret;
+}
+
+static bool Read_Sparse_Header(int fd, struct sparse_header* header) {
+	if (!Read_Full(fd, header, sizeof(*header)) || header->magic != SPARSE_HEADER_MAGIC)
+		return false;
+	if (header->major_version != 1 || header->file_hdr_sz < sizeof(*header) ||
+		header->chunk_hdr_sz < sizeof(struct sparse_chunk_header) ||
+		header->blk_sz == 0 || header->blk_sz % 4 != 0)
+		return false;
+	// Skip any header fields newer than ours
+	return lseek(fd, header->file_hdr_sz, SEEK_SET) == header->file_hdr_sz;
+}
+
+bool twrpBlockIO::Is_Sparse_Image(const string& Path) {
+	struct sparse_header header;
+
+	int fd = open(Path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	bool sparse = Read_Sparse_Header(fd, &header);
+	close(fd);
+	return sparse;
+}
+
+bool twrpBlockIO::Get_Image_Size(const string& Path, uint64_t& Size) {
+	struct sparse_header header;
+
+	int fd = open(Path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	bool sparse = Read_Sparse_Header(fd, &header);
+	close(fd);
+
+	if (sparse) {
+		Size = (uint64_t) header.total_blks * header.blk_sz;
+		return true;
+	}
+	return Get_Size(Path, Size);
+}
+
+// Zeroes a range of the device without sending the zeros down: a discard
+// when the device reads discarded blocks back as zeros, otherwise
+// BLKZEROOUT. Returns false when the caller has to write them.
+static bool Zero_Range(int fd, uint64_t offset, uint64_t length) {
+	unsigned int discard_zeroes = 0;
+	uint64_t range[2];
+
+	range[0] = offset;
+	range[1] = length;
+	if (ioctl(fd, BLKDISCARDZEROES, &discard_zeroes) == 0 && discard_zeroes &&
+		ioctl(fd, BLKDISCARD, &range) == 0)
+		return true;
+	return ioctl(fd, BLKZEROOUT, &range) == 0;
+}
+
+bool twrpBlockIO::Discard(const string& Device, uint64_t Length) {
+	uint64_t range[2], size;
+
+	if (!Get_Size(Device, size))
+		return false;
+	int fd = open(Device.c_str(), O_RDWR);
+	if (fd < 0) {
+		LOGINFO("Unable to open '%s' to discard: %s\n", Device.c_str(), strerror(errno));
+		return false;
+	}
+	range[0] = 0;
+	range[1] = (Length == 0 || Length > size) ? size : Length;
+	bool ret = ioctl(fd, BLKDISCARD, &range) == 0;
+	if (!ret)
+		LOGINFO("Discard of '%s' not supported: %s\n", Device.c_str(), strerror(errno));
+	close(fd);
+	return ret;
+}
+
+// Bionic has no fallocate() wrapper. On 32 bit ABIs each 64 bit argument
+// is passed as a low and high word, which is the order syscall() puts them in.
+static int Fallocate(int fd, uint64_t length) {
+#ifdef __NR_fallocate
+#ifdef __LP64__
+	return syscall(__NR_fallocate, fd, 0, (off_t) 0, (off_t) length);
+#else
+	return syscall(__NR_fallocate, fd, 0, 0, 0, (uint32_t) length, (uint32_t) (length >> 32));
+#endif
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+bool twrpBlockIO::Allocate_File(const string& Path, uint64_t Size) {
+	struct stat st;
+
+	int fd = open(Path.c_str(), O_WRONLY | O_CREAT, 0644);
+	if (fd < 0) {
+		LOGINFO("Unable to open '%s': %s\n", Path.c_str(), strerror(errno));
+		return false;
+	}
+	if (Fallocate(fd, Size) == 0) {
+		close(fd);
+		return true;
+	}
+	if (errno != EOPNOTSUPP && errno != ENOSYS) {
+		LOGINFO("Unable to allocate %llu bytes for '%s': %s\n", (unsigned long long) Size, Path.c_str(), strerror(errno));
+		close(fd);
+		return false;
+	}
+
+	// vfat can't reserve blocks, but it has no holes either, so growing the
+	// file makes the kernel zero the new part without any copying from here
+	bool ret = fstat(fd, &st) == 0 && (st.st_size >= (off_t) Size || ftruncate(fd, Size) == 0);
+	if (!ret)
+		LOGINFO("Unable to extend '%s' to %llu bytes: %s\n", Path.c_str(), (unsigned long long) Size, strerror(errno));
+	close(fd);
+	return ret;
+}
+
+int twrpBlockIO::Restore_Image(const string& Source, const string& Dest, Block_Progress Progress, void* Cookie) {
+	struct sparse_header header;
+	struct stat st;
+	bool dst_direct, is_block;
+	uint64_t offset = 0, total;
+	int ret = -1;
+
+	int src = open(Source.c_str(), O_RDONLY);
+	if (src < 0) {
+		LOGERR("Unable to open '%s' for reading: %s\n", Source.c_str(), strerror(errno));
+		return -1;
+	}
+	if (!Read_Sparse_Header(src, &header)) {
+		close(src);
+		return Copy(Source, Dest, 0, Progress, Cookie);
+	}
+
+	is_block = stat(Dest.c_str(), &st) == 0 && S_ISBLK(st.st_mode);
+	int dst = Open_Path(Dest, O_WRONLY | O_CREAT, &dst_direct);
+	if (dst < 0) {
+		LOGERR("Unable to open '%s' for writing: %s\n", Dest.c_str(), strerror(errno));
+		close(src);
+		return -1;
+	}
+	unsigned char* buffer = (unsigned char*) memalign(BLOCKIO_ALIGN, BLOCKIO_BUFFER_SIZE);
+	if (buffer == NULL) {
+		LOGERR("Unable to allocate copy buffer\n");
+		close(src);
+		close(dst);
+		return -1;
+	}
+
+	total = (uint64_t) header.total_blks * header.blk_sz;
+	for (uint32_t i = 0; i < header.total_chunks; i++) {
+		struct sparse_chunk_header chunk;
+		uint64_t length;
+		uint32_t fill;
+
+		if (!Read_Full(src, &chunk, sizeof(chunk)) ||
+			lseek(src, header.chunk_hdr_sz - sizeof(chunk), SEEK_CUR) < 0)
+			goto read_error;
+		length = (uint64_t) chunk.chunk_sz * header.blk_sz;
+		if (offset + length > total) {
+			LOGERR("Sparse image '%s' is corrupt\n", Source.c_str());
+			goto exit;
+		}
+
+		switch (chunk.chunk_type) {
+		case CHUNK_TYPE_RAW:
+			for (uint64_t left = length; left > 0; ) {
+				size_t want = left < BLOCKIO_BUFFER_SIZE ? left : BLOCKIO_BUFFER_SIZE;
+				if (!Read_Full(src, buffer, want))
+					goto read_error;
+				if (want % BLOCKIO_ALIGN)
+					Drop_Direct(dst, &dst_direct);
+				if (!Write_Full(dst, buffer, want))
+					goto write_error;
+				left -= want;
+			}
+			break;
+		case CHUNK_TYPE_FILL:
+			if (!Read_Full(src, &fill, 4))
+				goto read_error;
+			if (fill == 0 && is_block && Zero_Range(dst, offset, length)) {
+				if (lseek64(dst, offset + length, SEEK_SET) < 0)
+					goto write_error;
+				break;
+			}
+			for (size_t j = 0; j < BLOCKIO_BUFFER_SIZE / 4; j++)
+				((uint32_t*) buffer)[j] = fill;
+			for (uint64_t left = length; left > 0; ) {
+				size_t want = left < BLOCKIO_BUFFER_SIZE ? left : BLOCKIO_BUFFER_SIZE;
+				if (want % BLOCKIO_ALIGN)
+					Drop_Direct(dst, &dst_direct);
+				if (!Write_Full(dst, buffer, want))
+					goto write_error;
+				left -= want;
+			}
+			break;
+		case CHUNK_TYPE_DONT_CARE:
+			if (lseek64(dst, offset + length, SEEK_SET) < 0)
+				goto write_error;
+			break;
+		case CHUNK_TYPE_CRC32:
+			if (lseek(src, 4, SEEK_CUR) < 0)
+				goto read_error;
+			break;
+		default:
+			LOGERR("Unknown chunk type 0x%x in '%s'\n", chunk.chunk_type, Source.c_str());
+			goto exit;
+		}
+
+		offset += length;
+		if (Progress)
+			Progress(offset, total, Cookie);
+	}
+
+	// A plain file keeps the full size even if it ends in a skipped range
+	if (!is_block && ftruncate(dst, total) != 0)
+		goto write_error;
+	if (fsync(dst) != 0 && errno != EINVAL)
+		goto write_error;
+	ret = 0;
+	goto exit;
+
+read_error:
+	LOGERR("Error reading '%s': %s\n", Source.c_str(), errno ? strerror(errno) : "short read");
+	goto exit;
+write_error:
+	LOGERR("Error writing '%s': %s\n", Dest.c_str(), strerror(errno));
+exit:
+	free(buffer);
+	close(src);
+	if (close(dst) != 0 && ret == 0) {
+		LOGERR("Error closing '%s': %s\n", Dest.c_str(), strerror(errno));
+		ret = -1;
+	}
+	return ret;
+}
+
+// ext4 on-disk layout, only the fields needed to find the allocated blocks
+#define EXT4_SUPER_MAGIC                0xEF53
+#define EXT4_VALID_FS                   0x0001
+#define EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
+#define EXT4_FEATURE_INCOMPAT_RECOVER   0x0004
+#define EXT4_FEATURE_INCOMPAT_META_BG   0x0010
+#define EXT4_FEATURE_INCOMPAT_64BIT     0x0080
+#define EXT4_BG_BLOCK_UNINIT            0x0002
+
+static uint16_t Le16(const unsigned char* p) {
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t Le32(const unsigned char* p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static bool Read_At(int fd, uint64_t offset, void* buf, size_t len) {
+	return lseek64(fd, offset, SEEK_SET) == (off64_t) offset && Read_Full(fd, buf, len);
+}
+
+static bool Group_Has_Super(uint32_t group, bool sparse_super) {
+	if (!sparse_super || group <= 1)
+		return true;
+	for (uint32_t base = 3; base <= 7; base += 2) {
+		uint64_t power = base;
+		while (power < group)
+			power *= base;
+		if (power == group)
+			return true;
+	}
+	return false;
+}
+
+static void Mark_Blocks(vector<unsigned char>& used, uint64_t first, uint64_t count, uint64_t total) {
+	for (uint64_t block = first; block < first + count && block < total; block++)
+		used[block >> 3] |= 1 << (block & 7);
+}
+
+bool twrpBlockIO::Get_Ext4_Used_Ranges(const string& Device, vector<Block_Range>& Ranges) {
+	unsigned char sb[1024];
+	bool ret = false;
+
+	Ranges.clear();
+	int fd = open(Device.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	if (!Read_At(fd, 1024, sb, sizeof(sb)) || Le16(sb + 56) != EXT4_SUPER_MAGIC) {
+		close(fd);
+		return false;
+	}
+
+	uint32_t incompat = Le32(sb + 96), ro_compat = Le32(sb + 100);
+	uint64_t blocks = Le32(sb + 4);
+	if (incompat & EXT4_FEATURE_INCOMPAT_64BIT)
+		blocks |= (uint64_t) Le32(sb + 0x150) << 32;
+	uint32_t first_data_block = Le32(sb + 20);
+	uint32_t block_size = 1024 << Le32(sb + 24);
+	uint32_t blocks_per_group = Le32(sb + 32);
+	uint32_t inodes_per_group = Le32(sb + 40);
+	uint32_t inode_size = Le32(sb + 76) >= 1 ? Le16(sb + 88) : 128;
+	uint32_t desc_size = (incompat & EXT4_FEATURE_INCOMPAT_64BIT) ? Le16(sb + 254) : 32;
+	uint32_t reserved_gdt = Le16(sb + 206);
+
+	// Without a clean unmount the bitmaps can lag behind the journal
+	if (!(Le16(sb + 58) & EXT4_VALID_FS) || (incompat & EXT4_FEATURE_INCOMPAT_RECOVER)) {
+		LOGINFO("'%s' was not cleanly unmounted, not reading its bitmaps\n", Device.c_str());
+		close(fd);
+		return false;
+	}
+	// With meta_bg the descriptors are spread over the meta groups instead
+	// of following the superblock, leave those to a file based backup
+	if (incompat & EXT4_FEATURE_INCOMPAT_META_BG) {
+		LOGINFO("'%s' uses meta_bg, not reading its bitmaps\n", Device.c_str());
+		close(fd);
+		return false;
+	}
+	if (block_size > 65536 || blocks_per_group == 0 || desc_size < 32 || blocks <= first_data_block) {
+		close(fd);
+		return false;
+	}
+
+	uint32_t groups = (blocks - first_data_block + blocks_per_group - 1) / blocks_per_group;
+	uint32_t gdt_blocks = ((uint64_t) groups * desc_size + block_size - 1) / block_size;
+	uint32_t itable_blocks = ((uint64_t) inodes_per_group * inode_size + block_size - 1) / block_size;
+	vector<unsigned char> gdt((size_t) gdt_blocks * block_size);
+	vector<unsigned char> bitmap(block_size);
+	vector<unsigned char> used((size_t)(blocks / 8 + 1), 0);
+
+	if (!Read_At(fd, (uint64_t)(first_data_block + 1) * block_size, &gdt[0], gdt.size()))
+		goto exit;
+
+	// Boot sector and superblock
+	Mark_Blocks(used, 0, first_data_block + 1, blocks);
+	for (uint32_t group = 0; group < groups; group++) {
+		const unsigned char* desc = &gdt[(size_t) group * desc_size];
+		uint64_t block_bitmap = Le32(desc), inode_bitmap = Le32(desc + 4), inode_table = Le32(desc + 8);
+		uint64_t group_start = first_data_block + (uint64_t) group * blocks_per_group;
+
+		if (desc_size >= 64) {
+			block_bitmap |= (uint64_t) Le32(desc + 0x20) << 32;
+			inode_bitmap |= (uint64_t) Le32(desc + 0x24) << 32;
+			inode_table |= (uint64_t) Le32(desc + 0x28) << 32;
+		}
+		Mark_Blocks(used, block_bitmap, 1, blocks);
+		Mark_Blocks(used, inode_bitmap, 1, blocks);
+		Mark_Blocks(used, inode_table, itable_blocks, blocks);
+
+		if (Le16(desc + 18) & EXT4_BG_BLOCK_UNINIT) {
+			// Nothing but the superblock backup and descriptors is in
+			// an uninitialized group
+			if (Group_Has_Super(group, ro_compat & EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER))
+				Mark_Blocks(used, group_start, 1 + gdt_blocks + reserved_gdt, blocks);
+			continue;
+		}
+
+		if (!Read_At(fd, block_bitmap * block_size, &bitmap[0], block_size))
+			goto exit;
+		for (uint32_t bit = 0; bit < blocks_per_group && group_start + bit < blocks; bit++) {
+			if (bitmap[bit >> 3] & (1 << (bit & 7)))
+				used[(group_start + bit) >> 3] |= 1 << ((group_start + bit) & 7);
+		}
+	}
+
+	// Turn the block map into 4K aligned byte ranges
+	for (uint64_t block = 0; block < blocks; ) {
+		if (!(used[block >> 3] & (1 << (block & 7)))) {
+			block++;
+			continue;
+		}
+		uint64_t run = block;
+		while (run < blocks && (used[run >> 3] & (1 << (run & 7))))
+			run++;
+
+		uint64_t start = block * block_size / SPARSE_BLOCK_SIZE * SPARSE_BLOCK_SIZE;
+		uint64_t end = (run * block_size + SPARSE_BLOCK_SIZE - 1) / SPARSE_BLOCK_SIZE * SPARSE_BLOCK_SIZE;
+		if (!Ranges.empty() && Ranges.back().start + Ranges.back().length >= start) {
+			Ranges.back().length = end - Ranges.back().start;
+		} else {
+			Block_Range range = { start, end - start };
+			Ranges.push_back(range);
+		}
+		block = run;
+	}
+	ret = true;
+
+exit:
+	close(fd);
+	return ret;
+}
@@ -0,0 +1,59 @@
+/*
+        Copyright 2013 TeamWin
+        This file is part of TWRP/TeamWin Recovery Project.
+
+        TWRP is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        TWRP is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRP_BLOCKIO_HPP
+#define __TWRP_BLOCKIO_HPP
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+struct Block_Range {
+	uint64_t start;                                                           // In bytes
+	uint64_t length;
+};
+
+// Called as a copy goes along, Total is 0 when the length isn't known
+typedef void (*Block_Progress)(uint64_t Done, uint64_t Total, void* Cookie);
+
+// Raw copies between block devices and image files without going through
+// dd. Block devices are read and written with O_DIRECT where the kernel
+// allows it so large images don't flush the page cache.
+class twrpBlockIO
+{
+public:
+	static int Copy(const string& Source, const string& Dest, uint64_t Length = 0, Block_Progress Progress = NULL, void* Cookie = NULL); // Copies Length bytes, or all of Source when 0, returns 0 on success
+	static bool Get_Size(const string& Path, uint64_t& Size);                // Size of a block device or file
+	static int Compare(const string& Path1, const string& Path2);            // 0 if the contents are the same, 1 if not, -1 on errors
+	static bool Discard(const string& Device, uint64_t Length = 0);          // Tells the flash the first Length bytes, or the whole device when 0, are unused
+	static bool Allocate_File(const string& Path, uint64_t Size);            // Reserves Size bytes for a file with fallocate, without writing zeros
+	static bool Get_Mount_Usage(const string& Block_Device, uint64_t& Size, uint64_t& Used, uint64_t& Free); // statfs of the place the block device is mounted according to /proc/mounts
+
+	// Android sparse images: blocks that are one repeated 32 bit value are
+	// stored as fill chunks and everything else as raw chunks
+	static int Backup_Sparse(const string& Source, const string& Dest, uint64_t Length, Block_Progress Progress = NULL, void* Cookie = NULL, const vector<Block_Range>* Used = NULL); // Length must be a multiple of the 4K block size, only the Used ranges are read when given
+	static bool Is_Sparse_Image(const string& Path);
+	static int Restore_Image(const string& Source, const string& Dest, Block_Progress Progress = NULL, void* Cookie = NULL); // Restores a sparse or plain raw image
+	static bool Get_Image_Size(const string& Path, uint64_t& Size);          // Size of an image once it is written out, sparse or not
+
+	static bool Get_Ext4_Used_Ranges(const string& Device, vector<Block_Range>& Ranges); // 4K aligned ranges holding allocated blocks of a cleanly unmounted ext2/3/4 file system without meta_bg
+};
+
+#endif // __TWRP_BLOCKIO_HPP
@@ -0,0 +1,733 @@
+/*
+        Copyright 2013 TeamWin
+        This file is part of TWRP/TeamWin Recovery Project.
+
+        TWRP is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        TWRP is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <zlib.h>
+#include <vector>
+#include "twrpCodec.hpp"
+#include "twcommon.h"
+
+static uint32_t Get_Le32(const unsigned char* p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void Put_Le32(string& Out, uint32_t v) {
+	Out += (char) (v & 0xFF);
+	Out += (char) ((v >> 8) & 0xFF);
+	Out += (char) ((v >> 16) & 0xFF);
+	Out += (char) (v >> 24);
+}
+
+// gzip
+
+bool twrpCodec::Gzip_Compress(const string& In, string& Out) {
+	z_stream z;
+	char buf[65536];
+	int ret;
+
+	memset(&z, 0, sizeof(z));
+	if (deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return false;
+
+	Out.clear();
+	z.next_in = (Bytef*) In.data();
+	z.avail_in = In.size();
+	do {
+		z.next_out = (Bytef*) buf;
+		z.avail_out = sizeof(buf);
+		ret = deflate(&z, Z_FINISH);
+		Out.append(buf, sizeof(buf) - z.avail_out);
+	} while (ret == Z_OK);
+	deflateEnd(&z);
+	return ret == Z_STREAM_END;
+}
+
+bool twrpCodec::Gzip_Decompress(const string& In, string& Out) {
+	z_stream z;
+	char buf[65536];
+	int ret;
+
+	memset(&z, 0, sizeof(z));
+	if (inflateInit2(&z, 16 + MAX_WBITS) != Z_OK)
+		return false;
+
+	Out.clear();
+	z.next_in = (Bytef*) In.data();
+	z.avail_in = In.size();
+	do {
+		z.next_out = (Bytef*) buf;
+		z.avail_out = sizeof(buf);
+		ret = inflate(&z, Z_NO_FLUSH);
+		Out.append(buf, sizeof(buf) - z.avail_out);
+	} while (ret == Z_OK);
+	inflateEnd(&z);
+	if (ret != Z_STREAM_END) {
+		LOGINFO("gzip stream is corrupt (%d)\n", ret);
+		return false;
+	}
+	return true;
+}
+
+// lz4, legacy frames: a magic number followed by blocks of up to 8 MB,
+// each prefixed with its compressed size
+
+#define LZ4_LEGACY_MAGIC 0x184C2102
+#define LZ4_LEGACY_BLOCK (8 << 20)
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5                                                // The last bytes of a block are always literals
+#define LZ4_MATCH_LIMIT 12                                                 // A match can't start closer than this to the end
+#define LZ4_HASH_BITS 16
+
+static void Lz4_Put_Length(string& Out, size_t len) {
+	while (len >= 255) {
+		Out += (char) 255;
+		len -= 255;
+	}
+	Out += (char) len;
+}
+
+static void Lz4_Put_Sequence(string& Out, const unsigned char* literals, size_t lit_len, size_t offset, size_t match_len) {
+	size_t m = match_len ? match_len - LZ4_MIN_MATCH : 0;
+	unsigned char token = ((lit_len < 15 ? lit_len : 15) << 4) | (m < 15 ? m : 15);
+
+	Out += (char) token;
+	if (lit_len >= 15)
+		Lz4_Put_Length(Out, lit_len - 15);
+	Out.append((const char*) literals, lit_len);
+	if (!match_len)
+		return;
+	Out += (char) (offset & 0xFF);
+	Out += (char) (offset >> 8);
+	if (m >= 15)
+		Lz4_Put_Length(Out, m - 15);
+}
+
+void twrpCodec::Lz4_Compress_Block(const unsigned char* In, size_t Length, string& Out) {
+	vector<int> table(1 << LZ4_HASH_BITS, -1);
+	size_t anchor = 0, ip = 0;
+
+	while (Length > LZ4_MATCH_LIMIT && ip < Length - LZ4_MATCH_LIMIT) {
+		uint32_t seq = Get_Le32(In + ip);
+		uint32_t h = (seq * 2654435761U) >> (32 - LZ4_HASH_BITS);
+		int ref = table[h];
+
+		table[h] = ip;
+		if (ref < 0 || ip - ref > 65535 || Get_Le32(In + ref) != seq) {
+			ip++;
+			continue;
+		}
+
+		size_t len = LZ4_MIN_MATCH;
+		while (ip + len < Length - LZ4_LAST_LITERALS && In[ref + len] == In[ip + len])
+			len++;
+		Lz4_Put_Sequence(Out, In + anchor, ip - anchor, ip - ref, len);
+		ip += len;
+		anchor = ip;
+	}
+	Lz4_Put_Sequence(Out, In + anchor, Length - anchor, 0, 0);
+}
+
+bool twrpCodec::Lz4_Compress(const string& In, string& Out) {
+	const unsigned char* src = (const unsigned char*) In.data();
+	string block;
+
+	Out.clear();
+	Put_Le32(Out, LZ4_LEGACY_MAGIC);
+	for (size_t pos = 0; pos < In.size(); pos += LZ4_LEGACY_BLOCK) {
+		size_t len = In.size() - pos;
+		if (len > LZ4_LEGACY_BLOCK)
+			len = LZ4_LEGACY_BLOCK;
+		block.clear();
+		Lz4_Compress_Block(src + pos, len, block);
+		Put_Le32(Out, block.size());
+		Out += block;
+	}
+	return true;
+}
+
+static bool Lz4_Get_Length(const unsigned char*& p, const unsigned char* end, size_t& len) {
+	unsigned char b;
+	do {
+		if (p >= end)
+			return false;
+		b = *p++;
+		len += b;
+	} while (b == 255);
+	return true;
+}
+
+bool twrpCodec::Lz4_Decompress_Block(const unsigned char* In, size_t Length, string& Out) {
+	const unsigned char* p = In;
+	const unsigned char* end = In + Length;
+	size_t block_start = Out.size();
+
+	while (p < end) {
+		unsigned char token = *p++;
+		size_t lit_len = token >> 4;
+		if (lit_len == 15 && !Lz4_Get_Length(p, end, lit_len))
+			return false;
+		if ((size_t) (end - p) < lit_len)
+			return false;
+		Out.append((const char*) p, lit_len);
+		p += lit_len;
+		if (p == end)
+			break;                                                         // The last sequence has no match
+
+		if (end - p < 2)
+			return false;
+		size_t offset = p[0] | (p[1] << 8);
+		p += 2;
+		size_t match_len = token & 15;
+		if (match_len == 15 && !Lz4_Get_Length(p, end, match_len))
+			return false;
+		match_len += LZ4_MIN_MATCH;
+		if (offset == 0 || offset > Out.size() - block_start)
+			return false;
+
+		// Matches may overlap what they produce, so copy byte by byte
+		size_t from = Out.size() - offset;
+		Out.resize(Out.size() + match_len);
+		char* dst = &Out[0];
+		for (size_t i = 0; i < match_len; i++)
+			dst[from + offset + i] = dst[from + i];
+	}
+	return true;
+}
+
+bool twrpCodec::Lz4_Decompress(const string& In, string& Out) {
+	const unsigned char* p = (const unsigned char*) In.data();
+	const unsigned char* end = p + In.size();
+
+	Out.clear();
+	if (In.size() < 4 || Get_Le32(p) != LZ4_LEGACY_MAGIC)
+		return false;
+	p += 4;
+	while (end - p >= 4) {
+		uint32_t len = Get_Le32(p);
+		p += 4;
+		if (len == LZ4_LEGACY_MAGIC)
+			continue;                                                      // Concatenated streams
+		if (len == 0 || len > (size_t) (end - p))
+			break;                                                         // Padding after the last block
+		if (!Lz4_Decompress_Block(p, len, Out)) {
+			LOGINFO("lz4 stream is corrupt\n");
+			return false;
+		}
+		p += len;
+	}
+	return true;
+}
+
+// lzma, with the literal, match and length models of the reference
+// decoder. The encoder is greedy and only uses plain and rep0 matches,
+// which every decoder understands.
+
+#define LZMA_LC 3
+#define LZMA_PB 2
+#define LZMA_PROPS ((LZMA_PB * 5) * 9 + LZMA_LC)
+#define LZMA_HEADER_SIZE 13
+#define LZMA_STATES 12
+#define LZMA_POS_STATES (1 << LZMA_PB)
+#define LZMA_MATCH_MIN 2
+#define LZMA_MATCH_MAX 273
+#define LZMA_END_POS_MODEL 14
+#define LZMA_FULL_DISTANCES 128
+#define LZMA_ALIGN_BITS 4
+#define LZMA_PROB_BITS 11
+#define LZMA_PROB_INIT (1 << (LZMA_PROB_BITS - 1))
+#define LZMA_MOVE_BITS 5
+#define LZMA_TOP (1 << 24)
+#define LZMA_MAX_DICT (8 << 20)
+#define LZMA_HASH_BITS 16
+#define LZMA_CHAIN_DEPTH 48
+
+typedef uint16_t Lzma_Prob;
+
+struct Lzma_Len_Model {
+	Lzma_Prob choice;
+	Lzma_Prob choice2;
+	Lzma_Prob low[LZMA_POS_STATES][1 << 3];
+	Lzma_Prob mid[LZMA_POS_STATES][1 << 3];
+	Lzma_Prob high[1 << 8];
+};
+
+struct Lzma_Model {
+	Lzma_Prob literal[0x300 << LZMA_LC];
+	Lzma_Prob is_match[LZMA_STATES][LZMA_POS_STATES];
+	Lzma_Prob is_rep[LZMA_STATES];
+	Lzma_Prob is_rep_g0[LZMA_STATES];
+	Lzma_Prob is_rep_g1[LZMA_STATES];
+	Lzma_Prob is_rep_g2[LZMA_STATES];
+	Lzma_Prob is_rep0_long[LZMA_STATES][LZMA_POS_STATES];
+	Lzma_Prob pos_slot[4][1 << 6];
+	Lzma_Prob pos[1 + LZMA_FULL_DISTANCES - LZMA_END_POS_MODEL];
+	Lzma_Prob align[1 << LZMA_ALIGN_BITS];
+	Lzma_Len_Model len;
+	Lzma_Len_Model rep_len;
+
+	Lzma_Model() {
+		Lzma_Prob* p = (Lzma_Prob*) this;
+		for (size_t i = 0; i < sizeof(*this) / sizeof(Lzma_Prob); i++)
+			p[i] = LZMA_PROB_INIT;
+	}
+};
+
+static int Lzma_State_Literal(int s) { return s < 4 ? 0 : (s < 10 ? s - 3 : s - 6); }
+static int Lzma_State_Match(int s)   { return s < 7 ? 7 : 10; }
+static int Lzma_State_Rep(int s)     { return s < 7 ? 8 : 11; }
+static int Lzma_State_Short_Rep(int s) { return s < 7 ? 9 : 11; }
+
+class Lzma_Decoder {
+public:
+	Lzma_Decoder(const unsigned char* p, const unsigned char* e) : in(p), end(e), range(0xFFFFFFFF), code(0), corrupt(false) {
+		for (int i = 0; i < 5; i++)
+			code = (code << 8) | Next();
+	}
+
+	unsigned Bit(Lzma_Prob& prob) {
+		uint32_t bound = (range >> LZMA_PROB_BITS) * prob;
+		unsigned bit;
+		if (code < bound) {
+			prob += ((1 << LZMA_PROB_BITS) - prob) >> LZMA_MOVE_BITS;
+			range = bound;
+			bit = 0;
+		} else {
+			prob -= prob >> LZMA_MOVE_BITS;
+			code -= bound;
+			range -= bound;
+			bit = 1;
+		}
+		Normalize();
+		return bit;
+	}
+
+	uint32_t Direct(int bits) {
+		uint32_t res = 0;
+		while (bits--) {
+			range >>= 1;
+			code -= range;
+			uint32_t t = 0 - (code >> 31);
+			code += range & t;
+			res = (res << 1) + (t + 1);
+			Normalize();
+		}
+		return res;
+	}
+
+	unsigned Tree(Lzma_Prob* probs, int bits) {
+		unsigned m = 1;
+		for (int i = 0; i < bits; i++)
+			m = (m << 1) + Bit(probs[m]);
+		return m - (1 << bits);
+	}
+
+	unsigned Reverse_Tree(Lzma_Prob* probs, int bits) {
+		unsigned m = 1, sym = 0;
+		for (int i = 0; i < bits; i++) {
+			unsigned bit = Bit(probs[m]);
+			m = (m << 1) + bit;
+			sym |= bit << i;
+		}
+		return sym;
+	}
+
+	unsigned Length(Lzma_Len_Model& len, unsigned pos_state) {
+		if (!Bit(len.choice))
+			return Tree(len.low[pos_state], 3);
+		if (!Bit(len.choice2))
+			return 8 + Tree(len.mid[pos_state], 3);
+		return 16 + Tree(len.high, 8);
+	}
+
+	bool Corrupt(void) { return corrupt; }
+
+private:
+	unsigned char Next(void) {
+		if (in < end)
+			return *in++;
+		corrupt = true;
+		return 0;
+	}
+
+	void Normalize(void) {
+		if (range < LZMA_TOP) {
+			range <<= 8;
+			code = (code << 8) | Next();
+		}
+	}
+
+	const unsigned char* in;
+	const unsigned char* end;
+	uint32_t range;
+	uint32_t code;
+	bool corrupt;
+};
+
+bool twrpCodec::Lzma_Decompress(const string& In, string& Out) {
+	const unsigned char* p = (const unsigned char*) In.data();
+
+	Out.clear();
+	if (In.size() < LZMA_HEADER_SIZE)
+		return false;
+
+	unsigned props = p[0];
+	if (props >= 9 * 5 * 5)
+		return false;
+	unsigned lc = props % 9, lp = (props / 9) % 5, pb = props / 45;
+	uint64_t size = 0;
+	for (int i = 0; i < 8; i++)
+		size |= (uint64_t) p[5 + i] << (8 * i);
+	bool known_size = size != (uint64_t) -1;
+	if (known_size)
+		Out.reserve(size);
+
+	// Every lc/lp combination needs its own literal table size
+	vector<Lzma_Prob> literal(0x300 << (lc + lp), LZMA_PROB_INIT);
+	Lzma_Model* m = new Lzma_Model;
+	Lzma_Decoder rc(p + LZMA_HEADER_SIZE, p + In.size());
+	uint32_t rep0 = 0, rep1 = 0, rep2 = 0, rep3 = 0;
+	int state = 0;
+	bool ok = false;
+
+	while (!rc.Corrupt()) {
+		if (known_size && Out.size() == size) {
+			ok = true;
+			break;
+		}
+
+		size_t pos = Out.size();
+		unsigned pos_state = pos & ((1 << pb) - 1);
+		if (!rc.Bit(m->is_match[state][pos_state])) {
+			unsigned prev = pos ? (unsigned char) Out[pos - 1] : 0;
+			Lzma_Prob* probs = &literal[0x300 * (((pos & ((1 << lp) - 1)) << lc) + (prev >> (8 - lc)))];
+			unsigned sym = 1;
+			if (state >= 7) {
+				unsigned match_byte = (unsigned char) Out[pos - rep0 - 1];
+				do {
+					unsigned match_bit = (match_byte >> 7) & 1;
+					match_byte <<= 1;
+					unsigned bit = rc.Bit(probs[((1 + match_bit) << 8) + sym]);
+					sym = (sym << 1) | bit;
+					if (match_bit != bit)
+						break;
+				} while (sym < 0x100);
+			}
+			while (sym < 0x100)
+				sym = (sym << 1) | rc.Bit(probs[sym]);
+			Out += (char) (sym - 0x100);
+			state = Lzma_State_Literal(state);
+			continue;
+		}
+
+		unsigned len;
+		if (rc.Bit(m->is_rep[state])) {
+			if (pos == 0)
+				break;
+			if (!rc.Bit(m->is_rep_g0[state])) {
+				if (!rc.Bit(m->is_rep0_long[state][pos_state])) {
+					if (rep0 >= pos)
+						break;
+					state = Lzma_State_Short_Rep(state);
+					Out += Out[pos - rep0 - 1];
+					continue;
+				}
+			} else {
+				uint32_t dist;
+				if (!rc.Bit(m->is_rep_g1[state])) {
+					dist = rep1;
+				} else {
+					if (!rc.Bit(m->is_rep_g2[state])) {
+						dist = rep2;
+					} else {
+						dist = rep3;
+						rep3 = rep2;
+					}
+					rep2 = rep1;
+				}
+				rep1 = rep0;
+				rep0 = dist;
+			}
+			len = rc.Length(m->rep_len, pos_state);
+			state = Lzma_State_Rep(state);
+		} else {
+			rep3 = rep2;
+			rep2 = rep1;
+			rep1 = rep0;
+			len = rc.Length(m->len, pos_state);
+			state = Lzma_State_Match(state);
+
+			unsigned slot = rc.Tree(m->pos_slot[len < 3 ? len : 3], 6);
+			if (slot < 4) {
+				rep0 = slot;
+			} else {
+				int bits = (slot >> 1) - 1;
+				rep0 = (2 | (slot & 1)) << bits;
+				if (slot < LZMA_END_POS_MODEL) {
+					rep0 += rc.Reverse_Tree(m->pos + rep0 - slot, bits);
+				} else {
+					rep0 += rc.Direct(bits - LZMA_ALIGN_BITS) << LZMA_ALIGN_BITS;
+					rep0 += rc.Reverse_Tree(m->align, LZMA_ALIGN_BITS);
+				}
+				if (rep0 == 0xFFFFFFFF) {
+					ok = !known_size || Out.size() == size;          // End marker
+					break;
+				}
+			}
+		}
+
+		len += LZMA_MATCH_MIN;
+		if (rep0 >= pos)
+			break;
+		if (known_size && len > size - pos)
+			break;
+		size_t from = pos - rep0 - 1;
+		Out.resize(pos + len);
+		char* dst = &Out[0];
+		for (unsigned i = 0; i < len; i++)
+			dst[pos + i] = dst[from + i];
+	}
+	delete m;
+	if (!ok)
+		LOGINFO("lzma stream is corrupt\n");
+	return ok;
+}
+
+class Lzma_Encoder {
+public:
+	Lzma_Encoder(string& o) : out(o), low(0), range(0xFFFFFFFF), cache(0), cache_size(1) {}
+
+	void Bit(Lzma_Prob& prob, unsigned bit) {
+		uint32_t bound = (range >> LZMA_PROB_BITS) * prob;
+		if (!bit) {
+			range = bound;
+			prob += ((1 << LZMA_PROB_BITS) - prob) >> LZMA_MOVE_BITS;
+		} else {
+			low += bound;
+			range -= bound;
+			prob -= prob >> LZMA_MOVE_BITS;
+		}
+		while (range < LZMA_TOP) {
+			range <<= 8;
+			Shift_Low();
+		}
+	}
+
+	void Direct(uint32_t value, int bits) {
+		while (bits--) {
+			range >>= 1;
+			low += range & (0 - ((value >> bits) & 1));
+			while (range < LZMA_TOP) {
+				range <<= 8;
+				Shift_Low();
+			}
+		}
+	}
+
+	void Tree(Lzma_Prob* probs, int bits, unsigned sym) {
+		unsigned m = 1;
+		while (bits--) {
+			unsigned bit = (sym >> bits) & 1;
+			Bit(probs[m], bit);
+			m = (m << 1) | bit;
+		}
+	}
+
+	void Reverse_Tree(Lzma_Prob* probs, int bits, unsigned sym) {
+		unsigned m = 1;
+		for (int i = 0; i < bits; i++) {
+			unsigned bit = (sym >> i) & 1;
+			Bit(probs[m], bit);
+			m = (m << 1) | bit;
+		}
+	}
+
+	void Length(Lzma_Len_Model& len, unsigned pos_state, unsigned l) {
+		if (l < 8) {
+			Bit(len.choice, 0);
+			Tree(len.low[pos_state], 3, l);
+		} else if (l < 16) {
+			Bit(len.choice, 1);
+			Bit(len.choice2, 0);
+			Tree(len.mid[pos_state], 3, l - 8);
+		} else {
+			Bit(len.choice, 1);
+			Bit(len.choice2, 1);
+			Tree(len.high, 8, l - 16);
+		}
+	}
+
+	void Flush(void) {
+		for (int i = 0; i < 5; i++)
+			Shift_Low();
+	}
+
+private:
+	void Shift_Low(void) {
+		if ((uint32_t) low < 0xFF000000 || (low >> 32) != 0) {
+			unsigned char carry = low >> 32;
+			unsigned char temp = cache;
+			do {
+				out += (char) (temp + carry);
+				temp = 0xFF;
+			} while (--cache_size != 0);
+			cache = (low >> 24) & 0xFF;
+		}
+		cache_size++;
+		low = (low & 0x00FFFFFF) << 8;
+	}
+
+	string& out;
+	uint64_t low;
+	uint32_t range;
+	unsigned char cache;
+	uint64_t cache_size;
+};
+
+static unsigned Lzma_Pos_Slot(uint32_t dist) {
+	if (dist < 4)
+		return dist;
+	int n = 31;
+	while (!(dist >> n))
+		n--;
+	return (n << 1) | ((dist >> (n - 1)) & 1);
+}
+
+bool twrpCodec::Lzma_Compress(const string& In, string& Out) {
+	const unsigned char* src = (const unsigned char*) In.data();
+	size_t size = In.size();
+	uint32_t dict = 4096;
+
+	while (dict < size && dict < LZMA_MAX_DICT)
+		dict <<= 1;
+
+	Out.clear();
+	Out += (char) LZMA_PROPS;
+	Put_Le32(Out, dict);
+	Put_Le32(Out, size & 0xFFFFFFFF);
+	Put_Le32(Out, (uint64_t) size >> 32);
+
+	Lzma_Model* m = new Lzma_Model;
+	Lzma_Encoder rc(Out);
+	vector<int> head(1 << LZMA_HASH_BITS, -1);
+	vector<int> chain(size);
+	uint32_t rep0 = 0;
+	int state = 0;
+	size_t pos = 0, hashed = 0;
+
+	while (pos < size) {
+		unsigned pos_state = pos & (LZMA_POS_STATES - 1);
+		size_t max_len = size - pos;
+		if (max_len > LZMA_MATCH_MAX)
+			max_len = LZMA_MATCH_MAX;
+
+		// Longest earlier match through a hash chain of 3 byte prefixes
+		size_t best_len = 0;
+		uint32_t best_dist = 0;
+		if (max_len >= 3) {
+			uint32_t h = ((src[pos] | (src[pos + 1] << 8) | (src[pos + 2] << 16)) * 2654435761U) >> (32 - LZMA_HASH_BITS);
+			int cand = head[h];
+			for (int depth = 0; cand >= 0 && pos - cand <= dict && depth < LZMA_CHAIN_DEPTH; depth++) {
+				size_t len = 0;
+				while (len < max_len && src[cand + len] == src[pos + len])
+					len++;
+				if (len > best_len) {
+					best_len = len;
+					best_dist = pos - cand - 1;
+					if (len == max_len)
+						break;
+				}
+				cand = chain[cand];
+			}
+		}
+		// Short far matches cost more than the literals
+		if (best_len == 3 && best_dist >= (1 << 14))
+			best_len = 0;
+
+		size_t rep_len = 0;
+		if (pos > rep0) {
+			while (rep_len < max_len && src[pos - rep0 - 1 + rep_len] == src[pos + rep_len])
+				rep_len++;
+		}
+
+		size_t len;
+		if (rep_len >= LZMA_MATCH_MIN && rep_len + 1 >= best_len) {
+			len = rep_len;
+			rc.Bit(m->is_match[state][pos_state], 1);
+			rc.Bit(m->is_rep[state], 1);
+			rc.Bit(m->is_rep_g0[state], 0);
+			rc.Bit(m->is_rep0_long[state][pos_state], 1);
+			rc.Length(m->rep_len, pos_state, len - LZMA_MATCH_MIN);
+			state = Lzma_State_Rep(state);
+		} else if (best_len >= 3) {
+			len = best_len;
+			unsigned l = len - LZMA_MATCH_MIN;
+			rc.Bit(m->is_match[state][pos_state], 1);
+			rc.Bit(m->is_rep[state], 0);
+			rc.Length(m->len, pos_state, l);
+			state = Lzma_State_Match(state);
+
+			unsigned slot = Lzma_Pos_Slot(best_dist);
+			rc.Tree(m->pos_slot[l < 3 ? l : 3], 6, slot);
+			if (slot >= 4) {
+				int bits = (slot >> 1) - 1;
+				uint32_t base = (2 | (slot & 1)) << bits;
+				uint32_t reduced = best_dist - base;
+				if (slot < LZMA_END_POS_MODEL) {
+					rc.Reverse_Tree(m->pos + base - slot, bits, reduced);
+				} else {
+					rc.Direct(reduced >> LZMA_ALIGN_BITS, bits - LZMA_ALIGN_BITS);
+					rc.Reverse_Tree(m->align, LZMA_ALIGN_BITS, reduced & ((1 << LZMA_ALIGN_BITS) - 1));
+				}
+			}
+			rep0 = best_dist;
+		} else {
+			len = 1;
+			unsigned prev = pos ? src[pos - 1] : 0;
+			Lzma_Prob* probs = &m->literal[0x300 * (prev >> (8 - LZMA_LC))];
+			unsigned byte = src[pos], sym = 1;
+			bool matched = state >= 7;
+			unsigned match_byte = matched ? src[pos - rep0 - 1] : 0;
+
+			rc.Bit(m->is_match[state][pos_state], 0);
+			for (int i = 7; i >= 0; i--) {
+				unsigned bit = (byte >> i) & 1;
+				if (matched) {
+					unsigned match_bit = (match_byte >> i) & 1;
+					rc.Bit(probs[((1 + match_bit) << 8) + sym], bit);
+					matched = match_bit == bit;
+				} else {
+					rc.Bit(probs[sym], bit);
+				}
+				sym = (sym << 1) | bit;
+			}
+			state = Lzma_State_Literal(state);
+		}
+
+		// Everything that was passed over goes into the hash chains
+		pos += len;
+		for (; hashed < pos && hashed + 3 <= size; hashed++) {
+			uint32_t h = ((src[hashed] | (src[hashed + 1] << 8) | (src[hashed + 2] << 16)) * 2654435761U) >> (32 - LZMA_HASH_BITS);
+			chain[hashed] = head[h];
+			head[h] = hashed;
+		}
+	}
+	rc.Flush();
+	delete m;
+	return true;
+}
@@ -0,0 +1,43 @@
+/*
+        Copyright 2013 TeamWin
+        This file is part of TWRP/TeamWin Recovery Project.
+
+        TWRP is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        TWRP is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRP_CODEC_HPP
+#define __TWRP_CODEC_HPP
+
+#include <string>
+
+using namespace std;
+
+// In memory versions of the compressors the kernel can unpack a ramdisk
+// with, so boot images can be repacked without gzip, lz4 or lzma binaries
+class twrpCodec
+{
+public:
+	static bool Gzip_Compress(const string& In, string& Out);
+	static bool Gzip_Decompress(const string& In, string& Out);   // Data after the end of the stream is ignored
+	static bool Lz4_Compress(const string& In, string& Out);      // Legacy lz4 format as used by the kernel
+	static bool Lz4_Decompress(const string& In, string& Out);
+	static bool Lzma_Compress(const string& In, string& Out);     // .lzma (lzma_alone) with lc=3 lp=0 pb=2
+	static bool Lzma_Decompress(const string& In, string& Out);
+
+private:
+	static bool Lz4_Decompress_Block(const unsigned char* In, size_t Length, string& Out);
+	static void Lz4_Compress_Block(const unsigned char* In, size_t Length, string& Out);
+};
+
+#endif // __TWRP_CODEC_HPP
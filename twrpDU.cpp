@@ -0,0 +1,228 @@
+/*
+        Copyright 2013 TeamWin
+        This file is part of TWRP/TeamWin Recovery Project.
+
+        TWRP is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        TWRP is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#include "twrpDU.hpp"
+#include "twcommon.h"
+
+#define MAX_DU_THREADS 4
+
+// Folders changed this recently may change again within the same mtime
+// second, so they aren't cached
+#define DU_RACY_SECONDS 2
+
+map<twrpDU::Dir_Key, twrpDU::Dir_Info> twrpDU::cache;
+pthread_mutex_t twrpDU::cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void Log_Open_Error(const string& path, bool display_error) {
+	if (display_error) {
+		LOGERR("error opening '%s'\n", path.c_str());
+		LOGERR("error: %s\n", strerror(errno));
+	} else {
+		LOGINFO("error opening '%s': %s\n", path.c_str(), strerror(errno));
+	}
+}
+
+void twrpDU::Clear_Cache(void) {
+	pthread_mutex_lock(&cache_lock);
+	cache.clear();
+	pthread_mutex_unlock(&cache_lock);
+}
+
+// Reads the folder open on fd, the entries are looked up relative to fd
+// so the full path is only built for error messages
+bool twrpDU::Read_Dir(int fd, const string& path, Dir_Info& info, bool display_error) {
+	DIR* d;
+	struct dirent* de;
+	struct stat st;
+
+	int dup_fd = dup(fd);
+	if (dup_fd < 0 || (d = fdopendir(dup_fd)) == NULL) {
+		if (dup_fd >= 0)
+			close(dup_fd);
+		Log_Open_Error(path, display_error);
+		return false;
+	}
+
+	info.file_bytes = 0;
+	info.files.clear();
+	info.subdirs.clear();
+	while ((de = readdir(d)) != NULL) {
+		unsigned char type = de->d_type;
+
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+		if (type == DT_UNKNOWN || type == DT_REG) {
+			if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+				continue;
+			if (S_ISREG(st.st_mode))
+				type = DT_REG;
+			else if (S_ISDIR(st.st_mode))
+				type = DT_DIR;
+		}
+
+		if (type == DT_DIR && strcmp(de->d_name, "lost+found") != 0)
+			info.subdirs.push_back(de->d_name);
+		else if (type == DT_REG) {
+			info.file_bytes += (uint64_t)(st.st_size);
+			info.files.append(de->d_name, strlen(de->d_name) + 1);
+		}
+	}
+	closedir(d);
+	return true;
+}
+
+bool twrpDU::Stat_Files(int fd, Dir_Info& info) {
+	struct stat st;
+	size_t pos = 0;
+
+	info.file_bytes = 0;
+	while (pos < info.files.size()) {
+		const char* name = info.files.c_str() + pos;
+		if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(st.st_mode))
+			return false;
+		info.file_bytes += (uint64_t)(st.st_size);
+		pos += strlen(name) + 1;
+	}
+	return true;
+}
+
+// Scans one folder and queues its subfolders, returns the size of the
+// files directly in it
+uint64_t twrpDU::Scan_Dir(Scan* scan, const Dir_Job& job, vector<Dir_Job>& subdirs) {
+	struct stat st;
+	Dir_Key key;
+	Dir_Info info;
+	bool cached = false;
+
+	int fd = open(job.path.c_str(), O_RDONLY | O_DIRECTORY);
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		if (fd >= 0)
+			close(fd);
+		Log_Open_Error(job.path, scan->display_error);
+		return 0;
+	}
+
+	key.dev = st.st_dev;
+	key.ino = st.st_ino;
+	pthread_mutex_lock(&cache_lock);
+	map<Dir_Key, Dir_Info>::iterator it = cache.find(key);
+	if (it != cache.end() && it->second.mtime == st.st_mtime && it->second.ctime == st.st_ctime) {
+		info = it->second;
+		cached = true;
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	// Files can grow or shrink without touching the folder's times
+	if (cached && !Stat_Files(fd, info))
+		cached = false;
+	if (!cached) {
+		if (!Read_Dir(fd, job.path, info, scan->display_error)) {
+			close(fd);
+			return 0;
+		}
+		if (time(NULL) - st.st_mtime >= DU_RACY_SECONDS) {
+			info.mtime = st.st_mtime;
+			info.ctime = st.st_ctime;
+			pthread_mutex_lock(&cache_lock);
+			cache[key] = info;
+			pthread_mutex_unlock(&cache_lock);
+		}
+	}
+	close(fd);
+
+	for (vector<string>::iterator sub = info.subdirs.begin(); sub != info.subdirs.end(); sub++) {
+		if (job.top && scan->exclude_top && *sub == scan->exclude_top)
+			continue;
+
+		Dir_Job subdir;
+		subdir.path = job.path + "/" + *sub;
+		subdir.top = false;
+		subdirs.push_back(subdir);
+	}
+	return info.file_bytes;
+}
+
+void* twrpDU::scan_thread(void* cookie) {
+	Scan* scan = (Scan*) cookie;
+	vector<Dir_Job> subdirs;
+	uint64_t total = 0;
+
+	pthread_mutex_lock(&scan->lock);
+	while (1) {
+		while (scan->jobs.empty() && scan->pending > 0)
+			pthread_cond_wait(&scan->cond, &scan->lock);
+		if (scan->jobs.empty())
+			break;
+
+		// Taking the most recent job walks depth first and keeps the queue short
+		Dir_Job job = scan->jobs.back();
+		scan->jobs.pop_back();
+		pthread_mutex_unlock(&scan->lock);
+
+		subdirs.clear();
+		total += Scan_Dir(scan, job, subdirs);
+
+		pthread_mutex_lock(&scan->lock);
+		scan->jobs.insert(scan->jobs.end(), subdirs.begin(), subdirs.end());
+		scan->pending += (int) subdirs.size() - 1;
+		if (!subdirs.empty() || scan->pending == 0)
+			pthread_cond_broadcast(&scan->cond);
+	}
+	scan->total += total;
+	pthread_mutex_unlock(&scan->lock);
+	return NULL;
+}
+
+uint64_t twrpDU::Get_Folder_Size(const string& Path, bool Display_Error, const char* Exclude_Top) {
+	pthread_t threads[MAX_DU_THREADS];
+	int thread_count = 0, cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	Scan scan;
+	Dir_Job top;
+
+	pthread_mutex_init(&scan.lock, NULL);
+	pthread_cond_init(&scan.cond, NULL);
+	top.path = Path;
+	top.top = true;
+	scan.jobs.push_back(top);
+	scan.pending = 1;
+	scan.total = 0;
+	scan.display_error = Display_Error;
+	scan.exclude_top = Exclude_Top;
+
+	if (cpus > MAX_DU_THREADS)
+		cpus = MAX_DU_THREADS;
+	for (int i = 1; i < cpus; i++) {
+		if (pthread_create(&threads[thread_count], NULL, scan_thread, &scan) == 0)
+			thread_count++;
+	}
+	scan_thread(&scan);
+	for (int i = 0; i < thread_count; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_cond_destroy(&scan.cond);
+	pthread_mutex_destroy(&scan.lock);
+	return scan.total;
+}
@@ -0,0 +1,84 @@
+/*
+        Copyright 2013 TeamWin
+        This file is part of TWRP/TeamWin Recovery Project.
+
+        TWRP is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        TWRP is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRP_DU_HPP
+#define __TWRP_DU_HPP
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Sums the size of the regular files below a folder. Folders are walked
+// relative to their fds on a pool of threads. The entries of each folder
+// are remembered by inode and mtime, so a folder that hasn't had entries
+// added or removed is not read again. Its files are still stat'ed, since
+// writing to a file doesn't change the folder, and its subfolders are
+// checked the same way.
+class twrpDU
+{
+public:
+	static uint64_t Get_Folder_Size(const string& Path, bool Display_Error, const char* Exclude_Top = NULL); // Exclude_Top skips a folder directly under Path
+	static void Clear_Cache(void);                                            // Forgets all cached folders, call after a wipe or restore
+
+private:
+	struct Dir_Key {
+		dev_t dev;
+		ino_t ino;
+		bool operator<(const Dir_Key& other) const {
+			return dev != other.dev ? dev < other.dev : ino < other.ino;
+		}
+	};
+
+	struct Dir_Info {
+		time_t mtime;
+		time_t ctime;
+		uint64_t file_bytes;                                                  // Regular files directly in this folder
+		string files;                                                         // Their names, each one ended by a '\0'
+		vector<string> subdirs;
+	};
+
+	struct Dir_Job {
+		string path;
+		bool top;
+	};
+
+	struct Scan {
+		pthread_mutex_t lock;
+		pthread_cond_t cond;
+		vector<Dir_Job> jobs;
+		int pending;                                                          // Jobs queued or being scanned
+		uint64_t total;
+		bool display_error;
+		const char* exclude_top;
+	};
+
+	static void* scan_thread(void* cookie);
+	static uint64_t Scan_Dir(Scan* scan, const Dir_Job& job, vector<Dir_Job>& subdirs);
+	static bool Read_Dir(int fd, const string& path, Dir_Info& info, bool display_error);
+	static bool Stat_Files(int fd, Dir_Info& info);                           // Sums the current sizes of the cached files, false if any of them is gone
+
+	static map<Dir_Key, Dir_Info> cache;
+	static pthread_mutex_t cache_lock;
+};
+
+#endif // __TWRP_DU_HPP
@@ -0,0 +1,282 @@
+/*
+        Copyright 2013 TeamWin
+        This file is part of TWRP/TeamWin Recovery Project.
+
+        TWRP is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        TWRP is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include "twrpExec.hpp"
+#include "twcommon.h"
+
+#define EXEC_READ_SIZE (64 * 1024)
+#define EXEC_WAIT_STEP_MS 10
+
+static long long Now_Ms(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+vector<string> twrpExec::Argv(const char* Arg0, ...) {
+	vector<string> args;
+	va_list ap;
+
+	va_start(ap, Arg0);
+	for (const char* arg = Arg0; arg != NULL; arg = va_arg(ap, const char*))
+		args.push_back(arg);
+	va_end(ap);
+	return args;
+}
+
+string twrpExec::To_String(const vector<string>& Args) {
+	string ret;
+
+	for (size_t i = 0; i < Args.size(); i++) {
+		if (i)
+			ret += " ";
+		if (Args[i].empty() || Args[i].find_first_of(" \t'\"") != string::npos)
+			ret += "'" + Args[i] + "'";
+		else
+			ret += Args[i];
+	}
+	return ret;
+}
+
+// Everything the child needs is set up before vfork, between vfork and
+// exec it only makes system calls. A failed exec is reported back through
+// a close-on-exec pipe so it can be told apart from a program exiting 127.
+pid_t twrpExec::Spawn(const vector<string>& Args, int Out_Fd, unsigned Flags, bool New_Group, int* Exec_Errno) {
+	vector<char*> argv;
+	int err_pipe[2];
+	pid_t pid;
+
+	*Exec_Errno = 0;
+	if (Args.empty()) {
+		*Exec_Errno = EINVAL;
+		return -1;
+	}
+	for (size_t i = 0; i < Args.size(); i++)
+		argv.push_back(const_cast<char*>(Args[i].c_str()));
+	argv.push_back(NULL);
+
+	if (pipe2(err_pipe, O_CLOEXEC) != 0) {
+		*Exec_Errno = errno;
+		return -1;
+	}
+
+	pid = vfork();
+	if (pid == 0) {
+		if (New_Group)
+			setpgid(0, 0);
+		if (Out_Fd >= 0) {
+			dup2(Out_Fd, STDOUT_FILENO);
+			if (Flags & CAPTURE_STDERR)
+				dup2(Out_Fd, STDERR_FILENO);
+		}
+		execvp(argv[0], &argv[0]);
+		int err = errno;
+		write(err_pipe[1], &err, sizeof(err));
+		_exit(127);
+	}
+
+	close(err_pipe[1]);
+	if (pid < 0) {
+		*Exec_Errno = errno;
+	} else {
+		int err;
+		ssize_t len;
+
+		do {
+			len = read(err_pipe[0], &err, sizeof(err));
+		} while (len < 0 && errno == EINTR);
+		if (len == sizeof(err)) {
+			waitpid(pid, NULL, 0);
+			*Exec_Errno = err;
+			pid = -1;
+		}
+	}
+	close(err_pipe[0]);
+	return pid;
+}
+
+void twrpExec::Show_Lines(string& Pending, bool Flush) {
+	size_t start = 0, end;
+
+	while ((end = Pending.find('\n', start)) != string::npos) {
+		gui_print("%s", Pending.substr(start, end - start + 1).c_str());
+		start = end + 1;
+	}
+	Pending.erase(0, start);
+	if (Flush && !Pending.empty()) {
+		gui_print("%s\n", Pending.c_str());
+		Pending.clear();
+	}
+}
+
+Exec_Status twrpExec::Run(const vector<string>& Args, string* Output, int Timeout_Ms, unsigned Flags) {
+	Exec_Status ret;
+	int out_pipe[2] = { -1, -1 };
+	int exec_errno, status;
+	bool capture = Output || (Flags & SHOW_OUTPUT);
+	long long deadline = Timeout_Ms > 0 ? Now_Ms() + Timeout_Ms : 0;
+	string shown;
+
+	memset(&ret, 0, sizeof(ret));
+	ret.exit_code = -1;
+	if (capture && pipe2(out_pipe, O_CLOEXEC) != 0) {
+		LOGERR("Unable to create a pipe for '%s': %s\n", To_String(Args).c_str(), strerror(errno));
+		return ret;
+	}
+
+	// The child gets the write end through dup2, which drops O_CLOEXEC
+	pid_t pid = Spawn(Args, out_pipe[1], Flags, deadline != 0, &exec_errno);
+	if (out_pipe[1] >= 0)
+		close(out_pipe[1]);
+	if (pid < 0) {
+		LOGINFO("Unable to run '%s': %s\n", To_String(Args).c_str(), strerror(exec_errno));
+		if (out_pipe[0] >= 0)
+			close(out_pipe[0]);
+		return ret;
+	}
+	ret.started = true;
+
+	if (out_pipe[0] >= 0) {
+		vector<char> buf(EXEC_READ_SIZE);
+		int fd = out_pipe[0];
+
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		while (fd >= 0) {
+			int wait_ms = -1;
+			if (deadline) {
+				wait_ms = deadline - Now_Ms();
+				if (wait_ms <= 0) {
+					ret.timed_out = true;
+					break;
+				}
+			}
+
+			struct pollfd pfd;
+			pfd.fd = fd;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			int rc = poll(&pfd, 1, wait_ms);
+			if (rc < 0 && errno != EINTR)
+				break;
+			if (rc <= 0)
+				continue;
+
+			ssize_t len = read(fd, &buf[0], buf.size());
+			if (len > 0) {
+				if (Output)
+					Output->append(&buf[0], len);
+				if (Flags & SHOW_OUTPUT) {
+					shown.append(&buf[0], len);
+					Show_Lines(shown, false);
+				}
+			} else if (len == 0 || (errno != EAGAIN && errno != EINTR)) {
+				break;
+			}
+		}
+		close(out_pipe[0]);
+		if (Flags & SHOW_OUTPUT)
+			Show_Lines(shown, true);
+	}
+
+	// Output may be closed well before the program is done, so the
+	// timeout still applies while waiting for it to exit
+	while (deadline && !ret.timed_out) {
+		pid_t rc = waitpid(pid, &status, WNOHANG);
+		if (rc == pid)
+			break;
+		if (rc < 0 && errno != EINTR) {
+			LOGINFO("Unable to wait for '%s': %s\n", To_String(Args).c_str(), strerror(errno));
+			return ret;
+		}
+		if (Now_Ms() >= deadline)
+			ret.timed_out = true;
+		else
+			poll(NULL, 0, EXEC_WAIT_STEP_MS);
+	}
+	if (ret.timed_out) {
+		LOGINFO("'%s' did not finish within %d ms, killing it\n", To_String(Args).c_str(), Timeout_Ms);
+		kill(-pid, SIGKILL);
+		kill(pid, SIGKILL);
+	}
+	if (!deadline || ret.timed_out) {
+		pid_t rc;
+		do {
+			rc = waitpid(pid, &status, 0);
+		} while (rc < 0 && errno == EINTR);
+		if (rc != pid) {
+			LOGINFO("Unable to wait for '%s': %s\n", To_String(Args).c_str(), strerror(errno));
+			return ret;
+		}
+	}
+
+	if (WIFEXITED(status)) {
+		ret.exited = true;
+		ret.exit_code = WEXITSTATUS(status);
+		LOGINFO("%s process ended with RC=%d\n", Args[0].c_str(), ret.exit_code);
+	} else if (WIFSIGNALED(status)) {
+		ret.signal = WTERMSIG(status);
+		LOGINFO("%s process ended with signal: %d\n", Args[0].c_str(), ret.signal);
+	}
+	return ret;
+}
+
+// Commands that are only words separated by spaces are run directly. Anything
+// with quotes, variables, redirections, globs and the like goes to the shell.
+bool twrpExec::Split_Simple(const string& Command, vector<string>& Args) {
+	if (Command.find_first_of("\"'\\$`;&|<>*?[]{}()~#!%\t\n\r") != string::npos)
+		return false;
+
+	size_t start = 0;
+	while (start < Command.size()) {
+		size_t end = Command.find(' ', start);
+		if (end == string::npos)
+			end = Command.size();
+		if (end > start)
+			Args.push_back(Command.substr(start, end - start));
+		start = end + 1;
+	}
+	// VAR=value in front of the program sets the environment
+	return !Args.empty() && Args[0].find('=') == string::npos;
+}
+
+Exec_Status twrpExec::Run_Shell(const string& Command, string* Output, int Timeout_Ms, unsigned Flags) {
+	vector<string> args;
+
+	if (Split_Simple(Command, args)) {
+		// A missing program may still be a shell builtin like cd or export
+		Exec_Status ret = Run(args, Output, Timeout_Ms, Flags);
+		if (ret.started)
+			return ret;
+		args.clear();
+	}
+	args.push_back("/sbin/sh");
+	args.push_back("-c");
+	args.push_back(Command);
+	return Run(args, Output, Timeout_Ms, Flags);
+}
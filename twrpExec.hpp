@@ -0,0 +1,61 @@
+/*
+        Copyright 2013 TeamWin
+        This file is part of TWRP/TeamWin Recovery Project.
+
+        TWRP is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        TWRP is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRP_EXEC_HPP
+#define __TWRP_EXEC_HPP
+
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+struct Exec_Status {
+	bool started;                                                             // false if the program could not be run at all
+	bool exited;                                                              // Ended through exit(), exit_code is valid
+	int exit_code;
+	int signal;                                                               // Signal that ended it, 0 if it exited
+	bool timed_out;                                                           // Killed because the timeout ran out
+
+	bool Success() const { return exited && exit_code == 0 && !timed_out; }
+	int Return_Code() const { return exited ? exit_code : -1; }               // 0 on success like the old popen based calls
+};
+
+// Runs programs from an argv vector with vfork and execvp, no shell in
+// between. Output is read in large chunks from a non-blocking pipe and the
+// child can be killed after a timeout.
+class twrpExec
+{
+public:
+	enum {
+		CAPTURE_STDERR = 0x01,                                                // Output gets stderr as well as stdout
+		SHOW_OUTPUT    = 0x02,                                                // gui_print the output a line at a time as it arrives
+	};
+
+	static Exec_Status Run(const vector<string>& Args, string* Output = NULL, int Timeout_Ms = 0, unsigned Flags = 0);
+	static Exec_Status Run_Shell(const string& Command, string* Output = NULL, int Timeout_Ms = 0, unsigned Flags = 0); // Skips /sbin/sh when Command needs nothing from it
+	static vector<string> Argv(const char* Arg0, ...);                        // NULL terminated list, like execl
+	static string To_String(const vector<string>& Args);                      // For the logs
+
+private:
+	static pid_t Spawn(const vector<string>& Args, int Out_Fd, unsigned Flags, bool New_Group, int* Exec_Errno);
+	static bool Split_Simple(const string& Command, vector<string>& Args);
+	static void Show_Lines(string& Pending, bool Flush);
+};
+
+#endif // __TWRP_EXEC_HPP
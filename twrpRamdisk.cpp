@@ -0,0 +1,441 @@
+/*
+        Copyright 2013 TeamWin
+        This file is part of TWRP/TeamWin Recovery Project.
+
+        TWRP is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        TWRP is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/sysmacros.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <map>
+#include "twrpRamdisk.hpp"
+#include "twrpCodec.hpp"
+#include "twcommon.h"
+
+#define CPIO_HEADER_SIZE 110
+#define CPIO_TRAILER "TRAILER!!!"
+#define CPIO_FIRST_INO 300000                                              // Same as mkbootfs
+
+static bool Read_Whole_File(const string& Path, string& Data) {
+	char buf[65536];
+	ssize_t len;
+
+	int fd = open(Path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		LOGINFO("Unable to open '%s': %s\n", Path.c_str(), strerror(errno));
+		return false;
+	}
+	Data.clear();
+	while ((len = read(fd, buf, sizeof(buf))) > 0)
+		Data.append(buf, len);
+	close(fd);
+	return len == 0;
+}
+
+static bool Write_Whole_File(const string& Path, const string& Data, mode_t Mode) {
+	int fd = open(Path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, Mode);
+	if (fd < 0) {
+		LOGINFO("Unable to create '%s': %s\n", Path.c_str(), strerror(errno));
+		return false;
+	}
+	size_t done = 0;
+	while (done < Data.size()) {
+		ssize_t len = write(fd, Data.data() + done, Data.size() - done);
+		if (len <= 0) {
+			LOGINFO("Unable to write '%s': %s\n", Path.c_str(), strerror(errno));
+			close(fd);
+			return false;
+		}
+		done += len;
+	}
+	fchmod(fd, Mode);
+	return close(fd) == 0;
+}
+
+static size_t Align4(size_t n) {
+	return (n + 3) & ~3;
+}
+
+static bool Parse_Hex(const char* p, uint32_t& value) {
+	value = 0;
+	for (int i = 0; i < 8; i++) {
+		char c = p[i];
+		value <<= 4;
+		if (c >= '0' && c <= '9')
+			value |= c - '0';
+		else if (c >= 'a' && c <= 'f')
+			value |= c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F')
+			value |= c - 'A' + 10;
+		else
+			return false;
+	}
+	return true;
+}
+
+twrpRamdisk::twrpRamdisk() {
+	compression = -1;
+}
+
+string twrpRamdisk::Clean_Name(const string& Name) {
+	size_t start = 0, end = Name.size();
+
+	while (true) {
+		if (Name.compare(start, 2, "./") == 0)
+			start += 2;
+		else if (start < end && Name[start] == '/')
+			start++;
+		else
+			break;
+	}
+	while (end > start && Name[end - 1] == '/')
+		end--;
+	return Name.substr(start, end - start);
+}
+
+bool twrpRamdisk::Load(const string& Path) {
+	string packed, archive;
+	bool ret = false;
+
+	entries.clear();
+	compression = -1;
+	if (!Read_Whole_File(Path, packed))
+		return false;
+
+	const unsigned char* m = (const unsigned char*) packed.data();
+	if (packed.size() >= 4 && m[0] == 0x1F && m[1] == 0x8B) {
+		compression = CMPR_GZIP;
+		ret = twrpCodec::Gzip_Decompress(packed, archive);
+	} else if (packed.size() >= 4 && m[0] == 0x02 && m[1] == 0x21 && m[2] == 0x4C && m[3] == 0x18) {
+		compression = CMPR_LZ4;
+		ret = twrpCodec::Lz4_Decompress(packed, archive);
+	} else if (packed.size() >= 4 && m[0] == 0x5D && m[1] == 0x00) {
+		compression = CMPR_LZMA;
+		ret = twrpCodec::Lzma_Decompress(packed, archive);
+	} else {
+		LOGINFO("Unknown ramdisk compression (%X %X %X %X)\n", m[0], m[1], m[2], m[3]);
+		return false;
+	}
+	if (!ret) {
+		LOGINFO("Unable to decompress '%s'\n", Path.c_str());
+		return false;
+	}
+	return Parse(archive);
+}
+
+bool twrpRamdisk::Parse(const string& Archive) {
+	// Hard linked files only carry their data on the last link
+	map<uint64_t, vector<size_t> > links;
+	size_t pos = 0;
+
+	while (true) {
+		uint32_t f[13];
+
+		if (pos + CPIO_HEADER_SIZE > Archive.size())
+			break;
+		const char* h = Archive.data() + pos;
+		if (memcmp(h, "070701", 6) != 0 && memcmp(h, "070702", 6) != 0)
+			break;
+		for (int i = 0; i < 13; i++) {
+			if (!Parse_Hex(h + 6 + i * 8, f[i])) {
+				LOGINFO("Corrupt cpio header at %lu\n", (unsigned long) pos);
+				return false;
+			}
+		}
+
+		// ino, mode, uid, gid, nlink, mtime, filesize, devmajor, devminor,
+		// rdevmajor, rdevminor, namesize, check
+		uint32_t namesize = f[11], filesize = f[6];
+		if (namesize == 0 || pos + CPIO_HEADER_SIZE + namesize > Archive.size())
+			break;
+		string name(h + CPIO_HEADER_SIZE, namesize - 1);
+		pos = Align4(pos + CPIO_HEADER_SIZE + namesize);
+		if (name == CPIO_TRAILER)
+			return true;
+		if (pos + filesize > Archive.size())
+			break;
+
+		name = Clean_Name(name);
+		if (!name.empty()) {
+			Ramdisk_Entry entry;
+			entry.name = name;
+			entry.mode = f[1];
+			entry.uid = f[2];
+			entry.gid = f[3];
+			entry.mtime = f[5];
+			entry.rdev_major = f[9];
+			entry.rdev_minor = f[10];
+			entry.data.assign(Archive, pos, filesize);
+			entries.push_back(entry);
+
+			if (S_ISREG(entry.mode) && f[4] > 1) {
+				vector<size_t>& group = links[((uint64_t) f[7] << 48) ^ ((uint64_t) f[8] << 32) ^ f[0]];
+				if (filesize) {
+					for (size_t i = 0; i < group.size(); i++)
+						entries[group[i]].data = entry.data;
+				}
+				group.push_back(entries.size() - 1);
+			}
+		}
+		pos = Align4(pos + filesize);
+	}
+	LOGINFO("Ramdisk cpio archive is truncated or corrupt\n");
+	return false;
+}
+
+void twrpRamdisk::Write(string& Archive) {
+	char header[CPIO_HEADER_SIZE + 1];
+	uint32_t ino = CPIO_FIRST_INO;
+
+	Archive.clear();
+	for (size_t i = 0; i <= entries.size(); i++) {
+		const Ramdisk_Entry* e = i < entries.size() ? &entries[i] : NULL;
+		const string& name = e ? e->name : CPIO_TRAILER;
+
+		snprintf(header, sizeof(header), "070701%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x",
+			e ? ino++ : 0,
+			e ? e->mode : 0,
+			e ? e->uid : 0,
+			e ? e->gid : 0,
+			e && S_ISDIR(e->mode) ? 2 : 1,
+			e ? e->mtime : 0,
+			e ? (uint32_t) e->data.size() : 0,
+			0, 0,
+			e ? e->rdev_major : 0,
+			e ? e->rdev_minor : 0,
+			(uint32_t) name.size() + 1,
+			0);
+		Archive.append(header, CPIO_HEADER_SIZE);
+		Archive.append(name.c_str(), name.size() + 1);
+		Archive.resize(Align4(Archive.size()), '\0');
+		if (e) {
+			Archive += e->data;
+			Archive.resize(Align4(Archive.size()), '\0');
+		}
+	}
+}
+
+bool twrpRamdisk::Save(const string& Path, int Compression) {
+	string archive, packed;
+	bool ret = false;
+
+	Write(archive);
+	switch (Compression) {
+		case CMPR_GZIP:
+			ret = twrpCodec::Gzip_Compress(archive, packed);
+			break;
+		case CMPR_LZ4:
+			ret = twrpCodec::Lz4_Compress(archive, packed);
+			break;
+		case CMPR_LZMA:
+			ret = twrpCodec::Lzma_Compress(archive, packed);
+			break;
+		default:
+			LOGINFO("Invalid ramdisk compression %d\n", Compression);
+			return false;
+	}
+	if (!ret)
+		return false;
+	return Write_Whole_File(Path, packed, 0644);
+}
+
+Ramdisk_Entry* twrpRamdisk::Find(const string& Name) {
+	string name = Clean_Name(Name);
+
+	for (size_t i = 0; i < entries.size(); i++) {
+		if (entries[i].name == name)
+			return &entries[i];
+	}
+	return NULL;
+}
+
+void twrpRamdisk::List(const string& Pattern, vector<string>& Names) {
+	string pattern = Clean_Name(Pattern);
+
+	for (size_t i = 0; i < entries.size(); i++) {
+		if (fnmatch(pattern.c_str(), entries[i].name.c_str(), FNM_PATHNAME) == 0)
+			Names.push_back(entries[i].name);
+	}
+}
+
+bool twrpRamdisk::Extract_File(const string& Name, const string& Dest) {
+	Ramdisk_Entry* e = Find(Name);
+	if (!e) {
+		LOGINFO("'%s' is not in the ramdisk\n", Name.c_str());
+		return false;
+	}
+
+	mode_t perms = e->mode & 07777;
+	unlink(Dest.c_str());
+	if (S_ISLNK(e->mode)) {
+		if (symlink(e->data.c_str(), Dest.c_str()) != 0) {
+			LOGINFO("Unable to create symlink '%s': %s\n", Dest.c_str(), strerror(errno));
+			return false;
+		}
+		lchown(Dest.c_str(), e->uid, e->gid);
+		return true;
+	} else if (S_ISDIR(e->mode)) {
+		if (mkdir(Dest.c_str(), perms) != 0 && errno != EEXIST) {
+			LOGINFO("Unable to create folder '%s': %s\n", Dest.c_str(), strerror(errno));
+			return false;
+		}
+		chmod(Dest.c_str(), perms);
+	} else if (S_ISREG(e->mode)) {
+		if (!Write_Whole_File(Dest, e->data, perms))
+			return false;
+	} else {
+		LOGINFO("Not extracting special file '%s'\n", Name.c_str());
+		return false;
+	}
+
+	struct timeval times[2];
+	times[0].tv_sec = times[1].tv_sec = e->mtime;
+	times[0].tv_usec = times[1].tv_usec = 0;
+	chown(Dest.c_str(), e->uid, e->gid);
+	utimes(Dest.c_str(), times);
+	return true;
+}
+
+Ramdisk_Entry& twrpRamdisk::Add_Entry(const string& Name, uint32_t Mode) {
+	string name = Clean_Name(Name);
+	Ramdisk_Entry* e = Find(name);
+
+	if (!e) {
+		for (size_t slash = name.find('/'); slash != string::npos; slash = name.find('/', slash + 1)) {
+			string parent = name.substr(0, slash);
+			if (!Find(parent))
+				Add_Entry(parent, S_IFDIR | 0755);
+		}
+		Ramdisk_Entry entry;
+		entry.name = name;
+		entries.push_back(entry);
+		e = &entries.back();
+	}
+	e->mode = Mode;
+	e->uid = 0;
+	e->gid = 0;
+	e->mtime = time(NULL);
+	e->rdev_major = 0;
+	e->rdev_minor = 0;
+	e->data.clear();
+	return *e;
+}
+
+void twrpRamdisk::Add_File(const string& Name, const string& Data, uint32_t Mode) {
+	Add_Entry(Name, S_IFREG | (Mode & 07777)).data = Data;
+}
+
+bool twrpRamdisk::Add_File_From(const string& Name, const string& Source, uint32_t Mode) {
+	struct stat st;
+	string data;
+
+	if (stat(Source.c_str(), &st) != 0 || !Read_Whole_File(Source, data)) {
+		LOGINFO("Unable to read '%s'\n", Source.c_str());
+		return false;
+	}
+	Add_File(Name, data, Mode ? Mode : st.st_mode);
+	return true;
+}
+
+void twrpRamdisk::Add_Symlink(const string& Name, const string& Target) {
+	Add_Entry(Name, S_IFLNK | 0777).data = Target;
+}
+
+bool twrpRamdisk::Add_Tree(const string& Source, const string& Prefix) {
+	DIR* d = opendir(Source.c_str());
+	struct dirent* de;
+	bool ret = true;
+
+	if (!d) {
+		LOGINFO("Unable to open '%s': %s\n", Source.c_str(), strerror(errno));
+		return false;
+	}
+	while ((de = readdir(d)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+
+		string path = Source + "/" + de->d_name;
+		string name = Prefix.empty() ? string(de->d_name) : Prefix + "/" + de->d_name;
+		struct stat st;
+		if (lstat(path.c_str(), &st) != 0) {
+			ret = false;
+			continue;
+		}
+
+		Ramdisk_Entry& e = Add_Entry(name, st.st_mode);
+		e.uid = st.st_uid;
+		e.gid = st.st_gid;
+		e.mtime = st.st_mtime;
+		if (S_ISDIR(st.st_mode)) {
+			if (!Add_Tree(path, name))
+				ret = false;
+		} else if (S_ISREG(st.st_mode)) {
+			if (!Read_Whole_File(path, e.data))
+				ret = false;
+		} else if (S_ISLNK(st.st_mode)) {
+			char target[PATH_MAX];
+			ssize_t len = readlink(path.c_str(), target, sizeof(target));
+			if (len < 0)
+				ret = false;
+			else
+				e.data.assign(target, len);
+		} else {
+			e.rdev_major = major(st.st_rdev);
+			e.rdev_minor = minor(st.st_rdev);
+		}
+	}
+	closedir(d);
+	return ret;
+}
+
+bool twrpRamdisk::Rename(const string& From, const string& To) {
+	string to = Clean_Name(To);
+	Ramdisk_Entry* e = Find(From);
+
+	if (!e)
+		return false;
+	if (e->name == to)
+		return true;
+	Remove(to);
+	Find(From)->name = to;
+	return true;
+}
+
+bool twrpRamdisk::Remove(const string& Name) {
+	string name = Clean_Name(Name);
+	string prefix = name + "/";
+	bool found = false;
+
+	for (size_t i = 0; i < entries.size();) {
+		if (entries[i].name == name || entries[i].name.compare(0, prefix.size(), prefix) == 0) {
+			entries.erase(entries.begin() + i);
+			found = true;
+		} else {
+			i++;
+		}
+	}
+	return found;
+}
@@ -0,0 +1,80 @@
+/*
+        Copyright 2013 TeamWin
+        This file is part of TWRP/TeamWin Recovery Project.
+
+        TWRP is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        TWRP is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRP_RAMDISK_HPP
+#define __TWRP_RAMDISK_HPP
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+enum
+{
+	CMPR_GZIP   = 0,
+	CMPR_LZ4    = 1,
+	CMPR_LZMA   = 2,
+};
+
+struct Ramdisk_Entry {
+	string name;                                                              // Relative, without a leading "./"
+	uint32_t mode;                                                            // File type and permissions
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t mtime;
+	uint32_t rdev_major;
+	uint32_t rdev_minor;
+	string data;                                                              // File contents or symlink target
+};
+
+// A compressed newc cpio ramdisk held in memory, so boot images can be
+// patched without unpacking the ramdisk to /tmp and packing it back up
+class twrpRamdisk
+{
+public:
+	twrpRamdisk();
+
+	bool Load(const string& Path);                                            // Reads a gzip, lz4 or lzma compressed ramdisk
+	bool Save(const string& Path, int Compression);
+	int Get_Compression() const { return compression; }                     // CMPR_*, -1 when nothing is loaded
+
+	Ramdisk_Entry* Find(const string& Name);
+	bool Exists(const string& Name) { return Find(Name) != NULL; }
+	void List(const string& Pattern, vector<string>& Names);                  // fnmatch of the entry names
+	bool Extract_File(const string& Name, const string& Dest);                // Writes one entry with its mode and mtime
+
+	void Add_File(const string& Name, const string& Data, uint32_t Mode);     // Replaces Name if it exists
+	bool Add_File_From(const string& Name, const string& Source, uint32_t Mode = 0); // Mode 0 keeps the permissions of Source
+	void Add_Symlink(const string& Name, const string& Target);
+	bool Add_Tree(const string& Source, const string& Prefix = "");           // Adds everything under the Source folder
+	bool Rename(const string& From, const string& To);
+	bool Remove(const string& Name);
+
+private:
+	bool Parse(const string& Archive);
+	void Write(string& Archive);
+	Ramdisk_Entry& Add_Entry(const string& Name, uint32_t Mode);             // Creates missing parent folders too
+	static string Clean_Name(const string& Name);
+
+	vector<Ramdisk_Entry> entries;
+	int compression;
+};
+
+#endif // __TWRP_RAMDISK_HPP
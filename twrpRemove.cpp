@@ -0,0 +1,268 @@
+/*
+        Copyright 2013 TeamWin
+        This file is part of TWRP/TeamWin Recovery Project.
+
+        TWRP is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        TWRP is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <algorithm>
+#include "twrpRemove.hpp"
+#include "twcommon.h"
+#include "data.hpp"
+
+#define MAX_REMOVE_THREADS 4
+
+#ifndef FS_IMMUTABLE_FL
+#define FS_IMMUTABLE_FL 0x00000010
+#endif
+#ifndef FS_APPEND_FL
+#define FS_APPEND_FL 0x00000020
+#endif
+
+// Both flags make unlink fail with EPERM, on the entry itself and, for a
+// folder, on everything inside it
+void twrpRemove::Clear_Flags(int Fd) {
+	int flags;
+
+	if (ioctl(Fd, FS_IOC_GETFLAGS, &flags) != 0 || !(flags & (FS_IMMUTABLE_FL | FS_APPEND_FL)))
+		return;
+	flags &= ~(FS_IMMUTABLE_FL | FS_APPEND_FL);
+	ioctl(Fd, FS_IOC_SETFLAGS, &flags);
+}
+
+// Sorts the entries of an open folder into folders and everything else
+int twrpRemove::List_Dir(int Dir_Fd, const string& Path, vector<string>& Dirs, vector<string>& Files) {
+	struct dirent* de;
+	struct stat st;
+	DIR* d;
+
+	int fd = dup(Dir_Fd);
+	if (fd < 0 || (d = fdopendir(fd)) == NULL) {
+		if (fd >= 0)
+			close(fd);
+		LOGERR("Error opening '%s'\n", Path.c_str());
+		return -1;
+	}
+
+	while ((de = readdir(d)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+
+		bool is_dir = de->d_type == DT_DIR;
+		if (de->d_type == DT_UNKNOWN && fstatat(Dir_Fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+			is_dir = S_ISDIR(st.st_mode);
+		if (is_dir)
+			Dirs.push_back(de->d_name);
+		else
+			Files.push_back(de->d_name);
+	}
+	closedir(d);
+	return 0;
+}
+
+int twrpRemove::Remove_Entry(int Dir_Fd, const string& Path, const char* Name, bool Is_Dir, bool Clear_Immutable) {
+	struct stat st;
+	int ret = 0;
+
+	if (Is_Dir) {
+		int fd = openat(Dir_Fd, Name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		if (fd < 0) {
+			LOGINFO("Unable to open '%s/%s': %s\n", Path.c_str(), Name, strerror(errno));
+			return -1;
+		}
+		ret = Remove_Contents(fd, Path + "/" + Name, Clear_Immutable);
+		close(fd);
+	}
+	if (unlinkat(Dir_Fd, Name, Is_Dir ? AT_REMOVEDIR : 0) == 0)
+		return ret;
+
+	// Folders had their flags cleared by Remove_Contents. Of the rest only
+	// regular files can carry them, and opening anything else could have
+	// side effects.
+	int err = errno;
+	if (!Is_Dir && Clear_Immutable && err == EPERM &&
+		fstatat(Dir_Fd, Name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode)) {
+		int fd = openat(Dir_Fd, Name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+		if (fd >= 0) {
+			Clear_Flags(fd);
+			close(fd);
+			if (unlinkat(Dir_Fd, Name, 0) == 0)
+				return ret;
+			err = errno;
+		}
+	}
+	LOGINFO("Unable to remove '%s/%s': %s\n", Path.c_str(), Name, strerror(err));
+	return -1;
+}
+
+int twrpRemove::Remove_Contents(int Dir_Fd, const string& Path, bool Clear_Immutable) {
+	vector<string> dirs, files;
+	int ret = 0;
+
+	if (Clear_Immutable)
+		Clear_Flags(Dir_Fd);
+	if (List_Dir(Dir_Fd, Path, dirs, files) != 0)
+		return -1;
+	for (size_t i = 0; i < files.size(); i++) {
+		if (Remove_Entry(Dir_Fd, Path, files[i].c_str(), false, Clear_Immutable) != 0)
+			ret = -1;
+	}
+	for (size_t i = 0; i < dirs.size(); i++) {
+		if (Remove_Entry(Dir_Fd, Path, dirs[i].c_str(), true, Clear_Immutable) != 0)
+			ret = -1;
+	}
+	return ret;
+}
+
+void* twrpRemove::remove_thread(void* cookie) {
+	Work* work = (Work*) cookie;
+	int errors = 0;
+
+	while (1) {
+		string path;
+
+		pthread_mutex_lock(&work->lock);
+		if (work->next < work->jobs.size())
+			path = work->jobs[work->next++];
+		pthread_mutex_unlock(&work->lock);
+		if (path.empty())
+			break;
+
+		int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		if (fd < 0) {
+			LOGINFO("Unable to open '%s': %s\n", path.c_str(), strerror(errno));
+			errors++;
+			continue;
+		}
+		if (Remove_Contents(fd, path, work->clear_immutable) != 0)
+			errors++;
+		close(fd);
+		if (rmdir(path.c_str()) != 0) {
+			LOGINFO("Unable to remove '%s': %s\n", path.c_str(), strerror(errno));
+			errors++;
+		}
+
+		pthread_mutex_lock(&work->lock);
+		work->done++;
+		if (work->show_progress)
+			DataManager::SetProgress((float) work->done / work->jobs.size());
+		pthread_mutex_unlock(&work->lock);
+	}
+
+	pthread_mutex_lock(&work->lock);
+	work->errors += errors;
+	pthread_mutex_unlock(&work->lock);
+	return NULL;
+}
+
+int twrpRemove::Remove_Tree(const string& Path, bool Keep_Top, const vector<string>* Keep, bool Clear_Immutable, bool Show_Progress) {
+	vector<string> top_dirs, top_files;
+	pthread_t threads[MAX_REMOVE_THREADS];
+	int thread_count = 0, cpus = sysconf(_SC_NPROCESSORS_ONLN), ret = 0;
+	Work work;
+
+	int top_fd = open(Path.c_str(), O_RDONLY | O_DIRECTORY);
+	if (top_fd < 0) {
+		LOGERR("Error opening '%s'\n", Path.c_str());
+		return -1;
+	}
+	if (Clear_Immutable)
+		Clear_Flags(top_fd);
+	if (Show_Progress)
+		DataManager::SetProgress(0);
+	if (List_Dir(top_fd, Path, top_dirs, top_files) != 0) {
+		close(top_fd);
+		return -1;
+	}
+	if (Keep) {
+		for (size_t i = 0; i < Keep->size(); i++) {
+			top_dirs.erase(remove(top_dirs.begin(), top_dirs.end(), (*Keep)[i]), top_dirs.end());
+			top_files.erase(remove(top_files.begin(), top_files.end(), (*Keep)[i]), top_files.end());
+		}
+	}
+
+	// Files on the first two levels go right away, the folders on the
+	// second level are the jobs for the threads
+	pthread_mutex_init(&work.lock, NULL);
+	work.next = 0;
+	work.done = 0;
+	work.errors = 0;
+	work.clear_immutable = Clear_Immutable;
+	work.show_progress = Show_Progress;
+	for (size_t i = 0; i < top_files.size(); i++) {
+		if (Remove_Entry(top_fd, Path, top_files[i].c_str(), false, Clear_Immutable) != 0)
+			ret = -1;
+	}
+	for (size_t i = 0; i < top_dirs.size(); i++) {
+		string dir = Path + "/" + top_dirs[i];
+		vector<string> dirs, files;
+
+		int fd = openat(top_fd, top_dirs[i].c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		if (fd < 0 || List_Dir(fd, dir, dirs, files) != 0) {
+			if (fd >= 0)
+				close(fd);
+			ret = -1;
+			continue;
+		}
+		if (Clear_Immutable)
+			Clear_Flags(fd);
+		for (size_t j = 0; j < files.size(); j++) {
+			if (Remove_Entry(fd, dir, files[j].c_str(), false, Clear_Immutable) != 0)
+				ret = -1;
+		}
+		for (size_t j = 0; j < dirs.size(); j++)
+			work.jobs.push_back(dir + "/" + dirs[j]);
+		close(fd);
+	}
+
+	if (cpus > MAX_REMOVE_THREADS)
+		cpus = MAX_REMOVE_THREADS;
+	if (cpus > (int) work.jobs.size())
+		cpus = work.jobs.size();
+	for (int i = 1; i < cpus; i++) {
+		if (pthread_create(&threads[thread_count], NULL, remove_thread, &work) == 0)
+			thread_count++;
+	}
+	remove_thread(&work);
+	for (int i = 0; i < thread_count; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&work.lock);
+	if (work.errors)
+		ret = -1;
+
+	for (size_t i = 0; i < top_dirs.size(); i++) {
+		if (unlinkat(top_fd, top_dirs[i].c_str(), AT_REMOVEDIR) != 0) {
+			LOGINFO("Unable to remove '%s/%s': %s\n", Path.c_str(), top_dirs[i].c_str(), strerror(errno));
+			ret = -1;
+		}
+	}
+	close(top_fd);
+
+	if (!Keep_Top && rmdir(Path.c_str()) != 0) {
+		LOGINFO("Unable to remove '%s': %s\n", Path.c_str(), strerror(errno));
+		ret = -1;
+	}
+	if (Show_Progress)
+		DataManager::SetProgress(1);
+	return ret;
+}
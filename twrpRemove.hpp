@@ -0,0 +1,57 @@
+/*
+        Copyright 2013 TeamWin
+        This file is part of TWRP/TeamWin Recovery Project.
+
+        TWRP is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        TWRP is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRP_REMOVE_HPP
+#define __TWRP_REMOVE_HPP
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Removes folder trees with unlinkat() relative to folder fds. The folders
+// two levels down are handed out to a pool of threads, which covers the
+// usual shapes like /data/data/<package> and /data/app-lib/<package>.
+// Clear_Immutable drops the flags chattr +i and +a set on the way down,
+// Show_Progress moves the GUI progress bar as those folders are finished.
+class twrpRemove
+{
+public:
+	static int Remove_Tree(const string& Path, bool Keep_Top, const vector<string>* Keep = NULL, // Keep names entries directly under Path that are left alone, returns 0 if everything went
+		bool Clear_Immutable = false, bool Show_Progress = false);
+	static int Remove_Contents(int Dir_Fd, const string& Path, bool Clear_Immutable = false); // Removes everything inside an open folder
+
+private:
+	struct Work {
+		pthread_mutex_t lock;
+		vector<string> jobs;
+		size_t next;
+		size_t done;
+		int errors;
+		bool clear_immutable;
+		bool show_progress;
+	};
+
+	static void* remove_thread(void* cookie);
+	static int Remove_Entry(int Dir_Fd, const string& Path, const char* Name, bool Is_Dir, bool Clear_Immutable);
+	static void Clear_Flags(int Fd);                                         // Drops the immutable and append only flags
+	static int List_Dir(int Dir_Fd, const string& Path, vector<string>& Dirs, vector<string>& Files);
+};
+
+#endif // __TWRP_REMOVE_HPP
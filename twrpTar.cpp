@@ -33,6 +33,7 @@ extern "C" {
 #include <string>
 #include <sstream>
 #include <vector>
+#include <algorithm>
 #include <dirent.h>
 #include <sys/mman.h>
 #include "twrpTar.hpp"
@@ -40,6 +41,7 @@ extern "C" {
 #include "data.hpp"
 #include "variables.h"
 #include "twrp-functions.hpp"
+#include "twrpExec.hpp"
 
 using namespace std;
 
@@ -48,6 +50,7 @@ twrpTar::twrpTar(void) {
 	userdata_encryption = 0;
 	use_compression = 0;
 	split_archives = 0;
+	max_archive_size = MAX_ARCHIVE_SIZE;
 	has_data_media = 0;
 	pigz_pid = 0;
 	oaes_pid = 0;
@@ -467,6 +470,8 @@ int twrpTar::Generate_TarList(string Path, std::vector<TarListStruct> *TarList,
 		FileName += de->d_name;
 		if (has_data_media == 1 && FileName.size() >= 11 && strncmp(FileName.c_str(), "/data/media", 11) == 0)
 			continue; // Skip /data/media
+		if (find(tarexclude.begin(), tarexclude.end(), FileName) != tarexclude.end())
+			continue; // Excluded by its full path
 		if (de->d_type == DT_BLK || de->d_type == DT_CHR)
 			continue;
 		TarItem.fn = FileName;
@@ -530,12 +535,14 @@ int twrpTar::Generate_Multiple_Archives(string Path) {
 		FileName += de->d_name;
 		if (has_data_media == 1 && FileName.size() >= 11 && strncmp(FileName.c_str(), "/data/media", 11) == 0)
 			continue; // Skip /data/media
+		if (find(tarexclude.begin(), tarexclude.end(), FileName) != tarexclude.end())
+			continue; // Excluded by its full path
 		if (de->d_type == DT_BLK || de->d_type == DT_CHR)
 			continue;
 		if (de->d_type == DT_DIR && strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0 && strcmp(de->d_name, "lost+foud") != 0)
 		{
 			unsigned long long folder_size = TWFunc::Get_Folder_Size(FileName, false);
-			if (Archive_Current_Size + folder_size > MAX_ARCHIVE_SIZE) {
+			if (Archive_Current_Size + folder_size > max_archive_size) {
 				LOGINFO("Calling Generate_Multiple_Archives\n");
 				if (Generate_Multiple_Archives(FileName) < 0)
 					return -1;
@@ -552,7 +559,7 @@ int twrpTar::Generate_Multiple_Archives(string Path) {
 		{
 			stat(FileName.c_str(), &st);
 			if (de->d_type != DT_LNK) {
-				if (Archive_Current_Size != 0 && Archive_Current_Size + st.st_size > MAX_ARCHIVE_SIZE) {
+				if (Archive_Current_Size != 0 && Archive_Current_Size + st.st_size > max_archive_size) {
 					LOGINFO("Closing tar '%s', ", tarfn.c_str());
 					closeTar();
 					if (TWFunc::Get_File_Size(tarfn) == 0) {
@@ -774,7 +781,7 @@ int twrpTar::tarList(bool include_root, std::vector<TarListStruct> *TarList, uns
 			strcpy(buf, TarList->at(i).fn.c_str());
 			stat(buf, &st);
 			if (st.st_mode & S_IFREG) { // item is a regular file
-				if (Archive_Current_Size + (unsigned long long)(st.st_size) > MAX_ARCHIVE_SIZE) {
+				if (Archive_Current_Size + (unsigned long long)(st.st_size) > max_archive_size) {
 					if (closeTar() != 0) {
 						LOGERR("Error closing '%s' on thread %i\n", tarfn.c_str(), thread_id);
 						return -3;
@@ -1318,7 +1325,7 @@ int twrpTar::entryExists(string entry) {
 unsigned long long twrpTar::uncompressedSize() {
 	int type = 0;
 	unsigned long long total_size = 0;
-	string Tar, Command, result;
+	string Tar, result;
 	vector<string> split;
 
 	Tar = TWFunc::Get_Filename(tarfn);
@@ -1326,10 +1333,7 @@ unsigned long long twrpTar::uncompressedSize() {
 	if (type == 0)
 		total_size = TWFunc::Get_File_Size(tarfn);
 	else {
-		Command = "pigz -l " + tarfn;
-		/* if we set Command = "pigz -l " + tarfn + " | sed '1d' | cut -f5 -d' '";
-		   we get the uncompressed size at once. */
-		TWFunc::Exec_Cmd(Command, result);
+		TWFunc::Exec_Cmd(twrpExec::Argv("pigz", "-l", tarfn.c_str(), NULL), result);
 		if (!result.empty()) {
 			/* Expected output:
 				compressed   original reduced  name
@@ -57,6 +57,7 @@ public:
 	int userdata_encryption;
 	int use_compression;
 	int split_archives;
+	unsigned long long max_archive_size;
 	int has_data_media;
 	string backup_name;
 
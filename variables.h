@@ -186,4 +186,7 @@
 
 #define UBUNTU_COMMAND_FILE "/cache/recovery/ubuntu_command"
 
+// Decoded theme images, left out of cache backups and kept across wipes
+#define SURFACE_CACHE_DIR "/cache/recovery/surfaces"
+
 #endif  // _VARIABLES_HEADER_